@@ -0,0 +1,237 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitset.h"
+
+#define W BITSET_WORD_BITS
+
+/* Mask of the bits which are in use in the last word of a set */
+#define BITSET_TAIL_MASK(NBITS) (((NBITS) % W) ? (1UL << ((NBITS) % W)) - 1 : ~0UL)
+
+bitset_word_t *
+bitset_new (int nbits)
+{
+    return calloc (nbits > 0 ? BITSET_WORDS (nbits) : 1, sizeof (bitset_word_t));
+}
+
+void
+bitset_fill (bitset_word_t *set, int nbits)
+{
+    int n = BITSET_WORDS (nbits);
+    if (n)
+    {
+        memset (set, 0xff, n * sizeof (bitset_word_t));
+        set[n - 1] &= BITSET_TAIL_MASK (nbits);
+    }
+}
+
+void
+bitset_zero (bitset_word_t *set, int nbits)
+{
+    memset (set, 0, BITSET_WORDS (nbits) * sizeof (bitset_word_t));
+}
+
+int
+bitset_count (bitset_word_t *set, int nbits)
+{
+    int i, n = BITSET_WORDS (nbits), count = 0;
+    for (i = 0; i < n; i++)
+        count += __builtin_popcountl (set[i]);
+    return count;
+}
+
+/**
+ * Return the index of the first set bit at or after from, or -1.
+ */
+int
+bitset_next (bitset_word_t *set, int nbits, int from)
+{
+    int i, n = BITSET_WORDS (nbits);
+    bitset_word_t word;
+
+    if (from < 0)
+        from = 0;
+    if (from >= nbits)
+        return -1;
+
+    i = from / W;
+    word = set[i] & (~0UL << (from % W));
+    while (!word)
+    {
+        if (++i == n)
+            return -1;
+        word = set[i];
+    }
+    return i * W + __builtin_ctzl (word);
+}
+
+/**
+ * Return the index of the last set bit at or before from, or -1.
+ */
+int
+bitset_prev (bitset_word_t *set, int from)
+{
+    int i;
+    bitset_word_t word;
+
+    if (from < 0)
+        return -1;
+
+    i = from / W;
+    word = set[i] & BITSET_TAIL_MASK (from + 1);
+    while (!word)
+    {
+        if (--i < 0)
+            return -1;
+        word = set[i];
+    }
+    return i * W + W - 1 - __builtin_clzl (word);
+}
+
+/**
+ * Clear bits from from (included) to to (excluded).
+ */
+void
+bitset_clear_range (bitset_word_t *set, int from, int to)
+{
+    for (; from < to && from % W; from++)
+        BITSET_CLEAR (set, from);
+    for (; to - from >= W; from += W)
+        set[from / W] = 0;
+    for (; from < to; from++)
+        BITSET_CLEAR (set, from);
+}
+
+/**
+ * Set bits from from (included) to to (excluded).
+ */
+void
+bitset_set_range (bitset_word_t *set, int from, int to)
+{
+    for (; from < to && from % W; from++)
+        BITSET_SET (set, from);
+    for (; to - from >= W; from += W)
+        set[from / W] = ~0UL;
+    for (; from < to; from++)
+        BITSET_SET (set, from);
+}
+
+/**
+ * Copy the first nbits bits of src into dest, starting at bit dest_ofs.
+ *
+ * src and dest may be the same set, as long as the source and destination
+ * ranges don't overlap. The destination range is cleared before being
+ * written, so dest must not be read concurrently.
+ */
+void
+bitset_copy (bitset_word_t *dest, int dest_ofs, bitset_word_t *src, int nbits)
+{
+    int i, n = BITSET_WORDS (nbits);
+    int d = dest_ofs / W;
+    int shift = dest_ofs % W;
+    int last = BITSET_WORDS (dest_ofs + nbits);
+    bitset_word_t word;
+
+    if (nbits <= 0)
+        return;
+
+    if (!shift && !(nbits % W))
+    {
+        memcpy (dest + d, src, n * sizeof (bitset_word_t));
+        return;
+    }
+
+    bitset_clear_range (dest, dest_ofs, dest_ofs + nbits);
+    for (i = 0; i < n; i++)
+    {
+        word = src[i];
+        if (i == n - 1)
+            word &= BITSET_TAIL_MASK (nbits);
+        dest[d + i] |= word << shift;
+        if (shift && d + i + 1 < last)
+            dest[d + i + 1] |= word >> (W - shift);
+    }
+}
+
+/**
+ * Fill dest with repetitions of the src_nbits first bits of src.
+ *
+ * Copies the source once, then keeps doubling the filled area, so that this
+ * costs O(log(dest_nbits / src_nbits)) word-wise copies. If src and dest are
+ * the same set, its first src_nbits bits are repeated in place, and they are
+ * left untouched.
+ */
+void
+bitset_repeat (bitset_word_t *dest, int dest_nbits, bitset_word_t *src, int src_nbits)
+{
+    int filled, len;
+
+    if (src_nbits <= 0)
+    {
+        bitset_zero (dest, dest_nbits);
+        return;
+    }
+
+    filled = src_nbits < dest_nbits ? src_nbits : dest_nbits;
+    if (src != dest)
+        bitset_copy (dest, 0, src, filled);
+    while (filled < dest_nbits)
+    {
+        len = filled < dest_nbits - filled ? filled : dest_nbits - filled;
+        bitset_copy (dest, filled, dest, len);
+        filled += len;
+    }
+}
+
+/**
+ * Load a set from an array of bytes, one per bit. Any non-zero byte sets the
+ * corresponding bit. Each word is stored once.
+ */
+void
+bitset_import (bitset_word_t *set, const char *bytes, int nbits)
+{
+    int i, j, n = BITSET_WORDS (nbits);
+    bitset_word_t word;
+
+    for (i = 0; i < n; i++)
+    {
+        word = 0;
+        for (j = 0; j < W && i * W + j < nbits; j++)
+            if (bytes[i * W + j])
+                word |= 1UL << j;
+        set[i] = word;
+    }
+}
+
+/**
+ * Unpack a set into an array of nbits bytes, set to either 0 or 1.
+ */
+void
+bitset_export (bitset_word_t *set, char *bytes, int nbits)
+{
+    int i;
+    for (i = 0; i < nbits; i++)
+        bytes[i] = BITSET_TEST (set, i);
+}
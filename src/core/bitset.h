@@ -0,0 +1,60 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+#ifndef JACKBEAT_BITSET_H
+#define JACKBEAT_BITSET_H
+
+/*
+ * Fixed size array of bits, packed into machine words.
+ *
+ * Scanning and copying operate on whole words. Bits past the end of the set
+ * in the last word are always kept cleared, so that counting and searching
+ * never need to mask them out.
+ *
+ * Each word is updated with a single store, so a set may be read by the
+ * audio thread while another thread (only one) modifies it.
+ */
+
+typedef unsigned long bitset_word_t;
+
+#define BITSET_WORD_BITS (sizeof (bitset_word_t) * 8)
+#define BITSET_WORDS(NBITS) (((NBITS) + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS)
+
+#define BITSET_TEST(SET, I) (((SET)[(I) / BITSET_WORD_BITS] >> ((I) % BITSET_WORD_BITS)) & 1)
+#define BITSET_SET(SET, I) ((SET)[(I) / BITSET_WORD_BITS] |= 1UL << ((I) % BITSET_WORD_BITS))
+#define BITSET_CLEAR(SET, I) ((SET)[(I) / BITSET_WORD_BITS] &= ~(1UL << ((I) % BITSET_WORD_BITS)))
+#define BITSET_ASSIGN(SET, I, V) ((V) ? BITSET_SET (SET, I) : BITSET_CLEAR (SET, I))
+
+bitset_word_t * bitset_new(int nbits);
+void bitset_fill(bitset_word_t *set, int nbits);
+void bitset_zero(bitset_word_t *set, int nbits);
+int bitset_count(bitset_word_t *set, int nbits);
+int bitset_next(bitset_word_t *set, int nbits, int from);
+int bitset_prev(bitset_word_t *set, int from);
+void bitset_clear_range(bitset_word_t *set, int from, int to);
+void bitset_set_range(bitset_word_t *set, int from, int to);
+void bitset_copy(bitset_word_t *dest, int dest_ofs, bitset_word_t *src, int nbits);
+void bitset_repeat(bitset_word_t *dest, int dest_nbits, bitset_word_t *src, int src_nbits);
+void bitset_import(bitset_word_t *set, const char *bytes, int nbits);
+void bitset_export(bitset_word_t *set, char *bytes, int nbits);
+
+#endif
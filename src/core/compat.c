@@ -20,8 +20,11 @@
  *   SVN:$Id: msg.h 279 2008-09-02 11:27:40Z olivier $
  */
 
+#include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #ifdef __WIN32__
+#include <malloc.h>
 #include <windows.h>
 #endif
 
@@ -36,3 +39,51 @@ compat_sleep (unsigned long miliseconds)
     usleep (miliseconds * 1000);
 #endif
 }
+
+/**
+ * Allocate size bytes, aligned on the given power of two boundary.
+ *
+ * Returns NULL on failure. The memory must be released with 
+ * compat_aligned_free().
+ */
+void *
+compat_aligned_alloc (size_t alignment, size_t size)
+{
+#ifdef __WIN32__
+    return _aligned_malloc (size, alignment);
+#else
+    void *ptr;
+    return posix_memalign (&ptr, alignment, size) ? NULL : ptr;
+#endif
+}
+
+void
+compat_aligned_free (void *ptr)
+{
+#ifdef __WIN32__
+    _aligned_free (ptr);
+#else
+    free (ptr);
+#endif
+}
+
+/**
+ * Return a monotonic time, in microseconds, from an arbitrary origin.
+ *
+ * This doesn't block nor allocate, and can be used to time the audio thread.
+ */
+unsigned long long
+compat_time_usec (void)
+{
+#ifdef __WIN32__
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter (&count);
+    QueryPerformanceFrequency (&frequency);
+    return (unsigned long long) (count.QuadPart / frequency.QuadPart) * 1000000
+        + (count.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
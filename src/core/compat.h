@@ -23,6 +23,11 @@
 #ifndef JACKBEAT_COMPAT_H
 #define JACKBEAT_COMPAT_H
 
+#include <stddef.h>
+
 void compat_sleep(unsigned long miliseconds);
+void * compat_aligned_alloc(size_t alignment, size_t size);
+void compat_aligned_free(void *ptr);
+unsigned long long compat_time_usec(void);
 
 #endif
@@ -0,0 +1,189 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "vector.h"
+
+typedef struct epoch_item_t
+{
+    void *            ptr;
+    epoch_callback_t  callback;
+    void *            data;
+    unsigned long     stamp;
+} epoch_item_t;
+
+struct epoch_t
+{
+    unsigned long volatile  counter;
+    vector_t                retired;
+    pthread_mutex_t         mutex;
+} ;
+
+epoch_t *
+epoch_new ()
+{
+    epoch_t *epoch = malloc (sizeof (epoch_t));
+    epoch->counter = 0;
+    vector_init (&epoch->retired);
+    pthread_mutex_init (&epoch->mutex, NULL);
+    return epoch;
+}
+
+/**
+ * Reclaim all retired data and free the epoch. The reader must not be running
+ * anymore at this point.
+ */
+void
+epoch_destroy (epoch_t *epoch)
+{
+    epoch_flush (epoch);
+    vector_free (&epoch->retired);
+    pthread_mutex_destroy (&epoch->mutex);
+    free (epoch);
+}
+
+/**
+ * Mark the start of a new reader cycle. Realtime safe.
+ */
+void
+epoch_advance (epoch_t *epoch)
+{
+    __sync_add_and_fetch (&epoch->counter, 1);
+}
+
+/**
+ * Return the current epoch. This is a full memory barrier, so that the value
+ * is read after anything which has been published before.
+ */
+unsigned long
+epoch_get (epoch_t *epoch)
+{
+    return __sync_fetch_and_add (&epoch->counter, 0);
+}
+
+/**
+ * Whether the reader has started a new cycle since the given stamp was
+ * obtained with epoch_get().
+ */
+int
+epoch_passed (epoch_t *epoch, unsigned long stamp)
+{
+    // The counter only increases, wrapping around is harmless
+    return epoch_get (epoch) != stamp;
+}
+
+/**
+ * Queue some data to be reclaimed once the reader can't reference it anymore.
+ *
+ * When callback is NULL, ptr is simply freed. Otherwise, the callback is
+ * called with ptr and data, in the collecting thread.
+ */
+void
+epoch_retire (epoch_t *epoch, void *ptr, epoch_callback_t callback, void *data)
+{
+    epoch_item_t *item = malloc (sizeof (epoch_item_t));
+    item->ptr = ptr;
+    item->callback = callback;
+    item->data = data;
+
+    pthread_mutex_lock (&epoch->mutex);
+    item->stamp = epoch_get (epoch);
+    vector_add (&epoch->retired, item);
+    pthread_mutex_unlock (&epoch->mutex);
+}
+
+static void
+epoch_reclaim (epoch_item_t **items, int num)
+{
+    int i;
+    for (i = 0; i < num; i++)
+    {
+        if (items[i]->callback)
+            items[i]->callback (items[i]->ptr, items[i]->data);
+        else
+            free (items[i]->ptr);
+        free (items[i]);
+    }
+}
+
+/**
+ * Reclaim the data which the reader can't reference anymore, in the calling
+ * thread. Returns the number of items reclaimed.
+ */
+int
+epoch_collect (epoch_t *epoch)
+{
+    epoch_item_t **items;
+    int num;
+
+    pthread_mutex_lock (&epoch->mutex);
+    unsigned long current = epoch_get (epoch);
+
+    /* Stamps never decrease in the queue, so that reclaimable items are
+       all at its start */
+    for (num = 0; num < epoch->retired.num; num++)
+        if (VECTOR_AT (epoch_item_t, &epoch->retired, num)->stamp == current)
+            break;
+
+    if (!num)
+    {
+        pthread_mutex_unlock (&epoch->mutex);
+        return 0;
+    }
+
+    items = malloc (num * sizeof (epoch_item_t *));
+    memcpy (items, epoch->retired.items, num * sizeof (epoch_item_t *));
+    memmove (epoch->retired.items, epoch->retired.items + num,
+             (epoch->retired.num - num) * sizeof (void *));
+    epoch->retired.num -= num;
+    pthread_mutex_unlock (&epoch->mutex);
+
+    // Callbacks may retire more data
+    epoch_reclaim (items, num);
+    free (items);
+    return num;
+}
+
+/**
+ * Reclaim all retired data, regardless of the current epoch. This is meant to
+ * be called when the reader is known to be done with it, e.g. after a
+ * synchronous round-trip, or once it's stopped.
+ */
+void
+epoch_flush (epoch_t *epoch)
+{
+    epoch_item_t **items;
+    int num;
+
+    pthread_mutex_lock (&epoch->mutex);
+    num = epoch->retired.num;
+    items = VECTOR_ITEMS (epoch_item_t, &epoch->retired);
+    vector_init (&epoch->retired);
+    pthread_mutex_unlock (&epoch->mutex);
+
+    epoch_reclaim (items, num);
+    free (items);
+}
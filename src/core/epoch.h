@@ -0,0 +1,55 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+#ifndef JACKBEAT_EPOCH_H
+#define JACKBEAT_EPOCH_H
+
+/*
+ * Deferred reclamation of data shared with a realtime reader.
+ *
+ * The reader (usually the audio thread) calls epoch_advance() once per cycle,
+ * before it picks up any newly published pointer, and must not keep such
+ * pointers from one cycle to the next.
+ *
+ * A writer first publishes the new data (message, pointer store, ...), then
+ * retires the old one. Retired data is stamped with the current epoch, and
+ * gets reclaimed by epoch_collect() once the reader has started a new cycle,
+ * that is: once it can't be referencing it anymore. The writer never waits
+ * for the reader.
+ *
+ * Retiring and collecting may happen from any non-realtime threads. Advancing
+ * is lock-free and safe to call from the realtime thread.
+ */
+
+typedef struct epoch_t epoch_t;
+typedef void (* epoch_callback_t) (void *ptr, void *data);
+
+epoch_t * epoch_new();
+void epoch_destroy(epoch_t *epoch);
+void epoch_advance(epoch_t *epoch);
+unsigned long epoch_get(epoch_t *epoch);
+int epoch_passed(epoch_t *epoch, unsigned long stamp);
+void epoch_retire(epoch_t *epoch, void *ptr, epoch_callback_t callback, void *data);
+int epoch_collect(epoch_t *epoch);
+void epoch_flush(epoch_t *epoch);
+
+#endif
@@ -27,12 +27,14 @@
 #include <semaphore.h>
 
 #include "event.h"
-#include "array.h"
+#include "vector.h"
 
 #define DEBUG(M, ...) { printf("EVT  %s(): ", __func__); printf(M, ## __VA_ARGS__); printf("\n"); }
 #define _sem_wait(mutex) DEBUG("lock"); sem_wait (mutex)
 #define _sem_post(mutex) DEBUG("unlock"); sem_post (mutex)
 
+#define EVENT_QUEUE_SCOPE_INLINE 4
+
 typedef struct event_subject_t
 {
     void *  source;
@@ -49,10 +51,9 @@ typedef struct event_call_t
 typedef struct event_queue_t
 {
     void *          self;
-    void **         scope;
-    int             scope_num;
-    event_call_t ** calls;
-    int             calls_num;
+    vector_t        scope;
+    void *          scope_storage[EVENT_QUEUE_SCOPE_INLINE];
+    vector_t        calls;
     int             processing;
 } event_queue_t;
 
@@ -70,14 +71,16 @@ typedef struct event_gc_item_t
 } event_gc_item_t;
 
 static sem_t                  event_mutex;
-static event_subject_t **     event_subjects = NULL;
-static int                    event_subjects_num = 0;
-static event_subscriber_t **  event_subscribers = NULL;
-static int                    event_subscribers_num = 0;
-static event_queue_t **       event_queues = NULL;
-static int                    event_queues_num = 0;
-static event_gc_item_t **     event_gc_items = NULL;
-static int                    event_gc_items_num = 0;
+static vector_t               event_subjects = VECTOR_INITIALIZER;
+static vector_t               event_subscribers = VECTOR_INITIALIZER;
+static vector_t               event_queues = VECTOR_INITIALIZER;
+static vector_t               event_gc_items = VECTOR_INITIALIZER;
+
+#define SUBJECT(I)    VECTOR_AT (event_subject_t, &event_subjects, I)
+#define SUBSCRIBER(I) VECTOR_AT (event_subscriber_t, &event_subscribers, I)
+#define QUEUE(I)      VECTOR_AT (event_queue_t, &event_queues, I)
+#define GC_ITEM(I)    VECTOR_AT (event_gc_item_t, &event_gc_items, I)
+#define CALL(Q, I)    VECTOR_AT (event_call_t, &(Q)->calls, I)
 
 void
 event_init ()
@@ -90,20 +93,19 @@ event_cleanup ()
 {
     sem_wait (&event_mutex);
     sem_destroy (&event_mutex);
-    ARRAY_DESTROY (event_subjects, event_subjects_num);
-    ARRAY_DESTROY (event_subscribers, event_subscribers_num);
-    ARRAY_DESTROY (event_queues, event_queues_num);
-    ARRAY_DESTROY (event_gc_items, event_gc_items_num);
+    vector_free_items (&event_subjects);
+    vector_free_items (&event_subscribers);
+    vector_free_items (&event_queues);
+    vector_free_items (&event_gc_items);
 }
 
 static event_subject_t *
 event_subject_find (void * source, char * name)
 {
     int i;
-    for (i = 0; i < event_subjects_num; i++)
-        if (!strcmp (name, event_subjects[i]->name) && (event_subjects[i]->source
-                                                        == source))
-            return event_subjects[i];
+    for (i = 0; i < event_subjects.num; i++)
+        if (!strcmp (name, SUBJECT (i)->name) && (SUBJECT (i)->source == source))
+            return SUBJECT (i);
     return NULL;
 }
 
@@ -111,9 +113,9 @@ static event_queue_t *
 event_queue_find (void * self)
 {
     int i;
-    for (i = 0; i < event_queues_num; i++)
-        if (event_queues[i]->self == self)
-            return event_queues[i];
+    for (i = 0; i < event_queues.num; i++)
+        if (QUEUE (i)->self == self)
+            return QUEUE (i);
     return NULL;
 }
 
@@ -123,8 +125,8 @@ event_gc_add (void *data, void (* free_data) (void *) )
     if (free_data)
     {
         int i, found = 0;
-        for (i = 0; i < event_gc_items_num; i++)
-            if (event_gc_items[i]->data == data)
+        for (i = 0; i < event_gc_items.num; i++)
+            if (GC_ITEM (i)->data == data)
             {
                 found = 1;
                 break;
@@ -134,7 +136,7 @@ event_gc_add (void *data, void (* free_data) (void *) )
             event_gc_item_t *item = malloc (sizeof (event_gc_item_t));
             item->data = data;
             item->free_data = free_data;
-            ARRAY_ADD (event_gc_item_t, event_gc_items, event_gc_items_num, item);
+            vector_add (&event_gc_items, item);
         }
     }
 }
@@ -143,20 +145,20 @@ static void
 event_gc ()
 {
     int i, j, k;
-    for (i = 0; i < event_gc_items_num; i++)
+    for (i = 0; i < event_gc_items.num; i++)
     {
         int used = 0;
-        for (j = 0; !used && (j < event_queues_num); j++)
-            for (k = 0; !used && (k < event_queues[j]->calls_num); k++)
-                if (event_queues[j]->calls[k]->event->data == event_gc_items[i]->data)
+        for (j = 0; !used && (j < event_queues.num); j++)
+            for (k = 0; !used && (k < QUEUE (j)->calls.num); k++)
+                if (CALL (QUEUE (j), k)->event->data == GC_ITEM (i)->data)
                     used = 1;
         if (!used)
         {
-            event_gc_item_t *item = event_gc_items[i];
+            event_gc_item_t *item = GC_ITEM (i);
             item->free_data (item->data);
             free (item);
-            ARRAY_REMOVE (event_gc_item_t, event_gc_items, event_gc_items_num, item);
-            if (i > 0) i--;
+            // Order doesn't matter here
+            vector_swap_remove_at (&event_gc_items, i--);
         }
     }
 }
@@ -165,7 +167,7 @@ void
 _event_fire (const char *caller, void *source, char *name, void *data, void (* free_data) (void *) )
 {
     sem_wait (&event_mutex);
-    int i, j;
+    int i;
     //DEBUG("Event '%s' fired by %s()", name, caller);
     event_subject_t *subject = event_subject_find (source, name);
     if (subject == NULL)
@@ -174,9 +176,9 @@ _event_fire (const char *caller, void *source, char *name, void *data, void (* f
     }
     else
     {
-        for (i = 0; i < event_subscribers_num; i++)
+        for (i = 0; i < event_subscribers.num; i++)
         {
-            event_subscriber_t *subscriber = event_subscribers[i];
+            event_subscriber_t *subscriber = SUBSCRIBER (i);
             if (subscriber->subject == subject)
             {
                 event_t *event = malloc (sizeof (event_t));
@@ -186,15 +188,7 @@ _event_fire (const char *caller, void *source, char *name, void *data, void (* f
                 event->data = data;
                 event_queue_t *queue = event_queue_find (subscriber->self);
 
-                int in_scope = 0;
-                if (queue)
-                    for (j = 0; j < queue->scope_num; j++)
-                        if (queue->scope[j] == source)
-                        {
-                            //DEBUG("event %s in scope", event->name);
-                            in_scope = 1;
-                            break;
-                        }
+                int in_scope = queue && (vector_find (&queue->scope, source) >= 0);
 
                 if (!queue || in_scope)
                 {
@@ -211,7 +205,7 @@ _event_fire (const char *caller, void *source, char *name, void *data, void (* f
                     call->event = event;
                     call->callback = subscriber->callback;
                     call->processing = 0;
-                    ARRAY_ADD (event_call_t, queue->calls, queue->calls_num, call);
+                    vector_add (&queue->calls, call);
                 }
             }
         }
@@ -236,9 +230,9 @@ _event_subscribe (const char *caller, void *source, char *name, void *self, even
     else
     {
         int subscribed = 0, i;
-        for (i = 0; i < event_subscribers_num; i++)
+        for (i = 0; i < event_subscribers.num; i++)
         {
-            event_subscriber_t *subscriber = event_subscribers[i];
+            event_subscriber_t *subscriber = SUBSCRIBER (i);
             if ((subscriber->subject == subject) && (subscriber->self == self))
             {
                 subscribed = 1;
@@ -254,8 +248,7 @@ _event_subscribe (const char *caller, void *source, char *name, void *self, even
             subscriber->subject = subject;
             subscriber->callback = callback;
             subscriber->self = self;
-            ARRAY_ADD (event_subscriber_t, event_subscribers, event_subscribers_num,
-                       subscriber);
+            vector_add (&event_subscribers, subscriber);
         }
     }
     sem_post (&event_mutex);
@@ -275,8 +268,7 @@ _event_register (const char *caller, void *source, char *name)
         event_subject_t *subject = malloc (sizeof (event_subject_t));
         strcpy (subject->name, name);
         subject->source = source;
-        ARRAY_ADD (event_subject_t, event_subjects, event_subjects_num,
-                   subject);
+        vector_add (&event_subjects, subject);
     }
     sem_post (&event_mutex);
 }
@@ -288,25 +280,22 @@ _event_remove_source (const char *caller, void *source)
     int i, j;
     event_subject_t *subject = NULL;
     int source_found = 0;
-    for (i = 0; i < event_subjects_num; i++)
+    for (i = 0; i < event_subjects.num; i++)
     {
-        while ((i < event_subjects_num) && (event_subjects[i]->source == source))
+        while ((i < event_subjects.num) && (SUBJECT (i)->source == source))
         {
             source_found = 1;
-            subject = event_subjects[i];
-            for (j = 0; j < event_subscribers_num; j++)
+            subject = SUBJECT (i);
+            for (j = 0; j < event_subscribers.num; j++)
             {
-                while ((j < event_subscribers_num)
-                       && (event_subscribers[j]->subject == subject))
+                while ((j < event_subscribers.num)
+                       && (SUBSCRIBER (j)->subject == subject))
                 {
-                    event_subscriber_t *subscriber = event_subscribers[j];
-                    ARRAY_REMOVE (event_subscriber_t, event_subscribers,
-                                  event_subscribers_num, subscriber);
-                    free (subscriber);
+                    free (SUBSCRIBER (j));
+                    vector_remove_at (&event_subscribers, j);
                 }
             }
-            ARRAY_REMOVE (event_subject_t, event_subjects,
-                          event_subjects_num, subject);
+            vector_remove_at (&event_subjects, i);
             free (subject);
         }
     }
@@ -314,19 +303,20 @@ _event_remove_source (const char *caller, void *source)
     {
         DEBUG ("Trying to remove unknwown source %p from %s()", source, caller);
     }
-    for (i = 0; i < event_queues_num; i++)
-        for (j = 0; j < event_queues[i]->calls_num; j++)
+    for (i = 0; i < event_queues.num; i++)
+    {
+        event_queue_t *queue = QUEUE (i);
+        for (j = 0; j < queue->calls.num; j++)
         {
-            event_call_t *call = event_queues[i]->calls[j];
+            event_call_t *call = CALL (queue, j);
             if (call->event->source == source)
             {
-                ARRAY_REMOVE (event_call_t, event_queues[i]->calls, event_queues[i]->calls_num, call);
+                vector_remove_at (&queue->calls, j--);
                 free (call->event);
                 free (call);
-                if (j > 0)
-                    j--;
             }
         }
+    }
     event_gc ();
     sem_post (&event_mutex);
 }
@@ -339,12 +329,10 @@ event_enable_queue (void *self)
     {
         event_queue_t *queue = malloc (sizeof (event_queue_t));
         queue->self = self;
-        queue->calls_num = 0;
-        queue->calls = NULL;
-        queue->scope_num = 0;
-        queue->scope = NULL;
+        vector_init (&queue->calls);
+        vector_init_inline (&queue->scope, queue->scope_storage, EVENT_QUEUE_SCOPE_INLINE);
         queue->processing = 0;
-        ARRAY_ADD (event_queue_t, event_queues, event_queues_num, queue);
+        vector_add (&event_queues, queue);
     }
     sem_post (&event_mutex);
 }
@@ -355,15 +343,12 @@ event_do_disable_queue (void *self)
     event_queue_t *queue = event_queue_find (self);
     if (queue != NULL)
     {
-        while (queue->calls_num > 0)
-        {
-            event_call_t *call = queue->calls[0];
-            ARRAY_REMOVE (event_call_t, queue->calls, queue->calls_num, call);
-            free (call->event);
-            free (call);
-        }
-        ARRAY_REMOVE (event_queue_t, event_queues, event_queues_num, queue);
-        free (queue->scope);
+        int i;
+        for (i = 0; i < queue->calls.num; i++)
+            free (CALL (queue, i)->event);
+        vector_free_items (&queue->calls);
+        vector_remove (&event_queues, queue);
+        vector_free (&queue->scope);
         free (queue);
         event_gc ();
     }
@@ -385,9 +370,9 @@ event_process_queue (void *self)
     if (queue && !queue->processing)
     {
         queue->processing = 1;
-        while (queue->calls_num > 0)
+        while (queue->calls.num > 0)
         {
-            event_call_t *call = queue->calls[0];
+            event_call_t *call = CALL (queue, 0);
             if (!call->processing)
             {
                 call->processing = 1;
@@ -396,7 +381,7 @@ event_process_queue (void *self)
                 sem_wait (&event_mutex);
                 if ((queue = event_queue_find (self)))
                 { // The queue may be gone here
-                    ARRAY_REMOVE (event_call_t, queue->calls, queue->calls_num, call);
+                    vector_remove (&queue->calls, call);
                     free (call->event);
                     free (call);
                 }
@@ -420,7 +405,7 @@ event_scope_add (void *self, void *source)
     event_queue_t *queue = event_queue_find (self);
     if (queue != NULL)
     {
-        ARRAY_ADD (void, queue->scope, queue->scope_num, source);
+        vector_add (&queue->scope, source);
     }
     sem_post (&event_mutex);
 }
@@ -431,15 +416,13 @@ event_unsubscribe_all (void *self)
     sem_wait (&event_mutex);
     event_do_disable_queue (self);
     int j;
-    for (j = 0; j < event_subscribers_num; j++)
+    for (j = 0; j < event_subscribers.num; j++)
     {
-        while ((j < event_subscribers_num)
-               && (event_subscribers[j]->self == self))
+        while ((j < event_subscribers.num)
+               && (SUBSCRIBER (j)->self == self))
         {
-            event_subscriber_t *subscriber = event_subscribers[j];
-            ARRAY_REMOVE (event_subscriber_t, event_subscribers,
-                          event_subscribers_num, subscriber);
-            free (subscriber);
+            free (SUBSCRIBER (j));
+            vector_remove_at (&event_subscribers, j);
         }
     }
 
@@ -459,13 +442,12 @@ event_has_subscribers (void *source, char *name)
     }
     else
     {
-        for (i = 0; i < event_subscribers_num; i++)
-        {
-            event_subscriber_t *subscriber = event_subscribers[i];
-            if (subscriber->subject == subject)
+        for (i = 0; i < event_subscribers.num; i++)
+            if (SUBSCRIBER (i)->subject == subject)
+            {
                 ret = 1;
-            break;
-        }
+                break;
+            }
     }
     sem_post (&event_mutex);
     return ret;
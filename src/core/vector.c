@@ -0,0 +1,151 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *    
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *    
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vector.h"
+
+#define VECTOR_MIN_SIZE 8
+
+void
+vector_init (vector_t *vector)
+{
+    vector->items = NULL;
+    vector->num = 0;
+    vector->size = 0;
+    vector->inline_items = NULL;
+    vector->inline_size = 0;
+}
+
+void
+vector_init_inline (vector_t *vector, void **storage, int size)
+{
+    vector->items = storage;
+    vector->num = 0;
+    vector->size = size;
+    vector->inline_items = storage;
+    vector->inline_size = size;
+}
+
+void
+vector_free (vector_t *vector)
+{
+    if (vector->items != vector->inline_items)
+        free (vector->items);
+    vector->items = vector->inline_items;
+    vector->size = vector->inline_size;
+    vector->num = 0;
+}
+
+void
+vector_free_items (vector_t *vector)
+{
+    int i;
+    for (i = 0; i < vector->num; i++)
+        free (vector->items[i]);
+    vector_free (vector);
+}
+
+void
+vector_reserve (vector_t *vector, int size)
+{
+    if (size <= vector->size)
+        return;
+
+    int new_size = vector->size > VECTOR_MIN_SIZE / 2 ? vector->size * 2 : VECTOR_MIN_SIZE;
+    while (new_size < size)
+        new_size *= 2;
+
+    if (vector->items == vector->inline_items)
+    {
+        void **items = malloc (new_size * sizeof (void *));
+        if (vector->num)
+            memcpy (items, vector->items, vector->num * sizeof (void *));
+        vector->items = items;
+    }
+    else
+    {
+        vector->items = realloc (vector->items, new_size * sizeof (void *));
+    }
+    vector->size = new_size;
+}
+
+int
+vector_add (vector_t *vector, void *item)
+{
+    if (vector->num == vector->size)
+        vector_reserve (vector, vector->num + 1);
+    vector->items[vector->num] = item;
+    return vector->num++;
+}
+
+int
+vector_find (vector_t *vector, void *item)
+{
+    int i;
+    for (i = 0; i < vector->num; i++)
+        if (vector->items[i] == item)
+            return i;
+    return -1;
+}
+
+void
+vector_remove_at (vector_t *vector, int index)
+{
+    vector->num--;
+    if (index < vector->num)
+        memmove (vector->items + index, vector->items + index + 1,
+                 (vector->num - index) * sizeof (void *));
+}
+
+int
+vector_remove (vector_t *vector, void *item)
+{
+    int index = vector_find (vector, item);
+    if (index < 0)
+        return 0;
+    vector_remove_at (vector, index);
+    return 1;
+}
+
+void
+vector_swap_remove_at (vector_t *vector, int index)
+{
+    vector->items[index] = vector->items[--vector->num];
+}
+
+int
+vector_swap_remove (vector_t *vector, void *item)
+{
+    int index = vector_find (vector, item);
+    if (index < 0)
+        return 0;
+    vector_swap_remove_at (vector, index);
+    return 1;
+}
+
+void
+vector_clear (vector_t *vector)
+{
+    vector->num = 0;
+}
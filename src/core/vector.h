@@ -0,0 +1,68 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *    
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *    
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+#ifndef JACKBEAT_VECTOR_H
+#define JACKBEAT_VECTOR_H
+
+/*
+ * Growable array of pointers.
+ *
+ * Storage grows geometrically, so that adding n items costs O(n) overall.
+ * vector_remove() preserves the order of the remaining items, and
+ * vector_swap_remove() is O(1) when order doesn't matter.
+ *
+ * A vector may start on caller-provided storage (usually a small array
+ * embedded in the owning struct). It then only allocates on the heap once
+ * that storage is full.
+ *
+ * Items are accessed directly through the items and num members, or with
+ * the typed VECTOR_* macros.
+ */
+
+typedef struct vector_t
+{
+    void ** items;
+    int     num;
+    int     size;
+    void ** inline_items;
+    int     inline_size;
+} vector_t;
+
+#define VECTOR_INITIALIZER { NULL, 0, 0, NULL, 0 }
+
+#define VECTOR_AT(TYPE, VEC, I) ((TYPE *) (VEC)->items[I])
+#define VECTOR_ITEMS(TYPE, VEC) ((TYPE **) (VEC)->items)
+
+void vector_init(vector_t *vector);
+void vector_init_inline(vector_t *vector, void **storage, int size);
+void vector_free(vector_t *vector);
+void vector_free_items(vector_t *vector);
+void vector_reserve(vector_t *vector, int size);
+int vector_add(vector_t *vector, void *item);
+int vector_find(vector_t *vector, void *item);
+int vector_remove(vector_t *vector, void *item);
+void vector_remove_at(vector_t *vector, int index);
+void vector_swap_remove_at(vector_t *vector, int index);
+int vector_swap_remove(vector_t *vector, void *item);
+void vector_clear(vector_t *vector);
+
+#endif
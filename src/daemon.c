@@ -0,0 +1,385 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+/*
+ * Headless engine, controlled over OSC.
+ *
+ * Runs the sequences of a song without any GUI: JAB files given on the
+ * command line are loaded at startup, and everything else, including loading,
+ * saving and exporting, goes through OSC. File operations are carried out
+ * from the main loop, one at a time, in the order they were received.
+ *
+ * SIGINT and SIGTERM shut down cleanly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sndfile.h>
+#include <config.h>
+
+#include "song.h"
+#include "osc.h"
+#include "rc.h"
+#include "jab.h"
+#include "error.h"
+#include "util.h"
+#include "core/event.h"
+#include "core/pool.h"
+#include "core/compat.h"
+#include "stream/stream.h"
+#include "stream/device.h"
+
+#define DEBUG(M, ...) { printf("DMN  %s(): ", __func__); printf(M, ## __VA_ARGS__); printf("\n"); }
+
+/* Main loop period, in milliseconds */
+#define DAEMON_POLL_INTERVAL 50
+
+typedef struct daemon_t
+{
+    rc_t        rc;
+    pool_t *    pool;
+    song_t *    song;
+    osc_t *     osc;
+    stream_t *  stream;
+    int         sequence_counter;
+} daemon_t;
+
+static volatile sig_atomic_t daemon_quit = 0;
+
+static void
+daemon_usage (char *executable)
+{
+    printf ("Usage: %s [options] [jab filename...]\n", executable);
+    printf ("Options:\n");
+    printf ("  -c, --clientname=STRING   client/application name for Jack, PulseAudio,..\n");
+    printf ("  -h, --help                Display help information\n");
+    printf ("  -n, --null-stream         Do not load any audio stream driver on startup\n");
+    printf ("  -p, --osc-port=PORT       Port to receive OSC messages on (default: 10203)\n");
+    printf ("  -s, --start               Start playing the sequences loaded on startup\n");
+    printf ("  -o, --osc-reflect         Print OSC interface to standard output\n");
+    printf ("  -j, --jack-transport      Force all sequences to follow jack transport\n");
+    printf ("  -v, --version             Output version\n");
+}
+
+static void
+daemon_on_signal (int sig)
+{
+    daemon_quit = 1;
+}
+
+static void
+daemon_progress (char *status, double fraction, void *data)
+{
+    static char last_status[256] = "";
+    if (strncmp (status, last_status, sizeof (last_status) - 1))
+    {
+        DEBUG ("%s", status);
+        strncpy (last_status, status, sizeof (last_status) - 1);
+    }
+}
+
+static int
+daemon_has_sequence (daemon_t *daemon, sequence_t *sequence)
+{
+    sequence_t **sequences = song_list_sequences (daemon->song);
+    int i, ii = song_count_sequences (daemon->song);
+    for (i = 0; i < ii; i++)
+        if (sequences[i] == sequence)
+            return 1;
+    return 0;
+}
+
+/**
+ * Load a JAB file into a new sequence, registered to the song, and thus to
+ * OSC. Returns NULL on failure, with error set.
+ */
+static sequence_t *
+daemon_load_sequence (daemon_t *daemon, char *filename, int *error)
+{
+    jab_t *jab;
+    sequence_t *sequence = NULL;
+    char name[32];
+
+    DEBUG ("Loading %s", filename);
+    if ((jab = jab_open (filename, JAB_READ, daemon_progress, (void *) daemon, error)))
+    {
+        sprintf (name, "sequence%d", ++daemon->sequence_counter);
+        if ((sequence = jab_retrieve_sequence (jab, daemon->stream, name, error)))
+        {
+            song_register_sequence (daemon->song, sequence);
+            song_register_sequence_samples (daemon->song, sequence);
+            sequence_set_transport (sequence, daemon->rc.transport_aware, daemon->rc.transport_query);
+            if (daemon->rc.default_resampler_type != -1)
+                sequence_set_resampler_type (sequence, daemon->rc.default_resampler_type);
+        }
+        jab_close (jab);
+    }
+
+    if (!sequence)
+    {
+        char *s = error_to_string (*error);
+        printf ("Unable to load \"%s\": %s\n", filename, s);
+        free (s);
+    }
+    return sequence;
+}
+
+static void
+daemon_on_load_requested (event_t *event)
+{
+    daemon_t *daemon = (daemon_t *) event->self;
+    osc_request_t *request = (osc_request_t *) event->data;
+    sequence_t *sequence;
+    int error = 0;
+
+    if ((sequence = daemon_load_sequence (daemon, request->filename, &error)))
+    {
+        char *name = sequence_get_name (sequence);
+        osc_reply (daemon->osc, request, 0, name);
+        free (name);
+    }
+    else
+    {
+        osc_reply (daemon->osc, request, error ? error : ERR_INTERNAL, NULL);
+    }
+}
+
+static void
+daemon_on_save_requested (event_t *event)
+{
+    daemon_t *daemon = (daemon_t *) event->self;
+    osc_request_t *request = (osc_request_t *) event->data;
+    jab_t *jab;
+    int error = ERR_INTERNAL;
+
+    if (daemon_has_sequence (daemon, request->sequence))
+    {
+        DEBUG ("Saving %s", request->filename);
+        if (sequence_has_nested (request->sequence))
+        {
+            error = ERR_SEQUENCE_NESTED;
+        }
+        else if ((jab = jab_open (request->filename, JAB_WRITE, daemon_progress, (void *) daemon, &error)))
+        {
+            jab_add_sequence (jab, request->sequence);
+            if (jab_close (jab))
+                error = 0;
+            else
+                error = ERR_INTERNAL;
+        }
+    }
+    osc_reply (daemon->osc, request, error, NULL);
+}
+
+static void
+daemon_on_export_requested (event_t *event)
+{
+    daemon_t *daemon = (daemon_t *) event->self;
+    osc_request_t *request = (osc_request_t *) event->data;
+    int framerate;
+
+    if (daemon_has_sequence (daemon, request->sequence))
+    {
+        framerate = request->framerate > 0
+                    ? request->framerate : (int) sequence_get_framerate (request->sequence);
+        DEBUG ("Exporting %s at %d Hz", request->filename, framerate);
+        if (sequence_export (request->sequence, request->filename, framerate,
+                             request->sustain_type, SF_FORMAT_WAV | SF_FORMAT_PCM_16,
+                             daemon_progress, (void *) daemon))
+            osc_reply (daemon->osc, request, 0, NULL);
+        else if (sequence_get_error (request->sequence))
+            osc_reply (daemon->osc, request, sequence_get_error (request->sequence), NULL);
+        else
+            osc_reply (daemon->osc, request, ERR_INTERNAL, NULL);
+    }
+    else
+    {
+        osc_reply (daemon->osc, request, ERR_INTERNAL, NULL);
+    }
+}
+
+static void
+daemon_on_close_requested (event_t *event)
+{
+    daemon_t *daemon = (daemon_t *) event->self;
+    osc_request_t *request = (osc_request_t *) event->data;
+
+    if (daemon_has_sequence (daemon, request->sequence))
+    {
+        osc_reply (daemon->osc, request, 0, NULL);
+        sequence_destroy (request->sequence);
+    }
+    else
+    {
+        osc_reply (daemon->osc, request, ERR_INTERNAL, NULL);
+    }
+}
+
+static void
+daemon_on_quit_requested (event_t *event)
+{
+    daemon_t *daemon = (daemon_t *) event->self;
+    osc_reply (daemon->osc, (osc_request_t *) event->data, 0, NULL);
+    daemon_quit = 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+    daemon_t daemon;
+    char *client_name = NULL;
+    int null_stream = 0, osc_port = 0, start = 0, jack_transport = 0;
+    int option_index = 0, c, error;
+    struct sigaction sa;
+
+    static struct option long_options[] ={
+        {"clientname",  1, 0, 'c'},
+        {"help",        0, 0, 'h'},
+        {"null-stream", 0, 0, 'n'},
+        {"osc-port",    1, 0, 'p'},
+        {"start",       0, 0, 's'},
+        {"osc-reflect", 0, 0, 'o'},
+        {"jack-transport", 0, 0, 'j'},
+        {"version",     0, 0, 'v'},
+        {0,             0, 0, 0}
+    };
+
+    while ((c = getopt_long (argc, argv, "c:hnp:sojv", long_options, &option_index)) != EOF)
+    {
+        switch (c)
+        {
+            case 'c':
+                client_name = optarg;
+                break;
+
+            case 'n':
+                null_stream = 1;
+                break;
+
+            case 'p':
+                osc_port = atoi (optarg);
+                break;
+
+            case 's':
+                start = 1;
+                break;
+
+            case 'o':
+                osc_print_interface ();
+                exit (0);
+                break;
+
+            case 'j':
+                jack_transport = 1;
+                break;
+
+            case 'v':
+                printf ("%s\n", VERSION);
+                exit (0);
+                break;
+
+            case 'h':
+            default:
+                daemon_usage (argv[0]);
+                exit (c == 'h' ? 0 : 1);
+        }
+    }
+
+    sa.sa_handler = daemon_on_signal;
+    sa.sa_flags = 0;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+    signal (SIGPIPE, SIG_IGN);
+
+    util_init_paths ();
+    event_init ();
+    event_enable_queue (NULL);
+    event_enable_queue (&daemon);
+    sample_init ();
+
+    rc_read (&daemon.rc);
+    daemon.sequence_counter = 0;
+    daemon.pool = pool_new (4);
+    daemon.song = song_new (daemon.pool);
+    song_set_transport_follow (daemon.song, jack_transport);
+
+    if (!(daemon.osc = osc_new (daemon.song)))
+    {
+        printf ("Unable to start the OSC server\n");
+        exit (1);
+    }
+    if (osc_port && !osc_set_port (daemon.osc, osc_port))
+    {
+        printf ("Unable to receive OSC messages on port %d\n", osc_port);
+        exit (1);
+    }
+    osc_set_latency (daemon.osc, daemon.rc.osc_latency);
+    DEBUG ("Receiving OSC messages on port %d", osc_get_port (daemon.osc));
+
+    event_subscribe (daemon.osc, "load-requested", &daemon, daemon_on_load_requested);
+    event_subscribe (daemon.osc, "save-requested", &daemon, daemon_on_save_requested);
+    event_subscribe (daemon.osc, "export-requested", &daemon, daemon_on_export_requested);
+    event_subscribe (daemon.osc, "close-requested", &daemon, daemon_on_close_requested);
+    event_subscribe (daemon.osc, "quit-requested", &daemon, daemon_on_quit_requested);
+
+    daemon.stream = stream_new ();
+    stream_auto_connect (daemon.stream, daemon.rc.auto_connect);
+    stream_device_set_buffering (daemon.rc.audio_period_size, daemon.rc.audio_periods);
+    if (!null_stream)
+        stream_device_open (daemon.stream, daemon.rc.audio_output, daemon.rc.audio_sample_rate,
+                            client_name ? client_name : daemon.rc.client_name,
+                            daemon.rc.jack_auto_start);
+
+    for (; optind < argc; optind++)
+    {
+        sequence_t *sequence = daemon_load_sequence (&daemon, argv[optind], &error);
+        if (!sequence)
+            exit (1);
+        if (start)
+            sequence_start (sequence);
+    }
+
+    while (!daemon_quit)
+    {
+        event_process_queue (&daemon);
+        event_process_queue (NULL);
+        stream_collect (daemon.stream);
+        compat_sleep (DAEMON_POLL_INTERVAL);
+    }
+
+    DEBUG ("Shutting down");
+    while (song_count_sequences (daemon.song))
+        sequence_destroy (song_list_sequences (daemon.song)[0]);
+
+    stream_destroy (daemon.stream);
+    osc_destroy (daemon.osc);
+    song_destroy (daemon.song);
+    pool_destroy (daemon.pool);
+    event_cleanup ();
+
+    return 0;
+}
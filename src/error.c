@@ -64,6 +64,17 @@ error_to_string (int code)
             error_string = strdup ("Malformed name. Please only use letters, digits, underscores, dashes, "
                                    "plus signs and points.");
             break;
+        case ERR_SEQUENCE_NESTED_CYCLE:
+            error_string = strdup ("A sequence can't play itself, either directly or through "
+                                   "other sequences.");
+            break;
+        case ERR_SEQUENCE_NESTED:
+            error_string = strdup ("Tracks which play other sequences can't be saved nor "
+                                   "exported. Please assign them samples first.");
+            break;
+        case ERR_UNSUPPORTED:
+            error_string = strdup ("This operation isn't supported by this instance of Jackbeat.");
+            break;
         case ERR_SEQUENCE_INTERNAL:
         case ERR_INTERNAL:
         default:
@@ -33,6 +33,9 @@ enum {
     ERR_SEQUENCE_JACK_REGPORT,
     ERR_SEQUENCE_DUPLICATE_TRACK_NAME,
     ERR_SEQUENCE_INVALID_NAME,
+    ERR_SEQUENCE_NESTED_CYCLE,
+    ERR_SEQUENCE_NESTED,
+    ERR_UNSUPPORTED,
     ERR_INTERNAL
 };
 
@@ -24,10 +24,10 @@
 #include <fcntl.h>  /* for fcntl, O_NONBLOCK  - signal handlers */
 
 #define GUI_ANIMATION_INTERVAL 34 // miliseconds
+#define GUI_INSTANCE(i) VECTOR_AT (gui_t, &gui_instances, i)
 
 static int      gui_instance_counter  = 0;
-static int      gui_instances_num     = 0;
-static gui_t ** gui_instances         = NULL;
+static vector_t gui_instances         = VECTOR_INITIALIZER;
 gui_t *         gui_last_focus        = NULL;
 static int      signal_pipe[2];
 
@@ -412,12 +412,14 @@ gui_clear_sequence (gui_t * gui, guint action, GtkWidget * w)
         int ntracks = sequence_get_tracks_num (gui->sequence);
         int nbeats = sequence_get_beats_num (gui->sequence);
         int i, j;
+        sequence_edit_t *edit = sequence_edit_begin (gui->sequence);
         for (i = 0; i < ntracks; i++)
             for (j = 0; j < nbeats; j++)
             {
-                sequence_set_beat (gui->sequence, i, j, 0);
-                sequence_set_mask_beat (gui->sequence, i, j, 1);
+                sequence_edit_set_beat (edit, i, j, 0);
+                sequence_edit_set_mask_beat (edit, i, j, 1);
             }
+        sequence_edit_commit (edit);
     }
 }
 
@@ -567,6 +569,7 @@ gui_timeout (gpointer data)
     //sequence_process_events (gui->sequence);
     event_process_queue (gui);
     event_process_queue (NULL);
+    stream_collect (gui->stream);
 
     return TRUE;
 }
@@ -626,8 +629,8 @@ gui_close (GtkWidget * widget, GdkEvent  *event, gui_t * gui) // Glade callback
         gui_prefs_cleanup (gui);
         gtk_object_destroy (GTK_OBJECT (gui->tooltips));
         gui_builder_destroy (gui->builder);
-        ARRAY_REMOVE (gui_t, gui_instances, gui_instances_num, gui);
-        if (gui_instances_num == 0)
+        vector_remove (&gui_instances, gui);
+        if (gui_instances.num == 0)
         {
             gui_do_exit (gui);
         }
@@ -816,19 +819,6 @@ gui_menu_play_clicked (gui_t * gui, guint action, GtkWidget * w)
         sequence_start (gui->sequence);
 }
 
-void start_sequence()
-{
-    int i = 0;
-    for (i = 0; i < gui_instances_num; i++)
-    {
-        if(!sequence_is_playing (gui_instances[i]->sequence))
-        {
-            if (stream_is_connected(gui_instances[i]->stream))
-                sequence_start (gui_instances[i]->sequence);
-        }
-    }
-}
-
 G_MODULE_EXPORT void
 gui_pause_clicked (GtkWidget * widget, gui_t * gui) // Glade callback
 {
@@ -1500,6 +1490,7 @@ gui_new_child (rc_t *rc, arg_t *arg, gui_t *parent, song_t *song,
     event_subscribe (gui->stream, "connection-lost", gui, gui_stream_connection_lost);
     event_subscribe (gui->sequence, "transport-changed", gui, gui_on_transport_changed);
     event_subscribe (gui->sequence, "beat-changed", gui, gui_on_sequence_modified);
+    event_subscribe (gui->sequence, "region-changed", gui, gui_on_sequence_modified);
     event_subscribe (gui->sequence, "bpm-changed", gui, gui_on_bpm_changed);
     event_subscribe (gui->sequence, "looping-changed", gui, gui_on_looping_changed);
     event_subscribe (gui->sequence, "track-mute-changed", gui, gui_on_sequence_modified);
@@ -1530,7 +1521,7 @@ gui_new_child (rc_t *rc, arg_t *arg, gui_t *parent, song_t *song,
     gui_last_focus = gui;
     gui_enable_timeout (gui);
     gtk_widget_show (gui->window);
-    ARRAY_ADD (gui_t, gui_instances, gui_instances_num, gui);
+    vector_add (&gui_instances, gui);
     if (gui->is_initial)
     {
         GtkWidget *button = gui_builder_get_widget (gui->builder, "track_prop_toggle");
@@ -1565,14 +1556,14 @@ static void
 gui_save ()
 {
     int i = 0;
-    for (i = 0; i < gui_instances_num; i++)
+    for (i = 0; i < gui_instances.num; i++)
     {
-        if (gui_instances[i]->sequence_is_modified)
+        if (GUI_INSTANCE (i)->sequence_is_modified)
         {
-            if (gui_instances[i]->filename_is_set)
-                gui_file_do_save_sequence (gui_instances[i], gui_instances[i]->filename);
+            if (GUI_INSTANCE (i)->filename_is_set)
+                gui_file_do_save_sequence (GUI_INSTANCE (i), GUI_INSTANCE (i)->filename);
             else
-                gui_file_save_as_sequence (gui_instances[i], 0, 0);
+                gui_file_save_as_sequence (GUI_INSTANCE (i), 0, 0);
         }
     }
 }
@@ -1585,9 +1576,9 @@ gui_exit (gui_t * gui, guint action, GtkWidget * w)
         gui = gui_last_focus;
 
     int i, c = 0;
-    for (i = 0; i < gui_instances_num; i++)
+    for (i = 0; i < gui_instances.num; i++)
     {
-        if (gui_instances[i]->sequence_is_modified)
+        if (GUI_INSTANCE (i)->sequence_is_modified)
             c++;
     }
 
@@ -58,7 +58,7 @@
 #include "gui/dk.h"
 #include "gui/misc.h"
 #include "core/event.h"
-#include "core/array.h"
+#include "core/vector.h"
 #include "util.h"
 #include "osc.h"
 
@@ -54,7 +54,15 @@ gui_file_do_load_sample (gui_t *gui, int track, char *filename)
         gui_show_progress (gui, "Loading sample", "Hold on...");
         if ((sample = sample_new (filename, gui_progress_callback, (void *) gui)) != NULL)
         {
-            song_register_sample (gui->song, sample);
+            /* Same audio from another path: sharing the loaded copy */
+            sample_t *shared = song_dedup_sample (gui->song, sample);
+            if (shared)
+            {
+                sample_unref (sample);
+                sample = shared;
+            }
+            else
+                song_register_sample (gui->song, sample);
         }
         gui_hide_progress (gui);
     }
@@ -333,7 +341,15 @@ gui_file_export_sequence (gui_t * gui, guint action, GtkWidget * w)
 
             gui_show_progress (gui, "Exporting sequence", "Hold on...");
             gui_disable_timeout (gui); // avoid deadlock
-            sequence_export (gui->sequence, chosen_name, framerate, sustain_type, gui_progress_callback, (void *) gui);
+            if (!sequence_export (gui->sequence, chosen_name, framerate, sustain_type,
+                                  SF_FORMAT_WAV | SF_FORMAT_PCM_16,
+                                  gui_progress_callback, (void *) gui))
+            {
+                if (sequence_get_error (gui->sequence))
+                    gui_display_error (gui, error_to_string (sequence_get_error (gui->sequence)));
+                else
+                    gui_display_error (gui, "Unable to write the exported file.");
+            }
             gui_enable_timeout (gui);
             gui_hide_progress (gui);
         }
@@ -347,6 +363,11 @@ gui_file_do_save_sequence (gui_t * gui, char *filename)
 {
     int success = 0;
     jab_t *jab;
+    if (sequence_has_nested (gui->sequence))
+    {
+        gui_display_error (gui, error_to_string (ERR_SEQUENCE_NESTED));
+        return 0;
+    }
     gui_show_progress (gui, "Saving sequence", "Hold on...");
     int error;
     if ((jab = jab_open (filename, JAB_WRITE, gui_progress_callback,
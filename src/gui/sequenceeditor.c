@@ -79,6 +79,7 @@ static void gui_sequence_editor_control_update_bg (gui_sequence_editor_t *self,
                                                    int active_track, int width,
                                                    int track_height);
 static void gui_sequence_editor_on_mute_changed (event_t *event);
+static void gui_sequence_editor_on_region_changed (event_t *event);
 static void gui_sequence_editor_on_solo_changed (event_t *event);
 static void gui_sequence_editor_on_volume_changed (event_t *event);
 static void gui_sequence_editor_on_destroy (event_t *event);
@@ -706,6 +707,28 @@ gui_sequence_editor_on_beat_changed (event_t *event)
                    sequence_get_mask_beat (self->sequence, pos->track, pos->beat));
 }
 
+static void
+gui_sequence_editor_on_region_changed (event_t *event)
+{
+    gui_sequence_editor_t *self = (gui_sequence_editor_t *) event->self;
+    sequence_region_t *region = (sequence_region_t *) event->data;
+    int nbeats = sequence_get_beats_num (self->sequence);
+    char *beats = malloc (nbeats + 1);
+    char *mask = malloc (nbeats + 1);
+    int i, j;
+
+    for (i = region->track; i < region->track + region->tracks_num; i++)
+        if (sequence_get_pattern (self->sequence, i, beats, mask))
+            for (j = region->beat; j < region->beat + region->beats_num && j < nbeats; j++)
+            {
+                grid_set_value (self->grid, j, i, beats[j]);
+                grid_set_mask (self->grid, j, i, mask[j]);
+            }
+
+    free (beats);
+    free (mask);
+}
+
 static void
 gui_sequence_editor_on_resize (event_t *event)
 {
@@ -744,6 +767,7 @@ gui_sequence_editor_new (sequence_t *sequence)
     event_register (self, "size-delta-request");
 
     event_subscribe (self->sequence, "beat-changed", self, gui_sequence_editor_on_beat_changed);
+    event_subscribe (self->sequence, "region-changed", self, gui_sequence_editor_on_region_changed);
     event_subscribe (self->sequence, "resized", self, gui_sequence_editor_on_resize);
     event_subscribe (self->sequence, "reordered", self, gui_sequence_editor_on_resize);
     event_subscribe (self->sequence, "track-mute-changed", self, gui_sequence_editor_on_mute_changed);
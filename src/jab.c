@@ -37,7 +37,7 @@
 #include "jab.h"
 #include "util.h"
 #include "error.h"
-#include "core/array.h"
+#include "core/vector.h"
 
 #ifdef MEMDEBUG
 #include "memdebug.h"
@@ -55,8 +55,7 @@
 struct jab_t
 {
     FILE *              fd;
-    sequence_t **       sequences;
-    int                 sequences_num;
+    vector_t            sequences;
     char                path[512];
     char                samples_path[512];
     char                tmpdir[512];
@@ -159,7 +158,7 @@ jab_open (char *path, int mode, progress_callback_t progress_callback,
             break;
         case JAB_WRITE:
             jab = calloc (1, sizeof (jab_t));
-            jab->sequences = NULL;
+            vector_init (&jab->sequences);
             strcpy (jab->path, path);
             jab->mode = JAB_WRITE;
             DEBUG ("Opening jab file in write mode : %s", path)
@@ -354,6 +353,11 @@ jab_retrieve_sequence (jab_t *jab, stream_t *stream, char *sequence_name, int *e
         i = 0;
         int t, j;
         gchar **bs;
+        char *beats = calloc (tracks_num * beats_num, 1);
+        char *masks = calloc (tracks_num * beats_num, 1);
+        for (t = 0; t < tracks_num; t++)
+            sequence_get_pattern (sequence, t, beats + t * beats_num, masks + t * beats_num);
+
         if (_jab_xml_node_exists (jab->xml_des, beat))
         {
             do
@@ -368,15 +372,12 @@ jab_retrieve_sequence (jab_t *jab, stream_t *stream, char *sequence_name, int *e
                     {
                         int assigned =  sscanf (bs[j], "%d+%d", &x, &y);
                         DEBUG ("bs[%d] = %s (assigned:%d, beat:%d, mask:%d)", j, bs[j], assigned, x, y)
-                        if (assigned == 1)
-                        {
-                            sequence_set_beat (sequence, t++, i, x);
-                        }
-                        else if (assigned == 2)
-                        {
-                            sequence_set_beat (sequence, t, i, x);
-                            sequence_set_mask_beat (sequence, t++, i, y);
-                        }
+                        if (assigned >= 1)
+                            beats[t * beats_num + i] = x;
+                        if (assigned == 2)
+                            masks[t * beats_num + i] = y;
+                        if (assigned >= 1)
+                            t++;
                     }
                 }
 
@@ -386,6 +387,11 @@ jab_retrieve_sequence (jab_t *jab, stream_t *stream, char *sequence_name, int *e
             }
             while (i < beats_num && _jab_xml_node_exists (jab->xml_des, beat));
         }
+
+        for (t = 0; t < tracks_num; t++)
+            sequence_set_pattern (sequence, t, beats + t * beats_num, masks + t * beats_num);
+        free (beats);
+        free (masks);
         jab->progress_callback ("Done", 1, jab->progress_data);
     }
 
@@ -400,7 +406,7 @@ jab_retrieve_sequence (jab_t *jab, stream_t *stream, char *sequence_name, int *e
 void
 jab_add_sequence (jab_t *jab, sequence_t *sequence)
 {
-    ARRAY_ADD (sequence_t, jab->sequences, jab->sequences_num, sequence)
+    vector_add (&jab->sequences, sequence);
 }
 
 #define GS(F, ...) g_string_append_printf (gs, F, ## __VA_ARGS__)
@@ -420,9 +426,9 @@ _jab_get_xml_description (jab_t *jab)
     GS ("  <minVersion> %s </minVersion>\n", JAB_MIN_VERSION);
 
     sequence_t *s;
-    for (i = 0; i < jab->sequences_num; i++)
+    for (i = 0; i < jab->sequences.num; i++)
     {
-        s = jab->sequences[i];
+        s = VECTOR_AT (sequence_t, &jab->sequences, i);
         tn = sequence_get_tracks_num (s);
         bn = sequence_get_beats_num (s);
         char *name = sequence_get_name (s);
@@ -465,24 +471,34 @@ _jab_get_xml_description (jab_t *jab)
         }
         GS ("    <pattern>\n");
 
+        char *beats = malloc (tn * bn + 1);
+        char *masks = malloc (tn * bn + 1);
+        int *masked = malloc ((tn + 1) * sizeof (int));
+        for (k = 0; k < tn; k++)
+        {
+            sequence_get_pattern (s, k, beats + k * bn, masks + k * bn);
+            masked[k] = sequence_is_enabled_mask (s, k);
+        }
+
         for (j = 0; j < bn; j++)
         {
             GS ("      <beat> ");
-            for (k = 0; k < tn - 1; k++)
+            for (k = 0; k < tn; k++)
             {
-                if (sequence_is_enabled_mask (s, k))
-                    GS ("%d+%d - ", sequence_get_beat (s, k, j),
-                        sequence_get_mask_beat (s, k, j));
+                if (k > 0)
+                    GS (" - ");
+                if (masked[k])
+                    GS ("%d+%d", beats[k * bn + j], masks[k * bn + j]);
                 else
-                    GS ("%d - ", sequence_get_beat (s, k, j));
+                    GS ("%d", beats[k * bn + j]);
             }
-            if (sequence_is_enabled_mask (s, k))
-                GS ("%d+%d </beat>\n", sequence_get_beat (s, k, j),
-                    sequence_get_mask_beat (s, k, j));
-            else
-                GS ("%d </beat>\n", sequence_get_beat (s, k, j));
+            GS (" </beat>\n");
         }
 
+        free (beats);
+        free (masks);
+        free (masked);
+
         GS ("    </pattern>\n");
         GS ("  </sequence>\n");
     }
@@ -504,7 +520,20 @@ jab_close (jab_t *jab)
     char p[512];
     if (jab->mode == JAB_WRITE)
     {
-        char *tmpdir = util_mktmpdir ();
+        // Nesting refers to loaded sequences, it can't be stored
+        int i, nested = 0;
+        for (i = 0; i < jab->sequences.num; i++)
+            nested |= sequence_has_nested (VECTOR_AT (sequence_t, &jab->sequences, i));
+
+        char *tmpdir = NULL;
+        if (nested)
+        {
+            DEBUG ("Can't save tracks which use other sequences");
+        }
+        else
+        {
+            tmpdir = util_mktmpdir ();
+        }
         if (tmpdir)
         {
             sprintf (p, "%s/jab", tmpdir);
@@ -524,19 +553,19 @@ jab_close (jab_t *jab)
                         fclose (xml);
                         sprintf (p, "%s/jab/samples", tmpdir);
                         util_mkdir (p, 0700);
-                        int i, j, tn;
+                        int j, tn;
                         sample_t *s;
-                        for (i = 0, j = 0; i < jab->sequences_num; i++)
-                            j += sequence_get_tracks_num (jab->sequences[i]);
+                        for (i = 0, j = 0; i < jab->sequences.num; i++)
+                            j += sequence_get_tracks_num (VECTOR_AT (sequence_t, &jab->sequences, i));
                         jab->progress_ratio = 0.8 / (double) j;
                         jab->progress_step = 0;
-                        for (i = 0; i < jab->sequences_num; i++)
+                        for (i = 0; i < jab->sequences.num; i++)
                         {
-                            tn = sequence_get_tracks_num (jab->sequences[i]);
+                            tn = sequence_get_tracks_num (VECTOR_AT (sequence_t, &jab->sequences, i));
                             int err = 0;
                             for (j = 0; j < tn && (!err); j++)
                             {
-                                s = sequence_get_sample (jab->sequences[i], j);
+                                s = sequence_get_sample (VECTOR_AT (sequence_t, &jab->sequences, i), j);
                                 if (s)
                                 {
                                     sprintf (p, "%s/jab/samples/%s", tmpdir,
@@ -570,6 +599,7 @@ jab_close (jab_t *jab)
         success = 1;
     }
 
+    vector_free (&jab->sequences);
     free (jab);
     jab = NULL;
     return success;
@@ -200,6 +200,7 @@ main (int argc, char *argv[])
     event_init ();
     event_enable_queue (NULL);
     event_register (NULL, "desktop-open-action");
+    sample_init ();
 
 #ifdef HAVE_GTK_QUARTZ
     OSStatus err = AEInstallEventHandler (kCoreEventClass, kAEOpenDocuments,
@@ -223,14 +224,18 @@ main (int argc, char *argv[])
 
     DEBUG ("Creating song");
     song_t *song = song_new (pool);
+    song_set_transport_follow (song, jack_transport);
 
     DEBUG ("Bringing OSC up");
     osc_t *osc = osc_new (song);
+    if (osc)
+        osc_set_latency (osc, rc.osc_latency);
 
     DEBUG ("Creating audio stream");
     char *client_name = arg->client_name ? arg->client_name : rc.client_name;
     stream_t *stream = stream_new ();
     stream_auto_connect (stream, rc.auto_connect);
+    stream_device_set_buffering (rc.audio_period_size, rc.audio_periods);
     if (!arg->null_stream)
         stream_device_open (stream, rc.audio_output, rc.audio_sample_rate, client_name, rc.jack_auto_start);
 
@@ -25,28 +25,42 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 #include <glib.h>
 #include <lo/lo.h>
 #include "core/event.h"
-#include "core/array.h"
+#include "core/vector.h"
+#include "core/ringbuffer.h"
+#include "core/compat.h"
 #include "osc.h"
 #include "sequence.h"
+#include "error.h"
 
 #define DEBUG(M, ...) { printf("OSC  %s(): ", __func__); printf(M, ## __VA_ARGS__); printf("\n"); }
-
-// Can't write a function because of the variadic args of lo_send():
-#define osc_send_from_sequence(osc, sequence, path, type, ...) \
-{ \
-  osc_sequence_t *osc_sequence \
-    = (osc_sequence_t *) g_hash_table_lookup (osc->sequences, (gpointer) sequence); \
-  if (osc_sequence->output_address) \
-  { \
-    char *_path = malloc (strlen (osc_sequence->output_prefix) + strlen (path) + 1); \
-    sprintf (_path, "%s%s", osc_sequence->output_prefix, path); \
-    lo_send (osc_sequence->output_address, _path, type, __VA_ARGS__); \
-    free (_path); \
-  } \
-}
+#define METHOD(osc, i) VECTOR_AT (osc_method_t, &(osc)->methods, i)
+
+#define OSC_OUTPUT_QUEUE_SIZE 65536 // Bytes, per sequence, must be a power of 2
+#define OSC_OUTPUT_BATCH_SIZE 64
+
+// Outgoing events, in the order they appear in the interface:
+#define OSC_OUTPUT_BEAT_CHANGED   0
+#define OSC_OUTPUT_REGION_CHANGED 1
+#define OSC_OUTPUT_BEAT_ON        2
+#define OSC_OUTPUT_BEAT_OFF       3
+#define OSC_OUTPUT_PATTERN        4
+#define OSC_OUTPUT_LEVELS         5
+#define OSC_OUTPUT_POSITION       6
+#define OSC_OUTPUT_LOAD           7
+#define OSC_OUTPUT_NUM            8
+
+// Telemetry streams, sent as the outputs of the same index from OSC_OUTPUT_LEVELS:
+#define OSC_TELEMETRY_NUM         3
+#define OSC_TELEMETRY_MAX_RATE    100 // Hz
 
 typedef struct osc_method_def_t
 {
@@ -67,20 +81,68 @@ typedef struct osc_method_t
     osc_method_def_t *def;
 } osc_method_t;
 
+/* The output address, prefix and paths, and the changes queue, are protected
+   by the output_mutex. The events queue has a single writer, the pool thread
+   which processes the sequence events, so that queuing beats takes no lock. */
 typedef struct osc_sequence_t
 {
+    osc_t *       osc;
+    sequence_t *  sequence;
     char *        input_prefix;
     int           input_default_prefix;
     lo_address    output_address;
     char *        output_prefix;
+    char *        output_paths[OSC_OUTPUT_NUM];
+    unsigned long framerate;
+    ringbuffer_t *events;   // Beats played
+    ringbuffer_t *changes;  // Pattern changes
 } osc_sequence_t;
 
+/* Telemetry stream subscribed to by a client */
+typedef struct osc_subscription_t
+{
+    sequence_t *      sequence;
+    osc_sequence_t *  osc_sequence;
+    lo_address        address;
+    int               stream;
+    unsigned long long period; // Microseconds
+    unsigned long long next;
+    unsigned long     dropped_num;
+} osc_subscription_t;
+
+/* Outgoing message, as queued for the sender thread */
+typedef struct osc_output_t
+{
+    int               type;
+    int               argv[4];
+    unsigned long     frame;
+    lo_timetag        timetag;
+} osc_output_t;
+
 struct osc_t
 {
     lo_server_thread  server;
-    osc_method_t      **methods;
-    int               methods_num;
+    vector_t          methods;
     GHashTable *      sequences;
+    int               latency;
+    unsigned long volatile timed_num;
+    unsigned long volatile late_num;
+
+    vector_t          outputs;  // Of osc_sequence_t, drained by the sender
+    pthread_mutex_t   output_mutex;
+    pthread_t         sender;
+    int volatile      sender_running;
+    sem_t             sender_wakeup;
+    int volatile      sender_wakeup_pending;
+    unsigned long volatile sent_num;
+    unsigned long volatile dropped_num;
+    double volatile   output_latency;
+    double volatile   max_output_latency;
+
+    vector_t          subscriptions;
+    pthread_mutex_t   subscriptions_mutex;
+    float *           levels;
+    int               levels_size;
 } ;
 
 typedef struct osc_data_t
@@ -88,14 +150,19 @@ typedef struct osc_data_t
     lo_arg **     argv;
     int           argc;
     osc_method_t *method;
+    int           timed;
+    unsigned long frame;
+    lo_message    msg;
 } osc_data_t;
 
 typedef void(* osc_sequence_method_handler_t) (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+typedef void(* osc_song_method_handler_t) (osc_t *osc, osc_data_t *data);
 
 void  osc_error (int num, const char *m, const char *path);
 int   osc_generic_handler (const char *path, const char *types, lo_arg **argv,
                            int argc, void *data, void *user_data);
 int   osc_del_method (osc_t *osc, osc_method_t *method);
+osc_method_t * osc_add_song_method (osc_t *osc, osc_method_def_t *def);
 
 void  osc_on_sequence_destroy (event_t *event);
 void  osc_on_song_sequence_registered (event_t *event);
@@ -109,11 +176,24 @@ void  osc_sequence_set_transport (osc_t *osc, sequence_t *sequence, osc_data_t *
 void  osc_sequence_set_bpm (osc_t *osc, sequence_t *sequence, osc_data_t *data);
 void  osc_sequence_mute_track (osc_t *osc, sequence_t *sequence, osc_data_t *data);
 void  osc_sequence_solo_track (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_freeze_track (osc_t *osc, sequence_t *sequence, osc_data_t *data);
 void  osc_sequence_loop (osc_t *osc, sequence_t *sequence, osc_data_t *data);
 void  osc_sequence_set_track_pitch (osc_t *osc, sequence_t *sequence, osc_data_t *data);
 void  osc_sequence_set_track_volume (osc_t *osc, sequence_t *sequence, osc_data_t *data);
 void  osc_sequence_set_track_volume_db (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_set_pattern (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_set_region (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_get_pattern (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_get_region (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_subscribe (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_unsubscribe (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_save (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_export (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_sequence_close (osc_t *osc, sequence_t *sequence, osc_data_t *data);
+void  osc_song_load (osc_t *osc, osc_data_t *data);
+void  osc_song_quit (osc_t *osc, osc_data_t *data);
 void  osc_on_sequence_beat_changed (event_t *event);
+void  osc_on_sequence_region_changed (event_t *event);
 void  osc_on_sequence_beat_on (event_t *event);
 void
 osc_on_sequence_beat_off (event_t *event);
@@ -148,36 +228,374 @@ static osc_method_def_t osc_sequence_interface[] = {
     { OSC_IN, "solo_track", "ii",   osc_sequence_solo_track,
         {"track", "state"},
         "Set track solo state" },
+    { OSC_IN, "freeze_track", "ii", osc_sequence_freeze_track,
+        {"track", "state"},
+        "Freeze/unfreeze a track (play a rendered loop)" },
     { OSC_IN, "set_beat", "iii",    osc_sequence_set_beat,
         {"track", "beat", "state"},
         "Enable/disable a beat" },
     { OSC_IN, "mute_beat", "iii",   osc_sequence_mute_beat,
         {"track", "beat", "state"},
         "Mute/unmute a beat" },
+    { OSC_IN, "set_pattern", "b",   osc_sequence_set_pattern,
+        {"pattern"},
+        "Replace the whole pattern at once (see below)" },
+    { OSC_IN, "set_region", "iiiib", osc_sequence_set_region,
+        {"track", "beat", "tracks_num", "beats_num", "pattern"},
+        "Replace a rectangular part of the pattern at once" },
+    { OSC_IN, "get_pattern", "",    osc_sequence_get_pattern,
+        {}, "Request the whole pattern, replied to the sender with /pattern" },
+    { OSC_IN, "get_region", "iiii", osc_sequence_get_region,
+        {"track", "beat", "tracks_num", "beats_num"},
+        "Request a rectangular part of the pattern, replied with /pattern" },
+    { OSC_IN, "subscribe", "sf",    osc_sequence_subscribe,
+        {"stream", "rate"},
+        "Receive levels, position or load at the given rate (Hz), at the sender's address" },
+    { OSC_IN, "unsubscribe", "s",   osc_sequence_unsubscribe,
+        {"stream"},
+        "Stop receiving levels, position or load" },
+    { OSC_IN, "save", "s",          osc_sequence_save,
+        {"filename"},
+        "Save the sequence into a JAB file, replied with /reply" },
+    { OSC_IN, "export", "sii",      osc_sequence_export,
+        {"filename", "framerate", "sustain"},
+        "Render the sequence into a WAV file, replied with /reply. Sustain: 1 loop, "
+        "2 truncate, 3 keep" },
+    { OSC_IN, "close", "",          osc_sequence_close,
+        {},
+        "Destroy the sequence, replied with /reply" },
 
     // Events (sending)
     { OSC_OUT, "beat_changed", "iii", NULL,
         {"track", "beat", "state"},
         "A beat was toggled" },
+    { OSC_OUT, "region_changed", "iiii", NULL,
+        {"track", "beat", "tracks_num", "beats_num"},
+        "Several beats were changed at once, within this region" },
     { OSC_OUT, "beat_on", "ii", NULL,
         {"track", "beat"},
         "A beat is starting to play" },
     { OSC_OUT, "beat_off", "ii", NULL,
         {"track", "beat"},
         "A beat has finished playing" },
+    { OSC_OUT, "pattern", "iiiib", NULL,
+        {"track", "beat", "tracks_num", "beats_num", "pattern"},
+        "Part of the pattern, as requested. Patterns are blobs of one row of "
+        "bits per track, each padded to a whole byte, the first beat in the least "
+        "significant bit. Rows of beats may be followed by as many rows of mask bits" },
+    { OSC_OUT, "levels", "f", NULL,
+        {"level"},
+        "Output peak level of each track over the last cycle, one argument per track" },
+    { OSC_OUT, "position", "iiif", NULL,
+        {"playing", "beat", "position", "bpm"},
+        "Playback state, beat (-1 when stopped), and position in frames" },
+    { OSC_OUT, "load", "ff", NULL,
+        {"load", "time"},
+        "Fraction of the cycle spent rendering the sequence, and time in microseconds" },
+};
+
+static osc_method_def_t osc_song_interface[] = {
+    // Methods (receiving)
+    { OSC_IN, "load", "s",          osc_song_load,
+        {"filename"},
+        "Load a JAB file into a new sequence, replied with /reply carrying its name" },
+    { OSC_IN, "quit", "",           osc_song_quit,
+        {},
+        "Shut down, replied with /reply" },
+
+    // Events (sending)
+    { OSC_OUT, "reply", "sis", NULL,
+        {"path", "error", "result"},
+        "Outcome of a file operation, sent to the requester. Error is 0 on success, "
+        "in which case result may carry a value, otherwise it is an error message" },
 };
 
 static void
 osc_sequence_value_destroy (gpointer data)
 {
     osc_sequence_t *osc_sequence = (osc_sequence_t *) data;
+    int i;
     free (osc_sequence->input_prefix);
     free (osc_sequence->output_prefix);
+    for (i = 0; i < OSC_OUTPUT_NUM; i++)
+        free (osc_sequence->output_paths[i]);
     if (osc_sequence->output_address)
         lo_address_free (osc_sequence->output_address);
+    ringbuffer_free (osc_sequence->events);
+    ringbuffer_free (osc_sequence->changes);
+    event_unsubscribe_all (osc_sequence);
     free (osc_sequence);
 }
 
+static osc_method_def_t *
+osc_get_output_def (int type)
+{
+    int i, ii = sizeof (osc_sequence_interface) / sizeof (osc_sequence_interface[0]);
+    for (i = 0; i < ii; i++)
+        if (osc_sequence_interface[i].type == OSC_OUT && !type--)
+            return osc_sequence_interface + i;
+    return NULL;
+}
+
+/**
+ * Format the paths of outgoing events once, whenever the output prefix
+ * changes.
+ */
+static void
+osc_format_output_paths (osc_sequence_t *osc_sequence)
+{
+    osc_method_def_t *def;
+    int i;
+    for (i = 0; i < OSC_OUTPUT_NUM; i++)
+    {
+        def = osc_get_output_def (i);
+        free (osc_sequence->output_paths[i]);
+        osc_sequence->output_paths[i] = malloc (strlen (osc_sequence->output_prefix)
+                                                + strlen (def->name) + 2);
+        sprintf (osc_sequence->output_paths[i], "%s/%s", osc_sequence->output_prefix, def->name);
+    }
+}
+
+/**
+ * Send the telemetry streams which are due, from snapshots of the sequences
+ * state, so that the audio thread is never waited for. A stream which is
+ * late by more than a period skips the missed messages, and messages which
+ * can't be sent are dropped, so that a slow client doesn't hold the others.
+ *
+ * Returns the time at which the next stream is due, or 0 if there is none.
+ */
+static unsigned long long
+osc_send_telemetry (osc_t *osc)
+{
+    osc_subscription_t *sub;
+    sequence_snapshot_t snapshot;
+    unsigned long long now, next = 0;
+    lo_message msg;
+    int i, j, taken, due;
+
+    pthread_mutex_lock (&osc->subscriptions_mutex);
+    now = compat_time_usec ();
+    for (i = 0; i < osc->subscriptions.num; i++)
+    {
+        sub = VECTOR_AT (osc_subscription_t, &osc->subscriptions, i);
+        due = (now >= sub->next);
+        if (due)
+            sub->next = (now - sub->next > sub->period) ? now + sub->period : sub->next + sub->period;
+        if (!next || sub->next < next)
+            next = sub->next;
+        if (!due)
+            continue;
+
+        while ((taken = sequence_get_snapshot (sub->sequence, &snapshot, osc->levels,
+                                               osc->levels_size))
+               && snapshot.tracks_num > osc->levels_size)
+        {
+            osc->levels_size = snapshot.tracks_num;
+            osc->levels = realloc (osc->levels, osc->levels_size * sizeof (float));
+        }
+        if (!taken)
+            continue;
+
+        msg = lo_message_new ();
+        switch (sub->stream + OSC_OUTPUT_LEVELS)
+        {
+            case OSC_OUTPUT_LEVELS:
+                for (j = 0; j < snapshot.tracks_num; j++)
+                    lo_message_add_float (msg, osc->levels[j]);
+                break;
+            case OSC_OUTPUT_POSITION:
+                lo_message_add_int32 (msg, snapshot.playing);
+                lo_message_add_int32 (msg, snapshot.beat);
+                lo_message_add_int32 (msg, snapshot.position);
+                lo_message_add_float (msg, snapshot.bpm);
+                break;
+            case OSC_OUTPUT_LOAD:
+                lo_message_add_float (msg, snapshot.nframes
+                                      ? snapshot.process_time * sub->osc_sequence->framerate
+                                      / snapshot.nframes / 1000000 : 0);
+                lo_message_add_float (msg, snapshot.process_time);
+                break;
+        }
+        if (lo_send_message (sub->address, sub->osc_sequence->output_paths[sub->stream + OSC_OUTPUT_LEVELS],
+                             msg) == -1)
+            sub->dropped_num++;
+        lo_message_free (msg);
+    }
+    pthread_mutex_unlock (&osc->subscriptions_mutex);
+    return next;
+}
+
+/**
+ * Send the events queued for a sequence, packing those which belong to the
+ * same cycle into a single bundle, timetagged with the time of that cycle.
+ * Must be called with output_mutex held.
+ *
+ * Returns 1 if the queue may hold more events.
+ */
+static int
+osc_send_outputs (osc_t *osc, osc_sequence_t *osc_sequence, ringbuffer_t *queue)
+{
+    osc_output_t outputs[OSC_OUTPUT_BATCH_SIZE];
+    osc_output_t *first, *output;
+    lo_bundle bundle;
+    lo_message msg;
+    lo_timetag now;
+    double latency;
+    int i, j, k, n, argc;
+
+    for (n = 0; n < OSC_OUTPUT_BATCH_SIZE
+         && ringbuffer_read_space (queue) >= sizeof (osc_output_t); n++)
+        ringbuffer_read (queue, (char *) (outputs + n), sizeof (osc_output_t));
+
+    for (i = 0; i < n; i = j)
+    {
+        first = outputs + i;
+        bundle = lo_bundle_new (first->timetag);
+        for (j = i; j < n && outputs[j].frame == first->frame; j++)
+        {
+            output = outputs + j;
+            msg = lo_message_new ();
+            argc = strlen (osc_get_output_def (output->type)->typespec);
+            for (k = 0; k < argc; k++)
+                lo_message_add_int32 (msg, output->argv[k]);
+            lo_bundle_add_message (bundle, osc_sequence->output_paths[output->type], msg);
+        }
+
+        if (!osc_sequence->output_address
+            || lo_send_bundle (osc_sequence->output_address, bundle) == -1)
+        {
+            __sync_fetch_and_add (&osc->dropped_num, j - i);
+        }
+        else
+        {
+            osc->sent_num++;
+            lo_timetag_now (&now);
+            latency = lo_timetag_diff (now, first->timetag);
+            osc->output_latency = latency;
+            if (latency > osc->max_output_latency)
+                osc->max_output_latency = latency;
+        }
+        lo_bundle_free_messages (bundle);
+    }
+
+    return n == OSC_OUTPUT_BATCH_SIZE;
+}
+
+/**
+ * Wake the sender thread up, unless it is already due to run.
+ */
+static void
+osc_wake_sender (osc_t *osc)
+{
+    if (!__sync_lock_test_and_set (&osc->sender_wakeup_pending, 1))
+        sem_post (&osc->sender_wakeup);
+}
+
+/**
+ * Send queued events and telemetry. The thread sleeps until some event gets
+ * queued, or the next telemetry message is due.
+ */
+static void *
+osc_sender_run (void *data)
+{
+    osc_t *osc = (osc_t *) data;
+    osc_sequence_t *osc_sequence;
+    unsigned long long next, now;
+    struct timespec ts;
+    int i, more;
+
+    while (osc->sender_running)
+    {
+        // Events queued from now on wake the thread up again
+        __sync_lock_release (&osc->sender_wakeup_pending);
+        __sync_synchronize ();
+
+        pthread_mutex_lock (&osc->output_mutex);
+        do
+        {
+            more = 0;
+            for (i = 0; i < osc->outputs.num; i++)
+            {
+                osc_sequence = VECTOR_AT (osc_sequence_t, &osc->outputs, i);
+                more |= osc_send_outputs (osc, osc_sequence, osc_sequence->changes);
+                more |= osc_send_outputs (osc, osc_sequence, osc_sequence->events);
+            }
+        }
+        while (more);
+
+        next = osc->subscriptions.num ? osc_send_telemetry (osc) : 0;
+        pthread_mutex_unlock (&osc->output_mutex);
+
+        if (next)
+        {
+            now = compat_time_usec ();
+            clock_gettime (CLOCK_REALTIME, &ts);
+            if (next > now)
+            {
+                ts.tv_sec += (next - now) / 1000000;
+                ts.tv_nsec += (next - now) % 1000000 * 1000;
+                if (ts.tv_nsec >= 1000000000)
+                {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+            }
+            sem_timedwait (&osc->sender_wakeup, &ts);
+        }
+        else
+        {
+            sem_wait (&osc->sender_wakeup);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Queue an outgoing event for the sender thread. frame is the frame time of
+ * the cycle during which the event occurred, which is mapped to the bundle
+ * timetag. Events are dropped if the queue is full.
+ *
+ * Each queue must have a single writer at a time, see osc_sequence_t.
+ */
+static void
+osc_queue_output (osc_sequence_t *osc_sequence, ringbuffer_t *queue, int type,
+                  unsigned long frame, int *argv)
+{
+    osc_t *osc = osc_sequence->osc;
+    osc_output_t output;
+    unsigned long frame_time;
+    double time;
+    int i;
+
+    if (!osc->sender_running || !osc_sequence->output_address)
+        return;
+
+    output.type = type;
+    for (i = 0; i < strlen (osc_get_output_def (type)->typespec); i++)
+        output.argv[i] = argv[i];
+    output.frame = frame;
+
+    lo_timetag_now (&output.timetag);
+    frame_time = sequence_get_frame_time (osc_sequence->sequence);
+    if (frame < frame_time)
+    {
+        time = output.timetag.sec + output.timetag.frac / 4294967296.0
+                - (double) (frame_time - frame) / osc_sequence->framerate;
+        output.timetag.sec = (uint32_t) time;
+        output.timetag.frac = (uint32_t) ((time - output.timetag.sec) * 4294967296.0);
+    }
+
+    if (ringbuffer_write_space (queue) >= sizeof (osc_output_t))
+    {
+        ringbuffer_write (queue, (char *) &output, sizeof (osc_output_t));
+        osc_wake_sender (osc);
+    }
+    else
+    {
+        __sync_fetch_and_add (&osc->dropped_num, 1);
+    }
+}
+
 lo_server_thread
 osc_create_server (int port)
 {
@@ -186,6 +604,8 @@ osc_create_server (int port)
     sprintf (portstr, "%d", port);
     if ((server = lo_server_thread_new (port ? portstr : NULL, osc_error)))
     {
+        // Bundles are dispatched on arrival, and scheduled by timetag:
+        lo_server_enable_queue (lo_server_thread_get_server (server), 0, 1);
         lo_server_thread_add_method (server, NULL, NULL, osc_generic_handler, NULL);
         lo_server_thread_start (server);
         DEBUG ("New server on port %d", lo_server_thread_get_port (server));
@@ -207,13 +627,45 @@ osc_new (song_t *song)
         return NULL;
 
     osc_t * osc = malloc (sizeof (osc_t));
-    osc->methods = NULL;
-    osc->methods_num = 0;
+    vector_init (&osc->methods);
     osc->server = server;
+    osc->latency = 10;
+    osc->timed_num = 0;
+    osc->late_num = 0;
+
+    vector_init (&osc->outputs);
+    pthread_mutex_init (&osc->output_mutex, NULL);
+    sem_init (&osc->sender_wakeup, 0, 0);
+    osc->sender_wakeup_pending = 0;
+    osc->sent_num = 0;
+    osc->dropped_num = 0;
+    osc->output_latency = 0;
+    osc->max_output_latency = 0;
+    vector_init (&osc->subscriptions);
+    pthread_mutex_init (&osc->subscriptions_mutex, NULL);
+    osc->levels = NULL;
+    osc->levels_size = 0;
+    osc->sender_running = 1;
+    if (pthread_create (&osc->sender, NULL, osc_sender_run, (void *) osc))
+    {
+        DEBUG ("Couldn't start sender thread");
+        osc->sender_running = 0;
+    }
 
     event_subscribe (song, "sequence-registered", osc, osc_on_song_sequence_registered);
     osc->sequences = g_hash_table_new_full (NULL, NULL, NULL, osc_sequence_value_destroy);
 
+    event_register (osc, "load-requested");
+    event_register (osc, "save-requested");
+    event_register (osc, "export-requested");
+    event_register (osc, "close-requested");
+    event_register (osc, "quit-requested");
+
+    int i, ii = sizeof (osc_song_interface) / sizeof (osc_song_interface[0]);
+    for (i = 0; i < ii; i++)
+        if (osc_song_interface[i].type == OSC_IN)
+            osc_add_song_method (osc, osc_song_interface + i);
+
     return osc;
 }
 
@@ -221,11 +673,27 @@ void
 osc_destroy (osc_t *osc)
 {
     int i;
-    for (i = 0; i < osc->methods_num; i++)
-        while ((i < osc->methods_num) && osc_del_method (osc, osc->methods[i]))
+    for (i = 0; i < osc->methods.num; i++)
+        while ((i < osc->methods.num) && osc_del_method (osc, METHOD (osc, i)))
             ;
+    vector_free (&osc->methods);
     lo_server_thread_free (osc->server);
+    if (osc->sender_running)
+    {
+        osc->sender_running = 0;
+        sem_post (&osc->sender_wakeup);
+        pthread_join (osc->sender, NULL);
+    }
+    sem_destroy (&osc->sender_wakeup);
+    for (i = 0; i < osc->subscriptions.num; i++)
+        lo_address_free (VECTOR_AT (osc_subscription_t, &osc->subscriptions, i)->address);
+    vector_free_items (&osc->subscriptions);
+    pthread_mutex_destroy (&osc->subscriptions_mutex);
+    free (osc->levels);
     g_hash_table_unref (osc->sequences);
+    event_remove_source (osc);
+    vector_free (&osc->outputs);
+    pthread_mutex_destroy (&osc->output_mutex);
     free (osc);
 }
 
@@ -243,21 +711,69 @@ osc_generic_handler (const char *path, const char *types, lo_arg **argv,
     return 1;
 }
 
+/**
+ * Map the timetag of the bundle which contains a message to a frame time of
+ * the sequence's stream, adding the latency budget. Returns 0 if the message
+ * is to be applied immediately. Messages which arrive too late to meet their
+ * timetag are counted, and scheduled to apply as soon as possible.
+ */
+static int
+osc_get_message_frame (osc_t *osc, sequence_t *sequence, lo_message msg,
+                       unsigned long *frame)
+{
+    lo_timetag timetag = lo_message_get_timestamp (msg);
+    lo_timetag now;
+    double delay;
+
+    if (timetag.sec == LO_TT_IMMEDIATE.sec && timetag.frac == LO_TT_IMMEDIATE.frac)
+        return 0;
+
+    lo_timetag_now (&now);
+    delay = lo_timetag_diff (timetag, now) + (double) osc->latency / 1000;
+    *frame = sequence_get_frame_time (sequence);
+    osc->timed_num++;
+    if (delay > 0)
+        *frame += (unsigned long) (delay * sequence_get_framerate (sequence));
+    else
+        osc->late_num++;
+
+    return 1;
+}
+
 int
 osc_sequence_method_handler (const char *path, const char *types, lo_arg **argv,
                              int argc, void *data, void *user_data)
 {
     osc_data_t osc_data;
     osc_method_t *method = (osc_method_t *) user_data;
+    osc_sequence_method_handler_t handler = (osc_sequence_method_handler_t) method->def->function;
+    sequence_t *sequence = (sequence_t *) method->instance;
     osc_data.argv = argv;
     osc_data.argc = argc;
     osc_data.method = method;
-    osc_sequence_method_handler_t handler = (osc_sequence_method_handler_t) method->def->function;
-    sequence_t *sequence = (sequence_t *) method->instance;
+    osc_data.timed = osc_get_message_frame (method->osc, sequence, (lo_message) data,
+                                            &osc_data.frame);
+    osc_data.msg = (lo_message) data;
     handler (method->osc, sequence, &osc_data);
     return 0;
 }
 
+int
+osc_song_method_handler (const char *path, const char *types, lo_arg **argv,
+                         int argc, void *data, void *user_data)
+{
+    osc_data_t osc_data;
+    osc_method_t *method = (osc_method_t *) user_data;
+    osc_song_method_handler_t handler = (osc_song_method_handler_t) method->def->function;
+    osc_data.argv = argv;
+    osc_data.argc = argc;
+    osc_data.method = method;
+    osc_data.timed = 0;
+    osc_data.msg = (lo_message) data;
+    handler (method->osc, &osc_data);
+    return 0;
+}
+
 static char *
 osc_get_method_path (osc_method_t *method)
 {
@@ -277,11 +793,10 @@ osc_create_method (osc_t *osc, char *prefix, osc_method_def_t *def,
     method->prefix = strdup (prefix);
     method->osc = osc;
 
-    osc->methods = realloc (osc->methods, ++osc->methods_num * sizeof (osc_method_t *));
-    osc->methods[osc->methods_num - 1] = method;
+    vector_add (&osc->methods, method);
 
     char *path = osc_get_method_path (method);
-    DEBUG ("path: %s (%d method(s))", path, osc->methods_num);
+    DEBUG ("path: %s (%d method(s))", path, osc->methods.num);
     free (path);
     return method;
 }
@@ -301,29 +816,30 @@ osc_add_sequence_method (osc_t *osc, sequence_t *sequence, osc_method_def_t *def
     return method;
 }
 
+osc_method_t *
+osc_add_song_method (osc_t *osc, osc_method_def_t *def)
+{
+    osc_method_t *method = osc_create_method (osc, "", def, NULL, osc_song_method_handler);
+    char *path = osc_get_method_path (method);
+    lo_server_thread_add_method (osc->server, path, method->def->typespec,
+                                 method->wrapper, method);
+    free (path);
+    return method;
+}
+
 int
 osc_del_method (osc_t *osc, osc_method_t *method)
 {
     int i;
     int found = 0;
-    for (i = 0; i < osc->methods_num; i++)
+    for (i = 0; i < osc->methods.num; i++)
     {
-        if (osc->methods[i] == method)
+        if (METHOD (osc, i) == method)
         {
             char *path = osc_get_method_path (method);
             lo_server_thread_del_method (osc->server, path, method->def->typespec);
-            memcpy (osc->methods + i, osc->methods + i + 1,
-                    sizeof (osc_method_t *) * (osc->methods_num - i - 1));
-            if (--osc->methods_num == 0)
-            {
-                free (osc->methods);
-                osc->methods = NULL;
-            }
-            else
-            {
-                osc->methods = realloc (osc->methods, osc->methods_num * sizeof (osc_method_t *));
-            }
-            DEBUG ("path: %s (%d methods)", path, osc->methods_num);
+            vector_remove_at (&osc->methods, i);
+            DEBUG ("path: %s (%d methods)", path, osc->methods.num);
             free (path);
             free (method->prefix);
             free (method);
@@ -332,8 +848,8 @@ osc_del_method (osc_t *osc, osc_method_t *method)
         }
     }
     /*
-    for (i = 0; i < osc->methods_num; i++) {
-      DEBUG("method %d: %s", i, osc->methods[i]->path);
+    for (i = 0; i < osc->methods.num; i++) {
+      DEBUG("method %d: %s", i, METHOD (osc, i)->path);
     }
      */
     return found;
@@ -353,12 +869,19 @@ void
 osc_print_interface ()
 {
     int i, ii = sizeof (osc_sequence_interface) / sizeof (osc_sequence_interface[0]);
+    int j, jj = sizeof (osc_song_interface) / sizeof (osc_song_interface[0]);
     printf ("Methods (receiving):\n");
+    for (j = 0; j < jj; j++)
+        if (osc_song_interface[j].type == OSC_IN)
+            osc_print_method_def (osc_song_interface + j, "/");
     for (i = 0; i < ii; i++)
         if (osc_sequence_interface[i].type == OSC_IN)
             osc_print_method_def (osc_sequence_interface + i, "/<sequence>/");
 
     printf ("Events (sending):\n");
+    for (j = 0; j < jj; j++)
+        if (osc_song_interface[j].type == OSC_OUT)
+            osc_print_method_def (osc_song_interface + j, "/");
     for (i = 0; i < ii; i++)
         if (osc_sequence_interface[i].type == OSC_OUT)
             osc_print_method_def (osc_sequence_interface + i, "/<sequence>/");
@@ -367,19 +890,20 @@ osc_print_interface ()
 osc_method_desc_t **
 osc_reflect_sequence_methods (osc_t *osc, sequence_t *sequence)
 {
-    int i, desc_num = 0;
-    osc_method_desc_t **descs = NULL;
-    for (i = 0; i < osc->methods_num; i++)
-        if (osc->methods[i]->instance == sequence)
+    int i, output = 0;
+    vector_t descs;
+    vector_init (&descs);
+    for (i = 0; i < osc->methods.num; i++)
+        if (METHOD (osc, i)->instance == sequence)
         {
             osc_method_desc_t *item = malloc (sizeof (osc_method_desc_t));
-            ARRAY_ADD (osc_method_desc_t, descs, desc_num, item);
-            item->type = osc->methods[i]->def->type; // always OSC_IN
-            item->path = osc_get_method_path (osc->methods[i]);
-            item->name = osc->methods[i]->def->name;
-            item->typespec = osc->methods[i]->def->typespec;
-            item->parameters = osc->methods[i]->def->parameters;
-            item->comment = osc->methods[i]->def->comment;
+            vector_add (&descs, item);
+            item->type = METHOD (osc, i)->def->type; // always OSC_IN
+            item->path = osc_get_method_path (METHOD (osc, i));
+            item->name = METHOD (osc, i)->def->name;
+            item->typespec = METHOD (osc, i)->def->typespec;
+            item->parameters = METHOD (osc, i)->def->parameters;
+            item->comment = METHOD (osc, i)->def->comment;
         }
 
     int ii = sizeof (osc_sequence_interface) / sizeof (osc_sequence_interface[0]);
@@ -389,15 +913,13 @@ osc_reflect_sequence_methods (osc_t *osc, sequence_t *sequence)
         if (def->type == OSC_OUT)
         {
             osc_method_desc_t *item = malloc (sizeof (osc_method_desc_t));
-            ARRAY_ADD (osc_method_desc_t, descs, desc_num, item);
+            vector_add (&descs, item);
 
             item->type = def->type; // always OSC_OUT
 
-            // FIXME: duplicated code:
             osc_sequence_t *osc_sequence
                     = (osc_sequence_t *) g_hash_table_lookup (osc->sequences, (gpointer) sequence);
-            item->path = malloc (strlen (osc_sequence->output_prefix) + strlen (def->name) + 1);
-            sprintf (item->path, "%s%s", osc_sequence->output_prefix, def->name);
+            item->path = strdup (osc_sequence->output_paths[output++]);
 
             item->name = def->name;
 
@@ -407,9 +929,9 @@ osc_reflect_sequence_methods (osc_t *osc, sequence_t *sequence)
         }
     }
 
-    ARRAY_ADD (osc_method_desc_t, descs, desc_num, NULL);
+    vector_add (&descs, NULL);
 
-    return descs;
+    return VECTOR_ITEMS (osc_method_desc_t, &descs);
 }
 
 void
@@ -433,9 +955,9 @@ osc_set_port (osc_t *osc, int port)
         if ((server = osc_create_server (port)))
         {
             int i;
-            for (i = 0; i < osc->methods_num; i++)
+            for (i = 0; i < osc->methods.num; i++)
             {
-                osc_method_t *method = osc->methods[i];
+                osc_method_t *method = METHOD (osc, i);
                 char *path = osc_get_method_path (method);
                 lo_server_thread_add_method (server, path, method->def->typespec,
                                              method->wrapper, method);
@@ -458,6 +980,39 @@ osc_get_port (osc_t *osc)
     return lo_server_thread_get_port (osc->server);
 }
 
+/**
+ * Set the delay, in milliseconds, added to the timetags of incoming bundles.
+ * This must cover network jitter, and the time it takes until the engine
+ * receives the changes, that is up to one period.
+ */
+void
+osc_set_latency (osc_t *osc, int latency)
+{
+    osc->latency = latency >= 0 ? latency : 0;
+}
+
+int
+osc_get_latency (osc_t *osc)
+{
+    return osc->latency;
+}
+
+/**
+ * Retrieve input and output statistics: how many timestamped messages came
+ * too late to be applied at the time they were scheduled for, and how many
+ * outgoing events couldn't be sent.
+ */
+void
+osc_get_stats (osc_t *osc, osc_stats_t *stats)
+{
+    stats->timed_num = osc->timed_num;
+    stats->late_num = osc->late_num;
+    stats->sent_num = osc->sent_num;
+    stats->dropped_num = osc->dropped_num;
+    stats->latency = osc->output_latency;
+    stats->max_latency = osc->max_output_latency;
+}
+
 // Method handlers
 
 void
@@ -487,7 +1042,10 @@ osc_sequence_set_transport (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 void
 osc_sequence_set_bpm (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 {
-    sequence_set_bpm (sequence, data->argv[0]->f);
+    if (data->timed)
+        sequence_schedule_bpm (sequence, data->argv[0]->f, data->frame);
+    else
+        sequence_set_bpm (sequence, data->argv[0]->f);
 }
 
 void
@@ -502,19 +1060,32 @@ osc_sequence_loop (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 void
 osc_sequence_set_beat (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 {
-    sequence_set_beat (sequence, data->argv[0]->i, data->argv[1]->i, (char) data->argv[2]->i);
+    if (data->timed)
+        sequence_schedule_beat (sequence, data->argv[0]->i, data->argv[1]->i,
+                                (char) data->argv[2]->i, data->frame);
+    else
+        sequence_set_beat (sequence, data->argv[0]->i, data->argv[1]->i, (char) data->argv[2]->i);
 }
 
 void
 osc_sequence_mute_beat (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 {
-    sequence_set_mask_beat (sequence, data->argv[0]->i, data->argv[1]->i, (char) !data->argv[2]->i);
+    if (data->timed)
+        sequence_schedule_mask_beat (sequence, data->argv[0]->i, data->argv[1]->i,
+                                     (char) !data->argv[2]->i, data->frame);
+    else
+        sequence_set_mask_beat (sequence, data->argv[0]->i, data->argv[1]->i,
+                                (char) !data->argv[2]->i);
 }
 
 void
 osc_sequence_mute_track (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 {
-    sequence_mute_track (sequence, data->argv[1]->i, data->argv[0]->i);
+    if (data->timed)
+        sequence_schedule_mute (sequence, data->argv[0]->i, (char) data->argv[1]->i,
+                                data->frame, 0, SEQUENCE_RAMP_LINEAR);
+    else
+        sequence_mute_track (sequence, data->argv[1]->i, data->argv[0]->i);
 }
 
 void
@@ -523,22 +1094,411 @@ osc_sequence_solo_track (osc_t *osc, sequence_t *sequence, osc_data_t *data)
     sequence_solo_track (sequence, data->argv[1]->i, data->argv[0]->i);
 }
 
+void
+osc_sequence_freeze_track (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    if (data->argv[1]->i)
+        sequence_freeze_track (sequence, data->argv[0]->i);
+    else
+        sequence_unfreeze_track (sequence, data->argv[0]->i);
+}
+
 void
 osc_sequence_set_track_pitch (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 {
-    sequence_set_pitch (sequence, data->argv[0]->i, data->argv[1]->f);
+    if (data->timed)
+        sequence_schedule_pitch (sequence, data->argv[0]->i, data->argv[1]->f,
+                                 data->frame, 0, SEQUENCE_RAMP_LINEAR);
+    else
+        sequence_set_pitch (sequence, data->argv[0]->i, data->argv[1]->f);
 }
 
 void
 osc_sequence_set_track_volume (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 {
-    sequence_set_volume (sequence, data->argv[0]->i, data->argv[1]->f);
+    if (data->timed)
+        sequence_schedule_volume (sequence, data->argv[0]->i, data->argv[1]->f,
+                                  data->frame, 0, SEQUENCE_RAMP_LINEAR);
+    else
+        sequence_set_volume (sequence, data->argv[0]->i, data->argv[1]->f);
 }
 
 void
 osc_sequence_set_track_volume_db (osc_t *osc, sequence_t *sequence, osc_data_t *data)
 {
-    sequence_set_volume_db (sequence, data->argv[0]->i, data->argv[1]->f);
+    if (data->timed)
+        sequence_schedule_volume (sequence, data->argv[0]->i,
+                                  SEQUENCE_DB2GAIN (data->argv[1]->f),
+                                  data->frame, 0, SEQUENCE_RAMP_LINEAR);
+    else
+        sequence_set_volume_db (sequence, data->argv[0]->i, data->argv[1]->f);
+}
+
+/**
+ * Compute the size of a packed region, in bytes per row of beats and in
+ * total, with or without mask rows. Returns 0 if it doesn't fit in memory.
+ */
+static int
+osc_get_region_size (int tracks_num, int beats_num, size_t *row_size, size_t *rows_size)
+{
+    if (tracks_num <= 0 || beats_num <= 0)
+        return 0;
+
+    *row_size = ((size_t) beats_num + 7) / 8;
+    if (*row_size > SIZE_MAX / 2 / (size_t) tracks_num)
+        return 0;
+    *rows_size = *row_size * (size_t) tracks_num;
+
+    return 1;
+}
+
+/**
+ * Apply a pattern blob to a region, with a single edit transaction. The blob
+ * size tells whether it holds mask rows. Cells outside of the pattern are
+ * ignored, but the region can't be larger than the pattern.
+ */
+static void
+osc_sequence_apply_region (sequence_t *sequence, sequence_region_t *region, lo_blob blob)
+{
+    int tracks_num = sequence_get_tracks_num (sequence);
+    int beats_num = sequence_get_beats_num (sequence);
+    size_t size = lo_blob_datasize (blob), row_size, rows_size, k;
+    unsigned char *beats = (unsigned char *) lo_blob_dataptr (blob);
+    unsigned char *mask;
+    sequence_edit_t *edit;
+    int i, j, ii, jj;
+
+    if (region->track < 0 || region->track >= tracks_num
+        || region->beat < 0 || region->beat >= beats_num
+        || region->tracks_num > tracks_num || region->beats_num > beats_num
+        || !osc_get_region_size (region->tracks_num, region->beats_num, &row_size, &rows_size)
+        || (size != rows_size && size != rows_size * 2))
+    {
+        DEBUG ("Invalid pattern region: %lu bytes for %dx%d at %d,%d", (unsigned long) size,
+               region->tracks_num, region->beats_num, region->track, region->beat);
+        return;
+    }
+
+    mask = beats + rows_size;
+
+    // Clipping to the pattern, the blob layout still follows the region
+    ii = tracks_num - region->track;
+    if (ii > region->tracks_num)
+        ii = region->tracks_num;
+    jj = beats_num - region->beat;
+    if (jj > region->beats_num)
+        jj = region->beats_num;
+
+    edit = sequence_edit_begin (sequence);
+    for (i = 0; i < ii; i++)
+        for (j = 0; j < jj; j++)
+        {
+            k = i * row_size + j / 8;
+            sequence_edit_set_beat (edit, region->track + i, region->beat + j,
+                                    (beats[k] >> (j % 8)) & 1);
+            if (size > rows_size)
+                sequence_edit_set_mask_beat (edit, region->track + i, region->beat + j,
+                                             (mask[k] >> (j % 8)) & 1);
+        }
+    sequence_edit_commit (edit);
+}
+
+/**
+ * Reply to the sender of a request with a region of the pattern, including
+ * masks.
+ */
+static void
+osc_sequence_send_region (osc_t *osc, sequence_t *sequence, osc_data_t *data,
+                          sequence_region_t *region)
+{
+    char *beats, *mask;
+    unsigned char *packed;
+    size_t row_size, rows_size, k;
+    int i, j;
+    lo_blob blob;
+    lo_message msg;
+    osc_sequence_t *osc_sequence;
+
+    if (!sequence_get_region (sequence, region, &beats, &mask))
+    {
+        DEBUG ("Invalid region");
+        return;
+    }
+
+    // The region is clipped to the pattern, but it may still be too large to send
+    if (!osc_get_region_size (region->tracks_num, region->beats_num, &row_size, &rows_size)
+        || rows_size * 2 > INT_MAX
+        || !(packed = calloc (rows_size * 2, 1)))
+    {
+        DEBUG ("Region too large: %dx%d", region->tracks_num, region->beats_num);
+        free (beats);
+        free (mask);
+        return;
+    }
+
+    for (i = 0; i < region->tracks_num; i++)
+        for (j = 0; j < region->beats_num; j++)
+        {
+            k = i * row_size + j / 8;
+            packed[k] |= beats[(size_t) i * region->beats_num + j] << (j % 8);
+            packed[rows_size + k] |= mask[(size_t) i * region->beats_num + j] << (j % 8);
+        }
+    free (beats);
+    free (mask);
+
+    blob = lo_blob_new (rows_size * 2, packed);
+    msg = lo_message_new ();
+    lo_message_add_int32 (msg, region->track);
+    lo_message_add_int32 (msg, region->beat);
+    lo_message_add_int32 (msg, region->tracks_num);
+    lo_message_add_int32 (msg, region->beats_num);
+    lo_message_add_blob (msg, blob);
+
+    pthread_mutex_lock (&osc->output_mutex);
+    osc_sequence = (osc_sequence_t *) g_hash_table_lookup (osc->sequences, (gpointer) sequence);
+    lo_send_message_from (lo_message_get_source (data->msg),
+                          lo_server_thread_get_server (osc->server),
+                          osc_sequence->output_paths[OSC_OUTPUT_PATTERN], msg);
+    pthread_mutex_unlock (&osc->output_mutex);
+
+    lo_message_free (msg);
+    lo_blob_free (blob);
+    free (packed);
+}
+
+void
+osc_sequence_set_pattern (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    sequence_region_t region;
+    region.track = 0;
+    region.beat = 0;
+    region.tracks_num = sequence_get_tracks_num (sequence);
+    region.beats_num = sequence_get_beats_num (sequence);
+    osc_sequence_apply_region (sequence, &region, (lo_blob) data->argv[0]);
+}
+
+void
+osc_sequence_set_region (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    sequence_region_t region;
+    region.track = data->argv[0]->i;
+    region.beat = data->argv[1]->i;
+    region.tracks_num = data->argv[2]->i;
+    region.beats_num = data->argv[3]->i;
+    osc_sequence_apply_region (sequence, &region, (lo_blob) data->argv[4]);
+}
+
+void
+osc_sequence_get_pattern (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    sequence_region_t region;
+    region.track = 0;
+    region.beat = 0;
+    region.tracks_num = -1;
+    region.beats_num = -1;
+    osc_sequence_send_region (osc, sequence, data, &region);
+}
+
+/**
+ * Find the subscription of the sender of a request to a telemetry stream,
+ * given by name, and return its index, or -1. The stream index is stored into
+ * stream, set to -1 if the name is unknown. The caller must hold
+ * subscriptions_mutex.
+ */
+static int
+osc_find_subscription (osc_t *osc, sequence_t *sequence, osc_data_t *data, int *stream)
+{
+    lo_address source = lo_message_get_source (data->msg);
+    osc_subscription_t *sub;
+    int i;
+
+    for (*stream = OSC_TELEMETRY_NUM - 1; *stream >= 0; (*stream)--)
+        if (!strcmp (&data->argv[0]->s, osc_get_output_def (*stream + OSC_OUTPUT_LEVELS)->name))
+            break;
+
+    if (*stream != -1)
+        for (i = 0; i < osc->subscriptions.num; i++)
+        {
+            sub = VECTOR_AT (osc_subscription_t, &osc->subscriptions, i);
+            if (sub->sequence == sequence && sub->stream == *stream
+                && !strcmp (lo_address_get_hostname (sub->address), lo_address_get_hostname (source))
+                && !strcmp (lo_address_get_port (sub->address), lo_address_get_port (source)))
+                return i;
+        }
+
+    return -1;
+}
+
+/**
+ * Subscribe the sender to a telemetry stream, or change the rate of an
+ * existing subscription. A rate of zero or less unsubscribes.
+ */
+void
+osc_sequence_subscribe (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    lo_address source = lo_message_get_source (data->msg);
+    osc_subscription_t *sub;
+    float rate = data->argv[1]->f;
+    int i, stream;
+
+    if (rate <= 0)
+    {
+        osc_sequence_unsubscribe (osc, sequence, data);
+        return;
+    }
+    if (rate > OSC_TELEMETRY_MAX_RATE)
+        rate = OSC_TELEMETRY_MAX_RATE;
+
+    pthread_mutex_lock (&osc->subscriptions_mutex);
+    i = osc_find_subscription (osc, sequence, data, &stream);
+    if (stream == -1)
+    {
+        DEBUG ("Unknown telemetry stream: %s", &data->argv[0]->s);
+    }
+    else
+    {
+        if (i == -1)
+        {
+            sub = malloc (sizeof (osc_subscription_t));
+            sub->sequence = sequence;
+            sub->osc_sequence = (osc_sequence_t *) g_hash_table_lookup (osc->sequences, (gpointer) sequence);
+            sub->address = lo_address_new (lo_address_get_hostname (source),
+                                           lo_address_get_port (source));
+            sub->stream = stream;
+            sub->next = compat_time_usec ();
+            sub->dropped_num = 0;
+            vector_add (&osc->subscriptions, sub);
+        }
+        else
+        {
+            sub = VECTOR_AT (osc_subscription_t, &osc->subscriptions, i);
+        }
+        sub->period = 1000000 / rate;
+    }
+    pthread_mutex_unlock (&osc->subscriptions_mutex);
+    osc_wake_sender (osc);
+}
+
+void
+osc_sequence_unsubscribe (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    osc_subscription_t *sub;
+    int i, stream;
+
+    pthread_mutex_lock (&osc->subscriptions_mutex);
+    if ((i = osc_find_subscription (osc, sequence, data, &stream)) != -1)
+    {
+        sub = VECTOR_AT (osc_subscription_t, &osc->subscriptions, i);
+        lo_address_free (sub->address);
+        vector_swap_remove_at (&osc->subscriptions, i);
+        free (sub);
+    }
+    pthread_mutex_unlock (&osc->subscriptions_mutex);
+}
+
+static void
+osc_request_free (void *data)
+{
+    osc_request_t *request = (osc_request_t *) data;
+    free (request->path);
+    free (request->filename);
+    lo_address_free ((lo_address) request->source);
+    free (request);
+}
+
+/**
+ * Pass a file operation on to the application, through an event, since
+ * loading, saving and exporting are up to it. Requests which no one handles
+ * are replied with an error right away.
+ */
+static void
+osc_fire_request (osc_t *osc, char *name, sequence_t *sequence, osc_data_t *data,
+                  const char *filename)
+{
+    lo_address source = lo_message_get_source (data->msg);
+    osc_request_t *request = calloc (1, sizeof (osc_request_t));
+
+    request->path = osc_get_method_path (data->method);
+    request->sequence = sequence;
+    request->filename = filename ? strdup (filename) : NULL;
+    request->source = (void *) lo_address_new (lo_address_get_hostname (source),
+                                               lo_address_get_port (source));
+    if (data->method->def->function == osc_sequence_export)
+    {
+        request->framerate = data->argv[1]->i;
+        request->sustain_type = data->argv[2]->i;
+    }
+
+    if (event_has_subscribers (osc, name))
+    {
+        event_fire (osc, name, request, osc_request_free);
+    }
+    else
+    {
+        osc_reply (osc, request, ERR_UNSUPPORTED, NULL);
+        osc_request_free (request);
+    }
+}
+
+/**
+ * Reply to a file operation request. If error is 0 the operation succeeded,
+ * and result is an optional value for the requester, otherwise an error
+ * message is sent along with the error code.
+ */
+void
+osc_reply (osc_t *osc, osc_request_t *request, int error, const char *result)
+{
+    lo_message msg = lo_message_new ();
+    char *message = error ? error_to_string (error) : strdup (result ? result : "");
+
+    lo_message_add_string (msg, request->path);
+    lo_message_add_int32 (msg, error);
+    lo_message_add_string (msg, message);
+    lo_send_message_from ((lo_address) request->source,
+                          lo_server_thread_get_server (osc->server), "/reply", msg);
+    lo_message_free (msg);
+    free (message);
+}
+
+void
+osc_sequence_save (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    osc_fire_request (osc, "save-requested", sequence, data, &data->argv[0]->s);
+}
+
+void
+osc_sequence_export (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    osc_fire_request (osc, "export-requested", sequence, data, &data->argv[0]->s);
+}
+
+void
+osc_sequence_close (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    osc_fire_request (osc, "close-requested", sequence, data, NULL);
+}
+
+void
+osc_song_load (osc_t *osc, osc_data_t *data)
+{
+    osc_fire_request (osc, "load-requested", NULL, data, &data->argv[0]->s);
+}
+
+void
+osc_song_quit (osc_t *osc, osc_data_t *data)
+{
+    osc_fire_request (osc, "quit-requested", NULL, data, NULL);
+}
+
+void
+osc_sequence_get_region (osc_t *osc, sequence_t *sequence, osc_data_t *data)
+{
+    sequence_region_t region;
+    region.track = data->argv[0]->i;
+    region.beat = data->argv[1]->i;
+    region.tracks_num = data->argv[2]->i;
+    region.beats_num = data->argv[3]->i;
+    osc_sequence_send_region (osc, sequence, data, &region);
 }
 
 // Event handlers
@@ -549,14 +1509,26 @@ osc_on_song_sequence_registered (event_t *event)
     osc_t *osc = (osc_t *) event->self;
     sequence_t *sequence = (sequence_t *) event->data;
     osc_sequence_t *osc_sequence = malloc (sizeof (osc_sequence_t));
+    int i, ii = sizeof (osc_sequence_interface) / sizeof (osc_sequence_interface[0]);
+    osc_sequence->osc = osc;
+    osc_sequence->sequence = sequence;
+    osc_sequence->framerate = sequence_get_framerate (sequence);
+    osc_sequence->events = ringbuffer_create (OSC_OUTPUT_QUEUE_SIZE);
+    osc_sequence->changes = ringbuffer_create (OSC_OUTPUT_QUEUE_SIZE);
     osc_sequence->input_prefix = strdup ("");
     osc_sequence->output_prefix = strdup ("");
     osc_sequence->output_address = NULL;
+    for (i = 0; i < OSC_OUTPUT_NUM; i++)
+        osc_sequence->output_paths[i] = NULL;
+    osc_format_output_paths (osc_sequence);
     g_hash_table_replace (osc->sequences, (gpointer) sequence, (gpointer) osc_sequence);
     osc_set_sequence_input_prefix (osc, sequence, NULL);
 
+    pthread_mutex_lock (&osc->output_mutex);
+    vector_add (&osc->outputs, osc_sequence);
+    pthread_mutex_unlock (&osc->output_mutex);
+
     osc_method_def_t *def;
-    int i, ii = sizeof (osc_sequence_interface) / sizeof (osc_sequence_interface[0]);
     for (i = 0; i < ii; i++)
     {
         def = osc_sequence_interface + i;
@@ -565,9 +1537,11 @@ osc_on_song_sequence_registered (event_t *event)
     }
 
     event_subscribe (sequence, "destroy", osc, osc_on_sequence_destroy);
-    event_subscribe (sequence, "beat-changed", osc, osc_on_sequence_beat_changed);
-    event_subscribe (sequence, "beat-on", osc, osc_on_sequence_beat_on);
-    event_subscribe (sequence, "beat-off", osc, osc_on_sequence_beat_off);
+    // Outgoing events are handled without looking the sequence up
+    event_subscribe (sequence, "beat-changed", osc_sequence, osc_on_sequence_beat_changed);
+    event_subscribe (sequence, "region-changed", osc_sequence, osc_on_sequence_region_changed);
+    event_subscribe (sequence, "beat-on", osc_sequence, osc_on_sequence_beat_on);
+    event_subscribe (sequence, "beat-off", osc_sequence, osc_on_sequence_beat_off);
 }
 
 void
@@ -580,61 +1554,102 @@ osc_on_sequence_destroy (event_t *event)
     DEBUG ("Detaching sequence %s", name);
     free (name);
     int i;
-    for (i = 0; i < osc->methods_num; i++)
+    for (i = 0; i < osc->methods.num; i++)
     {
-        while ((i < osc->methods_num)
-               && (osc->methods[i]->instance == sequence)
-               && osc_del_method (osc, osc->methods[i]))
+        while ((i < osc->methods.num)
+               && (METHOD (osc, i)->instance == sequence)
+               && osc_del_method (osc, METHOD (osc, i)))
             ;
     }
+    pthread_mutex_lock (&osc->subscriptions_mutex);
+    for (i = osc->subscriptions.num - 1; i >= 0; i--)
+    {
+        osc_subscription_t *sub = VECTOR_AT (osc_subscription_t, &osc->subscriptions, i);
+        if (sub->sequence == sequence)
+        {
+            lo_address_free (sub->address);
+            vector_swap_remove_at (&osc->subscriptions, i);
+            free (sub);
+        }
+    }
+    pthread_mutex_unlock (&osc->subscriptions_mutex);
+
+    /* Beats are queued by the pool thread with the sequence locked, so that
+       once unsubscribed, going through the lock ensures that no handler still
+       uses osc_sequence */
+    osc_sequence_t *osc_sequence
+            = (osc_sequence_t *) g_hash_table_lookup (osc->sequences, (gpointer) sequence);
+    event_unsubscribe_all (osc_sequence);
+    sequence_get_framerate (sequence);
+
+    pthread_mutex_lock (&osc->output_mutex);
+    vector_remove (&osc->outputs, osc_sequence);
+    pthread_mutex_unlock (&osc->output_mutex);
     g_hash_table_remove (osc->sequences, (gpointer) sequence);
 }
 
 void
 osc_on_sequence_beat_changed (event_t *event)
 {
-    osc_t *osc = (osc_t *) event->self;
+    osc_sequence_t *osc_sequence = (osc_sequence_t *) event->self;
     sequence_t *sequence = (sequence_t *) event->source;
     sequence_position_t *pos = (sequence_position_t *) event->data;
-    int state = (int) sequence_get_beat (sequence, pos->track, pos->beat);
-    osc_send_from_sequence (osc, sequence, "/beat_changed", "iii", pos->track,
-                            pos->beat, state);
+    int argv[] = {pos->track, pos->beat, (int) sequence_get_beat (sequence, pos->track, pos->beat)};
+    pthread_mutex_lock (&osc_sequence->osc->output_mutex);
+    osc_queue_output (osc_sequence, osc_sequence->changes, OSC_OUTPUT_BEAT_CHANGED, pos->frame, argv);
+    pthread_mutex_unlock (&osc_sequence->osc->output_mutex);
 }
 
 void
-osc_on_sequence_beat_on (event_t *event)
+osc_on_sequence_region_changed (event_t *event)
 {
-    osc_t *osc = (osc_t *) event->self;
+    osc_sequence_t *osc_sequence = (osc_sequence_t *) event->self;
     sequence_t *sequence = (sequence_t *) event->source;
+    sequence_region_t *region = (sequence_region_t *) event->data;
+    int argv[] = {region->track, region->beat, region->tracks_num, region->beats_num};
+    pthread_mutex_lock (&osc_sequence->osc->output_mutex);
+    osc_queue_output (osc_sequence, osc_sequence->changes, OSC_OUTPUT_REGION_CHANGED,
+                      sequence_get_frame_time (sequence), argv);
+    pthread_mutex_unlock (&osc_sequence->osc->output_mutex);
+}
+
+/* Beats are fired by the pool thread, which is the only writer of the events
+   queue: neither the sequence nor the output lock is needed here */
+void
+osc_on_sequence_beat_on (event_t *event)
+{
+    osc_sequence_t *osc_sequence = (osc_sequence_t *) event->self;
     sequence_position_t *pos = (sequence_position_t *) event->data;
-    osc_send_from_sequence (osc, sequence, "/beat_on", "ii", pos->track,
-                            pos->beat);
+    int argv[] = {pos->track, pos->beat};
+    osc_queue_output (osc_sequence, osc_sequence->events, OSC_OUTPUT_BEAT_ON, pos->frame, argv);
 }
 
 void
 osc_on_sequence_beat_off (event_t *event)
 {
-    osc_t *osc = (osc_t *) event->self;
-    sequence_t *sequence = (sequence_t *) event->source;
+    osc_sequence_t *osc_sequence = (osc_sequence_t *) event->self;
     sequence_position_t *pos = (sequence_position_t *) event->data;
-    osc_send_from_sequence (osc, sequence, "/beat_off", "ii", pos->track,
-                            pos->beat);
+    int argv[] = {pos->track, pos->beat};
+    osc_queue_output (osc_sequence, osc_sequence->events, OSC_OUTPUT_BEAT_OFF, pos->frame, argv);
 }
 
+
 void
 osc_set_sequence_target (osc_t *osc, sequence_t *sequence, const char *host,
                          int port, const char *prefix)
 {
-    // Thread safe ?
     osc_sequence_t *osc_sequence
             = (osc_sequence_t *) g_hash_table_lookup (osc->sequences, (gpointer) sequence);
-    free (osc_sequence->output_prefix);
-    osc_sequence->output_prefix = strdup (prefix);
     char portstr[8];
     sprintf (portstr, "%d", port);
+    pthread_mutex_lock (&osc->output_mutex);
+    free (osc_sequence->output_prefix);
+    osc_sequence->output_prefix = strdup (prefix);
+    osc_format_output_paths (osc_sequence);
     if (osc_sequence->output_address)
         lo_address_free (osc_sequence->output_address);
     osc_sequence->output_address = lo_address_new (host, portstr);
+    pthread_mutex_unlock (&osc->output_mutex);
 }
 
 void
@@ -673,9 +1688,9 @@ osc_set_sequence_input_prefix (osc_t *osc, sequence_t *sequence, const char *pre
         osc_sequence->input_prefix = strdup (prefix);
 
     int i;
-    for (i = 0; i < osc->methods_num; i++)
+    for (i = 0; i < osc->methods.num; i++)
     {
-        osc_method_t *method = osc->methods[i];
+        osc_method_t *method = METHOD (osc, i);
         if (method->instance == sequence)
         {
             char *old_path = osc_get_method_path (method);
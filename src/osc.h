@@ -32,6 +32,26 @@ typedef enum {
     OSC_OUT
 } osc_method_type_t;
 
+typedef struct osc_stats_t {
+    unsigned long timed_num;    // Timestamped messages received
+    unsigned long late_num;     // Timestamped messages received too late
+    unsigned long sent_num;     // Bundles sent
+    unsigned long dropped_num;  // Outgoing messages dropped
+    double        latency;      // Delay of the last bundle after its cycle, in seconds
+    double        max_latency;
+} osc_stats_t;
+
+/* File operation received over OSC, carried out by whoever handles the
+ * corresponding "*-requested" event, which must then call osc_reply() */
+typedef struct osc_request_t {
+    char *       path;          // method path, echoed in the reply
+    sequence_t * sequence;      // NULL for song-wide requests
+    char *       filename;
+    int          framerate;
+    int          sustain_type;
+    void *       source;        // reply address
+} osc_request_t;
+
 typedef struct {
     osc_method_type_t type;
     char * path;
@@ -46,6 +66,9 @@ void osc_destroy(osc_t *osc);
 void osc_print_interface();
 int osc_set_port(osc_t *osc, int port);
 int osc_get_port(osc_t *osc);
+void osc_set_latency(osc_t *osc, int latency);
+int osc_get_latency(osc_t *osc);
+void osc_get_stats(osc_t *osc, osc_stats_t *stats);
 void osc_set_sequence_target(osc_t *osc, sequence_t *sequence, const char *host,
         int port, const char *prefix);
 void osc_get_sequence_target(osc_t *osc, sequence_t *sequence, char **host,
@@ -56,4 +79,5 @@ int osc_get_sequence_input_prefix(osc_t *osc, sequence_t *sequence,
         char **prefix);
 osc_method_desc_t ** osc_reflect_sequence_methods(osc_t *osc, sequence_t *sequence);
 void osc_reflect_free(osc_method_desc_t **descs);
+void osc_reply(osc_t *osc, osc_request_t *request, int error, const char *result);
 #endif
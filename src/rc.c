@@ -24,7 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sndfile.h>
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <libgen.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -72,6 +72,9 @@ rc_read (rc_t *rc)
     strcpy (rc->client_name, PACKAGE_NAME);
     strcpy (rc->audio_output, stream_device_get_default ());
     rc->audio_sample_rate = 44100;
+    rc->audio_period_size = 0;
+    rc->audio_periods = 0;
+    rc->osc_latency = 10;
 
     path = util_settings_dir ();
     if (stat (path, &b) == 0 && S_ISREG (b.st_mode)) strcpy (s, path);
@@ -107,6 +110,12 @@ rc_read (rc_t *rc)
                     strcpy (rc->audio_output, val);
                 else if (strcmp (key, "audio_sample_rate") == 0)
                     sscanf (val, "%d", &(rc->audio_sample_rate));
+                else if (strcmp (key, "audio_period_size") == 0)
+                    sscanf (val, "%d", &(rc->audio_period_size));
+                else if (strcmp (key, "audio_periods") == 0)
+                    sscanf (val, "%d", &(rc->audio_periods));
+                else if (strcmp (key, "osc_latency") == 0)
+                    sscanf (val, "%d", &(rc->osc_latency));
                 else if (strcmp (key, "jack_auto_start") == 0)
                     sscanf (val, "%d", &(rc->jack_auto_start));
             }
@@ -158,6 +167,9 @@ rc_write (rc_t * rc)
         fprintf (fd, "client_name = \"%s\"\n", rc->client_name);
         fprintf (fd, "audio_output = \"%s\"\n", rc->audio_output);
         fprintf (fd, "audio_sample_rate = %d\n", rc->audio_sample_rate);
+        fprintf (fd, "audio_period_size = %d\n", rc->audio_period_size);
+        fprintf (fd, "audio_periods = %d\n", rc->audio_periods);
+        fprintf (fd, "osc_latency = %d\n", rc->osc_latency);
         fprintf (fd, "jack_auto_start = %d\n", rc->jack_auto_start);
         fclose (fd);
     }
@@ -40,6 +40,9 @@ typedef struct rc_t {
     char client_name[512];
     char audio_output[512];
     int audio_sample_rate;
+    int audio_period_size;
+    int audio_periods;
+    int osc_latency;
     int jack_auto_start;
 } rc_t;
 
@@ -0,0 +1,389 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+/*
+ * Offline batch renderer.
+ *
+ * Exports JAB files as sequence_export() does from the GUI, without any
+ * audio device. Files are rendered in parallel by a number of workers, each
+ * with its own stream on the null driver. Loading goes through the JAB
+ * parser, which switches the process locale, so it is done by one worker at
+ * a time, while rendering is not.
+ *
+ * With --stems, each track also goes to its own file, from the same rendering
+ * pass, and the cores left over by the workers are used to encode these.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sndfile.h>
+#include <config.h>
+
+#include "sequence.h"
+#include "jab.h"
+#include "error.h"
+#include "util.h"
+#include "core/event.h"
+#include "core/compat.h"
+#include "stream/stream.h"
+
+#define DEBUG(M, ...) { printf("RDR  %s(): ", __func__); printf(M, ## __VA_ARGS__); printf("\n"); }
+
+typedef struct render_format_t
+{
+    char *  name;
+    int     format;
+    char *  extension;
+} render_format_t;
+
+static render_format_t render_formats[] = {
+    { "wav",    SF_FORMAT_WAV | SF_FORMAT_PCM_16,   "wav" },
+    { "wav24",  SF_FORMAT_WAV | SF_FORMAT_PCM_24,   "wav" },
+    { "wavf",   SF_FORMAT_WAV | SF_FORMAT_FLOAT,    "wav" },
+    { "aiff",   SF_FORMAT_AIFF | SF_FORMAT_PCM_16,  "aiff" },
+    { "flac",   SF_FORMAT_FLAC | SF_FORMAT_PCM_16,  "flac" },
+    { "ogg",    SF_FORMAT_OGG | SF_FORMAT_VORBIS,   "ogg" },
+};
+
+typedef struct render_job_t
+{
+    char *          filename;
+    char *          output;
+    int             error;
+    unsigned long   nframes;
+    double          time;       // Seconds, loading excluded
+} render_job_t;
+
+typedef struct render_t
+{
+    render_job_t *  jobs;
+    int             jobs_num;
+    int             next_job;
+    int             framerate;
+    int             sustain_type;
+    render_format_t *format;
+    int             stems;
+    int             mix;
+    int             writers_num;    // Stem encoding threads per worker
+    pthread_mutex_t mutex;
+    pthread_mutex_t load_mutex;
+} render_t;
+
+static void
+render_usage (char *executable)
+{
+    int i;
+    printf ("Usage: %s [options] jab filename...\n", executable);
+    printf ("Options:\n");
+    printf ("  -d, --output-dir=DIR      Directory to write to (default: next to each jab file)\n");
+    printf ("  -f, --format=FORMAT       Output format: ");
+    for (i = 0; i < sizeof (render_formats) / sizeof (render_formats[0]); i++)
+        printf ("%s%s", i ? ", " : "", render_formats[i].name);
+    printf (" (default: wav)\n");
+    printf ("  -h, --help                Display help information\n");
+    printf ("  -j, --jobs=NUM            Number of files rendered at once (default: number of cores)\n");
+    printf ("  -r, --rate=HZ             Sample rate (default: 44100)\n");
+    printf ("  -m, --no-mix              With --stems, do not write the mix\n");
+    printf ("  -s, --sustain=MODE        Samples playing past the end: loop, truncate or keep\n");
+    printf ("                            (default: truncate)\n");
+    printf ("  -t, --stems               Also write each track to FILE-TRACK.EXT\n");
+    printf ("  -v, --version             Output version\n");
+}
+
+static void
+render_progress (char *status, double fraction, void *data)
+{
+}
+
+static char *
+render_make_output_path (char *filename, char *dir, char *extension)
+{
+    char *base = util_basename (filename);
+    char *output = malloc ((dir ? strlen (dir) : strlen (filename)) + strlen (base)
+                           + (extension ? strlen (extension) : 0) + 3);
+    int len = strlen (base);
+
+    if ((len >= 4) && (strncasecmp (base + len - 4, ".jab", 4) == 0))
+        base[len - 4] = '\0';
+
+    if (dir)
+    {
+        sprintf (output, "%s/%s", dir, base);
+    }
+    else
+    {
+        char *parent = util_dirname (filename);
+        sprintf (output, "%s/%s", parent, base);
+        free (parent);
+    }
+
+    if (extension)
+        sprintf (output + strlen (output), ".%s", extension);
+
+    free (base);
+    return output;
+}
+
+static void
+render_job (render_t *render, render_job_t *job, stream_t *stream)
+{
+    jab_t *jab;
+    sequence_t *sequence = NULL;
+    unsigned long long start;
+
+    pthread_mutex_lock (&render->load_mutex);
+    if ((jab = jab_open (job->filename, JAB_READ, render_progress, NULL, &job->error)))
+    {
+        sequence = jab_retrieve_sequence (jab, stream, "render", &job->error);
+        jab_close (jab);
+    }
+    pthread_mutex_unlock (&render->load_mutex);
+
+    if (!sequence)
+    {
+        if (!job->error)
+            job->error = ERR_INTERNAL;
+        return;
+    }
+
+    start = compat_time_usec ();
+    if (render->stems)
+        job->nframes = sequence_export_stems (sequence, job->output, render->format->extension,
+                                              render->framerate, render->sustain_type,
+                                              render->format->format, render->mix,
+                                              render->writers_num, render_progress, NULL);
+    else
+        job->nframes = sequence_export (sequence, job->output, render->framerate,
+                                        render->sustain_type, render->format->format,
+                                        render_progress, NULL);
+    job->time = (compat_time_usec () - start) / 1000000.0;
+    if (!job->nframes)
+        job->error = ERR_INTERNAL;
+
+    sequence_destroy (sequence);
+}
+
+static void *
+render_worker_run (void *data)
+{
+    render_t *render = (render_t *) data;
+    stream_t *stream = stream_new ();
+    render_job_t *job;
+
+    for (;;)
+    {
+        pthread_mutex_lock (&render->mutex);
+        job = render->next_job < render->jobs_num ? render->jobs + render->next_job++ : NULL;
+        pthread_mutex_unlock (&render->mutex);
+        if (!job)
+            break;
+
+        DEBUG ("Rendering %s into %s", job->filename, job->output);
+        render_job (render, job, stream);
+    }
+
+    stream_destroy (stream);
+    return NULL;
+}
+
+static int
+render_print_summary (render_t *render)
+{
+    int i, failed = 0;
+    double duration;
+
+    printf ("\n%-40s %10s %10s %10s\n", "File", "Duration", "Time", "Speed");
+    for (i = 0; i < render->jobs_num; i++)
+    {
+        render_job_t *job = render->jobs + i;
+        char *base = util_basename (job->filename);
+        if (job->error)
+        {
+            char *s = error_to_string (job->error);
+            printf ("%-40s FAILED: %s\n", base, s);
+            free (s);
+            failed++;
+        }
+        else
+        {
+            duration = (double) job->nframes / render->framerate;
+            printf ("%-40s %9.2fs %9.2fs %9.1fx\n", base, duration, job->time,
+                    job->time > 0 ? duration / job->time : 0);
+        }
+        free (base);
+    }
+    printf ("%d file(s) rendered, %d failed\n", render->jobs_num - failed, failed);
+
+    return failed;
+}
+
+int
+main (int argc, char *argv[])
+{
+    render_t render;
+    char *output_dir = NULL;
+    int workers_num = 0, cores_num, option_index = 0, c, i;
+    pthread_t *workers;
+    SF_INFO info;
+
+    static struct option long_options[] ={
+        {"output-dir",  1, 0, 'd'},
+        {"format",      1, 0, 'f'},
+        {"help",        0, 0, 'h'},
+        {"jobs",        1, 0, 'j'},
+        {"no-mix",      0, 0, 'm'},
+        {"rate",        1, 0, 'r'},
+        {"sustain",     1, 0, 's'},
+        {"stems",       0, 0, 't'},
+        {"version",     0, 0, 'v'},
+        {0,             0, 0, 0}
+    };
+
+    render.framerate = 44100;
+    render.sustain_type = SEQUENCE_SUSTAIN_TRUNCATE;
+    render.format = render_formats;
+    render.stems = 0;
+    render.mix = 1;
+
+    while ((c = getopt_long (argc, argv, "d:f:hj:mr:s:tv", long_options, &option_index)) != EOF)
+    {
+        switch (c)
+        {
+            case 'd':
+                output_dir = optarg;
+                break;
+
+            case 'f':
+                render.format = NULL;
+                for (i = 0; i < sizeof (render_formats) / sizeof (render_formats[0]); i++)
+                    if (!strcmp (optarg, render_formats[i].name))
+                        render.format = render_formats + i;
+                if (!render.format)
+                {
+                    printf ("Unknown format: %s\n", optarg);
+                    exit (1);
+                }
+                break;
+
+            case 'j':
+                workers_num = atoi (optarg);
+                break;
+
+            case 'm':
+                render.mix = 0;
+                break;
+
+            case 't':
+                render.stems = 1;
+                break;
+
+            case 'r':
+                render.framerate = atoi (optarg);
+                break;
+
+            case 's':
+                if (!strcmp (optarg, "loop"))
+                    render.sustain_type = SEQUENCE_SUSTAIN_LOOP;
+                else if (!strcmp (optarg, "truncate"))
+                    render.sustain_type = SEQUENCE_SUSTAIN_TRUNCATE;
+                else if (!strcmp (optarg, "keep"))
+                    render.sustain_type = SEQUENCE_SUSTAIN_KEEP;
+                else
+                {
+                    printf ("Unknown sustain mode: %s\n", optarg);
+                    exit (1);
+                }
+                break;
+
+            case 'v':
+                printf ("%s\n", VERSION);
+                exit (0);
+                break;
+
+            case 'h':
+            default:
+                render_usage (argv[0]);
+                exit (c == 'h' ? 0 : 1);
+        }
+    }
+
+    if (optind >= argc)
+    {
+        render_usage (argv[0]);
+        exit (1);
+    }
+
+    info.samplerate = render.framerate;
+    info.channels = 2;
+    info.format = render.format->format;
+    if (render.framerate <= 0 || !sf_format_check (&info))
+    {
+        printf ("Can't write %s at %d Hz\n", render.format->name, render.framerate);
+        exit (1);
+    }
+
+    render.jobs_num = argc - optind;
+    render.jobs = calloc (render.jobs_num, sizeof (render_job_t));
+    for (i = 0; i < render.jobs_num; i++)
+    {
+        render.jobs[i].filename = argv[optind + i];
+        render.jobs[i].output = render_make_output_path (argv[optind + i], output_dir,
+                                                         render.stems ? NULL : render.format->extension);
+    }
+    render.next_job = 0;
+    pthread_mutex_init (&render.mutex, NULL);
+    pthread_mutex_init (&render.load_mutex, NULL);
+
+    cores_num = sysconf (_SC_NPROCESSORS_ONLN);
+    if (cores_num <= 0)
+        cores_num = 1;
+    if (workers_num <= 0)
+        workers_num = cores_num;
+    if (workers_num > render.jobs_num)
+        workers_num = render.jobs_num;
+    render.writers_num = cores_num / workers_num;
+
+    util_init_paths ();
+    event_init ();
+
+    workers = calloc (workers_num, sizeof (pthread_t));
+    for (i = 0; i < workers_num; i++)
+        pthread_create (workers + i, NULL, render_worker_run, (void *) &render);
+    for (i = 0; i < workers_num; i++)
+        pthread_join (workers[i], NULL);
+    free (workers);
+
+    c = render_print_summary (&render);
+
+    for (i = 0; i < render.jobs_num; i++)
+        free (render.jobs[i].output);
+    free (render.jobs);
+    pthread_mutex_destroy (&render.mutex);
+    pthread_mutex_destroy (&render.load_mutex);
+    event_cleanup ();
+
+    return c ? 1 : 0;
+}
@@ -259,17 +259,62 @@ sample_compare (sample_t * sample, char *filename)
             ? 0 : 1;
 }
 
+/* 64-bit FNV-1a over the sample format and audio data. It is computed on first
+ * request only, since it requires a full pass over the data. */
+uint64_t
+sample_get_content_hash (sample_t *sample)
+{
+    if (!sample->content_hashed)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        const unsigned char *bytes;
+        size_t i, len;
+        int32_t format[2] = { sample->channels_num, sample->framerate };
+
+        bytes = (const unsigned char *) format;
+        for (i = 0; i < sizeof (format); i++)
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+
+        bytes = (const unsigned char *) sample->data;
+        len = (size_t) sample->frames * sample->channels_num * sizeof (float);
+        for (i = 0; i < len; i++)
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+
+        sample->content_hash = hash;
+        sample->content_hashed = 1;
+    }
+    return sample->content_hash;
+}
+
+/* Return 1 if both samples hold the same audio, 0 otherwise. Hashes are
+ * compared first, the data is then checked to rule out collisions. */
+int
+sample_same_content (sample_t *a, sample_t *b)
+{
+    if (a == b)
+        return 1;
+
+    return (a->channels_num == b->channels_num)
+            && (a->framerate == b->framerate)
+            && (a->frames == b->frames)
+            && (sample_get_content_hash (a) == sample_get_content_hash (b))
+            && !memcmp (a->data, b->data, (size_t) a->frames * a->channels_num * sizeof (float));
+}
+
+/* References may be dropped by a pool thread, once the audio thread is done
+ * with a sample, so that counting is atomic. */
 void
 sample_ref (sample_t *sample)
 {
-    sample->ref_num++;
+    __sync_add_and_fetch (&sample->ref_num, 1);
 }
 
 void
 sample_unref (sample_t *sample)
 {
-    DEBUG ("sample '%s' is referenced %d time(s)", sample->name, sample->ref_num);
-    if (sample->ref_num-- <= 1)
+    int ref_num = __sync_sub_and_fetch (&sample->ref_num, 1);
+    DEBUG ("sample '%s' is referenced %d time(s)", sample->name, ref_num + 1);
+    if (ref_num <= 0)
     {
         event_fire (sample, "destroy", NULL, NULL);
         event_remove_source (sample);
@@ -283,3 +328,37 @@ sample_unref (sample_t *sample)
     }
 }
 
+static int sample_release_deferred = 0;
+
+static void
+sample_on_release (event_t *event)
+{
+    sample_unref ((sample_t *) event->data);
+}
+
+/**
+ * Let the references dropped with sample_release() be dropped in the main
+ * loop. To be called once the main event queue is enabled.
+ */
+void
+sample_init ()
+{
+    event_register (NULL, "sample-release");
+    event_subscribe (NULL, "sample-release", NULL, sample_on_release);
+    sample_release_deferred = 1;
+}
+
+/**
+ * Drop a reference from outside the main thread. The last one would fire the
+ * "destroy" event, whose subscribers expect the main thread, so that it is
+ * passed to the main event queue.
+ */
+void
+sample_release (sample_t *sample)
+{
+    if (sample_release_deferred)
+        event_fire (NULL, "sample-release", sample, NULL);
+    else
+        sample_unref (sample);
+}
+
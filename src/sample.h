@@ -26,6 +26,7 @@
 
 #include <sndfile.h>
 #include <sys/types.h>
+#include <stdint.h>
 
 #include "types.h"
 
@@ -42,6 +43,8 @@ typedef struct sample_t {
     time_t last_file_ctime;
     float peak;
     int ref_num;
+    uint64_t content_hash;
+    int content_hashed;
 } sample_t;
 
 sample_t * sample_new(char *filename, progress_callback_t progress_callback,
@@ -50,8 +53,12 @@ int sample_write(sample_t *sample, char *path, progress_callback_t progress_call
         void *progress_data);
 char * sample_storage_basename(sample_t *sample);
 int sample_compare(sample_t * sample, char *filename);
+uint64_t sample_get_content_hash(sample_t *sample);
+int sample_same_content(sample_t *a, sample_t *b);
 void sample_ref(sample_t *sample);
 void sample_unref(sample_t *sample);
+void sample_release(sample_t *sample);
+void sample_init();
 char ** sample_list_known_extensions();
 
 #endif
@@ -21,6 +21,7 @@
  */
 
 #define SEQUENCE_MASK_ATTACK_DELAY 3.0 // Miliseconds
+#define SEQUENCE_PARAM_SMOOTHING 20.0  // Miliseconds
 
 #include <samplerate.h>
 #include <stdio.h>
@@ -32,10 +33,15 @@
 #include <unistd.h>
 #include <config.h>
 #include <semaphore.h>
+#include <pthread.h>
 
 #include "sequence.h"
 #include "error.h"
 #include "core/msg.h"
+#include "core/bitset.h"
+#include "core/epoch.h"
+#include "core/compat.h"
+#include "core/ringbuffer.h"
 #include "util.h"
 
 #ifdef MEMDEBUG
@@ -79,38 +85,110 @@
    +--------------------------------------------+
  */
 
-typedef struct sequence_track_t
+/* Rendered loop of a frozen track. Allocated as a single block, with the
+   per-beat levels and channel data following the structure. */
+typedef struct sequence_freeze_t
 {
-    char *          beats;
-    char *          mask;
+    float **        data;
+    float *         levels;
+    unsigned long   nframes;
+    double          beat_length;
+    int             channels_num;
+    size_t          size;
+} sequence_freeze_t;
 
-    sample_t *      sample;
+typedef struct sequence_freeze_job_t sequence_freeze_job_t;
 
-    stream_port_t ** channels;
-    int             channels_num;
-    unsigned long * sample_input_pos;
-    unsigned long * sample_output_pos;
+/* Parameter ramp, advanced frame by frame by the audio thread. Exponential
+   ramps multiply the value by step on each frame, others add it. */
+typedef struct sequence_ramp_t
+{
+    double          target;
+    double          step;
+    unsigned long   frames;     // left until the target is reached
+    char            exponential;
+} sequence_ramp_t;
+
+#define SEQUENCE_RAMP_FLOOR 0.0001 // Where exponential ramps from or to zero start or end
+
+/* Parameter change, scheduled at a stream frame time */
+typedef struct sequence_param_t
+{
+    unsigned long   frame;
+    unsigned long   length;
+    double          value;
+    int             track;
+    int             beat;
+    int             type;
+    int             curve;
+} sequence_param_t;
+
+#define SEQUENCE_PARAM_VOLUME 1
+#define SEQUENCE_PARAM_PITCH  2
+#define SEQUENCE_PARAM_MUTE   3
+#define SEQUENCE_PARAM_BPM    4
+// Beat and mask changes are written to the grid at once, and the previous
+// state is held until the change is due:
+#define SEQUENCE_PARAM_BEAT   5
+#define SEQUENCE_PARAM_MASK   6
+
+#define SEQUENCE_PARAMS_SIZE 256
+#define SEQUENCE_HOLDS_SIZE  8192 // Bytes, a power of 2
+#define SEQUENCE_FREEZE_CHUNK 16   // Buffers rendered at once by a pool thread
+
+/* Track state, as accessed by the audio thread on every cycle. Fields are
+   ordered by access frequency, so that rendering a track mostly stays
+   within the first couple of cache lines. */
+typedef struct sequence_track_t
+{
+    sample_t *      sample;
+    unsigned long   sample_input_pos;
+    unsigned long   sample_output_pos;
+    double          sr_converter_ratio;
+    double          volume;
+    double          mask_envelope;
     float **        buffers;
     unsigned long   buffers_ofs;
-
+    float *         sr_converter_buffer;
+    int             channels_num;
+    int             sr_converter_type;
     int             active_beat;
     int             active_mask_beat;
-    char            name[256];
-
+    bitset_word_t * beats;
+    bitset_word_t * mask;
+    sequence_freeze_t * freeze;
+    sequence_t *    nested;
+    SRC_STATE *     sr_converter;
+    int             smoothing;
+    float volatile  current_level;
+    char            silent;
     char            enabled;
     char            solo;
     char            lock;
-    SRC_STATE *     sr_converter;
-    int             sr_converter_type;
-    float *         sr_converter_buffer;
-    double          sr_converter_ratio;
+    char            gain_active;
+    stream_port_t ** channels;
+    double          mute_gain;
+    sequence_ramp_t volume_ramp;
+    sequence_ramp_t mute_ramp;
+    sequence_ramp_t pitch_ramp;
+} sequence_track_t;
+
+/* Track metadata, which is never accessed by the audio thread. Kept in a
+   separate array, with the same indexes as the tracks. The sample is the one
+   last set, which the audio thread may not have picked up yet; the main loop
+   holds a reference to it, as with the nested sequence. freeze_serial
+   identifies a pending or completed freeze request, and is reset whenever the
+   track output changes. */
+typedef struct sequence_track_info_t
+{
+    char            name[256];
     double          pitch;
-    double          volume;
-    double          mask_envelope;
-    int             smoothing;
-    float volatile  current_level;
     float           level_peak;
-} sequence_track_t;
+    sample_t *      sample;
+    sequence_freeze_t * freeze;
+    unsigned long   freeze_serial;
+    sequence_t *    nested;
+} sequence_track_info_t;
 
 typedef enum sequence_status_t
 {
@@ -123,23 +201,66 @@ struct sequence_t
     stream_t *        stream;
     pool_t *          pool;
     sequence_track_t *tracks;
+    sequence_track_info_t *tracks_info;
     int               tracks_num;
+    int               tracks_size;
+    int               solo_num;
     int               beats_num;
+    int               beats_size;
     int               measure_len;
     float             bpm;
     sequence_status_t status;
     int               looping;
     int               transport_aware;
     int               transport_query;
+    int               transport_follow;
+    int               transport_rolling;
+    int               transport_synced;
+    unsigned long     transport_next_frame;
+    unsigned long     next_position;
     unsigned long     framerate;
     unsigned long     buffer_size;
     char              name[32];
     int               sr_converter_default_type;
     msg_t *           msg;
+    epoch_t *         epoch;
+    unsigned long     freeze_serial;
+    int               freeze_pending;
+    int               freeze_waiting;
+    unsigned long     freeze_stamp;
+    sequence_freeze_job_t *freeze_job;
+    unsigned long     cycle;
+    float *           mix[2];
+    char              mix_silent;
+    float *           gain;
+    unsigned long     frame_time;
+    sequence_param_t *params;
+    int               params_num;
+    unsigned long volatile params_dropped;
+    unsigned long     params_dropped_reported;
+    ringbuffer_t *    holds;
+    int               nested_refs;
+    unsigned long     trigger_offset;
+    float volatile    process_time;
+    sequence_snapshot_t snapshot;
+    float * volatile  snapshot_levels;
+    unsigned long volatile snapshot_serial;
+    int volatile      snapshot_readers;
     int               error;
     sem_t             mutex;
 } ;
 
+/* Track loop being rendered by a pool thread, on a private copy of the track,
+   within a minimal sequence. See sequence_freeze_next(). */
+struct sequence_freeze_job_t
+{
+    sequence_t          tmp;
+    sequence_track_t    track;
+    sequence_freeze_t * freeze;
+    unsigned long       serial;
+    unsigned long       pos;
+} ;
+
 /****************************************************************************
  * Type and macros for messages sent from the main loop to the audio thread *
  ****************************************************************************/
@@ -164,12 +285,13 @@ typedef struct sequence_msg_t
 #define SEQUENCE_MSG_MUTE_TRACK     14
 #define SEQUENCE_MSG_SOLO_TRACK     15
 #define SEQUENCE_MSG_SWAP_TRACKS    16
+#define SEQUENCE_MSG_SET_FOLLOW     17
+#define SEQUENCE_MSG_SCHEDULE       18
 
 #define SEQUENCE_MSG_NO_ACK -32
 #define SEQUENCE_MSG_ACK    33
 
-#define SEQUENCE_MSG_LOCK_TRACKS          34
-#define SEQUENCE_MSG_UNLOCK_TRACKS        35
+#define SEQUENCE_MSG_REMOVE_TRACK         34
 #define SEQUENCE_MSG_LOCK_SINGLE_TRACK    36
 #define SEQUENCE_MSG_UNLOCK_SINGLE_TRACK  37
 #define SEQUENCE_MSG_RESIZE               38
@@ -179,15 +301,37 @@ typedef struct sequence_msg_t
 #define SEQUENCE_MSG_ACK_STOP             43
 #define SEQUENCE_MSG_ACK_ENABLE           44
 #define SEQUENCE_MSG_ACK_DISABLE          45
+#define SEQUENCE_MSG_FREEZE_TRACK         46
+#define SEQUENCE_MSG_UNFREEZE_TRACK       47
+#define SEQUENCE_MSG_SET_NESTED           48
 
 
 /*******************************
  *   Various type and macros   *
  *******************************/
 
+#define SEQUENCE_MIN_TRACKS_SIZE 8
+
 #define SEQUENCE_NESTED 1
 #define SEQUENCE_SILENT 2
 
+/* Pending changes to a track pattern, within an edit transaction */
+typedef struct sequence_edit_track_t
+{
+    bitset_word_t * beats;
+    bitset_word_t * beats_touched;
+    bitset_word_t * mask;
+    bitset_word_t * mask_touched;
+} sequence_edit_track_t;
+
+struct sequence_edit_t
+{
+    sequence_t *              sequence;
+    int                       tracks_num;
+    int                       beats_num;
+    sequence_edit_track_t **  tracks;
+} ;
+
 typedef struct sequence_resize_data_t
 {
     sequence_track_t *tracks;
@@ -217,6 +361,8 @@ char *dump_s;
 #define SEQUENCE_VALID_NAME "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-._"
 
 static int sequence_process_events (void *data);
+static void sequence_release_sample (void *ptr, void *data);
+static void sequence_freeze_job_destroy (sequence_freeze_job_t *job);
 
 /************************************************************
  *   Private functions running inside the realtime thread   *
@@ -248,13 +394,63 @@ sequence_get_all_buffers (sequence_t * sequence, unsigned long nframes)
             sequence_get_buffers (sequence, i, nframes);
 }
 
+/**
+ * Reset a track's output buffers state at the beginning of a cycle.
+ *
+ * Tracks start each cycle as silent: their buffers are left untouched until
+ * some audible data gets written, so that idle tracks cost nothing.
+ */
+static void
+sequence_reset_buffers (sequence_track_t *t)
+{
+    t->buffers_ofs = 0;
+    t->silent = 1;
+}
+
+/** 
+ * zero-fills stream buffers with a length of n frames, for a given track. 
+ *
+ * While a track is silent, this only advances the buffers offset.
+ */
+static void
+sequence_zero_fill (sequence_t * sequence, int track, unsigned long nframes)
+{
+    int j, k;
+    sequence_track_t *t = sequence->tracks + track;
+
+    if (!t->silent)
+        for (j = 0; j < t->channels_num; j++)
+            for (k = 0; k < nframes; k++) t->buffers[j][k + t->buffers_ofs] = 0;
+
+    t->buffers_ofs += nframes;
+}
+
+/**
+ * Leave the silent state before writing audible data into a track's buffers.
+ *
+ * The frames which were skipped while the track was silent get zero-filled.
+ */
+static void
+sequence_unsilence (sequence_track_t *t)
+{
+    int j, k;
+    if (t->silent)
+    {
+        for (j = 0; j < t->channels_num; j++)
+            for (k = 0; k < t->buffers_ofs; k++) t->buffers[j][k] = 0;
+
+        t->silent = 0;
+    }
+}
+
 /**
  * Copies sample data to output buffers.
  *
  * Copies nframes frames from a given track's sample to the corresponding stream
  * audio buffers, and increases the internal track pointer (sample_input_pos)
  * accordingly. If there's not enough sample data, this function will zero-fill
- * the remaining space in the stream buffers
+ * the remaining space in the stream buffers. Nothing is written if the
+ * produced data is known to be silent.
  */
 static int
 sequence_copy_sample_data (sequence_t * sequence, int track,
@@ -276,14 +472,14 @@ sequence_copy_sample_data (sequence_t * sequence, int track,
 
     // What we have to produce and what is available
     nframes_required = nframes;
-    nframes_avail = (*(t->sample_input_pos) < t->sample->frames)
-            ? t->sample->frames - *(t->sample_input_pos) : 0;
+    nframes_avail = (t->sample_input_pos < t->sample->frames)
+            ? t->sample->frames - t->sample_input_pos : 0;
 
     // Performing sample rate conversion
     if (t->sr_converter_type == SEQUENCE_SINC)
     {
-        if (*(t->sample_input_pos) == 0) src_reset (t->sr_converter);
-        src_data.data_in = t->sample->data + *(t->sample_input_pos) * t->channels_num;
+        if (t->sample_input_pos == 0) src_reset (t->sr_converter);
+        src_data.data_in = t->sample->data + t->sample_input_pos * t->channels_num;
         filtered_data = src_data.data_out = t->sr_converter_buffer;
         src_data.input_frames = nframes_avail;
         src_data.output_frames = nframes_required;
@@ -301,15 +497,21 @@ sequence_copy_sample_data (sequence_t * sequence, int track,
     }
     else
     {
-        for (j = 0, k = 0; (j < nframes_required) && (k < nframes_avail); j++)
+        // Blocks are split at beat boundaries: the position must carry over
+        // exactly, without repeating the last frame of the previous call
+        for (j = 0; j < nframes_required; j++)
         {
+            k = (double) j / t->sr_converter_ratio;
+            if (k >= nframes_avail)
+                break;
             memcpy (t->sr_converter_buffer + j * t->channels_num,
-                    t->sample->data + (*(t->sample_input_pos) + k) * t->channels_num,
+                    t->sample->data + (t->sample_input_pos + k) * t->channels_num,
                     t->channels_num * sizeof (float));
-            k = (double) j / t->sr_converter_ratio;
         }
         nframes_filtered = j;
-        nframes_used = k;
+        nframes_used = (double) j / t->sr_converter_ratio;
+        if (nframes_used > nframes_avail)
+            nframes_used = nframes_avail;
         filtered_data = t->sr_converter_buffer;
     }
 
@@ -317,6 +519,17 @@ sequence_copy_sample_data (sequence_t * sequence, int track,
     double mask_env_delta = (double) 1 / mask_env_interval;
     double mask_env = t->mask_envelope;
 
+    // Nothing audible: either no data, or masked/muted with a closed envelope
+    if (!nframes_filtered || (!mask && mask_env == 0))
+    {
+        sequence_zero_fill (sequence, track, nframes_required);
+        t->sample_input_pos += nframes_used;
+        t->sample_output_pos += nframes_filtered / t->sr_converter_ratio;
+        return nframes_filtered;
+    }
+
+    sequence_unsilence (t);
+
     // Filling stream buffers
     float level;
     for (j = 0; j < t->channels_num; j++)
@@ -327,7 +540,7 @@ sequence_copy_sample_data (sequence_t * sequence, int track,
             if (mask && ((offset_next == 0) || (offset_next - k >
                                                 mask_env_interval)))
             {
-                if ((*(t->sample_input_pos) == 0)) mask_env = 1;
+                if ((t->sample_input_pos == 0)) mask_env = 1;
                 else if (mask_env < 1)
                 {
                     mask_env += mask_env_delta;
@@ -336,7 +549,7 @@ sequence_copy_sample_data (sequence_t * sequence, int track,
             }
             else
             {
-                if ((*(t->sample_input_pos) == 0)) mask_env = 0;
+                if ((t->sample_input_pos == 0)) mask_env = 0;
                 else if (mask_env > 0)
                 {
                     mask_env -= mask_env_delta;
@@ -344,7 +557,8 @@ sequence_copy_sample_data (sequence_t * sequence, int track,
                 }
             }
 
-            t->buffers[j][k + t->buffers_ofs] = filtered_data[k * t->channels_num + j] * t->volume * mask_env;
+            t->buffers[j][k + t->buffers_ofs] = filtered_data[k * t->channels_num + j] * mask_env
+                    * (t->gain_active ? sequence->gain[k + t->buffers_ofs] : t->volume);
             level = fabsf (filtered_data[k * t->channels_num + j] * mask_env);
             if (level > (*max_level)) (*max_level) = level;
         }
@@ -356,35 +570,27 @@ sequence_copy_sample_data (sequence_t * sequence, int track,
     t->mask_envelope = mask_env;
 
     // Increasing this track's frame counter
-    *(t->sample_input_pos) += nframes_used;
-    *(t->sample_output_pos) += nframes_filtered / t->sr_converter_ratio;
+    t->sample_input_pos += nframes_used;
+    t->sample_output_pos += nframes_filtered / t->sr_converter_ratio;
 
     // Returning the number of frames in the output buffers that really got
     // filled with sample data (versus: zero-filled)
     return nframes_filtered;
 }
 
-/** 
- * zero-fills stream buffers with a length of n frames, for a given track. 
+/**
+ * Fire an event about a track, or a beat, from the audio thread. Private
+ * copies rendered offline have no message queue, and fire nothing.
  */
-static void
-sequence_zero_fill (sequence_t * sequence, int track, unsigned long nframes)
-{
-    int j, k;
-    sequence_track_t *t = sequence->tracks + track;
-
-    for (j = 0; j < t->channels_num; j++)
-        for (k = 0; k < nframes; k++) t->buffers[j][k] = 0;
-
-    t->buffers_ofs += nframes;
-}
-
 static void
 sequence_msg_event_fire_pos (sequence_t *sequence, char *event_name, int beat, int track)
 {
     sequence_position_t pos;
+    if (!sequence->msg)
+        return;
     pos.beat = beat;
     pos.track = track;
+    pos.frame = sequence->frame_time;
     msg_event_fire (sequence->msg, event_name, &pos, sizeof (sequence_position_t), free);
 }
 
@@ -396,6 +602,145 @@ sequence_limit_volume (float volume)
     return volume > max ? max : (volume < min ? min : volume);
 }
 
+/**
+ * Count solo tracks. This is done whenever the tracks or their solo status
+ * change, so that the process loop doesn't need to scan all tracks.
+ */
+static void
+sequence_update_solo (sequence_t *sequence)
+{
+    int i;
+    sequence->solo_num = 0;
+    for (i = 0; i < sequence->tracks_num; i++)
+        if (sequence->tracks[i].solo)
+            sequence->solo_num++;
+}
+
+/**
+ * Start a ramp from a parameter's current value to a target, over length
+ * frames. Returns the value the parameter must be set to, which is the target
+ * when the length is zero.
+ */
+static double
+sequence_ramp_start (sequence_ramp_t *ramp, double from, double to, unsigned long length,
+                     int curve)
+{
+    ramp->target = to;
+    ramp->frames = length;
+    ramp->exponential = (curve == SEQUENCE_RAMP_EXPONENTIAL);
+    if (!length)
+        return to;
+
+    if (ramp->exponential)
+    {
+        if (from < SEQUENCE_RAMP_FLOOR) from = SEQUENCE_RAMP_FLOOR;
+        if (to < SEQUENCE_RAMP_FLOOR) to = SEQUENCE_RAMP_FLOOR;
+        ramp->step = pow (to / from, 1.0 / length);
+    }
+    else
+    {
+        ramp->step = (to - from) / length;
+    }
+    return from;
+}
+
+/**
+ * Advance a ramp by one frame, returning the parameter's new value.
+ */
+static inline double
+sequence_ramp_next (sequence_ramp_t *ramp, double value)
+{
+    if (!ramp->frames)
+        return value;
+    if (!--ramp->frames)
+        return ramp->target;
+    if (ramp->exponential)
+        return (value < SEQUENCE_RAMP_FLOOR ? SEQUENCE_RAMP_FLOOR : value) * ramp->step;
+    return value + ramp->step;
+}
+
+/**
+ * Advance a ramp by several frames at once, for parameters which are only
+ * updated once per cycle.
+ */
+static double
+sequence_ramp_skip (sequence_ramp_t *ramp, double value, unsigned long nframes)
+{
+    if (!ramp->frames)
+        return value;
+    if (nframes >= ramp->frames)
+    {
+        ramp->frames = 0;
+        return ramp->target;
+    }
+    ramp->frames -= nframes;
+    if (ramp->exponential)
+        return (value < SEQUENCE_RAMP_FLOOR ? SEQUENCE_RAMP_FLOOR : value) * pow (ramp->step, nframes);
+    return value + ramp->step * nframes;
+}
+
+/**
+ * Skip to the end of all ramps in progress, for a private copy of a track.
+ */
+static void
+sequence_settle_params (sequence_track_t *t)
+{
+    if (t->volume_ramp.frames)
+        t->volume = t->volume_ramp.target;
+    if (t->mute_ramp.frames)
+        t->mute_gain = t->mute_ramp.target;
+    if (t->pitch_ramp.frames)
+        t->sr_converter_ratio = t->pitch_ramp.target;
+    t->volume_ramp.frames = 0;
+    t->mute_ramp.frames = 0;
+    t->pitch_ramp.frames = 0;
+    if (!t->mute_gain)
+        t->enabled = 0;
+    t->mute_gain = t->enabled;
+    t->gain_active = 0;
+}
+
+/**
+ * Queue a scheduled parameter change, keeping the queue sorted by frame time.
+ * Changes scheduled at the same time are applied in the order they arrive.
+ */
+static void
+sequence_queue_param (sequence_t *sequence, sequence_param_t *param)
+{
+    int i;
+
+    // Reported by sequence_process_events(), not to print from the audio thread
+    if (sequence->params_num == SEQUENCE_PARAMS_SIZE)
+    {
+        __sync_fetch_and_add (&sequence->params_dropped, 1);
+        return;
+    }
+
+    for (i = sequence->params_num; i > 0 && sequence->params[i - 1].frame > param->frame; i--)
+        sequence->params[i] = sequence->params[i - 1];
+    sequence->params[i] = *param;
+    sequence->params_num++;
+}
+
+/**
+ * Move the beat states published by sequence_schedule_hold() to the parameter
+ * queue. This may happen at any time during a cycle.
+ */
+static void
+sequence_receive_holds (sequence_t *sequence)
+{
+    sequence_param_t param;
+
+    if (!sequence->holds)
+        return;
+
+    while (ringbuffer_read_space (sequence->holds) >= sizeof (sequence_param_t))
+    {
+        ringbuffer_read (sequence->holds, (char *) &param, sizeof (sequence_param_t));
+        sequence_queue_param (sequence, &param);
+    }
+}
+
 /**
  * Receive IPC messages.
  */
@@ -403,12 +748,18 @@ static void
 sequence_receive_messages (sequence_t * sequence)
 {
     sequence_msg_t msg;
-    sequence_track_t *t;
+    sequence_track_t *t, *tracks;
     int i, j;
     sample_t *samq;
     float f;
-    int *tl, st;
-    char *mask;
+    int st;
+    bitset_word_t *mask;
+    sequence_freeze_t *freeze;
+    sequence_t *nested;
+    sequence_param_t param;
+
+    // Holds must get their track remapped by the messages which follow them
+    sequence_receive_holds (sequence);
 
     while (msg_receive (sequence->msg, &msg))
     {
@@ -416,25 +767,45 @@ sequence_receive_messages (sequence_t * sequence)
         {
             case SEQUENCE_MSG_RESIZE:
                 sscanf (msg.text, "tracks=%p tracks_num=%d beats_num=%d measure_len=%d",
-                        &(sequence->tracks),
-                        &(sequence->tracks_num),
+                        (void **) &tracks, &i,
                         &(sequence->beats_num),
                         &(sequence->measure_len));
+                /* A new array is a copy made while this thread kept playing:
+                   carry the playback state over, but not the patterns */
+                if (tracks != sequence->tracks)
+                    for (j = 0; j < i && j < sequence->tracks_num; j++)
+                    {
+                        bitset_word_t *beats = tracks[j].beats;
+                        mask = tracks[j].mask;
+                        tracks[j] = sequence->tracks[j];
+                        tracks[j].beats = beats;
+                        tracks[j].mask = mask;
+                    }
+                sequence->tracks = tracks;
+                sequence->tracks_num = i;
+                sequence_update_solo (sequence);
                 break;
-            case SEQUENCE_MSG_LOCK_TRACKS:
-                sscanf (msg.text, "tracks=%p", &tl);
-                while (*tl != -1)
-                    sequence->tracks[*(tl++)].lock = 1;
-                DEBUG ("Tracks locks data received and stored");
-                break;
-            case SEQUENCE_MSG_UNLOCK_TRACKS:
-                sscanf (msg.text, "tracks=%p", &tl);
-                while (*tl != -1)
-                    sequence->tracks[*(tl++)].lock = 0;
+            case SEQUENCE_MSG_REMOVE_TRACK:
+                sscanf (msg.text, "track=%d", &i);
+                memmove (sequence->tracks + i, sequence->tracks + i + 1,
+                         (sequence->tracks_num - i - 1) * sizeof (sequence_track_t));
+                sequence->tracks_num--;
+                for (j = 0; j < sequence->params_num; j++)
+                    if (sequence->params[j].track > i)
+                        sequence->params[j].track--;
+                    else if (sequence->params[j].track == i)
+                        sequence->params[j].track = -1;
+                sequence_update_solo (sequence);
                 break;
             case SEQUENCE_MSG_LOCK_SINGLE_TRACK:
                 sscanf (msg.text, "track=%d", &st);
-                sequence->tracks[st].lock = 1;
+                t = sequence->tracks + st;
+                t->lock = 1;
+                /* Its ports are about to be replaced, and aren't refreshed
+                   anymore: they must not be read until then. */
+                t->silent = 1;
+                for (j = 0; j < t->channels_num; j++)
+                    stream_port_set_silent (sequence->stream, t->channels[j], 1);
                 break;
             case SEQUENCE_MSG_UNLOCK_SINGLE_TRACK:
                 sscanf (msg.text, "track=%d", &st);
@@ -444,8 +815,19 @@ sequence_receive_messages (sequence_t * sequence)
                 sscanf (msg.text, "track=%d sample=%p", &i, &samq);
                 t = sequence->tracks + i;
                 t->sample = samq;
-                *(t->sample_input_pos) = t->sample->frames;
-                *(t->sample_output_pos) = t->sample->frames;
+                t->nested = NULL;
+                t->sample_input_pos = t->sample->frames;
+                t->sample_output_pos = t->sample->frames;
+                t->lock = 0;
+                break;
+            case SEQUENCE_MSG_SET_NESTED:
+                nested = NULL;
+                sscanf (msg.text, "track=%d nested=%p", &i, &nested);
+                t = sequence->tracks + i;
+                t->nested = nested;
+                t->sample = NULL;
+                t->active_beat = -1;
+                t->mask_envelope = 0;
                 t->lock = 0;
                 break;
             case SEQUENCE_MSG_MUTE_TRACK:
@@ -453,6 +835,8 @@ sequence_receive_messages (sequence_t * sequence)
                 if (i >= 0 && i < sequence->tracks_num)
                 {
                     sequence->tracks[i].enabled = !j;
+                    sequence->tracks[i].mute_gain = !j;
+                    sequence->tracks[i].mute_ramp.frames = 0;
                     sequence_msg_event_fire_pos (sequence, "track-mute-changed", 0, i);
                 }
                 break;
@@ -461,6 +845,7 @@ sequence_receive_messages (sequence_t * sequence)
                 if (i >= 0 && i < sequence->tracks_num)
                 {
                     sequence->tracks[i].solo = j;
+                    sequence_update_solo (sequence);
                     sequence_msg_event_fire_pos (sequence, "track-solo-changed", 0, i);
                 }
                 break;
@@ -472,6 +857,24 @@ sequence_receive_messages (sequence_t * sequence)
                 sscanf (msg.text, "track=%d", &i);
                 sequence->tracks[i].mask = NULL;
                 break;
+            case SEQUENCE_MSG_FREEZE_TRACK:
+                sscanf (msg.text, "track=%d freeze=%p", &i, &freeze);
+                sequence->tracks[i].freeze = freeze;
+                sequence_msg_event_fire_pos (sequence, "track-freeze-changed", 0, i);
+                break;
+            case SEQUENCE_MSG_UNFREEZE_TRACK:
+                sscanf (msg.text, "track=%d", &i);
+                t = sequence->tracks + i;
+                t->freeze = NULL;
+                // Live rendering resumes on the next onset
+                if (t->sample)
+                {
+                    t->sample_input_pos = t->sample->frames;
+                    t->sample_output_pos = t->sample->frames;
+                }
+                t->active_beat = -1;
+                sequence_msg_event_fire_pos (sequence, "track-freeze-changed", 0, i);
+                break;
             case SEQUENCE_MSG_ACK_STOP:
                 sequence->status = SEQUENCE_DISABLED;
                 // Not stopping stream
@@ -497,6 +900,14 @@ sequence_receive_messages (sequence_t * sequence)
                         &(sequence->transport_query));
                 msg_event_fire (sequence->msg, "transport-changed", NULL, 0, NULL);
                 break;
+            case SEQUENCE_MSG_SET_FOLLOW:
+                sscanf (msg.text, "follow=%d", &i);
+                sequence->transport_follow = i;
+                // Catching up with the transport on the next cycle
+                sequence->transport_rolling = 0;
+                sequence->transport_synced = 0;
+                msg_event_fire (sequence->msg, "transport-changed", NULL, 0, NULL);
+                break;
             case SEQUENCE_MSG_SET_LOOPING:
                 if (!sequence->looping)
                 {
@@ -533,15 +944,28 @@ sequence_receive_messages (sequence_t * sequence)
                 break;
             case SEQUENCE_MSG_SET_VOLUME:
                 sscanf (msg.text, "track=%d volume=%f", &i, &f);
-                sequence->tracks[i].volume = sequence_limit_volume (f);
+                t = sequence->tracks + i;
+                t->volume = sequence_ramp_start (&t->volume_ramp, t->volume, sequence_limit_volume (f),
+                                                 sequence->framerate * SEQUENCE_PARAM_SMOOTHING / 1000,
+                                                 SEQUENCE_RAMP_LINEAR);
                 sequence_msg_event_fire_pos (sequence, "track-volume-changed", 0, i);
                 break;
             case SEQUENCE_MSG_MUL_VOLUME:
                 sscanf (msg.text, "track=%d ratio=%f", &i, &f);
-                f = sequence->tracks[i].volume * f;
-                sequence->tracks[i].volume = sequence_limit_volume (f);
+                t = sequence->tracks + i;
+                f = (t->volume_ramp.frames ? t->volume_ramp.target : t->volume) * f;
+                t->volume = sequence_ramp_start (&t->volume_ramp, t->volume, sequence_limit_volume (f),
+                                                 sequence->framerate * SEQUENCE_PARAM_SMOOTHING / 1000,
+                                                 SEQUENCE_RAMP_LINEAR);
                 sequence_msg_event_fire_pos (sequence, "track-volume-changed", 0, i);
                 break;
+            case SEQUENCE_MSG_SCHEDULE:
+                sscanf (msg.text, "track=%d type=%d frame=%lu length=%lu value=%lf curve=%d",
+                        &param.track, &param.type, &param.frame, &param.length,
+                        &param.value, &param.curve);
+                param.beat = 0;
+                sequence_queue_param (sequence, &param);
+                break;
             case SEQUENCE_MSG_SET_SMOOTHING:
                 sscanf (msg.text, "track=%d status=%d", &i, &j);
                 sequence->tracks[i].smoothing = j;
@@ -551,6 +975,11 @@ sequence_receive_messages (sequence_t * sequence)
                 sequence_track_t tmp = sequence->tracks[i];
                 sequence->tracks[i]  = sequence->tracks[j];
                 sequence->tracks[j]  = tmp;
+                for (st = 0; st < sequence->params_num; st++)
+                    if (sequence->params[st].track == i)
+                        sequence->params[st].track = j;
+                    else if (sequence->params[st].track == j)
+                        sequence->params[st].track = i;
                 msg_event_fire (sequence->msg, "reordered", NULL, 0, NULL);
                 break;
         }
@@ -560,12 +989,39 @@ sequence_receive_messages (sequence_t * sequence)
 }
 
 /**
- * Compute the duration (number of frames) of a beat. 
+ * Compute the duration of a beat, as a fractional number of frames.
+ */
+static double
+sequence_get_beat_length (sequence_t *sequence)
+{
+    return 60.0 * sequence->framerate / sequence->bpm / sequence->measure_len;
+}
+
+/**
+ * Return the frame at which a beat starts, counting beats from the start of
+ * the sequence, across loops. Each beat starts on the first frame at or after
+ * its exact time, which is computed from the beat index alone, so that
+ * rounding errors never accumulate, whatever the tempo.
+ */
+static unsigned long
+sequence_beat_start (double beat_length, unsigned long beat)
+{
+    return (unsigned long) ceil (beat * beat_length);
+}
+
+/**
+ * Return the index of the beat a frame belongs to, counting beats from the
+ * start of the sequence, across loops.
  */
 static unsigned long
-sequence_get_beat_nframes (sequence_t *sequence)
+sequence_beat_at (double beat_length, unsigned long position)
 {
-    return 60 * sequence->framerate / sequence->bpm / sequence->measure_len;
+    unsigned long beat = position / beat_length;
+    if (sequence_beat_start (beat_length, beat + 1) <= position)
+        beat++;
+    else if (beat && sequence_beat_start (beat_length, beat) > position)
+        beat--;
+    return beat;
 }
 
 /**
@@ -574,235 +1030,859 @@ sequence_get_beat_nframes (sequence_t *sequence)
 static char
 sequence_track_is_playing (sequence_t *sequence, int track)
 {
-    int i;
-    for (i = 0; i < sequence->tracks_num; i++)
-    {
-        if (sequence->tracks[i].solo)
-            break;
-    }
-    if (i < sequence->tracks_num)
+    return sequence->solo_num ? sequence->tracks[track].solo : sequence->tracks[track].enabled;
+}
+
+/**
+ * Copy the stereo mix of a track's nested sequence to the track buffers.
+ *
+ * The gate tells whether the track is audible. It opens and closes with the
+ * same short ramp as masking, to avoid clicks. Returns the peak level of the
+ * copied data, before volume.
+ */
+static float
+sequence_copy_nested_data (sequence_t *sequence, int track, unsigned long nframes, char gate)
+{
+    sequence_track_t *t = sequence->tracks + track;
+    sequence_t *source = t->nested;
+    double delta = 1000.0 / ((double) sequence->framerate * SEQUENCE_MASK_ATTACK_DELAY);
+    double env = t->mask_envelope;
+    float level = 0, value, *input;
+    unsigned long k;
+    int j;
+
+    if (source->mix_silent || (!gate && env == 0))
     {
-        return sequence->tracks[track].solo;
+        t->mask_envelope = gate ? 1 : 0;
+        sequence_zero_fill (sequence, track, nframes);
+        return 0;
     }
-    else
+
+    sequence_unsilence (t);
+    for (j = 0; j < t->channels_num; j++)
     {
-        return sequence->tracks[track].enabled;
+        env = t->mask_envelope;
+        input = source->mix[j % 2] + t->buffers_ofs;
+        for (k = 0; k < nframes; k++)
+        {
+            if (gate)
+            {
+                if ((env += delta) > 1) env = 1;
+            }
+            else if ((env -= delta) < 0)
+            {
+                env = 0;
+            }
+            value = input[k] * env;
+            t->buffers[j][t->buffers_ofs + k] = value
+                    * (t->gain_active ? sequence->gain[t->buffers_ofs + k] : t->volume);
+            if (fabsf (value) > level) level = fabsf (value);
+        }
     }
+
+    t->mask_envelope = env;
+    t->buffers_ofs += nframes;
+    return level;
 }
 
 /**
- * Perform sequencing.
+ * Return the state of a beat, or of its mask if type is SEQUENCE_PARAM_MASK,
+ * as it is at the start of the segment being played. This is the state held
+ * by the earliest pending change to this beat if any, or the grid content.
+ *
+ * The grid is read first: holds are published before the grid changes, so
+ * that a hold is always received here if the change it covers is seen.
  */
-static unsigned long
-sequence_do_process (sequence_t *sequence, unsigned long position, unsigned long nframes)
+static char
+sequence_test_beat (sequence_t *sequence, int track, int type, int beat)
 {
+    sequence_track_t *t = sequence->tracks + track;
+    unsigned long frame = sequence->frame_time + t->buffers_ofs;
+    sequence_param_t *p;
+    char state;
     int i;
-    int current_beat;
-    int previous_beat;
-    int current_offset;
-    unsigned long beat_nframes; // should be a double ?
-    unsigned long footer = 0;
-    int beat_trigger = 0;
 
-    beat_nframes = sequence_get_beat_nframes (sequence);
+    state = BITSET_TEST (type == SEQUENCE_PARAM_MASK ? t->mask : t->beats, beat);
+    __sync_synchronize ();
+    sequence_receive_holds (sequence);
+
+    for (i = 0; i < sequence->params_num; i++)
+    {
+        p = sequence->params + i;
+        if (p->frame > frame && p->type == type && p->track == track && p->beat == beat)
+            return (char) p->value;
+    }
+
+    return state;
+}
+
+#define sequence_test_mask(sequence, track, beat) \
+    (((beat) < (sequence)->beats_num && (sequence)->tracks[track].mask != NULL) \
+     ? sequence_test_beat (sequence, track, SEQUENCE_PARAM_MASK, beat) : 1)
 
-    current_beat = position / beat_nframes;
-    current_offset = position % beat_nframes;
+/**
+ * Play a frozen track, by copying its rendered loop at the current position.
+ * The frames to play must all belong to the given beat, counted across loops.
+ *
+ * Onsets still fire beat-on and beat-off events, but a beat stays active
+ * until the next onset, since the rendered tail of a sample isn't tracked.
+ * Returns the level of the current beat.
+ */
+static float
+sequence_play_frozen (sequence_t *sequence, int track, unsigned long position,
+                      unsigned long nframes, char playing, int beat_trigger,
+                      unsigned long beat)
+{
+    sequence_track_t *t = sequence->tracks + track;
+    sequence_freeze_t *freeze = t->freeze;
+    int current_beat = beat % sequence->beats_num;
+    unsigned long ofs;
+    int j;
 
-    if (sequence->looping)
+    if (beat_trigger && sequence_test_beat (sequence, track, SEQUENCE_PARAM_BEAT, current_beat))
     {
-        if (current_offset == 0) beat_trigger = 1;
-        else if (current_offset + nframes > beat_nframes)
+        if (playing)
         {
-            current_beat++;
-            footer = beat_nframes - current_offset;
-            current_offset = 0;
-            beat_trigger = 1;
+            if (t->active_beat != -1)
+                sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, track);
+            sequence_msg_event_fire_pos (sequence, "beat-on", current_beat, track);
         }
-
-        if (current_beat >= sequence->beats_num)
-            current_beat = current_beat % sequence->beats_num;
-    }
-    else if (current_beat < sequence->beats_num && current_offset == 0)
-    {
-        beat_trigger = 1;
+        t->active_beat = current_beat;
     }
-    else if (current_offset + nframes > beat_nframes && current_beat <
-             (sequence->beats_num - 1))
+
+    if (!playing || freeze->channels_num != t->channels_num)
     {
-        current_beat++;
-        footer = beat_nframes - current_offset;
-        current_offset = 0;
-        beat_trigger = 1;
+        sequence_zero_fill (sequence, track, nframes);
+        return 0;
     }
 
-    sequence_track_t *t;
-    char mask;
-    unsigned long nframes_played = 0;
-    unsigned long nframes_copied, n;
-    for (i = 0; i < sequence->tracks_num; i++)
-    {
-        t = sequence->tracks + i;
-        if (!t->lock)
-        {
-            float current_level = 0;
-            char playing        = sequence_track_is_playing (sequence, i);
-            if (t->sample != NULL)
-            {
-                t->buffers_ofs = 0;
-                nframes_copied = 0;
-                if (beat_trigger)
-                {
-                    previous_beat = (current_beat > 0)
-                            ? current_beat - 1 : sequence->beats_num - 1;
-                    mask = (t->mask) ? t->mask[previous_beat] : 1;
-                    nframes_copied = sequence_copy_sample_data (sequence, i, footer,
-                                                                mask & playing, footer, &current_level);
+    // Loops may be a frame shorter than the rendered one, never longer
+    ofs = position - sequence_beat_start (freeze->beat_length, beat - current_beat);
+    if (ofs + nframes > freeze->nframes)
+        ofs = freeze->nframes - nframes;
 
-                    if ((!nframes_copied) && (t->active_beat != -1))
-                    {
-                        if (playing)
-                            sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, i);
+    sequence_unsilence (t);
+    for (j = 0; j < t->channels_num; j++)
+        memcpy (t->buffers[j] + t->buffers_ofs, freeze->data[j] + ofs, nframes * sizeof (float));
+    t->buffers_ofs += nframes;
 
-                        t->active_beat = -1;
-                    }
+    return freeze->levels[current_beat];
+}
 
-                    if (t->beats[current_beat])
-                    {
-                        if (playing)
-                        {
-                            if (t->active_beat != -1)
-                            {
-                                sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, i);
-                            }
-
-                            sequence_msg_event_fire_pos (sequence, "beat-on", current_beat, i);
-                        }
-                        *(t->sample_input_pos) = 0;
-                        *(t->sample_output_pos) = 0;
-                        t->active_beat = current_beat;
-                    }
-                }
+/**
+ * Restart a nested sequence from its first beat, on an onset of a track which
+ * uses it, offset frames into the current cycle. The source has already been
+ * rendered for this cycle, so it is located from the next one on, to where it
+ * would be had it restarted at the onset.
+ */
+static void
+sequence_trigger_nested (sequence_t *source, unsigned long offset)
+{
+    if (source->snapshot.playing)
+        source->trigger_offset += source->snapshot.position + offset;
+}
 
-                // Looking up next active beat
-                int dist;
-                if ((!t->smoothing) || t->active_beat == -1) dist = -1;
-                else
-                {
-                    for (dist = 1;
-                         (current_beat + dist < sequence->beats_num)
-                         && (!t->beats[current_beat + dist]);
-                         dist++)
-                        ;
-                    if (current_beat + dist == sequence->beats_num)
-                    {
-                        if (!sequence->looping) dist = -1;
-                        else
-                        {
-                            for ( ; (dist <= sequence->beats_num)
-                                 && (!t->beats[current_beat + dist - sequence->beats_num]);
-                                 dist++)
-                                ;
-                            if (!t->beats[current_beat + dist - sequence->beats_num])
-                                dist = -1;
-                        }
-                    }
-                }
+/**
+ * Play a track which uses another sequence as its source, over frames which
+ * all belong to the current beat. Returns the level of the played data.
+ */
+static float
+sequence_play_nested (sequence_t *sequence, int track, unsigned long nframes,
+                      char playing, int beat_trigger, int current_beat)
+{
+    sequence_track_t *t = sequence->tracks + track;
+    char mask, gate;
+    float level;
 
-                long unsigned int offset_next = 0;
-                if (dist != -1)
-                {
-                    offset_next = beat_nframes - current_offset + (dist - 1) * beat_nframes;
-                }
+    if (beat_trigger)
+    {
+        if (playing && t->active_beat != -1)
+            sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, track);
 
-                if ((t->active_beat != -1) && (!t->beats[t->active_beat]))
-                {
-                    *(t->sample_input_pos) = t->sample->frames;
-                    *(t->sample_output_pos) = t->sample->frames;
-                    // FIXME: What if there is no sr_converter because we're using the 
-                    // SEQUENCE_LINEAR one ?
-                    if (t->sr_converter != NULL) src_reset (t->sr_converter);
-                }
+        if (sequence_test_beat (sequence, track, SEQUENCE_PARAM_BEAT, current_beat))
+        {
+            if (playing)
+            {
+                sequence_msg_event_fire_pos (sequence, "beat-on", current_beat, track);
+                sequence_trigger_nested (t->nested, t->buffers_ofs);
+            }
+            t->active_beat = current_beat;
+        }
+        else
+        {
+            t->active_beat = -1;
+        }
+    }
+    else if (t->active_beat != -1
+             && (current_beat >= sequence->beats_num
+                 || !sequence_test_beat (sequence, track, SEQUENCE_PARAM_BEAT, t->active_beat)))
+    {
+        if (playing)
+            sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, track);
+        t->active_beat = -1;
+    }
 
-                mask = ((current_beat < sequence->beats_num) && (t->mask != NULL))
-                        ? t->mask[current_beat] : 1;
+    mask = sequence_test_mask (sequence, track, current_beat);
+    gate = (t->active_beat != -1) && mask && playing;
+    level = sequence_copy_nested_data (sequence, track, nframes, gate);
 
-                n = sequence_copy_sample_data (sequence, i, nframes - footer,
-                                               mask & playing, offset_next, &current_level);
+    t->active_mask_beat = ((t->active_beat != -1) && t->mask && mask) ? current_beat : -1;
+    return level;
+}
 
-                if ((!n) && (t->active_beat != -1))
-                {
-                    if (playing)
-                        sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, i);
-                    t->active_beat = -1;
-                }
+/**
+ * Play a track's sample, over frames which all belong to the given beat,
+ * counted across loops. Returns the number of frames which received sample
+ * data, and raises max_level to the level of the played data.
+ */
+static unsigned long
+sequence_play_sample (sequence_t *sequence, int track, unsigned long position,
+                      unsigned long nframes, char playing, int beat_trigger,
+                      int current_beat, unsigned long beat, double beat_length,
+                      float *max_level)
+{
+    sequence_track_t *t = sequence->tracks + track;
+    unsigned long n, offset_next = 0;
+    int dist = -1, next;
+    char mask;
+
+    if (beat_trigger && sequence_test_beat (sequence, track, SEQUENCE_PARAM_BEAT, current_beat))
+    {
+        if (playing)
+        {
+            if (t->active_beat != -1)
+            {
+                sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, track);
+            }
+
+            sequence_msg_event_fire_pos (sequence, "beat-on", current_beat, track);
+        }
+        t->sample_input_pos = 0;
+        t->sample_output_pos = 0;
+        t->active_beat = current_beat;
+    }
+
+    // Looking up next active beat
+    if (t->smoothing && t->active_beat != -1)
+    {
+        next = bitset_next (t->beats, sequence->beats_num, current_beat + 1);
+        if (next != -1)
+            dist = next - current_beat;
+        else if (sequence->looping
+                 && (next = bitset_next (t->beats, sequence->beats_num, 0)) != -1)
+            dist = next + sequence->beats_num - current_beat;
+    }
+
+    if (dist != -1)
+        offset_next = sequence_beat_start (beat_length, beat + dist) - position;
+
+    if ((t->active_beat != -1)
+        && (!sequence_test_beat (sequence, track, SEQUENCE_PARAM_BEAT, t->active_beat)))
+    {
+        t->sample_input_pos = t->sample->frames;
+        t->sample_output_pos = t->sample->frames;
+        // FIXME: What if there is no sr_converter because we're using the 
+        // SEQUENCE_LINEAR one ?
+        if (t->sr_converter != NULL) src_reset (t->sr_converter);
+    }
+
+    mask = sequence_test_mask (sequence, track, current_beat);
+
+    n = sequence_copy_sample_data (sequence, track, nframes, mask & playing,
+                                   offset_next, max_level);
+
+    if ((!n) && (t->active_beat != -1))
+    {
+        if (playing)
+            sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, track);
+        t->active_beat = -1;
+    }
+
+    t->active_mask_beat = ((t->active_beat != -1) && t->mask && mask
+                           && (current_beat < sequence->beats_num)) ? current_beat : -1;
+    return n;
+}
+
+/**
+ * Play a track which has no sample, by only firing beat events. Returns 1
+ * when an onset is triggered, 0 otherwise.
+ */
+static float
+sequence_play_empty (sequence_t *sequence, int track, unsigned long nframes,
+                     char playing, int beat_trigger, int current_beat)
+{
+    sequence_track_t *t = sequence->tracks + track;
+    float level = 0;
+
+    if (beat_trigger && playing)
+    {
+        if (t->active_beat != -1)
+        {
+            sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, track);
+        }
+
+        if (sequence_test_beat (sequence, track, SEQUENCE_PARAM_BEAT, current_beat))
+        {
+            t->active_beat = current_beat;
+            level = 1;
+            sequence_msg_event_fire_pos (sequence, "beat-on", current_beat, track);
+        }
+        else
+        {
+            t->active_beat = -1;
+        }
+    }
 
-                nframes_copied += n;
-                if (nframes_copied > nframes_played) nframes_played = nframes_copied;
+    sequence_zero_fill (sequence, track, nframes);
+    return level;
+}
+
+/**
+ * Advance a track's volume and mute ramps over some frames of the current
+ * cycle, rendering the resulting gain envelope if gain isn't NULL.
+ */
+static void
+sequence_render_gain (sequence_track_t *t, float *gain, unsigned long from, unsigned long to)
+{
+    unsigned long k;
+    for (k = from; k < to; k++)
+    {
+        if (gain)
+            gain[k] = t->volume * t->mute_gain;
+        t->volume = sequence_ramp_next (&t->volume_ramp, t->volume);
+        t->mute_gain = sequence_ramp_next (&t->mute_ramp, t->mute_gain);
+    }
+}
+
+/**
+ * Apply the volume and mute changes which are due during the current cycle
+ * to a track, each at the exact frame it is scheduled at, or at the start of
+ * the cycle if late.
+ *
+ * While the track gain changes, its envelope is rendered into gain and
+ * gain_active is set, so that the copy functions apply it frame by frame.
+ * With gain set to NULL, ramps are only advanced, as when the sequence is
+ * stopped.
+ */
+static void
+sequence_run_track_params (sequence_t *sequence, int track, unsigned long nframes, float *gain)
+{
+    sequence_track_t *t = sequence->tracks + track;
+    unsigned long end = sequence->frame_time + nframes;
+    unsigned long ofs = 0, at;
+    sequence_param_t *p;
+    int i, due = 0;
+
+    for (i = 0; i < sequence->params_num && sequence->params[i].frame < end; i++)
+        if (sequence->params[i].track == track
+            && (sequence->params[i].type == SEQUENCE_PARAM_VOLUME
+                || sequence->params[i].type == SEQUENCE_PARAM_MUTE))
+            due = 1;
+
+    t->gain_active = due || t->volume_ramp.frames || t->mute_ramp.frames;
+    if (!t->gain_active)
+        return;
+
+    for (i = 0; i < sequence->params_num && sequence->params[i].frame < end; i++)
+    {
+        p = sequence->params + i;
+        if (p->track != track)
+            continue;
 
-                t->active_mask_beat = ((t->active_beat != -1) && t->mask && mask
-                                       && (current_beat < sequence->beats_num)) ? current_beat : -1;
+        at = (p->frame > sequence->frame_time) ? p->frame - sequence->frame_time : 0;
+        if (p->type == SEQUENCE_PARAM_VOLUME)
+        {
+            sequence_render_gain (t, gain, ofs, at);
+            ofs = at;
+            t->volume = sequence_ramp_start (&t->volume_ramp, t->volume,
+                                             sequence_limit_volume (p->value), p->length, p->curve);
+            sequence_msg_event_fire_pos (sequence, "track-volume-changed", 0, track);
+        }
+        else if (p->type == SEQUENCE_PARAM_MUTE)
+        {
+            sequence_render_gain (t, gain, ofs, at);
+            ofs = at;
+            // Muted tracks have a zero gain, which rises again once unmuted
+            if (!p->value && !t->enabled)
+            {
+                t->enabled = 1;
+                sequence_msg_event_fire_pos (sequence, "track-mute-changed", 0, track);
             }
-            else
+            t->mute_gain = sequence_ramp_start (&t->mute_ramp, t->mute_gain, p->value ? 0 : 1,
+                                                p->length, p->curve);
+        }
+    }
+    sequence_render_gain (t, gain, ofs, nframes);
+
+    if (t->enabled && !t->mute_gain && !t->mute_ramp.frames)
+    {
+        t->enabled = 0;
+        sequence_msg_event_fire_pos (sequence, "track-mute-changed", 0, track);
+    }
+}
+
+/**
+ * Apply the pitch and tempo changes which are due during the current cycle,
+ * and advance pitch ramps. These parameters only change once per cycle.
+ */
+static void
+sequence_run_params (sequence_t *sequence, unsigned long nframes)
+{
+    unsigned long end = sequence->frame_time + nframes;
+    sequence_param_t *p;
+    sequence_track_t *t;
+    int i;
+
+    for (i = 0; i < sequence->params_num && sequence->params[i].frame < end; i++)
+    {
+        p = sequence->params + i;
+        if (p->type == SEQUENCE_PARAM_BPM)
+        {
+            if (p->value > 0 && p->value <= 1000)
             {
-                if (beat_trigger && playing)
-                {
-                    if (t->active_beat != -1)
-                    {
-                        sequence_msg_event_fire_pos (sequence, "beat-off", t->active_beat, i);
-                    }
+                sequence->bpm = p->value;
+                msg_event_fire (sequence->msg, "bpm-changed", NULL, 0, NULL);
+            }
+        }
+        else if (p->type == SEQUENCE_PARAM_PITCH && p->track >= 0 && p->track < sequence->tracks_num
+                 && !sequence->tracks[p->track].lock)
+        {
+            t = sequence->tracks + p->track;
+            t->sr_converter_ratio = sequence_ramp_start (&t->pitch_ramp, t->sr_converter_ratio,
+                                                         p->value, p->length, p->curve);
+            sequence_msg_event_fire_pos (sequence, "track-pitch-changed", 0, p->track);
+        }
+    }
 
-                    if (t->beats[current_beat] && playing)
-                    {
-                        t->active_beat = current_beat;
-                        current_level = 1;
-                        sequence_msg_event_fire_pos (sequence, "beat-on", current_beat, i);
-                    }
-                    else
-                    {
-                        t->active_beat = -1;
-                        current_level = 0;
-                    }
-                }
+    for (i = 0; i < sequence->tracks_num; i++)
+    {
+        t = sequence->tracks + i;
+        if (t->pitch_ramp.frames && !t->lock)
+            t->sr_converter_ratio = sequence_ramp_skip (&t->pitch_ramp, t->sr_converter_ratio, nframes);
+    }
+}
 
-                sequence_zero_fill (sequence, i, nframes);
+/**
+ * Remove the changes which were due during the current cycle from the queue,
+ * except those of locked tracks, which are applied once unlocked.
+ */
+static void
+sequence_drop_params (sequence_t *sequence, unsigned long nframes)
+{
+    unsigned long end = sequence->frame_time + nframes;
+    sequence_param_t *p;
+    int i, n = 0;
 
+    for (i = 0; i < sequence->params_num; i++)
+    {
+        p = sequence->params + i;
+        if (p->frame >= end || (p->track >= 0 && p->track < sequence->tracks_num
+                                && sequence->tracks[p->track].lock))
+            sequence->params[n++] = *p;
+    }
+    sequence->params_num = n;
+}
+
+/**
+ * Perform sequencing.
+ *
+ * Each track is played in segments which never span a beat boundary, so that
+ * any number of onsets may fall within a single buffer, each one on the frame
+ * at which its beat starts. Returns the number of frames which received some
+ * data, for the track which received the most.
+ */
+static unsigned long
+sequence_do_process (sequence_t *sequence, unsigned long position, unsigned long nframes)
+{
+    int i;
+    int current_beat;
+    int beat_trigger;
+    double beat_length = sequence_get_beat_length (sequence);
+    unsigned long end = position + nframes;
+    unsigned long pos, len, beat, beat_start, next_start;
+    unsigned long nframes_played = 0, nframes_copied;
+
+    sequence_track_t *t;
+    char playing, frozen;
+    float current_level, level;
+    for (i = 0; i < sequence->tracks_num; i++)
+    {
+        t = sequence->tracks + i;
+        if (t->lock)
+            continue;
+
+        sequence_run_track_params (sequence, i, nframes, sequence->gain);
+        playing = sequence_track_is_playing (sequence, i);
+        frozen = t->freeze && sequence->looping && t->freeze->beat_length == beat_length
+                && !t->gain_active;
+        current_level = 0;
+        nframes_copied = 0;
+        sequence_reset_buffers (t);
+
+        for (pos = position; pos < end; pos += len)
+        {
+            beat = sequence_beat_at (beat_length, pos);
+            beat_start = sequence_beat_start (beat_length, beat);
+            next_start = sequence_beat_start (beat_length, beat + 1);
+            len = (next_start < end ? next_start : end) - pos;
+
+            if (sequence->looping)
+            {
+                current_beat = beat % sequence->beats_num;
+                beat_trigger = (pos == beat_start);
+            }
+            else
+            {
+                current_beat = beat < sequence->beats_num ? beat : sequence->beats_num;
+                beat_trigger = (pos == beat_start) && (beat < sequence->beats_num);
+            }
+
+            level = 0;
+            if (frozen)
+            {
+                level = sequence_play_frozen (sequence, i, pos, len, playing, beat_trigger, beat);
+                if (playing)
+                    nframes_copied += len;
+            }
+            else if (t->nested)
+            {
+                level = sequence_play_nested (sequence, i, len, playing, beat_trigger, current_beat);
+            }
+            else if (t->sample != NULL)
+            {
+                nframes_copied += sequence_play_sample (sequence, i, pos, len, playing, beat_trigger,
+                                                        current_beat, beat, beat_length, &level);
             }
-            t->current_level = current_level;
+            else
+            {
+                level = sequence_play_empty (sequence, i, len, playing, beat_trigger, current_beat);
+            }
+
+            if (level > current_level)
+                current_level = level;
         }
+
+        if (nframes_copied > nframes_played)
+            nframes_played = nframes_copied;
+        t->current_level = current_level;
     }
 
     return nframes_played;
 }
 
 /**
- * Process a given number of frames
+ * Start, stop and adopt the tempo of the stream transport, as reported for
+ * the current cycle. Start and stop only happen when the transport state
+ * changes, so that the sequence can still be controlled while it is stopped.
+ */
+static void
+sequence_follow_transport (sequence_t *sequence, stream_transport_t *transport)
+{
+    if (transport->rolling != sequence->transport_rolling)
+    {
+        sequence->transport_rolling = transport->rolling;
+        sequence->status = transport->rolling ? SEQUENCE_ENABLED : SEQUENCE_DISABLED;
+    }
+
+    if (transport->bbt_valid && (transport->bpm > 0) && (transport->bpm <= 1000)
+        && (fabs (transport->bpm - sequence->bpm) > 0.001))
+    {
+        sequence->bpm = transport->bpm;
+        msg_event_fire (sequence->msg, "bpm-changed", NULL, 0, NULL);
+    }
+}
+
+/**
+ * Map a transport position to the position of a sequence which was restarted
+ * by sequence_trigger_nested(). The offset is dropped once the transport goes
+ * back past the onset.
+ */
+static unsigned long
+sequence_apply_trigger_offset (sequence_t *sequence, unsigned long position)
+{
+    if (position < sequence->trigger_offset)
+        sequence->trigger_offset = 0;
+    return position - sequence->trigger_offset;
+}
+
+/**
+ * Compute the sequence position for the current cycle.
  *
- * This is the stream callback function.
+ * When following a transport which provides bars and beats, the position is
+ * anchored to them when playback starts or the transport jumps, so that the
+ * pattern stays aligned with the transport whatever the tempo changes it went
+ * through. Otherwise, it just advances cycle after cycle: ticks are integers,
+ * so that positions derived from them jitter by several frames, and locating
+ * again on every cycle would restart all samples. The anchor is then only
+ * followed again if it drifts away by more than a couple of ticks, such as
+ * after a tempo change.
+ *
+ * A nested sequence counts from the last onset which restarted it.
  */
-static int
-sequence_process (unsigned long nframes, void *data)
+static unsigned long
+sequence_get_transport_position (sequence_t *sequence, stream_transport_t *transport)
+{
+    double beats, beat_length, tolerance;
+    long anchor;
+
+    if (!sequence->transport_follow || !transport->bbt_valid
+        || (transport->beats_per_bar <= 0) || (transport->ticks_per_beat <= 0))
+        return sequence_apply_trigger_offset (sequence, transport->frame);
+
+    beat_length = sequence->measure_len * sequence_get_beat_length (sequence);
+    beats = (transport->bar - 1) * transport->beats_per_bar + transport->beat - 1
+            + transport->tick / transport->ticks_per_beat;
+    anchor = (long) ceil (beats * beat_length)
+             + (long) (transport->frame - transport->bbt_frame);
+    if (anchor < 0)
+        anchor = 0;
+    anchor = sequence_apply_trigger_offset (sequence, anchor);
+
+    if (sequence->transport_synced && (transport->frame == sequence->transport_next_frame))
+    {
+        tolerance = 2 * beat_length / transport->ticks_per_beat + 1;
+        if (fabs ((double) anchor - (double) sequence->next_position) <= tolerance)
+            return sequence->next_position;
+    }
+
+    return anchor;
+}
+
+/**
+ * Jump to another position, as when the transport gets relocated.
+ *
+ * Samples which would be playing at this position, had it been reached
+ * without jumping, resume at the corresponding offset. Other tracks are
+ * silenced until their next onset.
+ */
+static void
+sequence_locate (sequence_t *sequence, unsigned long position)
 {
+    int i, last, onset;
+    double beat_length;
+    unsigned long beat, loop_start, onset_beat, offset, elapsed, input_pos;
+    sequence_track_t *t;
+
+    beat_length = sequence_get_beat_length (sequence);
+    beat = sequence_beat_at (beat_length, position);
+    offset = position - sequence_beat_start (beat_length, beat);
+    loop_start = sequence->looping ? beat - beat % sequence->beats_num : 0;
+    last = (beat - loop_start < sequence->beats_num) ? beat - loop_start : sequence->beats_num - 1;
+
+    for (i = 0; i < sequence->tracks_num; i++)
+    {
+        t = sequence->tracks + i;
+        if (t->lock)
+            continue;
+
+        if (t->nested)
+        {
+            t->active_beat = (beat - loop_start == last && BITSET_TEST (t->beats, last)) ? last : -1;
+            continue;
+        }
+
+        t->active_beat = -1;
+        if (!t->sample)
+            continue;
+
+        t->sample_input_pos = t->sample->frames;
+        t->sample_output_pos = t->sample->frames;
+
+        if ((onset = bitset_prev (t->beats, last)) != -1)
+            onset_beat = loop_start + onset;
+        else if (loop_start && (onset = bitset_prev (t->beats, sequence->beats_num - 1)) != -1)
+            // Still ringing from the previous loop
+            onset_beat = loop_start - sequence->beats_num + onset;
+        else
+            continue;
+
+        // Onsets at the exact position are triggered by sequence_do_process()
+        if (onset_beat == beat && !offset)
+            continue;
+
+        elapsed = position - sequence_beat_start (beat_length, onset_beat);
+        input_pos = elapsed / t->sr_converter_ratio;
+        if (input_pos < t->sample->frames)
+        {
+            t->sample_input_pos = input_pos;
+            t->sample_output_pos = input_pos;
+            t->active_beat = onset;
+            if (t->sr_converter != NULL) src_reset (t->sr_converter);
+        }
+    }
+}
+
+/**
+ * Mix all tracks down to stereo, for the tracks which use this sequence as
+ * their source.
+ */
+static void
+sequence_mix_nested (sequence_t *sequence, unsigned long nframes)
+{
+    int i, j;
+    unsigned long k;
+    float *input;
+
+    sequence->mix_silent = 1;
+    for (i = 0; i < sequence->tracks_num; i++)
+    {
+        sequence_track_t *t = sequence->tracks + i;
+        if (t->lock || t->silent || !t->channels_num)
+            continue;
+
+        if (sequence->mix_silent)
+        {
+            memset (sequence->mix[0], 0, nframes * sizeof (float));
+            memset (sequence->mix[1], 0, nframes * sizeof (float));
+            sequence->mix_silent = 0;
+        }
+
+        for (j = 0; j < 2; j++)
+        {
+            input = t->buffers[j % t->channels_num];
+            for (k = 0; k < nframes; k++)
+                sequence->mix[j][k] += input[k];
+        }
+    }
+}
+
+/**
+ * Publish the sequence state at the end of a cycle, for readers which must
+ * not lock the sequence. The serial is odd while the snapshot is written.
+ */
+static void
+sequence_write_snapshot (sequence_t *sequence, unsigned long nframes, int playing,
+                         unsigned long position)
+{
+    sequence_snapshot_t *snapshot = &sequence->snapshot;
+    unsigned long beat;
     int i;
-    sequence_t *sequence = (sequence_t *) data;
+
+    sequence->snapshot_serial++;
+    __sync_synchronize ();
+
+    snapshot->frame_time = sequence->frame_time;
+    snapshot->nframes = nframes;
+    snapshot->playing = playing;
+    snapshot->position = position;
+    snapshot->beat = -1;
+    if (playing)
+    {
+        beat = sequence_beat_at (sequence_get_beat_length (sequence), position);
+        if (sequence->looping)
+            snapshot->beat = beat % sequence->beats_num;
+        else if (beat < sequence->beats_num)
+            snapshot->beat = beat;
+    }
+    snapshot->bpm = sequence->bpm;
+    snapshot->process_time = sequence->process_time;
+    snapshot->tracks_num = sequence->tracks_num;
+    snapshot->params_dropped = sequence->params_dropped;
+    for (i = 0; i < sequence->tracks_num; i++)
+        sequence->snapshot_levels[i] = (playing && !sequence->tracks[i].lock)
+                ? sequence->tracks[i].current_level : 0;
+
+    __sync_synchronize ();
+    sequence->snapshot_serial++;
+}
+
+/**
+ * Render the tracks of a sequence into their stream buffers, unless this has
+ * already been done during the current cycle.
+ *
+ * The sequences which tracks use as their sources are rendered first, so that
+ * each sequence is rendered exactly once per cycle, however many tracks use
+ * it, and whatever the order in which the stream runs processes. Sources
+ * can't depend on their users, so this always terminates.
+ */
+static void
+sequence_render (sequence_t *sequence, unsigned long nframes, unsigned long cycle)
+{
+    int i, j;
+    unsigned long long start;
+    unsigned long position = 0;
+    int playing = 0;
+    stream_transport_t transport;
+
+    if (sequence->cycle == cycle)
+        return;
+    sequence->cycle = cycle;
+
+    epoch_advance (sequence->epoch);
     sequence_receive_messages (sequence);
 
-    if (!sequence->tracks_num) return 0;
+    for (i = 0; i < sequence->tracks_num; i++)
+        if (sequence->tracks[i].nested && !sequence->tracks[i].lock)
+            sequence_render (sequence->tracks[i].nested, nframes, cycle);
 
+    start = compat_time_usec ();
     sequence_get_all_buffers (sequence, nframes);
 
-    if (stream_is_started (sequence->stream) && (sequence->status == SEQUENCE_ENABLED))
+    sequence->frame_time = stream_get_frame_time (sequence->stream);
+    sequence_run_params (sequence, nframes);
+
+    stream_get_transport (sequence->stream, &transport);
+    if (sequence->transport_follow)
+        sequence_follow_transport (sequence, &transport);
+
+    if (sequence->tracks_num && transport.rolling
+        && (sequence->status == SEQUENCE_ENABLED))
     {
-        sequence_do_process (sequence, stream_get_position (sequence->stream), nframes);
+        position = sequence_get_transport_position (sequence, &transport);
+        if (position != sequence->next_position)
+            sequence_locate (sequence, position);
+        sequence_do_process (sequence, position, nframes);
+        sequence->next_position = position + nframes;
+        sequence->transport_next_frame = transport.frame + nframes;
+        sequence->transport_synced = 1;
+        playing = 1;
     }
     else
     {
+        sequence->transport_synced = 0;
+        sequence->trigger_offset = 0;
         for (i = 0; i < sequence->tracks_num; i++)
-            if ((sequence->tracks + i)->channels_num && !(sequence->tracks + i)->lock)
+            if (!(sequence->tracks + i)->lock)
             {
-                sequence_zero_fill (sequence, i, nframes);
+                sequence_run_track_params (sequence, i, nframes, NULL);
+                if ((sequence->tracks + i)->channels_num)
+                    sequence_reset_buffers (sequence->tracks + i);
             }
     }
+
+    if (sequence->params_num)
+        sequence_drop_params (sequence, nframes);
+
+    /* Letting the stream driver skip idle ports, locked ones were made silent.
+       A nested sequence is only heard through the tracks which use it. */
+    for (i = 0; i < sequence->tracks_num; i++)
+    {
+        sequence_track_t *t = sequence->tracks + i;
+        if (!t->lock)
+            for (j = 0; j < t->channels_num; j++)
+                stream_port_set_silent (sequence->stream, t->channels[j],
+                                        t->silent || sequence->nested_refs);
+    }
+
+    if (sequence->nested_refs)
+        sequence_mix_nested (sequence, nframes);
+
+    // Smoothed over about a hundred cycles
+    sequence->process_time += ((float) (compat_time_usec () - start) - sequence->process_time) * 0.01f;
+
+    sequence_write_snapshot (sequence, nframes, playing, position);
+}
+
+/**
+ * Process a given number of frames
+ *
+ * This is the stream callback function.
+ */
+static int
+sequence_process (unsigned long nframes, void *data)
+{
+    sequence_t *sequence = (sequence_t *) data;
+    sequence_render (sequence, nframes, stream_get_cycle (sequence->stream));
     return 0;
 }
 
@@ -815,17 +1895,50 @@ static void
 sequence_init (sequence_t * sequence)
 {
     sequence->tracks = NULL;
+    sequence->tracks_info = NULL;
     sequence->tracks_num = 0;
+    sequence->tracks_size = 0;
+    sequence->solo_num = 0;
     sequence->beats_num = 0;
+    sequence->beats_size = 0;
     sequence->measure_len = 0;
     sequence->bpm = 100;
     sequence->status = SEQUENCE_DISABLED;
     sequence->looping = 1;
     sequence->transport_aware = 1;
     sequence->transport_query = 1;
+    sequence->transport_follow = 0;
+    sequence->transport_rolling = 0;
+    sequence->transport_synced = 0;
+    sequence->transport_next_frame = 0;
+    sequence->next_position = 0;
     sequence->framerate = 0;
     sequence->name[0] = '\0';
     sequence->msg = NULL;
+    sequence->epoch = NULL;
+    sequence->freeze_serial = 0;
+    sequence->freeze_pending = 0;
+    sequence->freeze_waiting = 0;
+    sequence->freeze_stamp = 0;
+    sequence->freeze_job = NULL;
+    sequence->cycle = -1;
+    sequence->mix[0] = NULL;
+    sequence->mix[1] = NULL;
+    sequence->mix_silent = 1;
+    sequence->gain = NULL;
+    sequence->frame_time = 0;
+    sequence->params = NULL;
+    sequence->params_num = 0;
+    sequence->params_dropped = 0;
+    sequence->params_dropped_reported = 0;
+    sequence->holds = NULL;
+    sequence->nested_refs = 0;
+    sequence->trigger_offset = 0;
+    sequence->process_time = 0;
+    memset (&sequence->snapshot, 0, sizeof (sequence_snapshot_t));
+    sequence->snapshot_levels = NULL;
+    sequence->snapshot_serial = 0;
+    sequence->snapshot_readers = 0;
     sequence->sr_converter_default_type = SEQUENCE_LINEAR;
     sequence->error = 0;
 
@@ -836,6 +1949,7 @@ sequence_init (sequence_t * sequence)
     event_register (sequence, "track-mute-changed");
     event_register (sequence, "track-solo-changed");
     event_register (sequence, "beat-changed");
+    event_register (sequence, "region-changed");
     event_register (sequence, "beat-on");
     event_register (sequence, "beat-off");
     event_register (sequence, "track-pitch-changed");
@@ -844,23 +1958,27 @@ sequence_init (sequence_t * sequence)
     event_register (sequence, "resized");
     event_register (sequence, "reordered");
     event_register (sequence, "resampler-type-changed");
+    event_register (sequence, "track-freeze-changed");
 }
 
 static void
-sequence_track_init (sequence_track_t *track)
+sequence_track_init (sequence_track_t *track, sequence_track_info_t *info)
 {
     track->beats                = NULL;
     track->mask                 = NULL;
+    track->freeze               = NULL;
+    track->nested               = NULL;
     track->sample               = NULL;
     track->channels             = NULL;
     track->channels_num         = 1;
-    track->sample_input_pos     = NULL;
-    track->sample_output_pos    = NULL;
+    track->sample_input_pos     = 0;
+    track->sample_output_pos    = 0;
     track->buffers              = NULL;
+    track->buffers_ofs          = 0;
+    track->silent               = 1;
     track->active_beat          = -1;
     track->active_mask_beat     = -1;
     track->current_level        = 0;
-    track->name[0]              = '\0';
     track->enabled              = 1;
     track->solo                 = 0;
     track->lock                 = 0;
@@ -868,24 +1986,30 @@ sequence_track_init (sequence_track_t *track)
     track->sr_converter_type    = -1;
     track->sr_converter_buffer  = NULL;
     track->sr_converter_ratio   = 1;
-    track->pitch                = 0;
     track->volume               = 1;
+    track->mute_gain            = 1;
+    track->gain_active          = 0;
+    track->volume_ramp.frames   = 0;
+    track->mute_ramp.frames     = 0;
+    track->pitch_ramp.frames    = 0;
     track->mask_envelope        = 1;
     track->smoothing            = 1;
-    track->level_peak           = 1;
+    info->name[0]               = '\0';
+    info->pitch                 = 0;
+    info->level_peak            = 1;
+    info->sample                = NULL;
+    info->freeze                = NULL;
+    info->freeze_serial         = 0;
+    info->nested                = NULL;
 }
 
 static void
-sequence_destroy_track (sequence_t *sequence, int track, int destroy_beats)
+sequence_destroy_track (sequence_t *sequence, sequence_track_t *t, sequence_track_info_t *info)
 {
-    sequence_track_t *t = sequence->tracks + track;
-
     int j;
     for (j = 0; j < t->channels_num; j++)
         stream_port_remove (sequence->stream, t->channels[j]);
 
-    free (t->sample_input_pos);
-    free (t->sample_output_pos);
     free (t->channels);
     free (t->buffers);
     if (t->sr_converter != NULL)
@@ -896,32 +2020,46 @@ sequence_destroy_track (sequence_t *sequence, int track, int destroy_beats)
         t->sr_converter_buffer = NULL;
     }
 
-    if (destroy_beats)
-    {
-        free (t->beats);
-        if (t->mask) free (t->mask);
-    }
+    free (t->beats);
+    if (t->mask) free (t->mask);
+
+    if (info->sample != NULL)
+        sample_unref (info->sample);
 
-    if (t->sample != NULL)
-        sample_unref (t->sample);
+    if (info->freeze != NULL)
+        free (info->freeze);
+
+    if (info->nested != NULL)
+        __sync_sub_and_fetch (&info->nested->nested_refs, 1);
+}
+
+/**
+ * Drop the reference to a sample which the audio thread has stopped using.
+ * Called by the sequence epoch, in a pool thread.
+ */
+static void
+sequence_release_sample (void *ptr, void *data)
+{
+    sample_release ((sample_t *) ptr);
 }
 
 static char *
-sequence_make_port_name (sequence_t *sequence, sequence_track_t *track, int channel)
+sequence_make_port_name (sequence_t *sequence, sequence_track_t *track,
+                         sequence_track_info_t *info, int channel)
 {
-    char *s = malloc (strlen (sequence->name) + strlen (track->name) + 6);
+    char *s = malloc (strlen (sequence->name) + strlen (info->name) + 6);
 
     switch (track->channels_num)
     {
         case 1:
-            sprintf (s, "%s_%s", sequence->name, track->name);
+            sprintf (s, "%s_%s", sequence->name, info->name);
             break;
         case 2:
-            if (channel == 0) sprintf (s, "%s_%s_L", sequence->name, track->name);
-            else sprintf (s, "%s_%s_R", sequence->name, track->name);
+            if (channel == 0) sprintf (s, "%s_%s_L", sequence->name, info->name);
+            else sprintf (s, "%s_%s_R", sequence->name, info->name);
             break;
         default:
-            sprintf (s, "%s_%s_%d", sequence->name, track->name, channel + 1);
+            sprintf (s, "%s_%s_%d", sequence->name, info->name, channel + 1);
             break;
     }
 
@@ -929,14 +2067,15 @@ sequence_make_port_name (sequence_t *sequence, sequence_track_t *track, int chan
 }
 
 static int
-sequence_register_track (sequence_t *sequence, sequence_track_t *track)
+sequence_register_track (sequence_t *sequence, sequence_track_t *track,
+                         sequence_track_info_t *info)
 {
     int j, flags;
     sequence->error = 0;
 
     for (j = 0; j < track->channels_num; j++)
     {
-        char *name = sequence_make_port_name (sequence, track, j);
+        char *name = sequence_make_port_name (sequence, track, info, j);
         flags = STREAM_OUTPUT;
         if (j == 0)
             flags |= STREAM_LEFT;
@@ -972,7 +2111,7 @@ static long int
 sequence_get_sustain_nframes (sequence_t *sequence)
 {
     int i, j;
-    int beat_nframes = sequence_get_beat_nframes (sequence);
+    double beat_length = sequence_get_beat_length (sequence);
     long int sustain = 0, track_sustain;
 
     for (i = 0; i < sequence->tracks_num; i++)
@@ -981,11 +2120,10 @@ sequence_get_sustain_nframes (sequence_t *sequence)
         if (track->sample)
         {
             long int sample_nframes = track->sample->frames * track->sr_converter_ratio;
-            for (j = sequence->beats_num; (j >= 0) && (!track->beats[j]) ; j--)
-                ;
+            j = bitset_prev (track->beats, sequence->beats_num - 1);
             if (j != -1)
             {
-                track_sustain = sample_nframes - (sequence->beats_num - j) * beat_nframes;
+                track_sustain = sample_nframes - (long int) ((sequence->beats_num - j) * beat_length);
                 if (track_sustain > sustain)
                     sustain = track_sustain;
             }
@@ -994,26 +2132,34 @@ sequence_get_sustain_nframes (sequence_t *sequence)
     return sustain;
 }
 
+/* Add a track's output to an interleaved stereo buffer */
+static void
+sequence_export_add_track (sequence_track_t *track, float *output, int nframes)
+{
+    int j, k;
+
+    if (track->silent)
+        return;
+
+    for (j = 0; j < track->channels_num; j++)
+        for (k = 0; k < nframes; k++)
+            output[k * 2 + (j % 2)] += track->buffers[j][k];
+
+    for ( ; j < 2; j++)
+        for (k = 0; k < nframes; k++)
+            output[k * 2 + j] += track->buffers[j % track->channels_num][k];
+}
+
 void static
 sequence_export_mix (sequence_t *sequence, float *output, int nframes)
 {
-    int i, j, k;
+    int i, k;
 
     for (k = 0; k < nframes * 2; k++)
         output[k] = 0;
 
     for (i = 0; i < sequence->tracks_num; i++)
-    {
-        sequence_track_t *track = sequence->tracks + i;
-
-        for (j = 0; j < track->channels_num; j++)
-            for (k = 0; k < nframes; k++)
-                output[k * 2 + (j % 2)] += track->buffers[j][k];
-
-        for ( ; j < 2; j++)
-            for (k = 0; k < nframes; k++)
-                output[k * 2 + j] += track->buffers[j % track->channels_num][k];
-    }
+        sequence_export_add_track (sequence->tracks + i, output, nframes);
 }
 
 static void
@@ -1034,7 +2180,7 @@ _sequence_track_name_exists (sequence_t *sequence, char *name)
     int i;
     for (i = 0; i < sequence->tracks_num; i++)
     {
-        if (!strcmp ((sequence->tracks + i)->name, name))
+        if (!strcmp ((sequence->tracks_info + i)->name, name))
             return 1;
     }
     return 0;
@@ -1068,9 +2214,41 @@ sequence_event_fire_pos (sequence_t *sequence, char *event_name, int beat, int t
     sequence_position_t *pos = malloc (sizeof (sequence_position_t));
     pos->beat = beat;
     pos->track = track;
+    pos->frame = stream_get_frame_time (sequence->stream);
     event_fire (sequence, event_name, pos, free);
 }
 
+/**
+ * Drop a track freeze, or cancel a pending freeze request, because the track
+ * output is about to change. The audio thread switches back to live rendering,
+ * and the rendered loop is freed once it has stopped reading it.
+ *
+ * Must be called with the sequence locked.
+ */
+static void
+sequence_thaw_track (sequence_t *sequence, int track)
+{
+    sequence_track_info_t *info = sequence->tracks_info + track;
+    info->freeze_serial = 0;
+    if (info->freeze)
+    {
+        sequence_msg_t msg;
+        msg.type = SEQUENCE_MSG_UNFREEZE_TRACK;
+        sprintf (msg.text, "track=%d", track);
+        msg_send (sequence->msg, &msg, 0);
+        epoch_retire (sequence->epoch, info->freeze, NULL, NULL);
+        info->freeze = NULL;
+    }
+}
+
+static void
+sequence_thaw_all (sequence_t *sequence)
+{
+    int i;
+    for (i = 0; i < sequence->tracks_num; i++)
+        sequence_thaw_track (sequence, i);
+}
+
 /*********************************
  *       Public functions        *
  *********************************/
@@ -1088,6 +2266,9 @@ sequence_new (stream_t *stream, char *name, int *error)
     strcpy (sequence->name, name);
 
     sequence->msg = msg_new (4096, sizeof (sequence_msg_t));
+    sequence->epoch = epoch_new ();
+    sequence->params = calloc (SEQUENCE_PARAMS_SIZE, sizeof (sequence_param_t));
+    sequence->holds = ringbuffer_create (SEQUENCE_HOLDS_SIZE);
     sem_init (&sequence->mutex, 0, 1);
 
     if (stream_add_process (sequence->stream, sequence->name, sequence_process,
@@ -1098,6 +2279,9 @@ sequence_new (stream_t *stream, char *name, int *error)
         //shouldn't be cached:
         sequence->framerate = stream_get_sample_rate (sequence->stream);
         DEBUG ("Stream framerate : %ld", sequence->framerate);
+        sequence->mix[0] = calloc (sequence->buffer_size, sizeof (float));
+        sequence->mix[1] = calloc (sequence->buffer_size, sizeof (float));
+        sequence->gain = calloc (sequence->buffer_size, sizeof (float));
     }
     else
     {
@@ -1160,25 +2344,97 @@ sequence_destroy (sequence_t * sequence)
     event_remove_source (sequence);
     if (sequence->pool)
         pool_remove_process (sequence->pool, sequence_process_events, (void *) sequence);
+    if (sequence->freeze_job)
+    {
+        free (sequence->freeze_job->freeze);
+        sequence_freeze_job_destroy (sequence->freeze_job);
+    }
     sem_wait (&sequence->mutex);
     sem_destroy (&sequence->mutex);
     sequence_stop_ack (sequence);
     stream_remove_process (sequence->stream, sequence->name);
     // FIXME: May need to sync in here
     msg_destroy (sequence->msg);
+    ringbuffer_free (sequence->holds);
+    stream_transaction_begin (sequence->stream);
     for (i = 0; i < sequence->tracks_num; i++)
-        sequence_destroy_track (sequence, i, 1);
+        sequence_destroy_track (sequence, sequence->tracks + i, sequence->tracks_info + i);
+    stream_transaction_commit (sequence->stream);
+    epoch_destroy (sequence->epoch);
     if (sequence->tracks != NULL)
         free (sequence->tracks);
+    if (sequence->tracks_info != NULL)
+        free (sequence->tracks_info);
+    free (sequence->mix[0]);
+    free (sequence->mix[1]);
+    free (sequence->gain);
+    free (sequence->params);
+    free (sequence->snapshot_levels);
     free (sequence);
 }
 
+/**
+ * Resize a pattern within its capacity. New steps are either cleared, set
+ * (fill), or repeat the existing ones (duplicate). Steps past the new size
+ * get cleared.
+ *
+ * When growing, the first beats_num steps are left untouched, so that the
+ * audio thread can keep reading them meanwhile. When shrinking, it must have
+ * stopped reading the steps past new_beats_num already.
+ */
+static void
+sequence_resize_pattern (bitset_word_t *pattern, int beats_num, int new_beats_num,
+                         int duplicate, int fill)
+{
+    if (new_beats_num < beats_num)
+        bitset_clear_range (pattern, new_beats_num, beats_num);
+    else if (duplicate && beats_num > 0)
+        bitset_repeat (pattern, new_beats_num, pattern, beats_num);
+    else if (fill)
+        bitset_set_range (pattern, beats_num, new_beats_num);
+}
+
+/**
+ * Return a resized copy of a pattern, with a larger capacity.
+ */
+static bitset_word_t *
+sequence_realloc_pattern (bitset_word_t *pattern, int capacity, int beats_num,
+                          int new_beats_num, int duplicate, int fill)
+{
+    bitset_word_t *copy = bitset_new (capacity);
+    int n = beats_num < new_beats_num ? beats_num : new_beats_num;
+    bitset_copy (copy, 0, pattern, n);
+    sequence_resize_pattern (copy, n, new_beats_num, duplicate, fill);
+    return copy;
+}
+
+static int
+sequence_grow_size (int size, int min, int required)
+{
+    if (size < min)
+        size = min;
+    while (size < required)
+        size *= 2;
+    return size;
+}
+
+/**
+ * Resize the sequence.
+ *
+ * Tracks and patterns are allocated with some spare capacity, which grows
+ * geometrically. As long as it suffices, tracks are added and patterns
+ * resized in place, in the parts of the storage which the audio thread
+ * doesn't read yet. The new dimensions are then published with a single
+ * acknowledged message, after which removed tracks and replaced storage
+ * are reclaimed.
+ */
 int
 sequence_resize (sequence_t * sequence, int tracks_num, int beats_num,
                  int measure_len, int duplicate_beats)
 {
     int i, j;
     sequence_msg_t msg;
+    sequence_track_t *t;
 
     sequence_lock (sequence);
 
@@ -1191,131 +2447,149 @@ sequence_resize (sequence_t * sequence, int tracks_num, int beats_num,
 
     sequence->error = 0;
 
-    /* Asks the audio thread to avoid playing (lock) tracks whose stream ports are
-       about to be unregistered */
-    if (tracks_num < sequence->tracks_num)
-    {
-        int *tl = calloc (sequence->tracks_num - tracks_num + 1, sizeof (int));
-        for (i = tracks_num, j = 0; i < sequence->tracks_num; i++)
-            tl[j++] = i;
-        tl[j] = -1;
-        DEBUG ("Requiring tracks locks");
-        msg.type = SEQUENCE_MSG_LOCK_TRACKS;
-        sprintf (msg.text, "tracks=%p", tl);
-        msg_send (sequence->msg, &msg, MSG_ACK);
-        DEBUG ("Tracks locks ack'ed. Freeing temporary data.");
-        free (tl);
-    }
+    // Rendered loops only stay valid as long as the loop length does
+    if ((sequence->beats_num != beats_num) || (sequence->measure_len != measure_len))
+        sequence_thaw_all (sequence);
 
-    /* Duplicates all tracks data so that we don't interfer with the audio thread */
-    sequence_track_t *new_tracks = calloc (tracks_num, sizeof
-                                           (sequence_track_t));
-    int tn = (sequence->tracks_num > tracks_num) ? tracks_num :
-            sequence->tracks_num;
-    memcpy (new_tracks, sequence->tracks, tn * sizeof (sequence_track_t));
+    sequence_track_t *old_tracks = sequence->tracks;
+    sequence_track_t *new_tracks = old_tracks;
+    int old_tracks_num = sequence->tracks_num;
+    int old_beats_num = sequence->beats_num;
+    int kept = (old_tracks_num < tracks_num) ? old_tracks_num : tracks_num;
+    int realloc_beats = (beats_num > sequence->beats_size);
+    float *old_levels = NULL;
+
+    /* Duplicates the tracks array when it, or the patterns, must grow. The audio
+       thread keeps using the current one until the new one gets published. */
+    if (realloc_beats)
+        sequence->beats_size = sequence_grow_size (sequence->beats_size, BITSET_WORD_BITS,
+                                                   beats_num);
+
+    if (tracks_num > sequence->tracks_size || realloc_beats)
+    {
+        int size = sequence_grow_size (sequence->tracks_size, SEQUENCE_MIN_TRACKS_SIZE, tracks_num);
+        DEBUG ("Reallocating tracks storage: %d tracks, %d beats", size, sequence->beats_size);
+        new_tracks = calloc (size, sizeof (sequence_track_t));
+        memcpy (new_tracks, old_tracks, kept * sizeof (sequence_track_t));
 
-    /* Unregister stream ports and wipes associated tracks data if tracks_num decreases. */
-    sequence_track_t *t;
-    for (i = tracks_num; i < sequence->tracks_num; i++)
-        sequence_destroy_track (sequence, i, 0);
+        /* Metadata isn't shared with the audio thread, it can be reallocated right away */
+        if (size > sequence->tracks_size)
+        {
+            sequence->tracks_info = realloc (sequence->tracks_info, size * sizeof (sequence_track_info_t));
+            sequence->tracks_size = size;
+
+            /* Snapshot readers may still be copying the old levels, see below */
+            old_levels = sequence->snapshot_levels;
+            float *levels = calloc (size, sizeof (float));
+            __sync_synchronize ();
+            sequence->snapshot_levels = levels;
+        }
+    }
+
+    /* Resize the patterns of remaining tracks */
+    for (i = 0; i < kept; i++)
+    {
+        t = new_tracks + i;
+        if (realloc_beats)
+        {
+            t->beats = sequence_realloc_pattern (t->beats, sequence->beats_size, old_beats_num,
+                                                 beats_num, duplicate_beats, 0);
+            if (t->mask)
+                t->mask = sequence_realloc_pattern (t->mask, sequence->beats_size, old_beats_num,
+                                                    beats_num, duplicate_beats, 1);
+        }
+        else if (beats_num > old_beats_num)
+        {
+            sequence_resize_pattern (t->beats, old_beats_num, beats_num, duplicate_beats, 0);
+            if (t->mask)
+                sequence_resize_pattern (t->mask, old_beats_num, beats_num, duplicate_beats, 1);
+        }
+    }
 
     /* Register stream ports and allocate new tracks data if tracks_num increases */
-    for (i = sequence->tracks_num; i < tracks_num; i++)
+    stream_transaction_begin (sequence->stream);
+    for (i = old_tracks_num; i < tracks_num; i++)
     {
         DEBUG ("Initializing track %d", i);
         t = new_tracks + i;
-        sequence_track_init (t);
+        sequence_track_info_t *info = sequence->tracks_info + i;
+        sequence_track_init (t, info);
         t->channels = calloc (t->channels_num, sizeof (stream_port_t *));
         t->buffers = calloc (t->channels_num, sizeof (float *));
-        t->sample_input_pos = malloc (sizeof (unsigned long));
-        *(t->sample_input_pos) = 0;
-        t->sample_output_pos = malloc (sizeof (unsigned long));
-        *(t->sample_output_pos) = 0;
 
         j = i;
-        do sprintf (t->name, "track%d", ++j);
-        while (_sequence_track_name_exists (sequence, t->name));
+        do sprintf (info->name, "track%d", ++j);
+        while (_sequence_track_name_exists (sequence, info->name));
 
-        if (!sequence_register_track (sequence, t))
+        if (!sequence_register_track (sequence, t, info))
         {
             DEBUG ("Couldn't not register track, stopping resize");
             free (t->channels);
             free (t->buffers);
-            free (t->sample_input_pos);
-            free (t->sample_output_pos);
-            if ((tracks_num = i) > 0)
-            {
-                new_tracks = realloc (new_tracks, tracks_num * sizeof (sequence_track_t));
-            }
-            else
-            {
-                free (new_tracks);
-                new_tracks = NULL;
-            }
+            tracks_num = i;
             break;
         }
-    }
 
-    /* Resize beats memory */
-    for (i = 0; i < tracks_num; i++)
-    {
-        (new_tracks + i)->beats = calloc (beats_num, 1);
-        (new_tracks + i)->mask = calloc (beats_num, 1);
-        memset ((new_tracks + i)->mask, 1, beats_num);
-        if (i < sequence->tracks_num)
-        {
-            if (sequence->beats_num > beats_num)
-            {
-                memcpy ((new_tracks + i)->beats, (sequence->tracks + i)->beats, beats_num);
-                memcpy ((new_tracks + i)->mask, (sequence->tracks + i)->mask, beats_num);
-            }
-            else
-            {
-                if (duplicate_beats)
-                {
-                    int bn;
-                    for (j = 0; j < beats_num; j += sequence->beats_num)
-                    {
-                        bn = (beats_num - j) < sequence->beats_num
-                                ? beats_num - j
-                                : sequence->beats_num;
-                        memcpy ((new_tracks + i)->beats + j,
-                                (sequence->tracks + i)->beats, bn);
-                        memcpy ((new_tracks + i)->mask + j, (sequence->tracks + i)->mask, bn);
-                    }
-                }
-                else
-                    memcpy ((new_tracks + i)->beats, (sequence->tracks + i)->beats,
-                            sequence->beats_num);
-                memcpy ((new_tracks + i)->mask, (sequence->tracks + i)->mask,
-                        sequence->beats_num);
-            }
-        }
+        t->beats = bitset_new (sequence->beats_size);
+        t->mask = bitset_new (sequence->beats_size);
+        bitset_set_range (t->mask, 0, beats_num);
     }
+    stream_transaction_commit (sequence->stream);
 
-    /* Packs all that and sends it to the audio thread */
+    /* Publishes all that to the audio thread */
     sprintf (msg.text, "tracks=%p tracks_num=%d beats_num=%d measure_len=%d",
              new_tracks, tracks_num, beats_num, measure_len);
 
     DEBUG ("Sending resize message : %s", msg.text);
-    sequence_track_t *old_tracks = sequence->tracks;
-    int old_tracks_num = sequence->tracks_num;
-
     msg.type = SEQUENCE_MSG_RESIZE;
     msg_send (sequence->msg, &msg, MSG_ACK);
 
-    /* Cleans up old data */
-    if (old_tracks)
+    /* Patterns shrunk in place are only cleared now that the audio thread
+       has picked the shorter length */
+    if (!realloc_beats && beats_num < old_beats_num)
+    {
+        for (i = 0; i < kept; i++)
+        {
+            t = new_tracks + i;
+            sequence_resize_pattern (t->beats, old_beats_num, beats_num, 0, 0);
+            if (t->mask)
+                sequence_resize_pattern (t->mask, old_beats_num, beats_num, 0, 1);
+        }
+    }
+
+    /* Removed tracks and old storage aren't accessed by the audio thread anymore */
+    if (old_tracks_num > tracks_num)
+    {
+        stream_transaction_begin (sequence->stream);
+        for (i = tracks_num; i < old_tracks_num; i++)
+            sequence_destroy_track (sequence, old_tracks + i, sequence->tracks_info + i);
+        stream_transaction_commit (sequence->stream);
+    }
+
+    if (old_tracks && new_tracks != old_tracks)
     {
         DEBUG ("Cleaning up old tracks data at %p", old_tracks);
-        for (i = 0; i < old_tracks_num; i++)
+        if (realloc_beats)
         {
-            free ((old_tracks + i)->beats);
-            if (old_tracks[i].mask) free ((old_tracks + i)->mask);
+            for (i = 0; i < kept; i++)
+            {
+                free ((old_tracks + i)->beats);
+                if (old_tracks[i].mask) free ((old_tracks + i)->mask);
+            }
         }
         free (old_tracks);
     }
 
+    if (old_levels)
+    {
+        /* Readers which incremented the counter before this barrier may hold
+           the old pointer, the others will load the new one */
+        __sync_synchronize ();
+        while (sequence->snapshot_readers)
+            compat_sleep (1);
+        free (old_levels);
+    }
+
     int success = sequence->error ? 0 : 1; // sequence->error might get set by sequence_register_track()
     sequence_unlock (sequence);
     if (success)
@@ -1323,6 +2597,10 @@ sequence_resize (sequence_t * sequence, int tracks_num, int beats_num,
     return success;
 }
 
+/**
+ * Remove a track, shifting the following ones. This is done by the audio
+ * thread, in place.
+ */
 void
 sequence_remove_track (sequence_t *sequence, int track)
 {
@@ -1333,25 +2611,19 @@ sequence_remove_track (sequence_t *sequence, int track)
 
     if (sequence_check_pos (sequence, track, 0))
     {
-        msg.type = SEQUENCE_MSG_LOCK_SINGLE_TRACK;
+        sequence_track_t removed = sequence->tracks[track];
+
+        msg.type = SEQUENCE_MSG_REMOVE_TRACK;
         sprintf (msg.text, "track=%d", track);
         msg_send (sequence->msg, &msg, MSG_ACK);
 
-        sequence_destroy_track (sequence, track, 1);
-
-        sequence_track_t *new_tracks = calloc (sequence->tracks_num - 1, sizeof (sequence_track_t));
-        memcpy (new_tracks, sequence->tracks, track * sizeof (sequence_track_t));
-        memcpy (new_tracks + track, sequence->tracks + track + 1,
-                (sequence->tracks_num - track - 1) * sizeof (sequence_track_t));
-
-        sequence_track_t *old_tracks = sequence->tracks;
-
-        msg.type = SEQUENCE_MSG_RESIZE;
-        sprintf (msg.text, "tracks=%p tracks_num=%d beats_num=%d measure_len=%d",
-                 new_tracks, sequence->tracks_num - 1, sequence->beats_num, sequence->measure_len);
-        msg_send (sequence->msg, &msg, MSG_ACK);
+        stream_transaction_begin (sequence->stream);
+        sequence_destroy_track (sequence, &removed, sequence->tracks_info + track);
+        stream_transaction_commit (sequence->stream);
 
-        free (old_tracks);
+        // tracks_num has been decremented by the audio thread at this point
+        memmove (sequence->tracks_info + track, sequence->tracks_info + track + 1,
+                 (sequence->tracks_num - track) * sizeof (sequence_track_info_t));
         resized = 1;
     }
 
@@ -1388,6 +2660,26 @@ sequence_get_transport (sequence_t * sequence, int *respond, int *query)
     sequence_unlock (sequence);
 }
 
+/**
+ * Make the sequence start, stop, locate and change tempo along with the
+ * stream transport, as reported by the audio driver on every cycle. This is
+ * meant for transports shared with other applications, such as JACK's.
+ */
+void
+sequence_set_transport_follow (sequence_t * sequence, int follow)
+{
+    sequence_msg_t msg;
+    msg.type = SEQUENCE_MSG_SET_FOLLOW;
+    sprintf (msg.text, "follow=%d", follow ? 1 : 0);
+    SEQUENCE_LOCK_CALL (msg_send (sequence->msg, &msg, 0));
+}
+
+int
+sequence_get_transport_follow (sequence_t * sequence)
+{
+    SEQUENCE_SAFE_GETTER (int, sequence->transport_follow);
+}
+
 int
 sequence_is_playing (sequence_t * sequence)
 {
@@ -1408,7 +2700,7 @@ sequence_get_level (sequence_t * sequence, int track)
 {
     SEQUENCE_SAFE_GETTER (float, sequence_check_pos (sequence, track, 0)
                           ?  sequence->tracks[track].current_level
-                          / sequence->tracks[track].level_peak
+                          / sequence->tracks_info[track].level_peak
                           : 0);
 }
 
@@ -1425,7 +2717,10 @@ sequence_unset_looping (sequence_t * sequence)
     sequence_msg_t msg;
     msg.type = SEQUENCE_MSG_UNSET_LOOPING;
     msg.text[0] = '\0';
-    SEQUENCE_LOCK_CALL (msg_send (sequence->msg, &msg, 0));
+    sequence_lock (sequence);
+    sequence_thaw_all (sequence);
+    msg_send (sequence->msg, &msg, 0);
+    sequence_unlock (sequence);
 }
 
 int
@@ -1456,7 +2751,10 @@ sequence_set_bpm (sequence_t * sequence, float bpm)
     sequence_msg_t msg;
     msg.type = SEQUENCE_MSG_SET_BPM;
     sprintf (msg.text, "bpm=%f", bpm);
-    SEQUENCE_LOCK_CALL (msg_send (sequence->msg, &msg, 0));
+    sequence_lock (sequence);
+    sequence_thaw_all (sequence);
+    msg_send (sequence->msg, &msg, 0);
+    sequence_unlock (sequence);
 }
 
 void
@@ -1468,7 +2766,9 @@ sequence_set_beat (sequence_t * sequence, int track, int beat, char status)
     {
         //DEBUG ("sequence: %p, track: %d, beat:%d, status: %d", sequence, track,
         //       beat, status);
-        sequence->tracks[track].beats[beat] = status;
+        if (BITSET_TEST (sequence->tracks[track].beats, beat) != !!status)
+            sequence_thaw_track (sequence, track);
+        BITSET_ASSIGN (sequence->tracks[track].beats, beat, status);
         changed = 1;
     }
     sequence_unlock (sequence);
@@ -1479,26 +2779,342 @@ sequence_set_beat (sequence_t * sequence, int track, int beat, char status)
 int
 sequence_get_tracks_num (sequence_t * sequence)
 {
-    SEQUENCE_SAFE_GETTER (int, sequence->tracks_num);
+    SEQUENCE_SAFE_GETTER (int, sequence->tracks_num);
+}
+
+int
+sequence_get_beats_num (sequence_t * sequence)
+{
+    SEQUENCE_SAFE_GETTER (int, sequence->beats_num);
+}
+
+int
+sequence_get_measure_len (sequence_t * sequence)
+{
+    SEQUENCE_SAFE_GETTER (int, sequence->measure_len);
+}
+
+char
+sequence_get_beat (sequence_t * sequence, int track, int beat)
+{
+    SEQUENCE_SAFE_GETTER (char, sequence_check_pos (sequence, track, beat)
+                          ? BITSET_TEST ((sequence->tracks + track)->beats, beat) : 0);
+}
+
+/**
+ * Copy a whole track pattern into beats, one byte per step. If mask is not
+ * NULL, it receives the track mask, which is all ones when masking is disabled.
+ */
+int
+sequence_get_pattern (sequence_t *sequence, int track, char *beats, char *mask)
+{
+    int success = 0;
+    sequence_lock (sequence);
+    if (sequence_check_pos (sequence, track, 0))
+    {
+        sequence_track_t *t = sequence->tracks + track;
+        bitset_export (t->beats, beats, sequence->beats_num);
+        if (mask)
+        {
+            if (t->mask)
+                bitset_export (t->mask, mask, sequence->beats_num);
+            else
+                memset (mask, 1, sequence->beats_num);
+        }
+        success = 1;
+    }
+    sequence_unlock (sequence);
+    return success;
+}
+
+/**
+ * Copy a rectangular part of the pattern and of the masks into newly allocated
+ * arrays of one byte per cell, track after track. The region is clipped to
+ * the pattern size, a negative tracks_num or beats_num extending it to the
+ * end, and the resulting dimensions are stored into it.
+ *
+ * All cells are read at once, so that they form a consistent snapshot.
+ * Returns 0 if the region is empty.
+ */
+int
+sequence_get_region (sequence_t *sequence, sequence_region_t *region, char **beats,
+                     char **mask)
+{
+    sequence_track_t *t;
+    int i, j, success = 0;
+
+    sequence_lock (sequence);
+    if (region->track >= 0 && region->track < sequence->tracks_num
+        && region->beat >= 0 && region->beat < sequence->beats_num)
+    {
+        if (region->tracks_num < 0 || region->track + region->tracks_num > sequence->tracks_num)
+            region->tracks_num = sequence->tracks_num - region->track;
+        if (region->beats_num < 0 || region->beat + region->beats_num > sequence->beats_num)
+            region->beats_num = sequence->beats_num - region->beat;
+    }
+    else
+    {
+        region->tracks_num = region->beats_num = 0;
+    }
+
+    if (region->tracks_num > 0 && region->beats_num > 0)
+    {
+        *beats = malloc ((size_t) region->tracks_num * region->beats_num);
+        *mask = malloc ((size_t) region->tracks_num * region->beats_num);
+        for (i = 0; i < region->tracks_num; i++)
+        {
+            t = sequence->tracks + region->track + i;
+            for (j = 0; j < region->beats_num; j++)
+            {
+                (*beats)[(size_t) i * region->beats_num + j] = BITSET_TEST (t->beats, region->beat + j);
+                (*mask)[(size_t) i * region->beats_num + j] = t->mask
+                        ? BITSET_TEST (t->mask, region->beat + j) : 1;
+            }
+        }
+        success = 1;
+    }
+    sequence_unlock (sequence);
+    return success;
+}
+
+/**
+ * Replace a whole track pattern, given as one byte per step. mask may be NULL,
+ * and is ignored when masking is disabled on this track.
+ *
+ * This is done with an edit transaction, so that the audio thread sees the
+ * new pattern at once, and a single region-changed event is fired.
+ */
+void
+sequence_set_pattern (sequence_t *sequence, int track, const char *beats, const char *mask)
+{
+    sequence_edit_t *edit = sequence_edit_begin (sequence);
+    int i;
+
+    for (i = 0; i < edit->beats_num; i++)
+    {
+        sequence_edit_set_beat (edit, track, i, beats[i]);
+        if (mask)
+            sequence_edit_set_mask_beat (edit, track, i, mask[i]);
+    }
+
+    sequence_edit_commit (edit);
+}
+
+/**
+ * Start a pattern edit transaction.
+ *
+ * Changes are recorded into shadow patterns, without locking the sequence.
+ * On commit, each modified track gets a new pattern, which is published to
+ * the audio thread with a single pointer store, and a single region-changed
+ * event is fired, carrying the bounding rectangle of the cells which
+ * actually changed.
+ *
+ * The transaction applies to the sequence dimensions at the time it begins.
+ * Changes to cells which are gone by the time it is committed are dropped.
+ */
+sequence_edit_t *
+sequence_edit_begin (sequence_t *sequence)
+{
+    sequence_edit_t *edit = malloc (sizeof (sequence_edit_t));
+    sequence_lock (sequence);
+    edit->sequence = sequence;
+    edit->tracks_num = sequence->tracks_num;
+    edit->beats_num = sequence->beats_num;
+    sequence_unlock (sequence);
+    edit->tracks = calloc (edit->tracks_num ? edit->tracks_num : 1, sizeof (sequence_edit_track_t *));
+    return edit;
+}
+
+static sequence_edit_track_t *
+sequence_edit_get_track (sequence_edit_t *edit, int track, int beat)
+{
+    if (track < 0 || track >= edit->tracks_num || beat < 0 || beat >= edit->beats_num)
+        return NULL;
+
+    if (!edit->tracks[track])
+    {
+        sequence_edit_track_t *shadow = malloc (sizeof (sequence_edit_track_t));
+        shadow->beats = bitset_new (edit->beats_num);
+        shadow->beats_touched = bitset_new (edit->beats_num);
+        shadow->mask = bitset_new (edit->beats_num);
+        shadow->mask_touched = bitset_new (edit->beats_num);
+        edit->tracks[track] = shadow;
+    }
+    return edit->tracks[track];
+}
+
+void
+sequence_edit_set_beat (sequence_edit_t *edit, int track, int beat, char status)
+{
+    sequence_edit_track_t *shadow = sequence_edit_get_track (edit, track, beat);
+    if (shadow)
+    {
+        BITSET_ASSIGN (shadow->beats, beat, status);
+        BITSET_SET (shadow->beats_touched, beat);
+    }
+}
+
+/**
+ * Record a mask change. It is dropped on commit if masking is disabled on
+ * the track, as with sequence_set_mask_beat().
+ */
+void
+sequence_edit_set_mask_beat (sequence_edit_t *edit, int track, int beat, char status)
+{
+    sequence_edit_track_t *shadow = sequence_edit_get_track (edit, track, beat);
+    if (shadow)
+    {
+        BITSET_ASSIGN (shadow->mask, beat, status);
+        BITSET_SET (shadow->mask_touched, beat);
+    }
+}
+
+/**
+ * Merge the touched bits of a shadow pattern into a copy of pattern, and
+ * flag the steps which change into changed. Returns NULL if nothing changes.
+ */
+static bitset_word_t *
+sequence_edit_merge (sequence_t *sequence, bitset_word_t *pattern, bitset_word_t *values,
+                     bitset_word_t *touched, int beats_num, bitset_word_t *changed)
+{
+    int i, n = BITSET_WORDS (beats_num);
+    bitset_word_t diff, any = 0;
+    bitset_word_t *merged = bitset_new (sequence->beats_size);
+
+    memcpy (merged, pattern, BITSET_WORDS (sequence->beats_size) * sizeof (bitset_word_t));
+    for (i = 0; i < n; i++)
+    {
+        merged[i] = (pattern[i] & ~touched[i]) | (values[i] & touched[i]);
+        diff = merged[i] ^ pattern[i];
+        changed[i] |= diff;
+        any |= diff;
+    }
+
+    if (!any)
+    {
+        free (merged);
+        merged = NULL;
+    }
+    return merged;
+}
+
+/**
+ * Replace a pattern which the audio thread may be reading. The old one is
+ * freed once the audio thread has started a new cycle.
+ */
+static void
+sequence_publish_pattern (sequence_t *sequence, bitset_word_t **slot, bitset_word_t *pattern)
+{
+    bitset_word_t *old = *slot;
+    __sync_synchronize ();
+    *slot = pattern;
+    epoch_retire (sequence->epoch, old, NULL, NULL);
 }
 
-int
-sequence_get_beats_num (sequence_t * sequence)
+static void
+sequence_edit_free (sequence_edit_t *edit)
 {
-    SEQUENCE_SAFE_GETTER (int, sequence->beats_num);
+    int i;
+    for (i = 0; i < edit->tracks_num; i++)
+        if (edit->tracks[i])
+        {
+            free (edit->tracks[i]->beats);
+            free (edit->tracks[i]->beats_touched);
+            free (edit->tracks[i]->mask);
+            free (edit->tracks[i]->mask_touched);
+            free (edit->tracks[i]);
+        }
+    free (edit->tracks);
+    free (edit);
 }
 
+/**
+ * Apply and free an edit transaction. Returns 1 if any cell changed, 0
+ * otherwise.
+ */
 int
-sequence_get_measure_len (sequence_t * sequence)
+sequence_edit_commit (sequence_edit_t *edit)
 {
-    SEQUENCE_SAFE_GETTER (int, sequence->measure_len);
+    sequence_t *sequence = edit->sequence;
+    sequence_region_t *region = NULL;
+    bitset_word_t *changed, *merged;
+    int i, first, last, tracks_num, beats_num;
+
+    sequence_lock (sequence);
+    tracks_num = edit->tracks_num < sequence->tracks_num ? edit->tracks_num : sequence->tracks_num;
+    beats_num = edit->beats_num < sequence->beats_num ? edit->beats_num : sequence->beats_num;
+    changed = bitset_new (beats_num);
+
+    for (i = 0; i < tracks_num; i++)
+    {
+        sequence_edit_track_t *shadow = edit->tracks[i];
+        sequence_track_t *t = sequence->tracks + i;
+        if (!shadow)
+            continue;
+
+        // Drop steps which have been removed meanwhile
+        bitset_clear_range (shadow->beats_touched, beats_num, edit->beats_num);
+        bitset_clear_range (shadow->mask_touched, beats_num, edit->beats_num);
+
+        bitset_zero (changed, beats_num);
+        merged = sequence_edit_merge (sequence, t->beats, shadow->beats, shadow->beats_touched,
+                                      beats_num, changed);
+        if (merged)
+            sequence_publish_pattern (sequence, &t->beats, merged);
+
+        if (t->mask)
+        {
+            merged = sequence_edit_merge (sequence, t->mask, shadow->mask, shadow->mask_touched,
+                                          beats_num, changed);
+            if (merged)
+                sequence_publish_pattern (sequence, &t->mask, merged);
+        }
+
+        if ((first = bitset_next (changed, beats_num, 0)) != -1)
+        {
+            sequence_thaw_track (sequence, i);
+            last = bitset_prev (changed, beats_num - 1);
+            if (!region)
+            {
+                region = malloc (sizeof (sequence_region_t));
+                region->track = i;
+                region->tracks_num = 1;
+                region->beat = first;
+                region->beats_num = last - first + 1;
+            }
+            else
+            {
+                region->tracks_num = i - region->track + 1;
+                if (first < region->beat)
+                {
+                    region->beats_num += region->beat - first;
+                    region->beat = first;
+                }
+                if (last >= region->beat + region->beats_num)
+                    region->beats_num = last - region->beat + 1;
+            }
+        }
+    }
+    sequence_unlock (sequence);
+
+    free (changed);
+    sequence_edit_free (edit);
+
+    if (region)
+    {
+        event_fire (sequence, "region-changed", region, free);
+        return 1;
+    }
+    return 0;
 }
 
-char
-sequence_get_beat (sequence_t * sequence, int track, int beat)
+/**
+ * Drop an edit transaction, without applying it.
+ */
+void
+sequence_edit_cancel (sequence_edit_t *edit)
 {
-    SEQUENCE_SAFE_GETTER (char, sequence_check_pos (sequence, track, beat)
-                          ? (sequence->tracks + track)->beats[beat] : 0);
+    sequence_edit_free (edit);
 }
 
 char *
@@ -1508,7 +3124,7 @@ sequence_get_track_name (sequence_t * sequence, int track)
     char *name;
     if (sequence_check_pos (sequence, track, 0))
     {
-        char *src = (sequence->tracks + track)->name;
+        char *src = (sequence->tracks_info + track)->name;
         name = malloc (strlen (src) + 1);
         strcpy (name, src);
     }
@@ -1530,37 +3146,37 @@ sample_t *
 sequence_get_sample (sequence_t * sequence, int track)
 {
     SEQUENCE_SAFE_GETTER (sample_t *, sequence_check_pos (sequence, track, 0)
-                          ? (sequence->tracks + track)->sample : NULL);
+                          ? sequence->tracks_info[track].sample : NULL);
 }
 
-int
-sequence_set_sample (sequence_t * sequence, int track, sample_t * sample)
+/**
+ * Change the number of channels of a track, registering new stream ports.
+ *
+ * On success, the track is left locked: the audio thread doesn't render it
+ * until it receives the new track source, which unlocks it. Must be called
+ * with the sequence locked.
+ */
+static int
+sequence_set_channels_num (sequence_t *sequence, int track, int channels_num)
 {
-    sequence_lock (sequence);
-    if (!sequence_check_pos (sequence, track, 0))
-    {
-        sequence_unlock (sequence);
-        return 0;
-    }
     sequence_msg_t msg;
     sequence_track_t *t = sequence->tracks + track;
     sequence_track_t old_track;
-    int j, sr_converter_error;
-    sequence->error = 0;
-    int success = 1;
+    int j, success = 1;
 
-    if (t->channels_num != sample->channels_num)
+    if (t->channels_num != channels_num)
     {
         msg.type = SEQUENCE_MSG_LOCK_SINGLE_TRACK;
         sprintf (msg.text, "track=%d", track);
         msg_send (sequence->msg, &msg, MSG_ACK);
 
         memcpy (&old_track, t, sizeof (sequence_track_t));
+        t->channels_num = channels_num;
         t->buffers = calloc (t->channels_num, sizeof (float *));
-        t->channels_num = sample->channels_num;
         t->channels = calloc (t->channels_num, sizeof (stream_port_t *));
 
-        if (sequence_register_track (sequence, t))
+        stream_transaction_begin (sequence->stream);
+        if (sequence_register_track (sequence, t, sequence->tracks_info + track))
         {
 
             if (old_track.channels_num)
@@ -1570,14 +3186,16 @@ sequence_set_sample (sequence_t * sequence, int track, sample_t * sample)
                 free (old_track.channels);
                 free (old_track.buffers);
             }
+            stream_transaction_commit (sequence->stream);
 
+            // Both are sized for a given number of channels
             if (t->sr_converter != NULL)
             {
                 src_delete (t->sr_converter);
                 t->sr_converter = NULL;
-                free (t->sr_converter_buffer);
-                t->sr_converter_buffer = NULL;
             }
+            free (t->sr_converter_buffer);
+            t->sr_converter_buffer = NULL;
         }
         else
         {
@@ -1587,6 +3205,7 @@ sequence_set_sample (sequence_t * sequence, int track, sample_t * sample)
             t->channels = old_track.channels;
             t->channels_num = old_track.channels_num;
             t->buffers = old_track.buffers;
+            stream_transaction_commit (sequence->stream);
             msg.type = SEQUENCE_MSG_UNLOCK_SINGLE_TRACK;
             sprintf (msg.text, "track=%d", track);
             msg_send (sequence->msg, &msg, MSG_ACK);
@@ -1594,6 +3213,45 @@ sequence_set_sample (sequence_t * sequence, int track, sample_t * sample)
         }
     }
 
+    return success;
+}
+
+/**
+ * Replace the source of a track, once the audio thread has picked the new one,
+ * by releasing the sample or nested sequence which it used. Must be called
+ * with the sequence locked.
+ */
+static void
+sequence_release_source (sequence_t *sequence, int track)
+{
+    sequence_track_info_t *info = sequence->tracks_info + track;
+    if (info->sample != NULL)
+    {
+        epoch_retire (sequence->epoch, info->sample, sequence_release_sample, NULL);
+        info->sample = NULL;
+    }
+    if (info->nested != NULL)
+    {
+        __sync_sub_and_fetch (&info->nested->nested_refs, 1);
+        info->nested = NULL;
+    }
+}
+
+int
+sequence_set_sample (sequence_t * sequence, int track, sample_t * sample)
+{
+    sequence_lock (sequence);
+    if (!sequence_check_pos (sequence, track, 0))
+    {
+        sequence_unlock (sequence);
+        return 0;
+    }
+    sequence_msg_t msg;
+    sequence_track_t *t = sequence->tracks + track;
+    int sr_converter_error;
+    sequence->error = 0;
+    int success = sequence_set_channels_num (sequence, track, sample->channels_num);
+
     if (success)
     {
         if (t->sr_converter_type == -1)
@@ -1626,20 +3284,204 @@ sequence_set_sample (sequence_t * sequence, int track, sample_t * sample)
                                              sizeof (float));
         t->sr_converter_ratio = (double) sequence->framerate
                 / (double) sample->framerate
-                / pow (2, t->pitch / 12);
+                / pow (2, sequence->tracks_info[track].pitch / 12);
 
-        t->level_peak = sample->peak > 0 ? sample->peak : 1;
+        sequence->tracks_info[track].level_peak = sample->peak > 0 ? sample->peak : 1;
+        sequence_thaw_track (sequence, track);
 
-        sample_t * old_sample = t->sample;
+        /* The old sample is released once the audio thread has switched to
+           the new one, without waiting for it */
+        sample_ref (sample);
         msg.type = SEQUENCE_MSG_SET_SAMPLE;
         sprintf (msg.text, "track=%d sample=%p", track, sample);
-        msg_send (sequence->msg, &msg, MSG_ACK);
-        sample_ref (sample);
-        if (old_sample != NULL)
-            sample_unref (old_sample);
+        msg_send (sequence->msg, &msg, 0);
+        sequence_release_source (sequence, track);
+        sequence->tracks_info[track].sample = sample;
+    }
+
+    sequence_unlock (sequence);
+    return success;
+}
+
+/* Serializes nesting, so that two sequences can't start using each other at
+   once. This is taken before any sequence lock. */
+static pthread_mutex_t sequence_nesting_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Tell whether a sequence renders another one, either directly or through
+ * other nested sequences.
+ */
+static int
+sequence_uses (sequence_t *sequence, sequence_t *target)
+{
+    sequence_t **sources;
+    int i, n = 0, found = 0;
+
+    sequence_lock (sequence);
+    sources = malloc ((sequence->tracks_num + 1) * sizeof (sequence_t *));
+    for (i = 0; i < sequence->tracks_num; i++)
+        if (sequence->tracks_info[i].nested)
+            sources[n++] = sequence->tracks_info[i].nested;
+    sequence_unlock (sequence);
+
+    for (i = 0; i < n && !found; i++)
+        found = (sources[i] == target) || sequence_uses (sources[i], target);
+
+    free (sources);
+    return found;
+}
+
+/**
+ * Use another sequence as the source of a track. The nested sequence is mixed
+ * down to stereo, and the track pattern gates it: it is audible during the
+ * steps which are set, and not masked.
+ *
+ * The nested sequence keeps playing on its own, but is only heard through the
+ * tracks which use it: its own ports are silent. Each onset of such a track
+ * restarts it from its first beat. It is rendered once per cycle, whatever
+ * the number of tracks which use it. source may be NULL, to empty the
+ * track. This fails with ERR_SEQUENCE_NESTED_CYCLE if source already uses this
+ * sequence, or is this sequence itself.
+ *
+ * The caller must ensure that the nested sequence outlives its use; see
+ * sequence_unset_nested().
+ */
+int
+sequence_set_nested (sequence_t *sequence, int track, sequence_t *source)
+{
+    sequence_msg_t msg;
+    int success = 0;
+
+    pthread_mutex_lock (&sequence_nesting_mutex);
+    if (source && (source == sequence || sequence_uses (source, sequence)))
+    {
+        pthread_mutex_unlock (&sequence_nesting_mutex);
+        DEBUG ("Can't nest %s: it depends on this sequence", source->name);
+        SEQUENCE_LOCK_CALL (sequence->error = ERR_SEQUENCE_NESTED_CYCLE);
+        return 0;
+    }
+
+    sequence_lock (sequence);
+    sequence->error = 0;
+    if (sequence_check_pos (sequence, track, 0)
+        && sequence_set_channels_num (sequence, track, 2))
+    {
+        sequence_thaw_track (sequence, track);
+        if (source)
+            __sync_add_and_fetch (&source->nested_refs, 1);
+        msg.type = SEQUENCE_MSG_SET_NESTED;
+        sprintf (msg.text, "track=%d nested=%p", track, source);
+        msg_send (sequence->msg, &msg, 0);
+        sequence_release_source (sequence, track);
+        sequence->tracks_info[track].nested = source;
+        sequence->tracks_info[track].level_peak = 1;
+        success = 1;
     }
+    sequence_unlock (sequence);
+    pthread_mutex_unlock (&sequence_nesting_mutex);
+    return success;
+}
+
+sequence_t *
+sequence_get_nested (sequence_t *sequence, int track)
+{
+    SEQUENCE_SAFE_GETTER (sequence_t *, sequence_check_pos (sequence, track, 0)
+                          ? sequence->tracks_info[track].nested : NULL);
+}
+
+/* Count the tracks which use another sequence. The sequence must be locked. */
+static int
+sequence_count_nested (sequence_t *sequence)
+{
+    int i, n = 0;
+    for (i = 0; i < sequence->tracks_num; i++)
+        if (sequence->tracks_info[i].nested)
+            n++;
+    return n;
+}
+
+/**
+ * Tell whether some tracks use other sequences. Such sequences can't be saved
+ * nor exported, since nesting only refers to sequences which are loaded.
+ */
+int
+sequence_has_nested (sequence_t *sequence)
+{
+    SEQUENCE_SAFE_GETTER (int, sequence_count_nested (sequence) > 0);
+}
+
+/**
+ * Empty all tracks which use source. Once this returns, the audio thread
+ * doesn't render source on behalf of this sequence anymore, and it can be
+ * destroyed. Returns the number of tracks which were emptied.
+ */
+int
+sequence_unset_nested (sequence_t *sequence, sequence_t *source)
+{
+    sequence_msg_t msg;
+    int i, n = 0;
+
+    sequence_lock (sequence);
+    for (i = 0; i < sequence->tracks_num; i++)
+        if (sequence->tracks_info[i].nested == source)
+        {
+            msg.type = SEQUENCE_MSG_SET_NESTED;
+            sprintf (msg.text, "track=%d nested=%p", i, NULL);
+            msg_send (sequence->msg, &msg, 0);
+            sequence_release_source (sequence, i);
+            n++;
+        }
 
+    if (n)
+    {
+        msg.type = SEQUENCE_MSG_ACK;
+        msg_send (sequence->msg, &msg, MSG_ACK);
+    }
     sequence_unlock (sequence);
+    return n;
+}
+
+/**
+ * Return the time spent rendering this sequence's own tracks, on average per
+ * cycle, in microseconds. Nested sequences are accounted for separately.
+ */
+float
+sequence_get_process_time (sequence_t *sequence)
+{
+    return sequence->process_time;
+}
+
+/**
+ * Copy the state of the sequence as of the last cycle, and the output level
+ * of up to levels_size tracks, without locking. This is meant for telemetry:
+ * it never blocks, and returns 0 if no consistent snapshot could be taken,
+ * which may only happen if the audio thread is writing one meanwhile.
+ */
+int
+sequence_get_snapshot (sequence_t *sequence, sequence_snapshot_t *snapshot, float *levels,
+                       int levels_size)
+{
+    unsigned long serial;
+    int i, n, tries, success = 0;
+
+    __sync_fetch_and_add (&sequence->snapshot_readers, 1);
+    for (tries = 0; tries < 100 && !success; tries++)
+    {
+        serial = sequence->snapshot_serial;
+        __sync_synchronize ();
+        if (serial & 1)
+            continue;
+
+        *snapshot = sequence->snapshot;
+        n = snapshot->tracks_num < levels_size ? snapshot->tracks_num : levels_size;
+        for (i = 0; i < n; i++)
+            levels[i] = sequence->snapshot_levels[i];
+
+        __sync_synchronize ();
+        success = (sequence->snapshot_serial == serial);
+    }
+    __sync_fetch_and_sub (&sequence->snapshot_readers, 1);
+
     return success;
 }
 
@@ -1651,16 +3493,17 @@ sequence_do_set_track_name (sequence_t * sequence, int track, char *name, int fo
     if (sequence_check_pos (sequence, track, 0))
     {
         sequence_track_t *t = sequence->tracks + track;
-        if (strcmp (t->name, name))
+        sequence_track_info_t *info = sequence->tracks_info + track;
+        if (strcmp (info->name, name))
         {
             if (force || !_sequence_track_name_exists (sequence, name))
             {
                 if (strlen (name) > 0 && strspn (name, SEQUENCE_VALID_NAME) == strlen (name))
                 {
-                    strcpy (t->name, name);
+                    strcpy (info->name, name);
                     for (j = 0; j < t->channels_num; j++)
                     {
-                        char *name = sequence_make_port_name (sequence, t, j);
+                        char *name = sequence_make_port_name (sequence, t, info, j);
                         stream_port_rename (sequence->stream, t->channels[j], name);
                         free (name);
                     }
@@ -1705,12 +3548,12 @@ sequence_get_sample_usage (sequence_t * sequence, sample_t * sample)
     int r = 0;
     for (i = 0; i < sequence->tracks_num; i++)
     {
-        if ((sequence->tracks + i)->sample)
+        if ((sequence->tracks_info + i)->sample)
         {
-            DEBUG ("Track %d has sample : %s", i, (sequence->tracks +
+            DEBUG ("Track %d has sample : %s", i, (sequence->tracks_info +
                                                    i)->sample->name);
         }
-        if ((sequence->tracks + i)->sample == sample) r++;
+        if ((sequence->tracks_info + i)->sample == sample) r++;
     }
     DEBUG ("Usage for sample \"%s\" is : %d", sample->name, r);
     sequence_unlock (sequence);
@@ -1724,9 +3567,10 @@ sequence_get_track_type (sequence_t * sequence, int track)
     sequence_track_type_t r = EMPTY;
     if (sequence_check_pos (sequence, track, 0))
     {
-        sequence_track_t *t = (sequence->tracks + track);
-        if (t->sample)
+        if (sequence->tracks_info[track].sample)
             r = SAMPLE;
+        else if (sequence->tracks_info[track].nested)
+            r = NESTED;
     }
     sequence_unlock (sequence);
     return r;
@@ -1786,8 +3630,8 @@ sequence_enable_mask (sequence_t *sequence, int track)
     sequence_lock (sequence);
     if (sequence_check_pos (sequence, track, 0) && !sequence->tracks[track].mask)
     {
-        char *mask = calloc (sequence->beats_num, 1);
-        memset (mask, 1, sequence->beats_num);
+        bitset_word_t *mask = bitset_new (sequence->beats_size);
+        bitset_set_range (mask, 0, sequence->beats_num);
 
         sequence_msg_t msg;
         msg.type = SEQUENCE_MSG_ENABLE_MASK;
@@ -1803,7 +3647,8 @@ sequence_disable_mask (sequence_t *sequence, int track)
     sequence_lock (sequence);
     if (sequence_check_pos (sequence, track, 0) && sequence->tracks[track].mask)
     {
-        char *old_mask = sequence->tracks[track].mask;
+        bitset_word_t *old_mask = sequence->tracks[track].mask;
+        sequence_thaw_track (sequence, track);
 
         sequence_msg_t msg;
         msg.type = SEQUENCE_MSG_DISABLE_MASK;
@@ -1825,7 +3670,9 @@ sequence_set_mask_beat (sequence_t * sequence, int track, int beat, char status)
         //       beat, status);
         if (sequence->tracks[track].mask)
         {
-            sequence->tracks[track].mask[beat] = status;
+            if (BITSET_TEST (sequence->tracks[track].mask, beat) != !!status)
+                sequence_thaw_track (sequence, track);
+            BITSET_ASSIGN (sequence->tracks[track].mask, beat, status);
             changed = 1;
         }
     }
@@ -1837,8 +3684,9 @@ sequence_set_mask_beat (sequence_t * sequence, int track, int beat, char status)
 char
 sequence_get_mask_beat (sequence_t * sequence, int track, int beat)
 {
-    SEQUENCE_SAFE_GETTER (char, sequence_check_pos (sequence, track, 0)
-                          ? sequence->tracks[track].mask[beat] : 0);
+    SEQUENCE_SAFE_GETTER (char, !sequence_check_pos (sequence, track, beat) ? 0
+                          : (sequence->tracks[track].mask
+                             ? BITSET_TEST (sequence->tracks[track].mask, beat) : 1));
 }
 
 int
@@ -1855,12 +3703,13 @@ sequence_set_pitch (sequence_t *sequence, int track, double pitch)
     sequence_lock (sequence);
     if (sequence_check_pos (sequence, track, 0))
     {
-        if (sequence->tracks[track].pitch != pitch)
+        if (sequence->tracks_info[track].pitch != pitch)
         {
             DEBUG ("Setting pitch on track %d to : %f (was: %f)", track, pitch,
-                   sequence->tracks[track].pitch);
+                   sequence->tracks_info[track].pitch);
             sequence_msg_t msg;
-            sequence->tracks[track].pitch = pitch;
+            sequence->tracks_info[track].pitch = pitch;
+            sequence_thaw_track (sequence, track);
             if (sequence->tracks[track].sample != NULL)
             {
                 double ratio = (double) sequence->framerate
@@ -1885,7 +3734,7 @@ double
 sequence_get_pitch (sequence_t *sequence, int track)
 {
     SEQUENCE_SAFE_GETTER (double, sequence_check_pos (sequence, track, 0)
-                          ? sequence->tracks[track].pitch : 0);
+                          ? sequence->tracks_info[track].pitch : 0);
 }
 
 void
@@ -1896,6 +3745,7 @@ sequence_set_volume (sequence_t *sequence, int track, double volume)
     if (sequence_check_pos (sequence, track, 0))
     {
         sequence_msg_t msg;
+        sequence_thaw_track (sequence, track);
         msg.type = SEQUENCE_MSG_SET_VOLUME;
         sprintf (msg.text, "track=%d volume=%f", track, volume);
         msg_send (sequence->msg, &msg, 0);
@@ -1911,6 +3761,7 @@ sequence_multiply_volume (sequence_t *sequence, int track, double ratio)
     if (sequence_check_pos (sequence, track, 0))
     {
         sequence_msg_t msg;
+        sequence_thaw_track (sequence, track);
         msg.type = SEQUENCE_MSG_MUL_VOLUME;
         sprintf (msg.text, "track=%d ratio=%f", track, ratio);
         msg_send (sequence->msg, &msg, 0);
@@ -1933,14 +3784,192 @@ sequence_increase_volume_db (sequence_t *sequence, int track, double delta)
 double
 sequence_get_volume (sequence_t *sequence, int track)
 {
-    SEQUENCE_SAFE_GETTER (double, sequence_check_pos (sequence, track, 0)
-                          ? sequence->tracks[track].volume : 0);
+    SEQUENCE_SAFE_GETTER (double, !sequence_check_pos (sequence, track, 0) ? 0
+                          : sequence->tracks[track].volume_ramp.frames
+                          ? sequence->tracks[track].volume_ramp.target
+                          : sequence->tracks[track].volume);
 }
 
 double
 sequence_get_volume_db (sequence_t *sequence, int track)
 {
-    return SEQUENCE_GAIN2DB (sequence_get_volume (sequence, track));
+    return SEQUENCE_GAIN2DB (sequence_get_volume (sequence, track));
+}
+
+/**
+ * Return the current stream frame time, to schedule parameter changes from.
+ */
+unsigned long
+sequence_get_frame_time (sequence_t *sequence)
+{
+    return stream_get_frame_time (sequence->stream);
+}
+
+/* Must be called with the lock held */
+static void
+sequence_schedule (sequence_t *sequence, int track, int type, double value,
+                   unsigned long frame, unsigned long length, int curve)
+{
+    sequence_msg_t msg;
+    msg.type = SEQUENCE_MSG_SCHEDULE;
+    sprintf (msg.text, "track=%d type=%d frame=%lu length=%lu value=%.9g curve=%d",
+             track, type, frame, length, value, curve);
+    msg_send (sequence->msg, &msg, 0);
+}
+
+/**
+ * Schedule a change of a track's volume at a given frame time, as returned by
+ * sequence_get_frame_time(). From that frame on, the volume ramps to the
+ * target over length frames. Changes scheduled in the past are applied on the
+ * next cycle.
+ */
+void
+sequence_schedule_volume (sequence_t *sequence, int track, double volume,
+                          unsigned long frame, unsigned long length, sequence_ramp_curve_t curve)
+{
+    sequence_lock (sequence);
+    if (sequence_check_pos (sequence, track, 0))
+    {
+        sequence_thaw_track (sequence, track);
+        sequence_schedule (sequence, track, SEQUENCE_PARAM_VOLUME, volume, frame, length, curve);
+    }
+    sequence_unlock (sequence);
+}
+
+/**
+ * Schedule a change of a track's pitch, in semitones. The pitch only changes
+ * once per cycle, so ramps are rendered as steps of one cycle.
+ */
+void
+sequence_schedule_pitch (sequence_t *sequence, int track, double pitch,
+                         unsigned long frame, unsigned long length, sequence_ramp_curve_t curve)
+{
+    int fire = 0;
+    sequence_lock (sequence);
+    if (sequence_check_pos (sequence, track, 0))
+    {
+        sequence->tracks_info[track].pitch = pitch;
+        sequence_thaw_track (sequence, track);
+        if (sequence->tracks[track].sample != NULL)
+            sequence_schedule (sequence, track, SEQUENCE_PARAM_PITCH,
+                               (double) sequence->framerate
+                               / (double) sequence->tracks[track].sample->framerate
+                               / pow (2, pitch / 12), frame, length, curve);
+        else
+            fire = 1;
+    }
+    sequence_unlock (sequence);
+    if (fire)
+        sequence_event_fire_pos (sequence, "track-pitch-changed", 0, track);
+}
+
+/**
+ * Schedule muting or unmuting a track. Muting fades the track out over length
+ * frames, after which it is reported as muted. Unmuting takes effect at once,
+ * and fades the track in.
+ */
+void
+sequence_schedule_mute (sequence_t *sequence, int track, char status,
+                        unsigned long frame, unsigned long length, sequence_ramp_curve_t curve)
+{
+    sequence_lock (sequence);
+    if (sequence_check_pos (sequence, track, 0))
+        sequence_schedule (sequence, track, SEQUENCE_PARAM_MUTE, status ? 1 : 0, frame, length, curve);
+    sequence_unlock (sequence);
+}
+
+/**
+ * Schedule a tempo change. The tempo changes at once, on the cycle the given
+ * frame falls in.
+ */
+void
+sequence_schedule_bpm (sequence_t *sequence, float bpm, unsigned long frame)
+{
+    sequence_lock (sequence);
+    sequence_thaw_all (sequence);
+    sequence_schedule (sequence, -1, SEQUENCE_PARAM_BPM, bpm, frame, 0, SEQUENCE_RAMP_LINEAR);
+    sequence_unlock (sequence);
+}
+
+/**
+ * Publish the state a beat or mask beat has until the given frame, so that
+ * the grid can then be changed right away. This doesn't wait for the audio
+ * thread, which picks holds up whenever it reads the grid.
+ */
+static void
+sequence_schedule_hold (sequence_t *sequence, int track, int type, int beat,
+                        char status, unsigned long frame)
+{
+    sequence_param_t param;
+
+    param.track = track;
+    param.type = type;
+    param.beat = beat;
+    param.frame = frame;
+    param.value = status ? 1 : 0;
+    param.length = 0;
+    param.curve = SEQUENCE_RAMP_LINEAR;
+
+    if (ringbuffer_write_space (sequence->holds) < sizeof (sequence_param_t))
+    {
+        DEBUG ("WARNING: hold queue full, changing beat at once");
+        return;
+    }
+    ringbuffer_write (sequence->holds, (char *) &param, sizeof (sequence_param_t));
+    __sync_synchronize ();
+}
+
+/**
+ * Schedule activating or deactivating a beat. The grid is changed at once, as
+ * reported by sequence_get_beat(), but onsets which occur before the given
+ * frame are still played according to the previous state.
+ */
+void
+sequence_schedule_beat (sequence_t *sequence, int track, int beat, char status,
+                        unsigned long frame)
+{
+    int changed = 0;
+    sequence_lock (sequence);
+    if (sequence_check_pos (sequence, track, beat))
+    {
+        if (BITSET_TEST (sequence->tracks[track].beats, beat) != !!status)
+        {
+            sequence_thaw_track (sequence, track);
+            sequence_schedule_hold (sequence, track, SEQUENCE_PARAM_BEAT, beat,
+                                    !status, frame);
+        }
+        BITSET_ASSIGN (sequence->tracks[track].beats, beat, status);
+        changed = 1;
+    }
+    sequence_unlock (sequence);
+    if (changed)
+        sequence_event_fire_pos (sequence, "beat-changed", beat, track);
+}
+
+/**
+ * Schedule a change of a beat's mask, as sequence_schedule_beat() does for
+ * beats.
+ */
+void
+sequence_schedule_mask_beat (sequence_t *sequence, int track, int beat, char status,
+                             unsigned long frame)
+{
+    int changed = 0;
+    sequence_lock (sequence);
+    if (sequence_check_pos (sequence, track, beat) && sequence->tracks[track].mask)
+    {
+        if (BITSET_TEST (sequence->tracks[track].mask, beat) != !!status)
+        {
+            sequence_thaw_track (sequence, track);
+            sequence_schedule_hold (sequence, track, SEQUENCE_PARAM_MASK, beat,
+                                    !status, frame);
+        }
+        BITSET_ASSIGN (sequence->tracks[track].mask, beat, status);
+        changed = 1;
+    }
+    sequence_unlock (sequence);
+    if (changed)
+        sequence_event_fire_pos (sequence, "beat-changed", beat, track);
 }
 
 void
@@ -1951,6 +3980,7 @@ sequence_set_smoothing (sequence_t *sequence, int track, int status)
     if (sequence_check_pos (sequence, track, 0))
     {
         sequence_msg_t msg;
+        sequence_thaw_track (sequence, track);
         msg.type = SEQUENCE_MSG_SET_SMOOTHING;
         sprintf (msg.text, "track=%d status=%d", track, status);
         msg_send (sequence->msg, &msg, 0);
@@ -1983,6 +4013,7 @@ sequence_set_resampler_type (sequence_t * sequence, int type)
         }
 
         sequence->sr_converter_default_type = type;
+        sequence_thaw_all (sequence);
         int i;
         for (i = 0; i < sequence->tracks_num; i++)
         {
@@ -2018,99 +4049,543 @@ sequence_set_resampler_type (sequence_t * sequence, int type)
         event_fire (sequence, "resampler-type-changed", NULL, NULL);
 }
 
-int
-sequence_get_resampler_type (sequence_t *sequence)
+int
+sequence_get_resampler_type (sequence_t *sequence)
+{
+    SEQUENCE_SAFE_GETTER (int, sequence->sr_converter_default_type);
+}
+
+/**
+ * Stop the sequence, and make a copy of it, private to the calling thread, to
+ * render from. The sequence must be locked.
+ */
+static sequence_t *
+sequence_export_begin (sequence_t *sequence, int framerate, int sustain_type)
+{
+    unsigned long bufsize = sequence->buffer_size;
+    sequence_msg_t msg;
+    sequence_t *sequence_tmp;
+    sequence_track_t *track;
+    int i, j;
+
+    // Stopping sequence
+    if (sequence->status == SEQUENCE_ENABLED)
+    {
+        msg.type = SEQUENCE_MSG_ACK_DISABLE;
+        msg_send (sequence->msg, &msg, MSG_ACK);
+    }
+
+    sequence_tmp = malloc (sizeof (sequence_t));
+    memcpy (sequence_tmp, sequence, sizeof (sequence_t));
+
+    sequence_tmp->tracks = calloc (sequence->tracks_num, sizeof (sequence_track_t));
+    memcpy (sequence_tmp->tracks, sequence->tracks, sequence->tracks_num * sizeof (sequence_track_t));
+
+    sequence_tmp->looping = (sustain_type == SEQUENCE_SUSTAIN_LOOP);
+    sequence_tmp->params_num = 0;
+    sequence_tmp->holds = NULL;
+    // Nobody processes the events of the copy, they would overrun the queue
+    sequence_tmp->msg = NULL;
+
+    // Allocating temporary buffers
+    for (i = 0; i < sequence->tracks_num; i++)
+    {
+        track = sequence_tmp->tracks + i;
+        track->sample = sequence->tracks_info[i].sample;
+        sequence_settle_params (track);
+        // Rendered loops are specific to the stream framerate
+        track->freeze = NULL;
+        /* Nested sequences are only rendered by the audio thread. Exports of
+           nested tracks are refused upfront, this only covers tracks nested
+           while the progress callbacks ran unlocked. */
+        track->nested = NULL;
+        // Patterns may be replaced by edit transactions while unlocked
+        track->beats = bitset_new (sequence->beats_num);
+        bitset_copy (track->beats, 0, sequence->tracks[i].beats, sequence->beats_num);
+        if (track->mask)
+        {
+            track->mask = bitset_new (sequence->beats_num);
+            bitset_copy (track->mask, 0, sequence->tracks[i].mask, sequence->beats_num);
+        }
+        track->buffers = calloc (track->channels_num, sizeof (float *));
+        for (j = 0; j < track->channels_num; j++)
+            track->buffers[j] = calloc (bufsize, sizeof (float));
+        if (track->sample)
+        {
+            track->sample_input_pos = track->sample->frames;
+            track->sample_output_pos = track->sample->frames;
+        }
+        track->active_beat = -1;
+        if (track->sample)
+            track->sr_converter_ratio = track->sr_converter_ratio * framerate / sequence_tmp->framerate;
+    }
+
+    sequence_tmp->framerate = framerate;
+    return sequence_tmp;
+}
+
+static void
+sequence_export_end (sequence_t *sequence, sequence_t *sequence_tmp)
+{
+    sequence_track_t *track;
+    int i, j;
+
+    // Freeing temporary buffers
+    for (i = 0; i < sequence->tracks_num; i++)
+    {
+        track = sequence_tmp->tracks + i;
+        for (j = 0; j < track->channels_num; j++)
+        {
+            free (track->buffers[j]);
+        }
+        free (track->buffers);
+        free (track->beats);
+        free (track->mask);
+    }
+    free (sequence_tmp->tracks);
+    free (sequence_tmp);
+}
+
+/**
+ * Render the sequence into a stereo file, normalized, in the given libsndfile
+ * format (for instance SF_FORMAT_WAV | SF_FORMAT_PCM_16). Returns the number
+ * of frames written, or 0 if the file couldn't be opened.
+ */
+unsigned long
+sequence_export (sequence_t *sequence, char *filename, int framerate, int sustain_type,
+                 int format, progress_callback_t progress_callback, void *progress_data)
+{
+    sequence_lock (sequence);
+    unsigned long bufsize;
+    SF_INFO info;
+    SNDFILE *fd;
+    int i;
+    float *output;
+    unsigned long nframes, pos, nframes_played, sequence_nframes, written = 0;
+    sequence_t *sequence_tmp;
+    sequence_track_t *track;
+
+    DEBUG ("Exporting sequence to file: %s", filename);
+
+    sequence->error = 0;
+    if (sequence_count_nested (sequence))
+    {
+        DEBUG ("Can't export tracks which use other sequences");
+        sequence->error = ERR_SEQUENCE_NESTED;
+        sequence_unlock (sequence);
+        return 0;
+    }
+
+    SEQUENCE_UNLOCK_CALL (progress_callback ("Preparing to export...", 0, progress_data));
+
+    // Opening file for writing
+    info.samplerate = framerate;
+    info.channels = 2;
+    info.format = format;
+    fd = sf_open (filename, SFM_WRITE, &info);
+    if (fd)
+    {
+        DEBUG ("Successfully opened outfile");
+    }
+    else
+    {
+        DEBUG ("FAILED to open outfile: %s", sf_strerror (NULL));
+        SEQUENCE_UNLOCK_CALL (progress_callback ("Done", 1, progress_data));
+        sequence_unlock (sequence);
+        return 0;
+    }
+
+    bufsize = sequence->buffer_size;
+    sequence_tmp = sequence_export_begin (sequence, framerate, sustain_type);
+    sequence_nframes = sequence_beat_start (sequence_get_beat_length (sequence_tmp), sequence->beats_num);
+
+    output = calloc (2 * bufsize, sizeof (float));
+
+    long int process_total_nframes = 0, process_pos = 0;
+    switch (sustain_type)
+    {
+        case SEQUENCE_SUSTAIN_LOOP:
+            process_total_nframes = sequence_nframes * 4;
+            break;
+        case SEQUENCE_SUSTAIN_TRUNCATE:
+            process_total_nframes = sequence_nframes * 3;
+            break;
+        case SEQUENCE_SUSTAIN_KEEP:
+            process_total_nframes = (sequence_nframes + sequence_get_sustain_nframes (sequence)) * 3;
+            break;
+    }
+
+    // Dry playing once for loop mixing
+    if (sustain_type == SEQUENCE_SUSTAIN_LOOP)
+        for (pos = 0; pos < sequence_nframes; pos += bufsize)
+        {
+            SEQUENCE_UNLOCK_CALL (progress_callback ("Preparing loop",
+                                                     0.1 + (float) process_pos / process_total_nframes * 0.9,
+                                                     progress_data));
+            nframes = pos + bufsize < sequence_nframes ? bufsize : sequence_nframes - pos;
+            sequence_do_process (sequence_tmp, pos, nframes);
+            process_pos += nframes;
+        }
+
+    // Finding level peak
+    float peak = 0;
+    for (pos = 0; pos < sequence_nframes; pos += bufsize)
+    {
+        SEQUENCE_UNLOCK_CALL (progress_callback ("Computing level peak",
+                                                 0.1 + (float) process_pos / process_total_nframes * 0.9,
+                                                 progress_data));
+        nframes = pos + bufsize < sequence_nframes ? bufsize : sequence_nframes - pos;
+        sequence_do_process (sequence_tmp, pos, nframes);
+        sequence_export_mix (sequence_tmp, output, nframes);
+        for (i = 0; i < (nframes * 2); i++) if (fabsf (output[i]) > peak) peak = fabsf (output[i]);
+        process_pos += nframes;
+    }
+
+    if (sustain_type == SEQUENCE_SUSTAIN_KEEP)
+    {
+        for (; (nframes_played = sequence_do_process (sequence_tmp, pos, bufsize)); pos += bufsize)
+        {
+            SEQUENCE_UNLOCK_CALL (progress_callback ("Computing level peak",
+                                                     0.1 + (float) process_pos / process_total_nframes * 0.9,
+                                                     progress_data));
+            sequence_export_mix (sequence_tmp, output, nframes_played);
+            for (i = 0; i < (nframes_played * 2); i++) if (fabsf (output[i]) > peak) peak = fabsf (output[i]);
+            process_pos += nframes_played;
+        }
+    }
+
+    if (sustain_type != SEQUENCE_SUSTAIN_LOOP)
+        for (i = 0; i < sequence_tmp->tracks_num; i++)
+        {
+            track = sequence_tmp->tracks + i;
+            if (track->sample)
+            {
+                track->sample_input_pos = track->sample->frames;
+                track->sample_output_pos = track->sample->frames;
+            }
+            track->active_beat = -1;
+        }
+
+    DEBUG ("level peak is: %f", peak);
+    if (peak == 0)
+        peak = 1;
+
+    // Writing to file
+    for (pos = 0; pos < sequence_nframes; pos += bufsize)
+    {
+        SEQUENCE_UNLOCK_CALL (progress_callback ("Mixing and writing to file",
+                                                 0.1 + (float) process_pos / process_total_nframes * 0.9,
+                                                 progress_data));
+        nframes = pos + bufsize < sequence_nframes ? bufsize : sequence_nframes - pos;
+        sequence_do_process (sequence_tmp, pos, nframes);
+        sequence_export_mix (sequence_tmp, output, nframes);
+        for (i = 0; i < (nframes * 2); i++) output[i] /= peak;
+        written += sf_writef_float (fd, output, nframes);
+        process_pos += nframes * 2;
+    }
+
+    if (sustain_type == SEQUENCE_SUSTAIN_KEEP)
+        for (; (nframes_played = sequence_do_process (sequence_tmp, pos, bufsize)); pos += bufsize)
+        {
+            SEQUENCE_UNLOCK_CALL (progress_callback ("Mixing and writing to file",
+                                                     0.1 + (float) process_pos / process_total_nframes * 0.9,
+                                                     progress_data));
+            sequence_export_mix (sequence_tmp, output, nframes_played);
+            for (i = 0; i < (nframes_played * 2); i++) output[i] /= peak;
+            written += sf_writef_float (fd, output, nframes_played);
+            process_pos += nframes_played * 2;
+        }
+
+    DEBUG ("Processed %ld frames on an estimated total of %ld", process_pos, process_total_nframes);
+
+    sf_close (fd);
+
+    free (output);
+    sequence_export_end (sequence, sequence_tmp);
+
+    SEQUENCE_UNLOCK_CALL (progress_callback ("Done", 1, progress_data));
+    sequence_unlock (sequence);
+
+    return written;
+}
+
+/* Size of the queue of each stem file, in bytes, a power of 2 */
+#define SEQUENCE_STEMS_QUEUE_SIZE 262144
+#define SEQUENCE_STEMS_CHUNK      1024 // Frames, read by writers at once
+
+typedef struct sequence_stem_t
+{
+    char *          filename;
+    SNDFILE *       fd;
+    ringbuffer_t *  queue;
+    int             normalize;
+    FILE *          spool;      // Whole output, when normalizing
+    float           peak;
+} sequence_stem_t;
+
+typedef struct sequence_stems_writer_t
+{
+    pthread_t           thread;
+    sequence_stem_t *   stems;
+    int                 stems_num;
+    int                 first;
+    int                 step;
+    int volatile *      done;
+} sequence_stems_writer_t;
+
+/* Queue frames for writing, waiting for the writer if it is late */
+static void
+sequence_stems_push (sequence_stem_t *stem, float *data, unsigned long nframes)
+{
+    size_t size = nframes * 2 * sizeof (float), space;
+    char *ptr = (char *) data;
+
+    while (size)
+    {
+        while (!(space = ringbuffer_write_space (stem->queue)))
+            compat_sleep (1);
+        if (space > size)
+            space = size;
+        ringbuffer_write (stem->queue, ptr, space);
+        ptr += space;
+        size -= space;
+    }
+}
+
+static void
+sequence_stems_pull (sequence_stem_t *stem, float *data, unsigned long nframes)
+{
+    unsigned long i;
+    ringbuffer_read (stem->queue, (char *) data, nframes * 2 * sizeof (float));
+    if (stem->normalize)
+    {
+        for (i = 0; i < nframes * 2; i++)
+            if (fabsf (data[i]) > stem->peak)
+                stem->peak = fabsf (data[i]);
+        fwrite (data, 2 * sizeof (float), nframes, stem->spool);
+    }
+    else
+    {
+        sf_writef_float (stem->fd, data, nframes);
+    }
+}
+
+/**
+ * Encode the stems assigned to a writer as they get rendered. The done flag
+ * is read before draining the queues, so that nothing is left behind once it
+ * is seen set with all queues empty.
+ */
+static void *
+sequence_stems_writer_run (void *data)
+{
+    sequence_stems_writer_t *writer = (sequence_stems_writer_t *) data;
+    float buffer[SEQUENCE_STEMS_CHUNK * 2];
+    sequence_stem_t *stem;
+    unsigned long nframes, i;
+    int k, done, idle;
+
+    do
+    {
+        done = *writer->done;
+        __sync_synchronize ();
+        idle = 1;
+        for (k = writer->first; k < writer->stems_num; k += writer->step)
+        {
+            stem = writer->stems + k;
+            while ((nframes = ringbuffer_read_space (stem->queue) / (2 * sizeof (float))))
+            {
+                if (nframes > SEQUENCE_STEMS_CHUNK)
+                    nframes = SEQUENCE_STEMS_CHUNK;
+                sequence_stems_pull (stem, buffer, nframes);
+                idle = 0;
+            }
+        }
+        if (idle && !done)
+            compat_sleep (1);
+    }
+    while (!done || !idle);
+
+    for (k = writer->first; k < writer->stems_num; k += writer->step)
+    {
+        stem = writer->stems + k;
+        if (stem->normalize)
+        {
+            // Second pass, once the peak is known
+            if (stem->peak == 0)
+                stem->peak = 1;
+            rewind (stem->spool);
+            while ((nframes = fread (buffer, 2 * sizeof (float), SEQUENCE_STEMS_CHUNK, stem->spool)))
+            {
+                for (i = 0; i < nframes * 2; i++)
+                    buffer[i] /= stem->peak;
+                sf_writef_float (stem->fd, buffer, nframes);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Split a rendered block into the stem queues, summing the mix if requested */
+static void
+sequence_stems_process (sequence_t *sequence_tmp, sequence_stem_t *stems, int mix,
+                        float *output, float *mix_output, unsigned long nframes)
 {
-    SEQUENCE_SAFE_GETTER (int, sequence->sr_converter_default_type);
+    int i, k;
+
+    if (mix)
+        memset (mix_output, 0, nframes * 2 * sizeof (float));
+
+    for (i = 0; i < sequence_tmp->tracks_num; i++)
+    {
+        memset (output, 0, nframes * 2 * sizeof (float));
+        sequence_export_add_track (sequence_tmp->tracks + i, output, nframes);
+        sequence_stems_push (stems + i, output, nframes);
+        if (mix)
+            for (k = 0; k < nframes * 2; k++)
+                mix_output[k] += output[k];
+    }
+
+    if (mix)
+        sequence_stems_push (stems + sequence_tmp->tracks_num, mix_output, nframes);
 }
 
-void
-sequence_export (sequence_t *sequence, char *filename, int framerate, int sustain_type,
-                 progress_callback_t progress_callback, void *progress_data)
+/**
+ * Render each track into its own stereo file, named after the path, the track
+ * name and the extension, such as "path-kick.wav", and optionally the mix into
+ * "path.wav", from a single rendering pass.
+ *
+ * Unlike the mix, which is normalized as by sequence_export(), stems are
+ * written at their actual level, clipped if needed, so that they sum up to the
+ * mix before normalization. Files are encoded by up to writers_num threads.
+ * The mix is spooled to a temporary file until its peak is known.
+ *
+ * Returns the number of frames written to each file, or 0 if some file
+ * couldn't be opened.
+ */
+unsigned long
+sequence_export_stems (sequence_t *sequence, char *path, char *extension, int framerate,
+                       int sustain_type, int format, int mix, int writers_num,
+                       progress_callback_t progress_callback, void *progress_data)
 {
     sequence_lock (sequence);
     unsigned long bufsize;
     SF_INFO info;
-    SNDFILE *fd;
-    int i, j;
-    float *output;
-    unsigned long nframes, pos, nframes_played, sequence_nframes;
-    sequence_msg_t msg;
+    int i, stems_num, failed = 0;
+    int volatile done = 0;
+    float *output, *mix_output;
+    unsigned long nframes, pos, nframes_played, sequence_nframes, written = 0;
     sequence_t *sequence_tmp;
-    sequence_track_t *track;
+    sequence_stem_t *stems;
+    sequence_stems_writer_t *writers;
 
-    DEBUG ("Exporting sequence to file: %s", filename);
-
-    SEQUENCE_UNLOCK_CALL (progress_callback ("Preparing to export...", 0, progress_data));
-
-    bufsize = sequence->buffer_size;
+    DEBUG ("Exporting stems to: %s-*.%s", path, extension);
 
-    // Stopping sequence
-    if (sequence->status == SEQUENCE_ENABLED)
+    sequence->error = 0;
+    if (sequence_count_nested (sequence))
     {
-        msg.type = SEQUENCE_MSG_ACK_DISABLE;
-        msg_send (sequence->msg, &msg, MSG_ACK);
+        DEBUG ("Can't export tracks which use other sequences");
+        sequence->error = ERR_SEQUENCE_NESTED;
+        sequence_unlock (sequence);
+        return 0;
     }
 
-    sequence_tmp = malloc (sizeof (sequence_t));
-    memcpy (sequence_tmp, sequence, sizeof (sequence_t));
+    SEQUENCE_UNLOCK_CALL (progress_callback ("Preparing to export...", 0, progress_data));
 
-    sequence_tmp->tracks = calloc (sequence->tracks_num, sizeof (sequence_track_t));
-    memcpy (sequence_tmp->tracks, sequence->tracks, sequence->tracks_num * sizeof (sequence_track_t));
+    // Opening all files first, so that nothing gets rendered if one can't be
+    stems_num = sequence->tracks_num + (mix ? 1 : 0);
+    stems = calloc (stems_num, sizeof (sequence_stem_t));
+    for (i = 0; i < stems_num && !failed; i++)
+    {
+        sequence_stem_t *stem = stems + i;
+        if (i < sequence->tracks_num)
+        {
+            char *name = sequence->tracks_info[i].name;
+            stem->filename = malloc (strlen (path) + strlen (name) + strlen (extension) + 3);
+            sprintf (stem->filename, "%s-%s.%s", path, name, extension);
+        }
+        else
+        {
+            stem->filename = malloc (strlen (path) + strlen (extension) + 2);
+            sprintf (stem->filename, "%s.%s", path, extension);
+            stem->normalize = 1;
+        }
 
-    sequence_tmp->looping = (sustain_type == SEQUENCE_SUSTAIN_LOOP);
+        info.samplerate = framerate;
+        info.channels = 2;
+        info.format = format;
+        if ((stem->fd = sf_open (stem->filename, SFM_WRITE, &info)))
+        {
+            if (!stem->normalize)
+                sf_command (stem->fd, SFC_SET_CLIPPING, NULL, SF_TRUE);
+            else if (!(stem->spool = tmpfile ()))
+            {
+                DEBUG ("FAILED to create a temporary file for %s", stem->filename);
+                failed = 1;
+            }
+        }
+        else
+        {
+            DEBUG ("FAILED to open %s: %s", stem->filename, sf_strerror (NULL));
+            failed = 1;
+        }
+    }
 
-    // Allocating temporary buffers
-    for (i = 0; i < sequence->tracks_num; i++)
+    if (failed)
     {
-        track = sequence_tmp->tracks + i;
-        track->buffers = calloc (track->channels_num, sizeof (float *));
-        for (j = 0; j < track->channels_num; j++)
-            track->buffers[j] = calloc (bufsize, sizeof (float));
-        if (track->sample)
+        for (i = 0; i < stems_num; i++)
         {
-            *(track->sample_input_pos) = track->sample->frames;
-            *(track->sample_output_pos) = track->sample->frames;
+            if (stems[i].fd)
+                sf_close (stems[i].fd);
+            if (stems[i].spool)
+                fclose (stems[i].spool);
+            free (stems[i].filename);
         }
-        track->active_beat = -1;
-        if (track->sample)
-            track->sr_converter_ratio = track->sr_converter_ratio * framerate / sequence_tmp->framerate;
+        free (stems);
+        SEQUENCE_UNLOCK_CALL (progress_callback ("Done", 1, progress_data));
+        sequence_unlock (sequence);
+        return 0;
     }
 
-    sequence_tmp->framerate = framerate;
-    sequence_nframes = sequence->beats_num * sequence_get_beat_nframes (sequence_tmp);
+    bufsize = sequence->buffer_size;
+    sequence_tmp = sequence_export_begin (sequence, framerate, sustain_type);
+    sequence_nframes = sequence_beat_start (sequence_get_beat_length (sequence_tmp), sequence->beats_num);
 
     output = calloc (2 * bufsize, sizeof (float));
-
-    // Opening file for writing
-    info.samplerate = sequence_tmp->framerate;
-    info.channels = 2;
-    info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
-    fd = sf_open (filename, SFM_WRITE, &info); // Needs error checking
-    if (fd)
-    {
-        DEBUG ("Successfully opened outfile");
-    }
-    else
-    {
-        DEBUG ("FAILED to open outfile");
-        sf_perror (fd);
-    }
+    mix_output = calloc (2 * bufsize, sizeof (float));
 
     long int process_total_nframes = 0, process_pos = 0;
     switch (sustain_type)
     {
         case SEQUENCE_SUSTAIN_LOOP:
-            process_total_nframes = sequence_nframes * 4;
+            process_total_nframes = sequence_nframes * 2;
             break;
         case SEQUENCE_SUSTAIN_TRUNCATE:
-            process_total_nframes = sequence_nframes * 3;
+            process_total_nframes = sequence_nframes;
             break;
         case SEQUENCE_SUSTAIN_KEEP:
-            process_total_nframes = (sequence_nframes + sequence_get_sustain_nframes (sequence)) * 3;
+            process_total_nframes = sequence_nframes + sequence_get_sustain_nframes (sequence);
             break;
     }
 
+    // Starting writers
+    if (writers_num > stems_num)
+        writers_num = stems_num;
+    if (writers_num < 1)
+        writers_num = 1;
+    writers = calloc (writers_num, sizeof (sequence_stems_writer_t));
+    for (i = 0; i < stems_num; i++)
+        stems[i].queue = ringbuffer_create (SEQUENCE_STEMS_QUEUE_SIZE);
+    for (i = 0; i < writers_num; i++)
+    {
+        writers[i].stems = stems;
+        writers[i].stems_num = stems_num;
+        writers[i].first = i;
+        writers[i].step = writers_num;
+        writers[i].done = &done;
+        pthread_create (&writers[i].thread, NULL, sequence_stems_writer_run, (void *) (writers + i));
+    }
+
     // Dry playing once for loop mixing
     if (sustain_type == SEQUENCE_SUSTAIN_LOOP)
         for (pos = 0; pos < sequence_nframes; pos += bufsize)
@@ -2123,104 +4598,395 @@ sequence_export (sequence_t *sequence, char *filename, int framerate, int sustai
             process_pos += nframes;
         }
 
-    // Finding level peak
-    float peak = 0;
+    // Rendering, while writers encode
     for (pos = 0; pos < sequence_nframes; pos += bufsize)
     {
-        SEQUENCE_UNLOCK_CALL (progress_callback ("Computing level peak",
+        SEQUENCE_UNLOCK_CALL (progress_callback ("Rendering stems",
                                                  0.1 + (float) process_pos / process_total_nframes * 0.9,
                                                  progress_data));
         nframes = pos + bufsize < sequence_nframes ? bufsize : sequence_nframes - pos;
         sequence_do_process (sequence_tmp, pos, nframes);
-        sequence_export_mix (sequence_tmp, output, nframes);
-        for (i = 0; i < (nframes * 2); i++) if (fabsf (output[i]) > peak) peak = fabsf (output[i]);
+        sequence_stems_process (sequence_tmp, stems, mix, output, mix_output, nframes);
+        written += nframes;
         process_pos += nframes;
     }
 
     if (sustain_type == SEQUENCE_SUSTAIN_KEEP)
-    {
         for (; (nframes_played = sequence_do_process (sequence_tmp, pos, bufsize)); pos += bufsize)
         {
-            SEQUENCE_UNLOCK_CALL (progress_callback ("Computing level peak",
+            SEQUENCE_UNLOCK_CALL (progress_callback ("Rendering stems",
                                                      0.1 + (float) process_pos / process_total_nframes * 0.9,
                                                      progress_data));
-            sequence_export_mix (sequence_tmp, output, nframes_played);
-            for (i = 0; i < (nframes_played * 2); i++) if (fabsf (output[i]) > peak) peak = fabsf (output[i]);
+            sequence_stems_process (sequence_tmp, stems, mix, output, mix_output, nframes_played);
+            written += nframes_played;
             process_pos += nframes_played;
         }
+
+    SEQUENCE_UNLOCK_CALL (progress_callback ("Writing to files", 1, progress_data));
+    __sync_synchronize ();
+    done = 1;
+    for (i = 0; i < writers_num; i++)
+        pthread_join (writers[i].thread, NULL);
+
+    DEBUG ("Rendered %lu frames into %d file(s)", written, stems_num);
+
+    for (i = 0; i < stems_num; i++)
+    {
+        sf_close (stems[i].fd);
+        ringbuffer_free (stems[i].queue);
+        free (stems[i].filename);
+        if (stems[i].spool)
+            fclose (stems[i].spool);
     }
+    free (stems);
+    free (writers);
+    free (output);
+    free (mix_output);
+    sequence_export_end (sequence, sequence_tmp);
 
-    if (sustain_type != SEQUENCE_SUSTAIN_LOOP)
-        for (i = 0; i < sequence_tmp->tracks_num; i++)
-        {
-            track = sequence_tmp->tracks + i;
-            if (track->sample)
-            {
-                *(track->sample_input_pos) = track->sample->frames;
-                *(track->sample_output_pos) = track->sample->frames;
-            }
-            track->active_beat = -1;
-        }
+    SEQUENCE_UNLOCK_CALL (progress_callback ("Done", 1, progress_data));
+    sequence_unlock (sequence);
 
-    DEBUG ("level peak is: %f", peak);
+    return written;
+}
 
-    // Writing to file
-    for (pos = 0; pos < sequence_nframes; pos += bufsize)
+/**
+ * Allocate a rendered loop, with its channel data, in a single block.
+ */
+static sequence_freeze_t *
+sequence_freeze_new (int channels_num, unsigned long nframes, int beats_num)
+{
+    int j;
+    size_t size = sizeof (sequence_freeze_t) + channels_num * sizeof (float *)
+            + (beats_num + channels_num * nframes) * sizeof (float);
+    sequence_freeze_t *freeze = calloc (1, size);
+
+    freeze->data = (float **) (freeze + 1);
+    freeze->levels = (float *) (freeze->data + channels_num);
+    for (j = 0; j < channels_num; j++)
+        freeze->data[j] = freeze->levels + beats_num + j * nframes;
+    freeze->nframes = nframes;
+    freeze->channels_num = channels_num;
+    freeze->size = size;
+    return freeze;
+}
+
+/**
+ * Render the next chunk of a track loop. The loop of the single track sequence
+ * is played twice, and the second pass is kept, so that sample tails wrap
+ * around the loop start as they would when playing live.
+ *
+ * Returns 1 once the whole loop has been rendered.
+ */
+static int
+sequence_render_loop (sequence_freeze_job_t *job)
+{
+    sequence_t *tmp = &job->tmp;
+    sequence_track_t *t = tmp->tracks;
+    sequence_freeze_t *freeze = job->freeze;
+    double beat_length = freeze->beat_length;
+    unsigned long loop_start = freeze->nframes;
+    unsigned long loop_end = sequence_beat_start (beat_length, 2 * tmp->beats_num);
+    unsigned long chunk_end = job->pos + SEQUENCE_FREEZE_CHUNK * tmp->buffer_size;
+    unsigned long pos, nframes, from;
+    int j, beat;
+
+    for (pos = job->pos; pos < loop_end && pos < chunk_end; pos += nframes)
     {
-        SEQUENCE_UNLOCK_CALL (progress_callback ("Mixing and writing to file",
-                                                 0.1 + (float) process_pos / process_total_nframes * 0.9,
-                                                 progress_data));
-        nframes = pos + bufsize < sequence_nframes ? bufsize : sequence_nframes - pos;
-        sequence_do_process (sequence_tmp, pos, nframes);
-        sequence_export_mix (sequence_tmp, output, nframes);
-        for (i = 0; i < (nframes * 2); i++) output[i] /= peak;
-        sf_writef_float (fd, output, nframes);
-        process_pos += nframes * 2;
+        nframes = pos + tmp->buffer_size < loop_end
+                ? tmp->buffer_size : loop_end - pos;
+        sequence_do_process (tmp, pos, nframes);
+        if (pos + nframes <= loop_start)
+            continue;
+
+        from = pos < loop_start ? loop_start - pos : 0;
+        if (!t->silent)
+            for (j = 0; j < t->channels_num; j++)
+                memcpy (freeze->data[j] + pos + from - loop_start, t->buffers[j] + from,
+                        (nframes - from) * sizeof (float));
+
+        beat = sequence_beat_at (beat_length, pos + from) - tmp->beats_num;
+        if (t->current_level > freeze->levels[beat])
+            freeze->levels[beat] = t->current_level;
     }
 
-    if (sustain_type == SEQUENCE_SUSTAIN_KEEP)
-        for (; (nframes_played = sequence_do_process (sequence_tmp, pos, bufsize)); pos += bufsize)
+    job->pos = pos;
+    return pos >= loop_end;
+}
+
+/**
+ * Take a private copy of the next track to freeze, if any. Must be called with
+ * the sequence locked.
+ *
+ * Returns 1 if a request was handled, 0 if there was none.
+ */
+static int
+sequence_freeze_start (sequence_t *sequence, sequence_freeze_job_t **job_ptr)
+{
+    sequence_freeze_job_t *job;
+    sequence_track_t *track;
+    sequence_track_info_t *info = NULL;
+    double beat_length;
+    int i, j, error;
+
+    *job_ptr = NULL;
+    if (!sequence->freeze_pending)
+        return 0;
+
+    for (i = 0; i < sequence->tracks_num; i++)
+        if (sequence->tracks_info[i].freeze_serial && !sequence->tracks_info[i].freeze)
         {
-            SEQUENCE_UNLOCK_CALL (progress_callback ("Mixing and writing to file",
-                                                     0.1 + (float) process_pos / process_total_nframes * 0.9,
-                                                     progress_data));
-            sequence_export_mix (sequence_tmp, output, nframes_played);
-            for (i = 0; i < (nframes_played * 2); i++) output[i] /= peak;
-            sf_writef_float (fd, output, nframes_played);
-            process_pos += nframes_played * 2;
+            info = sequence->tracks_info + i;
+            break;
         }
 
-    DEBUG ("Processed %ld frames on an estimated total of %ld", process_pos, process_total_nframes);
+    if (!info)
+    {
+        sequence->freeze_pending = 0;
+        return 0;
+    }
 
-    sf_close (fd);
+    if (!info->sample || !sequence->looping || !sequence->beats_num)
+    {
+        info->freeze_serial = 0;
+        return 1;
+    }
 
-    // Freeing temporary buffers
-    free (output);
+    job = calloc (1, sizeof (sequence_freeze_job_t));
+    job->serial = info->freeze_serial;
+    track = &job->track;
+
+    /* Only the fields which sequence_do_process() reads are set, so that
+       nothing is shared with the live sequence. Without a message queue, the
+       render fires no events. */
+    job->tmp.framerate = sequence->framerate;
+    job->tmp.bpm = sequence->bpm;
+    job->tmp.measure_len = sequence->measure_len;
+    job->tmp.beats_num = sequence->beats_num;
+    job->tmp.buffer_size = sequence->buffer_size;
+    job->tmp.looping = 1;
+    job->tmp.tracks = track;
+    job->tmp.tracks_num = 1;
+
+    memcpy (track, sequence->tracks + i, sizeof (sequence_track_t));
+    sequence_settle_params (track);
+
+    track->sample = info->sample;
+    sample_ref (track->sample);
+    track->beats = bitset_new (sequence->beats_num);
+    bitset_copy (track->beats, 0, sequence->tracks[i].beats, sequence->beats_num);
+    if (track->mask)
+    {
+        track->mask = bitset_new (sequence->beats_num);
+        bitset_copy (track->mask, 0, sequence->tracks[i].mask, sequence->beats_num);
+    }
+    track->freeze = NULL;
+    track->nested = NULL;
+    track->channels = NULL;
+    track->enabled = 1;
+    track->mute_gain = 1;
+    track->solo = 0;
+    track->lock = 0;
+    track->sample_input_pos = track->sample->frames;
+    track->sample_output_pos = track->sample->frames;
+    track->active_beat = -1;
+    track->active_mask_beat = -1;
+    track->mask_envelope = 1;
+    track->sr_converter = (track->sr_converter_type == SEQUENCE_SINC)
+            ? src_new (SRC_SINC_FASTEST, track->channels_num, &error) : NULL;
+    track->sr_converter_buffer = calloc (sequence->buffer_size * track->channels_num, sizeof (float));
+    track->buffers = calloc (track->channels_num, sizeof (float *));
+    for (j = 0; j < track->channels_num; j++)
+        track->buffers[j] = calloc (sequence->buffer_size, sizeof (float));
+
+    // The first loop is the longest one, since it starts on an exact frame
+    beat_length = sequence_get_beat_length (&job->tmp);
+    job->freeze = sequence_freeze_new (track->channels_num,
+                                       sequence_beat_start (beat_length, sequence->beats_num),
+                                       sequence->beats_num);
+    job->freeze->beat_length = beat_length;
+
+    DEBUG ("Rendering track %d loop", i);
+    *job_ptr = job;
+    return 1;
+}
+
+/**
+ * Free the private track copy of a freeze job, but not its rendered loop.
+ */
+static void
+sequence_freeze_job_destroy (sequence_freeze_job_t *job)
+{
+    sequence_track_t *track = &job->track;
+    int j;
+
+    for (j = 0; j < track->channels_num; j++)
+        free (track->buffers[j]);
+    free (track->buffers);
+    free (track->sr_converter_buffer);
+    if (track->sr_converter)
+        src_delete (track->sr_converter);
+    free (track->beats);
+    free (track->mask);
+    sample_release (track->sample);
+    free (job);
+}
+
+/**
+ * Publish a rendered loop to the audio thread, unless the track changed
+ * meanwhile, in which case it is dropped.
+ */
+static void
+sequence_freeze_end (sequence_t *sequence, sequence_freeze_job_t *job)
+{
+    sequence_freeze_t *freeze = job->freeze;
+    sequence_msg_t msg;
+    int i;
+
+    sequence_lock (sequence);
     for (i = 0; i < sequence->tracks_num; i++)
+        if (sequence->tracks_info[i].freeze_serial == job->serial)
+            break;
+
+    if (i < sequence->tracks_num && !sequence->tracks_info[i].freeze)
     {
-        track = sequence_tmp->tracks + i;
-        for (j = 0; j < track->channels_num; j++)
+        sequence->tracks_info[i].freeze = freeze;
+        msg.type = SEQUENCE_MSG_FREEZE_TRACK;
+        sprintf (msg.text, "track=%d freeze=%p", i, freeze);
+        msg_send (sequence->msg, &msg, 0);
+    }
+    else
+    {
+        DEBUG ("Track changed while rendering, dropping its loop");
+        free (freeze);
+    }
+    sequence_unlock (sequence);
+
+    sequence_freeze_job_destroy (job);
+}
+
+/**
+ * Render pending track freezes in a pool thread. The sequence is only locked
+ * while taking a private copy of the track and publishing the result, and the
+ * loop is rendered a few buffers at a time, so that the other pool processes
+ * get their turn meanwhile.
+ *
+ * Returns 1 if there is more work to do right away, 0 otherwise.
+ */
+static int
+sequence_freeze_next (sequence_t *sequence)
+{
+    sequence_freeze_job_t *job = sequence->freeze_job;
+    int handled = 0;
+
+    if (job)
+    {
+        if (sequence_render_loop (job))
         {
-            free (track->buffers[j]);
+            sequence->freeze_job = NULL;
+            sequence_freeze_end (sequence, job);
         }
-        free (track->buffers);
+        return 1;
     }
-    free (sequence_tmp->tracks);
-    free (sequence_tmp);
 
-    SEQUENCE_UNLOCK_CALL (progress_callback ("Done", 1, progress_data));
+    /* Let the audio thread apply pending parameter changes before copying
+       them, that is: wait for a whole cycle to run after the request, without
+       blocking the pool thread. */
+    sequence_lock (sequence);
+    if (!sequence->freeze_pending)
+        sequence->freeze_waiting = 0;
+    else if (!sequence->freeze_waiting)
+    {
+        sequence->freeze_stamp = epoch_get (sequence->epoch);
+        sequence->freeze_waiting = 1;
+    }
+    else if (epoch_get (sequence->epoch) - sequence->freeze_stamp >= 2)
+    {
+        sequence->freeze_waiting = 0;
+        handled = sequence_freeze_start (sequence, &sequence->freeze_job);
+    }
     sequence_unlock (sequence);
 
+    return handled;
 }
 
 static int
 sequence_process_events (void *data)
 {
     sequence_t *sequence = (sequence_t *) data;
+    unsigned long dropped;
     sequence_lock (sequence);
     msg_process_events (sequence->msg, sequence);
+    epoch_collect (sequence->epoch);
+    if ((dropped = sequence->params_dropped) != sequence->params_dropped_reported)
+    {
+        DEBUG ("WARNING: parameter queue full, dropped %lu change(s)",
+               dropped - sequence->params_dropped_reported);
+        sequence->params_dropped_reported = dropped;
+    }
     sequence_unlock (sequence);
-    return 0;
+    return sequence_freeze_next (sequence);
+}
+
+/**
+ * Freeze a track: its loop gets rendered in the background, after which the
+ * audio thread plays it back by copy instead of resampling its sample. This
+ * only applies in looping mode, to tracks which have a sample.
+ *
+ * The track is unfrozen automatically as soon as its pattern or any of its
+ * parameters, or the sequence tempo or length, change. Muting and soloing
+ * don't unfreeze it. The track-freeze-changed event is fired whenever the
+ * audio thread switches between the rendered loop and live rendering.
+ *
+ * Returns 1 if the track is, or is going to be, frozen.
+ */
+int
+sequence_freeze_track (sequence_t *sequence, int track)
+{
+    int success = 0;
+    sequence_lock (sequence);
+    if (sequence_check_pos (sequence, track, 0) && sequence->pool
+        && sequence->looping && sequence->tracks_info[track].sample)
+    {
+        sequence_track_info_t *info = sequence->tracks_info + track;
+        if (!info->freeze_serial)
+        {
+            info->freeze_serial = ++sequence->freeze_serial;
+            sequence->freeze_pending = 1;
+        }
+        success = 1;
+    }
+    sequence_unlock (sequence);
+    return success;
+}
+
+void
+sequence_unfreeze_track (sequence_t *sequence, int track)
+{
+    SEQUENCE_LOCK_CALL (if (sequence_check_pos (sequence, track, 0))
+                        sequence_thaw_track (sequence, track));
+}
+
+/**
+ * Tell whether a track has been rendered and is played from its loop.
+ */
+int
+sequence_track_is_frozen (sequence_t *sequence, int track)
+{
+    SEQUENCE_SAFE_GETTER (int, sequence_check_pos (sequence, track, 0)
+                          ? (sequence->tracks_info[track].freeze ? 1 : 0) : 0);
+}
+
+/**
+ * Return the memory used by a frozen track loop, in bytes, or 0 if the track
+ * isn't frozen.
+ */
+size_t
+sequence_get_track_freeze_memory (sequence_t *sequence, int track)
+{
+    SEQUENCE_SAFE_GETTER (size_t, (sequence_check_pos (sequence, track, 0)
+                                   && sequence->tracks_info[track].freeze)
+                          ? sequence->tracks_info[track].freeze->size : 0);
 }
 
 void
@@ -2239,8 +5005,8 @@ sequence_get_sample_position (sequence_t *sequence, int track)
     if (sequence_check_pos (sequence, track, 0))
     {
         sequence_track_t *t = sequence->tracks + track;
-        if (t->sample && sequence_track_is_playing (sequence, track) && (*(t->sample_output_pos) < t->sample->frames))
-            pos = *(t->sample_output_pos);
+        if (t->sample && sequence_track_is_playing (sequence, track) && (t->sample_output_pos < t->sample->frames))
+            pos = t->sample_output_pos;
     }
     sequence_unlock (sequence);
     return pos;
@@ -2262,7 +5028,11 @@ sequence_swap_tracks (sequence_t *sequence, int track1, int track2)
         sequence_msg_t msg;
         msg.type = SEQUENCE_MSG_SWAP_TRACKS;
         sprintf (msg.text, "track1=%d track2=%d", track1, track2);
-        msg_send (sequence->msg, &msg, 0);
+        msg_send (sequence->msg, &msg, MSG_ACK);
+
+        sequence_track_info_t tmp = sequence->tracks_info[track1];
+        sequence->tracks_info[track1] = sequence->tracks_info[track2];
+        sequence->tracks_info[track2] = tmp;
     }
     sequence_unlock (sequence);
 }
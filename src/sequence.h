@@ -58,8 +58,37 @@ typedef enum sequence_track_type_t {
 typedef struct sequence_position_t {
     int track;
     int beat;
+    unsigned long frame; // Frame time of the cycle during which the event occurred
 } sequence_position_t;
 
+/* State of the sequence at the end of a cycle, as taken by the audio thread */
+typedef struct sequence_snapshot_t {
+    unsigned long frame_time;   // frame time of the cycle
+    unsigned long nframes;      // cycle length
+    int playing;
+    unsigned long position;     // playback position, in frames
+    int beat;                   // current beat, -1 when not playing
+    float bpm;
+    float process_time;         // smoothed, in microseconds
+    int tracks_num;
+    unsigned long params_dropped; // scheduled changes lost to a full queue
+} sequence_snapshot_t;
+
+/* Rectangular part of the pattern, as carried by the region-changed event */
+typedef struct sequence_region_t {
+    int track;
+    int beat;
+    int tracks_num;
+    int beats_num;
+} sequence_region_t;
+
+typedef struct sequence_edit_t sequence_edit_t;
+
+typedef enum sequence_ramp_curve_t {
+    SEQUENCE_RAMP_LINEAR,
+    SEQUENCE_RAMP_EXPONENTIAL
+} sequence_ramp_curve_t;
+
 /* Sequence object construction and destruction */
 sequence_t * sequence_new(stream_t *stream, char *name, int *error);
 void sequence_activate(sequence_t *sequence, pool_t *pool);
@@ -68,8 +97,11 @@ void sequence_destroy(sequence_t *sequence);
 void sequence_wait(sequence_t *sequence);
 
 /* Waveform export */
-void sequence_export(sequence_t *sequence, char *filename, int framerate,
-        int sustain_type,
+unsigned long sequence_export(sequence_t *sequence, char *filename, int framerate,
+        int sustain_type, int format,
+        progress_callback_t progress_callback, void *progress_data);
+unsigned long sequence_export_stems(sequence_t *sequence, char *path, char *extension,
+        int framerate, int sustain_type, int format, int mix, int writers_num,
         progress_callback_t progress_callback, void *progress_data);
 
 /* Global settings and informations */
@@ -83,6 +115,8 @@ void sequence_normalize_name(char *name);
 /* Transport control */
 void sequence_set_transport(sequence_t *sequence, int respond, int query);
 void sequence_get_transport(sequence_t *sequence, int *respond, int *query);
+void sequence_set_transport_follow(sequence_t *sequence, int follow);
+int sequence_get_transport_follow(sequence_t *sequence);
 void sequence_start(sequence_t *sequence);
 void sequence_stop(sequence_t *sequence);
 void sequence_rewind(sequence_t *sequence);
@@ -115,6 +149,15 @@ int sequence_set_sample(sequence_t *sequence, int track, sample_t *sample);
 int sequence_get_sample_usage(sequence_t *sequence, sample_t *sample);
 unsigned long sequence_get_sample_position(sequence_t *sequence, int track);
 
+/* Nested sequences */
+int sequence_set_nested(sequence_t *sequence, int track, sequence_t *source);
+sequence_t * sequence_get_nested(sequence_t *sequence, int track);
+int sequence_unset_nested(sequence_t *sequence, sequence_t *source);
+int sequence_has_nested(sequence_t *sequence);
+float sequence_get_process_time(sequence_t *sequence);
+int sequence_get_snapshot(sequence_t *sequence, sequence_snapshot_t *snapshot, float *levels,
+        int levels_size);
+
 /* Track volume, pitch and smoothing */
 void sequence_set_pitch(sequence_t *sequence, int track, double pitch);
 double sequence_get_pitch(sequence_t *sequence, int track);
@@ -131,6 +174,26 @@ char sequence_track_is_solo(sequence_t *sequence, int track);
 void sequence_set_smoothing(sequence_t *sequence, int track, int status);
 int sequence_get_smoothing(sequence_t *sequence, int track);
 
+/* Scheduled parameter changes */
+unsigned long sequence_get_frame_time(sequence_t *sequence);
+void sequence_schedule_volume(sequence_t *sequence, int track, double volume,
+        unsigned long frame, unsigned long length, sequence_ramp_curve_t curve);
+void sequence_schedule_pitch(sequence_t *sequence, int track, double pitch,
+        unsigned long frame, unsigned long length, sequence_ramp_curve_t curve);
+void sequence_schedule_mute(sequence_t *sequence, int track, char status,
+        unsigned long frame, unsigned long length, sequence_ramp_curve_t curve);
+void sequence_schedule_bpm(sequence_t *sequence, float bpm, unsigned long frame);
+void sequence_schedule_beat(sequence_t *sequence, int track, int beat, char status,
+        unsigned long frame);
+void sequence_schedule_mask_beat(sequence_t *sequence, int track, int beat, char status,
+        unsigned long frame);
+
+/* Track freezing */
+int sequence_freeze_track(sequence_t *sequence, int track);
+void sequence_unfreeze_track(sequence_t *sequence, int track);
+int sequence_track_is_frozen(sequence_t *sequence, int track);
+size_t sequence_get_track_freeze_memory(sequence_t *sequence, int track);
+
 /* Track-masking */
 void sequence_enable_mask(sequence_t *sequence, int track);
 void sequence_disable_mask(sequence_t *sequence, int track);
@@ -142,6 +205,17 @@ int sequence_get_active_mask_beat(sequence_t *sequence, int track);
 /* Beat operations */
 void sequence_set_beat(sequence_t *sequence, int track, int beat, char status);
 char sequence_get_beat(sequence_t *sequence, int track, int beat);
+int sequence_get_pattern(sequence_t *sequence, int track, char *beats, char *mask);
+int sequence_get_region(sequence_t *sequence, sequence_region_t *region, char **beats,
+        char **mask);
+void sequence_set_pattern(sequence_t *sequence, int track, const char *beats, const char *mask);
+
+/* Pattern edit transactions */
+sequence_edit_t * sequence_edit_begin(sequence_t *sequence);
+void sequence_edit_set_beat(sequence_edit_t *edit, int track, int beat, char status);
+void sequence_edit_set_mask_beat(sequence_edit_t *edit, int track, int beat, char status);
+int sequence_edit_commit(sequence_edit_t *edit);
+void sequence_edit_cancel(sequence_edit_t *edit);
 int sequence_get_active_beat(sequence_t *sequence, int track);
 float sequence_get_level(sequence_t * sequence, int track);
 
@@ -26,11 +26,14 @@
 #include <assert.h>
 #include <config.h>
 #include <semaphore.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <glib.h>
 
 #include "song.h"
 #include "core/event.h"
 #include "core/pool.h"
-#include "core/array.h"
+#include "core/vector.h"
 
 #ifdef MEMDEBUG
 #include "memdebug.h"
@@ -44,19 +47,91 @@
 #define FREE_AND_RETURN(P,V) { free(P); return V; }
 #define JACK_CLIENT_NAME "jackbeat"
 
+/* Registered samples are indexed three ways: by pointer (registration
+ * state), by "canonical path|size|ctime" file key, and by content hash
+ * when content dedup is enabled. All three tables share the same entries,
+ * which are owned by the samples table. */
+typedef struct song_sample_entry_t
+{
+    sample_t *  sample;
+    char *      file_key;
+    int         content_indexed;
+} song_sample_entry_t;
+
 struct song_t
 {
     pool_t *      pool;
-    sequence_t ** sequences;
-    int           sequences_num;
-    sample_t **   samples;
-    int           samples_num;
+    vector_t      sequences;
+    GHashTable *  samples;
+    GHashTable *  samples_by_file;
+    GHashTable *  samples_by_content;
+    int           content_dedup;
+    int           transport_follow;
     sem_t         mutex;
 } ;
 
 static void song_on_sample_destroy (event_t *event);
 static void song_on_sequence_destroy (event_t *event);
 
+/* The mutex guards the samples tables: samples may get destroyed by a pool
+ * thread, when a sequence releases its last reference. */
+static void
+song_lock (song_t *song)
+{
+    sem_wait (&(song->mutex));
+}
+
+static void
+song_unlock (song_t *song)
+{
+    sem_post (&(song->mutex));
+}
+
+static guint
+song_content_hash (gconstpointer key)
+{
+    uint64_t hash = *((const uint64_t *) key);
+    return (guint) (hash ^ (hash >> 32));
+}
+
+static gboolean
+song_content_equal (gconstpointer a, gconstpointer b)
+{
+    return *((const uint64_t *) a) == *((const uint64_t *) b);
+}
+
+static void
+song_sample_entry_destroy (gpointer value)
+{
+    song_sample_entry_t *entry = (song_sample_entry_t *) value;
+    free (entry->file_key);
+    free (entry);
+}
+
+/* Build the registry key of a sample file, with a single stat() call.
+ * Returns NULL if the file can't be accessed. */
+static char *
+song_sample_file_key (const char *filename, off_t *size, time_t *ctime)
+{
+    struct stat statd;
+    char canonical[PATH_MAX];
+    char *key;
+
+    if (stat (filename, &statd))
+        return NULL;
+
+    if (!realpath (filename, canonical))
+        strncpy (canonical, filename, PATH_MAX - 1)[PATH_MAX - 1] = '\0';
+
+    key = malloc (strlen (canonical) + 64);
+    sprintf (key, "%s|%lld|%lld", canonical, (long long) statd.st_size, (long long) statd.st_ctime);
+    if (size)
+        *size = statd.st_size;
+    if (ctime)
+        *ctime = statd.st_ctime;
+    return key;
+}
+
 song_t *
 song_new (pool_t *pool)
 {
@@ -64,10 +139,11 @@ song_new (pool_t *pool)
     event_register (song, "sequence-registered");
 
     song->pool = pool;
-    song->sequences = NULL;
-    song->sequences_num = 0;
-    song->samples = NULL;
-    song->samples_num = 0;
+    vector_init (&song->sequences);
+    song->samples = g_hash_table_new_full (NULL, NULL, NULL, song_sample_entry_destroy);
+    song->samples_by_file = g_hash_table_new (g_str_hash, g_str_equal);
+    song->samples_by_content = g_hash_table_new (song_content_hash, song_content_equal);
+    song->content_dedup = 1;
     sem_init (&(song->mutex), 0, 1);
     return song;
 
@@ -78,17 +154,21 @@ song_destroy (song_t * song)
 {
     sem_wait (&(song->mutex));
     sem_destroy (&(song->mutex));
-    if (song->sequences) free (song->sequences);
-    if (song->samples) free (song->samples);
+    vector_free (&song->sequences);
+    g_hash_table_destroy (song->samples_by_content);
+    g_hash_table_destroy (song->samples_by_file);
+    g_hash_table_destroy (song->samples);
     free (song);
 }
 
 void
 song_register_sequence (song_t *song, sequence_t *sequence)
 {
-    ARRAY_ADD (sequence_t, song->sequences, song->sequences_num, sequence)
+    vector_add (&song->sequences, sequence);
     event_subscribe (sequence, "destroy", song, song_on_sequence_destroy);
     sequence_activate (sequence, song->pool);
+    if (song->transport_follow)
+        sequence_set_transport_follow (sequence, 1);
     event_fire (song, "sequence-registered", sequence, NULL);
 }
 
@@ -97,53 +177,160 @@ song_register_sequence_samples (song_t *song, sequence_t *sequence)
 {
     int tn = sequence_get_tracks_num (sequence);
     int i;
-    sample_t *sample;
+    sample_t *sample, *shared;
     for (i = 0; i < tn; i++)
         if ((sample = sequence_get_sample (sequence, i)))
-            song_register_sample (song, sample);
+        {
+            if ((shared = song_dedup_sample (song, sample)) && shared != sample)
+            {
+                DEBUG ("Sharing sample '%s' with '%s'", sample->name, shared->name);
+                // Unrefs and frees the duplicate
+                sequence_set_sample (sequence, i, shared);
+            }
+            else
+            {
+                song_register_sample (song, sample);
+            }
+        }
+}
+
+/**
+ * Use a sequence of this song as the source of a track of another one. Both
+ * sequences must be registered. Returns 0 on failure, including when this
+ * would create a cycle; see sequence_set_nested().
+ *
+ * Nested sequences are unset from all tracks using them when destroyed.
+ */
+int
+song_nest_sequence (song_t *song, sequence_t *sequence, int track, sequence_t *source)
+{
+    if (vector_find (&song->sequences, sequence) == -1
+        || (source && vector_find (&song->sequences, source) == -1))
+    {
+        DEBUG ("Warning: can't nest a sequence which isn't part of this song");
+        return 0;
+    }
+
+    return sequence_set_nested (sequence, track, source);
 }
 
 int
 song_count_sequences (song_t * song)
 {
-    return song->sequences_num;
+    return song->sequences.num;
 }
 
 sequence_t **
 song_list_sequences (song_t * song)
 {
-    return song->sequences;
+    return VECTOR_ITEMS (sequence_t, &song->sequences);
+}
+
+static void
+song_index_sample_content (song_t *song, song_sample_entry_t *entry)
+{
+    sample_t *sample = entry->sample;
+    sample_get_content_hash (sample);
+    if (!g_hash_table_lookup (song->samples_by_content, &sample->content_hash))
+    {
+        g_hash_table_insert (song->samples_by_content, &sample->content_hash, entry);
+        entry->content_indexed = 1;
+    }
 }
 
 void
 song_register_sample (song_t *song, sample_t *sample)
 {
-    int i;
-    for (i = 0; i < song->samples_num; i++)
-        if (song->samples[i] == sample)
-        {
-            DEBUG ("Warning: sample '%s' is already registered", sample->name);
-            return;
-        }
-    ARRAY_ADD (sample_t, song->samples, song->samples_num, sample)
+    song_lock (song);
+    if (g_hash_table_lookup (song->samples, sample))
+    {
+        DEBUG ("Warning: sample '%s' is already registered", sample->name);
+        song_unlock (song);
+        return;
+    }
+
+    song_sample_entry_t *entry = calloc (1, sizeof (song_sample_entry_t));
+    entry->sample = sample;
+    g_hash_table_insert (song->samples, sample, entry);
+
+    /* The key only matches if the file hasn't changed since it was loaded */
+    off_t size;
+    time_t ctime;
+    entry->file_key = song_sample_file_key (sample->filename, &size, &ctime);
+    if (entry->file_key && (size != sample->last_file_size || ctime != sample->last_file_ctime))
+    {
+        free (entry->file_key);
+        entry->file_key = NULL;
+    }
+    if (entry->file_key && !g_hash_table_lookup (song->samples_by_file, entry->file_key))
+        g_hash_table_insert (song->samples_by_file, entry->file_key, entry);
+
+    if (song->content_dedup)
+        song_index_sample_content (song, entry);
+
+    song_unlock (song);
     event_subscribe (sample, "destroy", song, song_on_sample_destroy);
 }
 
+void
+song_set_content_dedup (song_t *song, int enable)
+{
+    song->content_dedup = enable;
+}
+
+/**
+ * Make all sequences of this song, including those registered later, follow
+ * the stream transport. See sequence_set_transport_follow().
+ */
+void
+song_set_transport_follow (song_t *song, int enable)
+{
+    int i;
+    song->transport_follow = enable;
+    for (i = 0; i < song->sequences.num; i++)
+        sequence_set_transport_follow (VECTOR_AT (sequence_t, &song->sequences, i), enable);
+}
+
+sample_t *
+song_dedup_sample (song_t *song, sample_t *sample)
+{
+    if (!song->content_dedup)
+        return NULL;
+
+    uint64_t hash = sample_get_content_hash (sample);
+    sample_t *shared = NULL;
+
+    song_lock (song);
+    song_sample_entry_t *entry = g_hash_table_lookup (song->samples_by_content, &hash);
+    if (entry && sample_same_content (entry->sample, sample))
+        shared = entry->sample;
+    song_unlock (song);
+
+    return shared;
+}
+
 int
 song_get_sequence_index (song_t *song)
 {
-    return song->sequences_num;
+    return song->sequences.num;
 }
 
 sample_t *
 song_try_reuse_sample (song_t *song, char *filename)
 {
-    int i;
-    for (i = 0; i < song->samples_num; i++)
-        if (sample_compare (song->samples[i], filename) == 0)
-            return song->samples[i];
+    sample_t *sample = NULL;
+    char *key = song_sample_file_key (filename, NULL, NULL);
+    if (key)
+    {
+        song_lock (song);
+        song_sample_entry_t *entry = g_hash_table_lookup (song->samples_by_file, key);
+        if (entry)
+            sample = entry->sample;
+        song_unlock (song);
+        free (key);
+    }
 
-    return NULL;
+    return sample;
 }
 
 // Event handlers
@@ -154,7 +341,17 @@ song_on_sample_destroy (event_t *event)
     song_t * song = (song_t *) event->self;
     sample_t * sample = (sample_t *) event->source;
     DEBUG ("Unregistering sample: %s", sample->name);
-    ARRAY_REMOVE (sample_t, song->samples, song->samples_num, sample)
+    song_lock (song);
+    song_sample_entry_t *entry = g_hash_table_lookup (song->samples, sample);
+    if (entry)
+    {
+        if (entry->file_key && g_hash_table_lookup (song->samples_by_file, entry->file_key) == entry)
+            g_hash_table_remove (song->samples_by_file, entry->file_key);
+        if (entry->content_indexed)
+            g_hash_table_remove (song->samples_by_content, &sample->content_hash);
+        g_hash_table_remove (song->samples, sample);
+    }
+    song_unlock (song);
 }
 
 static void
@@ -162,27 +359,18 @@ song_on_sequence_destroy (event_t *event)
 {
     song_t * song = (song_t *) event->self;
     sequence_t * sequence = (sequence_t *) event->source;
+    int i;
     char *name = sequence_get_name (sequence);
     DEBUG ("Unregistering sequence: %s", name);
     free (name);
-    assert (song->sequences);
-    ARRAY_REMOVE (sequence_t, song->sequences, song->sequences_num, sequence)
-}
+    assert (song->sequences.num);
+    vector_remove (&song->sequences, sequence);
 
-/* Currently song_lock and song_unlock are unused */
-/*
-static void
-song_lock (song_t *song)
-{
-    sem_wait (&(song->mutex));
+    // The audio thread must stop rendering it before it gets destroyed
+    for (i = 0; i < song->sequences.num; i++)
+        sequence_unset_nested (VECTOR_AT (sequence_t, &song->sequences, i), sequence);
 }
 
-static void
-song_unlock (song_t *song)
-{
-    sem_post (&(song->mutex));
-}
-*/
 
 pool_t *
 song_pool (song_t *song)
@@ -33,8 +33,12 @@ void song_destroy(song_t * song);
 void song_register_sequence(song_t *song, sequence_t *sequence);
 void song_register_sequence_samples(song_t *song, sequence_t *sequence);
 int song_count_sequences(song_t * song);
+int song_nest_sequence(song_t *song, sequence_t *sequence, int track, sequence_t *source);
 sequence_t ** song_list_sequences(song_t * song);
 void song_register_sample(song_t *song, sample_t *sample);
 sample_t * song_try_reuse_sample(song_t *song, char *filename);
+sample_t * song_dedup_sample(song_t *song, sample_t *sample);
+void song_set_content_dedup(song_t *song, int enable);
+void song_set_transport_follow(song_t *song, int enable);
 
 #endif /* JACKBEAT_SONG_H */
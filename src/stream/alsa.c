@@ -0,0 +1,489 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <alsa/asoundlib.h>
+#include "alsa.h"
+#include "driver.h"
+#include "stereo.h"
+#include "core/compat.h"
+
+#define CLASSNAME "AlsaStreamDriver"
+#define CAST(self) stream_driver_cast (self, CLASSNAME)
+#define BIND(self, parent, data) \
+  stream_driver_t *_self = CAST(self); \
+  stream_driver_t *parent = _self->parent; \
+  stream_driver_alsa_data_t *data = (stream_driver_alsa_data_t *) _self->data;
+#define BIND_DATA(self, data) stream_driver_alsa_data_t *data = (stream_driver_alsa_data_t *) (CAST(self)->data)
+#define BIND_PARENT(self, parent) stream_driver_t *parent = CAST(self)->parent;
+
+#define STREAM_ALSA_DEFAULT_DEVICE      "default"
+#define STREAM_ALSA_DEFAULT_PERIOD_SIZE 256
+#define STREAM_ALSA_DEFAULT_PERIODS     2
+#define STREAM_ALSA_RT_PRIORITY         60
+
+typedef struct stream_driver_alsa_data_t
+{
+    char *              device_name;
+    snd_pcm_t *         pcm;
+    unsigned int        sample_rate;
+    snd_pcm_uframes_t   period_size;
+    unsigned int        periods;
+    unsigned int        channels;
+    snd_pcm_format_t    format;
+    int                 mmap;
+    float *             buffer;
+    void *              rw_buffer;
+    int                 rt_checked;
+    int volatile        latency;
+    unsigned long volatile xruns;
+} stream_driver_alsa_data_t;
+
+static const snd_pcm_format_t formats[] = {
+    SND_PCM_FORMAT_FLOAT_LE,
+    SND_PCM_FORMAT_S32_LE,
+    SND_PCM_FORMAT_S16_LE
+};
+
+static void
+destroy (stream_driver_t *self)
+{
+    BIND (self, parent, data);
+
+    free (data->device_name);
+    free (data->buffer);
+    free (data);
+
+    parent->interface->destroy (self);
+
+    self = CAST (self);
+    free (self->classname);
+    free (self->interface);
+    free (self);
+}
+
+/**
+ * Convert a float sample to the device format, at the given address
+ */
+static inline void
+write_sample (snd_pcm_format_t format, void *dest, float value)
+{
+    if (format == SND_PCM_FORMAT_FLOAT_LE)
+    {
+        *((float *) dest) = value;
+        return;
+    }
+
+    if (value > 1)
+        value = 1;
+    else if (value < -1)
+        value = -1;
+
+    if (format == SND_PCM_FORMAT_S32_LE)
+        *((int32_t *) dest) = (int32_t) (value * 2147483647.0);
+    else
+        *((int16_t *) dest) = (int16_t) (value * 32767.0);
+}
+
+/**
+ * Copy interleaved stereo frames to the device channel areas.
+ *
+ * A mono device receives the average of both channels, and additional
+ * channels are silenced.
+ */
+static void
+write_areas (stream_driver_t *self, const snd_pcm_channel_area_t *areas,
+             snd_pcm_uframes_t offset, float *input, int nframes)
+{
+    BIND_DATA (self, data);
+    unsigned int c;
+    int k;
+
+    for (c = 0; c < data->channels; c++)
+    {
+        const snd_pcm_channel_area_t *area = areas + c;
+        char *addr = (char *) area->addr + (area->first + offset * area->step) / 8;
+        int step = area->step / 8;
+
+        for (k = 0; k < nframes; k++, addr += step)
+        {
+            float value;
+            if (data->channels == 1)
+                value = (input[k * 2] + input[k * 2 + 1]) / 2;
+            else if (c < 2)
+                value = input[k * 2 + c];
+            else
+                value = 0;
+            write_sample (data->format, addr, value);
+        }
+    }
+}
+
+/**
+ * Try to recover from an xrun or suspend. Returns 0 on success.
+ */
+static int
+recover (stream_driver_t *self, int err)
+{
+    BIND_DATA (self, data);
+
+    if (err == -EPIPE || err == -ESTRPIPE)
+        data->xruns++;
+
+    err = snd_pcm_recover (data->pcm, err, 1);
+    if (err < 0)
+        DEBUG ("Can't recover from ALSA error: %s", snd_strerror (err));
+
+    return err;
+}
+
+/**
+ * Switch the calling thread to SCHED_FIFO, if allowed.
+ */
+static void
+set_realtime ()
+{
+    struct sched_param param;
+    int max = sched_get_priority_max (SCHED_FIFO);
+    param.sched_priority = STREAM_ALSA_RT_PRIORITY < max ? STREAM_ALSA_RT_PRIORITY : max;
+    if (pthread_setschedparam (pthread_self (), SCHED_FIFO, &param))
+        DEBUG ("Warning: can't use realtime scheduling, running with normal priority");
+    else
+        DEBUG ("Running with SCHED_FIFO priority %d", param.sched_priority);
+}
+
+/**
+ * Render nframes frames into the scratch buffer, by blocks of at most
+ * STREAM_BUFFER_SIZE frames, and write them to the device.
+ */
+static void
+render (stream_driver_t *self, const snd_pcm_channel_area_t *areas,
+        snd_pcm_uframes_t offset, snd_pcm_uframes_t nframes)
+{
+    BIND_DATA (self, data);
+    snd_pcm_uframes_t ofs;
+    int len;
+
+    for (ofs = 0; ofs < nframes; ofs += len)
+    {
+        len = self->interface->iterate (self, nframes - ofs, data->buffer);
+        if (areas)
+        {
+            write_areas (self, areas, offset + ofs, data->buffer, len);
+        }
+        else
+        {
+            snd_pcm_channel_area_t rw_areas[data->channels];
+            unsigned int c;
+            int width = snd_pcm_format_physical_width (data->format);
+            for (c = 0; c < data->channels; c++)
+            {
+                rw_areas[c].addr = data->rw_buffer;
+                rw_areas[c].first = c * width;
+                rw_areas[c].step = data->channels * width;
+            }
+            write_areas (self, rw_areas, 0, data->buffer, len);
+            snd_pcm_sframes_t written = snd_pcm_writei (data->pcm, data->rw_buffer, len);
+            if (written < 0)
+            {
+                recover (self, written);
+                break;
+            }
+        }
+    }
+}
+
+static void
+thread_process (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    snd_pcm_sframes_t avail;
+    int err;
+
+    if (!data->rt_checked)
+    {
+        set_realtime ();
+        data->rt_checked = 1;
+    }
+
+    avail = snd_pcm_avail_update (data->pcm);
+    if (avail < 0)
+    {
+        if (recover (self, avail) < 0)
+            compat_sleep (100);
+        return;
+    }
+
+    if (avail < data->period_size)
+    {
+        if (snd_pcm_state (data->pcm) == SND_PCM_STATE_PREPARED)
+        {
+            // Buffer is full: starting playback
+            if ((err = snd_pcm_start (data->pcm)) < 0)
+                recover (self, err);
+        }
+        else if ((err = snd_pcm_wait (data->pcm, 100)) < 0)
+        {
+            recover (self, err);
+        }
+        return;
+    }
+
+    self->interface->sync (self);
+
+    if (data->mmap)
+    {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = data->period_size;
+
+        if ((err = snd_pcm_mmap_begin (data->pcm, &areas, &offset, &frames)) < 0)
+        {
+            recover (self, err);
+            return;
+        }
+
+        render (self, areas, offset, frames);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit (data->pcm, offset, frames);
+        if (committed < 0 || (snd_pcm_uframes_t) committed != frames)
+        {
+            recover (self, committed >= 0 ? -EPIPE : committed);
+            return;
+        }
+    }
+    else
+    {
+        render (self, NULL, 0, data->period_size);
+    }
+
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay (data->pcm, &delay) == 0 && delay >= 0)
+        data->latency = delay;
+}
+
+/**
+ * Open and configure the PCM device.
+ */
+static int
+open_pcm (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_uframes_t buffer_size;
+    unsigned int i;
+    int err, dir = 0;
+
+    DEBUG ("Opening ALSA device: %s", data->device_name);
+    if ((err = snd_pcm_open (&data->pcm, data->device_name, SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+    {
+        DEBUG ("Can't open ALSA device: %s", snd_strerror (err));
+        data->pcm = NULL;
+        return 0;
+    }
+
+    snd_pcm_hw_params_alloca (&hw_params);
+    snd_pcm_hw_params_any (data->pcm, hw_params);
+
+    data->mmap = 1;
+    if (snd_pcm_hw_params_set_access (data->pcm, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0)
+    {
+        DEBUG ("mmap access not available, falling back to read/write access");
+        data->mmap = 0;
+        if ((err = snd_pcm_hw_params_set_access (data->pcm, hw_params,
+                                                 SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+            goto error;
+    }
+
+    for (i = 0; i < sizeof (formats) / sizeof (snd_pcm_format_t); i++)
+        if (snd_pcm_hw_params_set_format (data->pcm, hw_params, formats[i]) == 0)
+            break;
+
+    if (i == sizeof (formats) / sizeof (snd_pcm_format_t))
+    {
+        err = -EINVAL;
+        goto error;
+    }
+    data->format = formats[i];
+
+    data->channels = 2;
+    if ((err = snd_pcm_hw_params_set_channels_near (data->pcm, hw_params, &data->channels)) < 0)
+        goto error;
+
+    if ((err = snd_pcm_hw_params_set_rate_near (data->pcm, hw_params, &data->sample_rate, &dir)) < 0)
+        goto error;
+
+    if ((err = snd_pcm_hw_params_set_period_size_near (data->pcm, hw_params,
+                                                       &data->period_size, &dir)) < 0)
+        goto error;
+
+    if ((err = snd_pcm_hw_params_set_periods_near (data->pcm, hw_params, &data->periods, &dir)) < 0)
+        goto error;
+
+    if ((err = snd_pcm_hw_params (data->pcm, hw_params)) < 0)
+        goto error;
+
+    snd_pcm_hw_params_get_period_size (hw_params, &data->period_size, &dir);
+    snd_pcm_hw_params_get_periods (hw_params, &data->periods, &dir);
+    snd_pcm_hw_params_get_buffer_size (hw_params, &buffer_size);
+
+    snd_pcm_sw_params_alloca (&sw_params);
+    snd_pcm_sw_params_current (data->pcm, sw_params);
+    // Playback is started explicitly, once the buffer is filled
+    snd_pcm_sw_params_set_start_threshold (data->pcm, sw_params, buffer_size + 1);
+    snd_pcm_sw_params_set_avail_min (data->pcm, sw_params, data->period_size);
+    if ((err = snd_pcm_sw_params (data->pcm, sw_params)) < 0)
+        goto error;
+
+    if ((err = snd_pcm_prepare (data->pcm)) < 0)
+        goto error;
+
+    if (!data->mmap)
+        data->rw_buffer = malloc (STREAM_BUFFER_SIZE * data->channels
+                                  * snd_pcm_format_physical_width (data->format) / 8);
+
+    DEBUG ("ALSA device ready: %s, %u Hz, %u channel(s), %s, %s, %lu frames x %u periods",
+           data->device_name, data->sample_rate, data->channels,
+           snd_pcm_format_name (data->format), data->mmap ? "mmap" : "read/write",
+           (unsigned long) data->period_size, data->periods);
+
+    return 1;
+
+error:
+    DEBUG ("Can't configure ALSA device: %s", snd_strerror (err));
+    snd_pcm_close (data->pcm);
+    data->pcm = NULL;
+    return 0;
+}
+
+static void
+close_pcm (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    snd_pcm_drop (data->pcm);
+    snd_pcm_close (data->pcm);
+    data->pcm = NULL;
+    free (data->rw_buffer);
+    data->rw_buffer = NULL;
+}
+
+static int
+activate (stream_driver_t *self)
+{
+    BIND (self, parent, data);
+
+    data->rt_checked = 0;
+    data->latency = 0;
+    data->xruns = 0;
+
+    if (!open_pcm (self))
+        return 0;
+
+    if (!parent->interface->activate (self))
+    {
+        close_pcm (self);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+deactivate (stream_driver_t *self)
+{
+    BIND (self, parent, data);
+    if (data->pcm != NULL)
+    {
+        parent->interface->deactivate (self);
+        close_pcm (self);
+    }
+    return 1;
+}
+
+static int
+get_sample_rate (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    return data->sample_rate;
+}
+
+static int
+port_get_latency (stream_driver_t *self, stream_driver_port_t *port)
+{
+    BIND_DATA (self, data);
+    return data->latency ? data->latency : data->period_size * data->periods;
+}
+
+static int
+get_stats (stream_driver_t *self, stream_stats_t *stats)
+{
+    BIND_DATA (self, data);
+    memset (stats, 0, sizeof (stream_stats_t));
+    stats->underruns   = data->xruns;
+    stats->latency     = port_get_latency (self, NULL);
+    stats->period_size = data->period_size;
+    stats->periods     = data->periods;
+    return 1;
+}
+
+stream_driver_t *
+stream_driver_alsa_new (const char *device_name, int sample_rate, int period_size, int periods)
+{
+    stream_driver_t *self = stream_driver_subclass (CLASSNAME, stream_driver_stereo_new ());
+    self->data = malloc (sizeof (stream_driver_alsa_data_t));
+    BIND_DATA (self, data);
+
+    data->device_name = strdup (device_name ? device_name : STREAM_ALSA_DEFAULT_DEVICE);
+    data->pcm         = NULL;
+    data->sample_rate = sample_rate > 0 ? sample_rate : 44100;
+    data->period_size = period_size > 0 ? period_size : STREAM_ALSA_DEFAULT_PERIOD_SIZE;
+    data->periods     = periods > 1 ? periods : STREAM_ALSA_DEFAULT_PERIODS;
+    data->channels    = 2;
+    data->format      = SND_PCM_FORMAT_FLOAT_LE;
+    data->mmap        = 1;
+    data->buffer      = malloc (STREAM_BUFFER_SIZE * sizeof (float) * 2);
+    data->rw_buffer   = NULL;
+    data->rt_checked  = 0;
+    data->latency     = 0;
+    data->xruns       = 0;
+
+    // A period must fit into the port buffers
+    if (data->period_size > STREAM_BUFFER_SIZE)
+        data->period_size = STREAM_BUFFER_SIZE;
+
+    self->interface->destroy           = destroy;
+    self->interface->activate          = activate;
+    self->interface->deactivate        = deactivate;
+    self->interface->thread_process    = thread_process;
+    self->interface->get_sample_rate   = get_sample_rate;
+    self->interface->port_get_latency  = port_get_latency;
+    self->interface->get_stats         = get_stats;
+
+    return self;
+}
@@ -0,0 +1,38 @@
+/*
+ *   Jackbeat - JACK sequencer
+ *    
+ *   Copyright (c) 2004-2008 Olivier Guilyardi <olivier {at} samalyse {dot} com>
+ *    
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   SVN:$Id$
+ */
+
+#ifndef JACKBEAT_STREAM_ALSA_H
+#define JACKBEAT_STREAM_ALSA_H
+
+#include "stream.h"
+
+/**
+ * Create a native ALSA playback driver.
+ *
+ * device_name is an ALSA PCM name such as "default" or "hw:0", NULL meaning
+ * "default". A period_size or periods of 0 selects the default buffering
+ * (256 frames x 2 periods).
+ */
+stream_driver_t * stream_driver_alsa_new (const char *device_name, int sample_rate,
+                                          int period_size, int periods);
+
+#endif
@@ -27,6 +27,19 @@
 #include "jack.h"
 #include "paudio.h"
 #include "pulse.h"
+#ifdef HAVE_ALSA
+#include "alsa.h"
+#endif
+
+static int stream_device_period_size = 0;
+static int stream_device_periods = 0;
+
+void
+stream_device_set_buffering (int period_size, int periods)
+{
+    stream_device_period_size = period_size;
+    stream_device_periods = periods;
+}
 
 int
 stream_device_open (stream_t *stream, char *device_name, int sample_rate,
@@ -39,7 +52,9 @@ stream_device_open (stream_t *stream, char *device_name, int sample_rate,
 #ifdef HAVE_JACK
                 stream_set_driver (stream, stream_driver_jack_new (client_name, 0)) ||
 #endif    
-                stream_set_driver (stream, stream_driver_portaudio_new (NULL, -1));
+                stream_set_driver (stream, stream_driver_portaudio_new (NULL, -1,
+                                                                        stream_device_period_size,
+                                                                        stream_device_periods));
     }
 #ifdef HAVE_JACK
     else if (!strcmp (device_name, STREAM_DEVICE_JACK))
@@ -47,10 +62,20 @@ stream_device_open (stream_t *stream, char *device_name, int sample_rate,
 #endif    
 #ifdef HAVE_PULSE
     else if (!strcmp (device_name, STREAM_DEVICE_PULSE))
-        success = stream_set_driver (stream, stream_driver_pulse_new (client_name));
+        success = stream_set_driver (stream, stream_driver_pulse_new (client_name,
+                                                                      stream_device_period_size,
+                                                                      stream_device_periods));
+#endif    
+#ifdef HAVE_ALSA
+    else if (!strcmp (device_name, STREAM_DEVICE_ALSA))
+        success = stream_set_driver (stream, stream_driver_alsa_new (NULL, sample_rate,
+                                                                     stream_device_period_size,
+                                                                     stream_device_periods));
 #endif    
     else
-        success = stream_set_driver (stream, stream_driver_portaudio_new (device_name, sample_rate));
+        success = stream_set_driver (stream, stream_driver_portaudio_new (device_name, sample_rate,
+                                                                          stream_device_period_size,
+                                                                          stream_device_periods));
 
     return success;
 }
@@ -73,6 +98,11 @@ stream_device_list ()
     devices[devcount] = strdup (STREAM_DEVICE_PULSE);
     devices[++devcount] = NULL;
 #endif    
+#ifdef HAVE_ALSA
+    devices = realloc (devices, sizeof (char *) * (devcount + 2));
+    devices[devcount] = strdup (STREAM_DEVICE_ALSA);
+    devices[++devcount] = NULL;
+#endif    
 
     char ** pa_devices = stream_driver_portaudio_list_devices ();
     if (pa_devices)
@@ -108,6 +138,8 @@ stream_device_get_name (stream_t *stream)
             name = strdup (STREAM_DEVICE_JACK);
         else if (!strcmp (classname, "PulseAudioStreamDriver"))
             name = strdup (STREAM_DEVICE_PULSE);
+        else if (!strcmp (classname, "AlsaStreamDriver"))
+            name = strdup (STREAM_DEVICE_ALSA);
         else if (!strcmp (classname, "PortAudioStreamDriver"))
             name = stream_driver_portaudio_get_current_device (stream_get_driver (stream));
     }
@@ -29,6 +29,10 @@
 #define STREAM_DEVICE_AUTO "Automatic"
 #define STREAM_DEVICE_JACK "JACK"
 #define STREAM_DEVICE_PULSE "PulseAudio"
+#define STREAM_DEVICE_ALSA "ALSA"
+
+/* Period size preset: the lowest latency advertised by the device */
+#define STREAM_DEVICE_LOW_LATENCY -1
 
 int stream_device_open(stream_t *stream, char *device_name, int sample_rate,
         const char *client_name, int auto_start_server);
@@ -36,4 +40,9 @@ char ** stream_device_list();
 char * stream_device_get_default();
 char * stream_device_get_name(stream_t *stream);
 
+/* Set the period size (in frames) and number of periods requested by the
+ * drivers which open the sound card themselves. 0 means driver default, and
+ * STREAM_DEVICE_LOW_LATENCY asks for the device's low latency preset. */
+void stream_device_set_buffering(int period_size, int periods);
+
 #endif
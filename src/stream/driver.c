@@ -25,7 +25,8 @@
 #include <pthread.h>
 #include "driver.h"
 #include "core/msg.h"
-#include "core/array.h"
+#include "core/epoch.h"
+#include "core/compat.h"
 
 #define CLASSNAME "StreamDriver"
 #define CAST(self) stream_driver_cast (self, CLASSNAME)
@@ -36,10 +37,20 @@
 #define BIND_DATA(self, data) stream_driver_data_t *data = (stream_driver_data_t *) (CAST(self)->data)
 #define BIND_PARENT(self, parent) stream_driver_t *parent = CAST(self)->parent; 
 
+/* Ports are allocated by blocks, with each port struct on its own cache line(s)
+   and all buffers of a block laid out contiguously after the structs. */
+#define STREAM_CACHE_LINE         64
+#define STREAM_ARENA_BLOCK_PORTS  16
+#define STREAM_PORT_SLOT_SIZE \
+  ((sizeof (stream_driver_port_t) + STREAM_CACHE_LINE - 1) & ~(STREAM_CACHE_LINE - 1))
+#define STREAM_ARENA_BLOCK_SIZE \
+  (STREAM_ARENA_BLOCK_PORTS * (STREAM_PORT_SLOT_SIZE + STREAM_BUFFER_SIZE * sizeof (float)))
+
 enum
 {
     STREAM_PORTS_REPLACE,
-    STREAM_PROCESS_REPLACE
+    STREAM_PROCESS_REPLACE,
+    STREAM_COMMIT
 } ;
 
 typedef struct stream_driver_process_t
@@ -55,6 +66,37 @@ typedef struct stream_driver_data_t
     int                 nprocesses;
     stream_driver_port_t **    ports;
     int                 nports;
+
+    /* Main thread copies of the tables, published to the audio thread on commit */
+    stream_driver_port_t **    table;
+    int                 table_num;
+    int                 table_size;
+    int                 table_changed;
+    int                 table_private;
+    stream_driver_process_t *  proc_table;
+    int                 proc_table_num;
+    int                 proc_table_size;
+    int                 proc_table_changed;
+    int                 proc_table_private;
+
+    /* Pending transaction state */
+    int                 transaction;
+    void **             garbage;
+    int                 ngarbage;
+    int                 process_removed;
+
+    /* Removed ports. The first nstamped_ports ones are released once the audio
+       thread has moved past removed_stamp. */
+    stream_driver_port_t **    removed_ports;
+    int                 nremoved_ports;
+    int                 nstamped_ports;
+    unsigned long       removed_stamp;
+    epoch_t *           epoch;
+
+    void **             blocks;
+    int                 nblocks;
+    stream_driver_port_t **    free_ports;
+    int                 nfree_ports;
     msg_t *             msg;
     void                (* shutdown_callback) (void *) ;
     void *              shutdown_data;
@@ -62,27 +104,227 @@ typedef struct stream_driver_data_t
     pthread_t           thread;
     int volatile        thread_terminate;
     int                 thread_running;
+
+    /* Process cycles run and frames processed so far, carried over from the
+       previous driver of the stream, see stream_driver_copy_processes() */
+    unsigned long volatile cycle;
+    unsigned long volatile frame_time;
 } stream_driver_data_t;
 
+/**
+ * Queue some memory to be freed once the current transaction is committed, and
+ * the audio thread is done with it
+ */
+static void
+collect_garbage (stream_driver_t *self, void *ptr)
+{
+    BIND_DATA (self, data);
+    data->garbage = realloc (data->garbage, (data->ngarbage + 1) * sizeof (void *));
+    data->garbage[data->ngarbage++] = ptr;
+}
+
+/**
+ * Start a transaction.
+ *
+ * Until the matching commit, port and process changes only affect private 
+ * copies of the tables, which the audio thread doesn't see. Transactions 
+ * can be nested.
+ */
+static void
+transaction_begin (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    data->transaction++;
+}
+
+/**
+ * Release the removed ports which the audio thread can't reference anymore,
+ * and stamp the ones which have just been unpublished.
+ */
+static void
+release_ports (stream_driver_t *self, int all)
+{
+    BIND_DATA (self, data);
+    int i, n = 0;
+    int fresh = data->nremoved_ports > data->nstamped_ports;
+
+    if (all)
+        n = data->nremoved_ports;
+    else if (data->nstamped_ports && epoch_passed (data->epoch, data->removed_stamp))
+        n = data->nstamped_ports;
+
+    for (i = 0; i < n; i++)
+        self->interface->port_release (self, data->removed_ports[i]);
+
+    data->nremoved_ports -= n;
+    memmove (data->removed_ports, data->removed_ports + n,
+             data->nremoved_ports * sizeof (stream_driver_port_t *));
+
+    if (fresh && data->nremoved_ports)
+        data->removed_stamp = epoch_get (data->epoch);
+    data->nstamped_ports = data->nremoved_ports;
+}
+
+/**
+ * Commit a transaction.
+ *
+ * Publishes the modified tables to the audio thread at once, without waiting
+ * for it. Old tables and removed ports are reclaimed by later commits or by
+ * collect(), once the audio thread has started a new cycle.
+ *
+ * Removing a process is the exception: callers usually free the process data
+ * right after, so that a single ACK is then waited for.
+ */
+static void
+transaction_commit (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    int i;
+
+    if (--data->transaction > 0)
+        return;
+
+    if (data->table_changed)
+        msg_call (data->msg, STREAM_PORTS_REPLACE, 0, "ports=%p nports=%d",
+                  data->table, data->table_num);
+
+    if (data->proc_table_changed)
+        msg_call (data->msg, STREAM_PROCESS_REPLACE, 0, "processes=%p nprocesses=%d",
+                  data->proc_table, data->proc_table_num);
+
+    for (i = 0; i < data->ngarbage; i++)
+        epoch_retire (data->epoch, data->garbage[i], NULL, NULL);
+    free (data->garbage);
+    data->garbage = NULL;
+    data->ngarbage = 0;
+
+    if (data->process_removed)
+    {
+        msg_call (data->msg, STREAM_COMMIT, MSG_ACK, "process_removed=1");
+        epoch_flush (data->epoch);
+        release_ports (self, 1);
+        data->process_removed = 0;
+    }
+    else
+    {
+        epoch_collect (data->epoch);
+        release_ports (self, 0);
+    }
+
+    data->table_changed = data->table_private = 0;
+    data->proc_table_changed = data->proc_table_private = 0;
+}
+
+/**
+ * Reclaim the old tables and removed ports which the audio thread is done
+ * with, without waiting for another commit. Called from the main loop.
+ */
+static void
+collect (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    if (data->transaction)
+        return;
+
+    epoch_collect (data->epoch);
+    release_ports (self, 0);
+}
+
+/**
+ * Take a port slot from the arena, allocating a new block if needed.
+ */
+static stream_driver_port_t *
+port_alloc (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    int i;
+
+    if (!data->nfree_ports)
+    {
+        char *block = compat_aligned_alloc (STREAM_CACHE_LINE, STREAM_ARENA_BLOCK_SIZE);
+        if (!block)
+            return NULL;
+
+        data->blocks = realloc (data->blocks, (data->nblocks + 1) * sizeof (void *));
+        data->blocks[data->nblocks++] = block;
+        data->free_ports = realloc (data->free_ports, data->nblocks * STREAM_ARENA_BLOCK_PORTS
+                                    * sizeof (stream_driver_port_t *));
+
+        float *buffers = (float *) (block + STREAM_ARENA_BLOCK_PORTS * STREAM_PORT_SLOT_SIZE);
+        // Pushed in reverse order, so that ports are handed out in memory order
+        for (i = STREAM_ARENA_BLOCK_PORTS - 1; i >= 0; i--)
+        {
+            stream_driver_port_t *port = (stream_driver_port_t *) (block + i * STREAM_PORT_SLOT_SIZE);
+            port->buffer = buffers + i * STREAM_BUFFER_SIZE;
+            data->free_ports[data->nfree_ports++] = port;
+        }
+    }
+
+    stream_driver_port_t *port = data->free_ports[--data->nfree_ports];
+    memset (port->buffer, 0, STREAM_BUFFER_SIZE * sizeof (float));
+    return port;
+}
+
+/**
+ * Give a port slot back to the arena. 
+ *
+ * This is called once the audio thread is known not to reference the port 
+ * anymore.
+ */
+static void
+port_release (stream_driver_t *self, stream_driver_port_t *port)
+{
+    BIND_DATA (self, data);
+    free (port->name);
+    port->name = NULL;
+    data->free_ports[data->nfree_ports++] = port;
+}
+
+/**
+ * Make sure that the ports table can be modified in place, that is: that 
+ * it isn't the one that the audio thread is reading, and that it can hold
+ * at least size ports.
+ */
+static void
+ports_table_reserve (stream_driver_t *self, int size, int private)
+{
+    BIND_DATA (self, data);
+    if (size > data->table_size || (private && !data->table_private))
+    {
+        stream_driver_port_t **old_table = data->table;
+        int new_size = data->table_size ? data->table_size : STREAM_ARENA_BLOCK_PORTS;
+        while (new_size < size)
+            new_size *= 2;
+
+        data->table = calloc (new_size, sizeof (stream_driver_port_t *));
+        memcpy (data->table, old_table, data->table_num * sizeof (stream_driver_port_t *));
+        data->table_size = new_size;
+        data->table_private = 1;
+        if (old_table)
+            collect_garbage (self, old_table);
+    }
+}
+
 static stream_driver_port_t *
 port_add (stream_driver_t *self, char *name, stream_port_flags_t flags, void *port_data)
 {
     BIND_DATA (self, data);
-    stream_driver_port_t *port = malloc (sizeof (stream_driver_port_t));
-    port->buffer = calloc (STREAM_BUFFER_SIZE, sizeof (float));
+    stream_driver_port_t *port = port_alloc (self);
+    if (!port)
+        return NULL;
+
     port->data = port_data;
     port->flags = flags;
     port->name = strdup (name);
+    port->silent = 0;
 
-    stream_driver_port_t **oldports = data->ports;
-    stream_driver_port_t **newports = calloc (data->nports + 1, sizeof (stream_driver_port_t *));
-    memcpy (newports, data->ports, data->nports * sizeof (stream_driver_port_t *));
-    newports[data->nports] = port;
-
-    msg_call (data->msg, STREAM_PORTS_REPLACE, MSG_ACK, "ports=%p nports=%d",
-              newports, data->nports + 1);
-
-    free (oldports);
+    /* The audio thread never reads past its own ports count, so unless the
+       table needs to grow, appending happens in place. */
+    transaction_begin (self);
+    ports_table_reserve (self, data->table_num + 1, 0);
+    data->table[data->table_num++] = port;
+    data->table_changed = 1;
+    transaction_commit (self);
 
     return port;
 }
@@ -105,17 +347,21 @@ static void
 port_remove (stream_driver_t *self, stream_driver_port_t *port)
 {
     BIND_DATA (self, data);
-    stream_driver_port_t **oldports = data->ports;
-    stream_driver_port_t **newports = calloc (data->nports, sizeof (stream_driver_port_t *));
-    memcpy (newports, data->ports, data->nports * sizeof (stream_driver_port_t *));
-    int newports_num = data->nports;
-    ARRAY_REMOVE (stream_driver_port_t, newports, newports_num, port);
-    msg_call (data->msg, STREAM_PORTS_REPLACE, MSG_ACK, "ports=%p nports=%d",
-              newports, newports_num);
-    free (port->buffer);
-    free (port->name);
-    free (port);
-    free (oldports);
+    int i, j;
+
+    transaction_begin (self);
+    ports_table_reserve (self, data->table_num, 1);
+    for (i = 0, j = 0; i < data->table_num; i++)
+        if (data->table[i] != port)
+            data->table[j++] = data->table[i];
+
+    data->table_num = j;
+    data->table_changed = 1;
+
+    data->removed_ports = realloc (data->removed_ports, (data->nremoved_ports + 1)
+                                   * sizeof (stream_driver_port_t *));
+    data->removed_ports[data->nremoved_ports++] = port;
+    transaction_commit (self);
 }
 
 static void
@@ -124,13 +370,18 @@ auto_connect (stream_driver_t *self, int active) { }
 static void
 port_touch (stream_driver_t *self, stream_driver_port_t *port) { }
 
-#ifdef JACK_GET_LATENCY
 static int
 port_get_latency (stream_driver_t *self, stream_driver_port_t *port)
 {
     return 0;
 }
-#endif // JACK_GET_LATENCY
+
+static int
+get_stats (stream_driver_t *self, stream_stats_t *stats)
+{
+    memset (stats, 0, sizeof (stream_stats_t));
+    return 0;
+}
 
 static int
 get_buffer_size (stream_driver_t *self)
@@ -150,8 +401,8 @@ process_exists (stream_driver_t *self, char *name)
     BIND_DATA (self, data);
 
     int i, exists = 0;
-    for (i = 0; i < data->nprocesses; i++)
-        if (!strcmp (data->processes[i].name, name))
+    for (i = 0; i < data->proc_table_num; i++)
+        if (!strcmp (data->proc_table[i].name, name))
         {
             exists = 1;
             break;
@@ -160,6 +411,29 @@ process_exists (stream_driver_t *self, char *name)
     return exists;
 }
 
+/**
+ * Same as ports_table_reserve(), for the processes table
+ */
+static void
+processes_table_reserve (stream_driver_t *self, int size, int private)
+{
+    BIND_DATA (self, data);
+    if (size > data->proc_table_size || (private && !data->proc_table_private))
+    {
+        stream_driver_process_t *old_table = data->proc_table;
+        int new_size = data->proc_table_size ? data->proc_table_size : 8;
+        while (new_size < size)
+            new_size *= 2;
+
+        data->proc_table = calloc (new_size, sizeof (stream_driver_process_t));
+        memcpy (data->proc_table, old_table, data->proc_table_num * sizeof (stream_driver_process_t));
+        data->proc_table_size = new_size;
+        data->proc_table_private = 1;
+        if (old_table)
+            collect_garbage (self, old_table);
+    }
+}
+
 static int
 add_process (stream_driver_t *self, char *name, stream_process_t callback, void *userdata)
 {
@@ -169,18 +443,14 @@ add_process (stream_driver_t *self, char *name, stream_process_t callback, void
 
     if (!exists)
     {
-        stream_driver_process_t *old = data->processes;
-        stream_driver_process_t *new = calloc (data->nprocesses + 1, sizeof (stream_driver_process_t));
-        memcpy (new, old, data->nprocesses * sizeof (stream_driver_process_t));
-        new[data->nprocesses].callback = callback;
-        new[data->nprocesses].data     = userdata;
-        new[data->nprocesses].name     = strdup (name);
-
-        msg_call (data->msg, STREAM_PROCESS_REPLACE, MSG_ACK,
-                  "processes=%p nprocesses=%d",
-                  new, data->nprocesses + 1);
-
-        free (old);
+        transaction_begin (self);
+        processes_table_reserve (self, data->proc_table_num + 1, 0);
+        stream_driver_process_t *process = data->proc_table + data->proc_table_num++;
+        process->callback = callback;
+        process->data     = userdata;
+        process->name     = strdup (name);
+        data->proc_table_changed = 1;
+        transaction_commit (self);
     }
     else
     {
@@ -199,12 +469,12 @@ rename_process (stream_driver_t *self, char *old_name, char *new_name)
     if (exists)
     {
         int i;
-        for (i = 0; i < data->nprocesses; i++)
+        for (i = 0; i < data->proc_table_num; i++)
         {
-            if (!strcmp (data->processes[i].name, old_name))
+            if (!strcmp (data->proc_table[i].name, old_name))
             {
-                char *p                 = data->processes[i].name;
-                data->processes[i].name = strdup (new_name);
+                char *p                  = data->proc_table[i].name;
+                data->proc_table[i].name = strdup (new_name);
                 free (p);
                 break;
             }
@@ -224,26 +494,21 @@ remove_process (stream_driver_t *self, char *name)
 
     if (self->interface->process_exists (self, name))
     {
-        stream_driver_process_t *old = data->processes;
-        stream_driver_process_t *new = calloc (data->nprocesses - 1, sizeof (stream_driver_process_t));
+        transaction_begin (self);
+        processes_table_reserve (self, data->proc_table_num, 1);
 
         int i, j = 0;
-        char *old_name = NULL;
-        for (i = 0; i < data->nprocesses; i++)
+        for (i = 0; i < data->proc_table_num; i++)
         {
-            if (strcmp (old[i].name, name))
-                memcpy (new + j++, old + i, sizeof (stream_driver_process_t));
+            if (strcmp (data->proc_table[i].name, name))
+                memcpy (data->proc_table + j++, data->proc_table + i, sizeof (stream_driver_process_t));
             else
-                old_name = old[i].name;
+                collect_garbage (self, data->proc_table[i].name);
         }
-
-        msg_call (data->msg, STREAM_PROCESS_REPLACE, MSG_ACK,
-                  "processes=%p nprocesses=%d",
-                  new, data->nprocesses - 1);
-
-        if(old_name != NULL)
-            free (old_name);
-        free (old);
+        data->proc_table_num = j;
+        data->proc_table_changed = 1;
+        data->process_removed = 1;
+        transaction_commit (self);
     }
     else
     {
@@ -263,6 +528,14 @@ is_started (stream_driver_t *self)
     return 0;
 }
 
+static void
+get_transport (stream_driver_t *self, stream_transport_t *transport)
+{
+    memset (transport, 0, sizeof (stream_transport_t));
+    transport->rolling = self->interface->is_started (self);
+    transport->frame = self->interface->get_position (self);
+}
+
 static void
 start (stream_driver_t *self) { }
 
@@ -281,14 +554,25 @@ destroy (stream_driver_t *self)
         msg_destroy (data->msg);
 
     int i;
-    for (i = 0; i < data->nports; i++)
-    {
-        free (data->ports[i]->buffer);
-        free (data->ports[i]);
-    }
-    free (data->ports);
-
-    free (data->processes);
+    for (i = 0; i < data->table_num; i++)
+        free (data->table[i]->name);
+    free (data->table);
+    for (i = 0; i < data->nremoved_ports; i++)
+        free (data->removed_ports[i]->name);
+    free (data->removed_ports);
+    for (i = 0; i < data->ngarbage; i++)
+        free (data->garbage[i]);
+    free (data->garbage);
+    epoch_destroy (data->epoch);
+
+    for (i = 0; i < data->nblocks; i++)
+        compat_aligned_free (data->blocks[i]);
+    free (data->blocks);
+    free (data->free_ports);
+
+    for (i = 0; i < data->proc_table_num; i++)
+        free (data->proc_table[i].name);
+    free (data->proc_table);
 
     self = CAST (self);
 
@@ -312,6 +596,7 @@ sync (stream_driver_t *self)
     BIND_DATA (self, data);
     msg_call_t call;
 
+    epoch_advance (data->epoch);
     while (msg_receive (data->msg, &call))
     {
         switch (call.feature)
@@ -323,12 +608,28 @@ sync (stream_driver_t *self)
                 sscanf (call.params, "processes=%p nprocesses=%d", (void **) &data->processes,
                         &data->nprocesses);
                 break;
+            case STREAM_COMMIT:
+                break;
         }
     }
 
     msg_sync (data->msg);
 }
 
+static unsigned long
+get_cycle (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    return data->cycle;
+}
+
+static unsigned long
+get_frame_time (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+    return data->frame_time;
+}
+
 static int
 iterate (stream_driver_t *self, int nframes, ...)
 {
@@ -337,22 +638,38 @@ iterate (stream_driver_t *self, int nframes, ...)
     if (nframes > STREAM_BUFFER_SIZE)
         nframes = STREAM_BUFFER_SIZE;
 
+    __sync_fetch_and_add (&data->cycle, 1);
+
     int i;
     for (i = 0; i < data->nprocesses; i++)
         data->processes[i].callback (nframes, data->processes[i].data);
 
+    __sync_fetch_and_add (&data->frame_time, nframes);
+
     return nframes;
 }
 
+/**
+ * Add the processes of a driver to another one, which the stream is switching
+ * to. The cycle and frame counters of the new driver are pushed ahead by those
+ * of the old one, so that they keep increasing for these processes. The new
+ * driver may be running already, hence the atomic updates.
+ */
 void
 stream_driver_copy_processes (stream_driver_t *self, stream_driver_t *other)
 {
     BIND_DATA (self, data);
+    stream_driver_data_t *other_data = (stream_driver_data_t *) CAST (other)->data;
     int i;
 
-    for (i = 0; i < data->nprocesses; i++)
-        other->interface->add_process (other, data->processes[i].name,
-                                       data->processes[i].callback, data->processes[i].data);
+    __sync_fetch_and_add (&other_data->cycle, data->cycle);
+    __sync_fetch_and_add (&other_data->frame_time, data->frame_time);
+
+    other->interface->transaction_begin (other);
+    for (i = 0; i < data->proc_table_num; i++)
+        other->interface->add_process (other, data->proc_table[i].name,
+                                       data->proc_table[i].callback, data->proc_table[i].data);
+    other->interface->transaction_commit (other);
 }
 
 static void *
@@ -466,8 +783,33 @@ stream_driver_new ()
     BIND_DATA (self, data);
     data->processes = NULL;
     data->nprocesses = 0;
+    data->cycle = 0;
+    data->frame_time = 0;
     data->ports = NULL;
     data->nports = 0;
+    data->table = NULL;
+    data->table_num = 0;
+    data->table_size = 0;
+    data->table_changed = 0;
+    data->table_private = 0;
+    data->proc_table = NULL;
+    data->proc_table_num = 0;
+    data->proc_table_size = 0;
+    data->proc_table_changed = 0;
+    data->proc_table_private = 0;
+    data->transaction = 0;
+    data->garbage = NULL;
+    data->ngarbage = 0;
+    data->process_removed = 0;
+    data->removed_ports = NULL;
+    data->nremoved_ports = 0;
+    data->nstamped_ports = 0;
+    data->removed_stamp = 0;
+    data->epoch = epoch_new ();
+    data->blocks = NULL;
+    data->nblocks = 0;
+    data->free_ports = NULL;
+    data->nfree_ports = 0;
     data->msg = msg_new (4096, sizeof (msg_call_t));
     data->shutdown_callback = NULL;
     data->shutdown_data = NULL;
@@ -478,10 +820,9 @@ stream_driver_new ()
     self->interface->port_rename       = port_rename;
     self->interface->port_get_buffer   = port_get_buffer;
     self->interface->port_remove       = port_remove;
+    self->interface->port_release      = port_release;
     self->interface->port_touch        = port_touch;
-#ifdef JACK_GET_LATENCY
     self->interface->port_get_latency  = port_get_latency;
-#endif
     self->interface->auto_connect      = auto_connect;
     self->interface->get_buffer_size   = get_buffer_size;
     self->interface->get_sample_rate   = get_sample_rate;
@@ -491,6 +832,7 @@ stream_driver_new ()
     self->interface->process_exists    = process_exists;
     self->interface->get_position      = get_position;
     self->interface->is_started        = is_started;
+    self->interface->get_transport     = get_transport;
     self->interface->start             = start;
     self->interface->stop              = stop;
     self->interface->seek              = seek;
@@ -498,6 +840,12 @@ stream_driver_new ()
     self->interface->sync              = sync;
     self->interface->iterate           = iterate;
     self->interface->on_shutdown       = on_shutdown;
+    self->interface->transaction_begin = transaction_begin;
+    self->interface->transaction_commit = transaction_commit;
+    self->interface->collect           = collect;
+    self->interface->get_stats         = get_stats;
+    self->interface->get_cycle         = get_cycle;
+    self->interface->get_frame_time    = get_frame_time;
     self->interface->activate          = activate;
     self->interface->deactivate        = deactivate;
     self->interface->thread_process    = NULL;
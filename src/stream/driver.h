@@ -32,6 +32,7 @@ typedef struct stream_driver_port_t {
     char * name;
     stream_port_flags_t flags;
     void * data;
+    int silent;
 } stream_driver_port_t;
 
 typedef struct stream_driver_interface_t {
@@ -40,6 +41,7 @@ typedef struct stream_driver_interface_t {
     void (* port_rename) (stream_driver_t *, stream_driver_port_t *, char *name);
     float * (* port_get_buffer) (stream_driver_t *, stream_driver_port_t *, int nframes);
     void (* port_remove) (stream_driver_t *, stream_driver_port_t *port);
+    void (* port_release) (stream_driver_t *, stream_driver_port_t *port);
     void (* port_touch) (stream_driver_t *, stream_driver_port_t *port);
     int (* port_get_latency) (stream_driver_t *, stream_driver_port_t *port);
     void (* auto_connect) (stream_driver_t *, int active);
@@ -51,6 +53,7 @@ typedef struct stream_driver_interface_t {
     int (* process_exists) (stream_driver_t *, char *name);
     unsigned long (* get_position) (stream_driver_t *);
     int (* is_started) (stream_driver_t *);
+    void (* get_transport) (stream_driver_t *, stream_transport_t *transport);
     void (* start) (stream_driver_t *);
     void (* stop) (stream_driver_t *);
     void (* rewind) (stream_driver_t *);
@@ -62,6 +65,12 @@ typedef struct stream_driver_interface_t {
     int (* activate) (stream_driver_t *);
     int (* deactivate) (stream_driver_t *);
     void (* thread_process) (stream_driver_t *);
+    void (* transaction_begin) (stream_driver_t *);
+    void (* transaction_commit) (stream_driver_t *);
+    void (* collect) (stream_driver_t *);
+    int (* get_stats) (stream_driver_t *, stream_stats_t *stats);
+    unsigned long (* get_cycle) (stream_driver_t *);
+    unsigned long (* get_frame_time) (stream_driver_t *);
 } stream_driver_interface_t;
 
 struct stream_driver_t {
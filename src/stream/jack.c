@@ -27,7 +27,6 @@
 #include <jack/jack.h>
 #include "jack.h"
 #include "driver.h"
-#include "../gui.h"
 
 #define CLASSNAME "JackStreamDriver"
 #define CAST(self) stream_driver_cast (self, CLASSNAME)
@@ -45,6 +44,8 @@ typedef struct stream_driver_jack_data_t
     char *          client_name;
     int volatile    process_called;
     unsigned long   position;
+    int volatile    rolling;
+    jack_position_t transport;
     int             auto_start;
     int             auto_connect;
 } stream_driver_jack_data_t;
@@ -142,13 +143,16 @@ port_rename (stream_driver_t *self, stream_driver_port_t *port, char *name)
         jack_port_rename (data->client, PORTDATA (port), name);   // The newer version - not all support this
 }
 
+/**
+ * Unregister the JACK port once the base driver doesn't reference it anymore.
+ */
 static void
-port_remove (stream_driver_t *self, stream_driver_port_t *port)
+port_release (stream_driver_t *self, stream_driver_port_t *port)
 {
     BIND (self, parent, data);
     jack_port_t *jack_port = PORTDATA (port);
 
-    parent->interface->port_remove (self, port);
+    parent->interface->port_release (self, port);
 
     if (data->client && jack_port)
         jack_port_unregister (data->client, jack_port);
@@ -212,10 +216,32 @@ static int
 is_started (stream_driver_t *self)
 {
     BIND_DATA (self, data);
-    if (data->client)
-        return (jack_transport_query (data->client, NULL) == JackTransportRolling);
-    else
-        return 0;
+    return data->client ? data->rolling : 0;
+}
+
+/* Only valid within the process callback: the snapshot is updated once per
+   period by process() */
+static void
+get_transport (stream_driver_t *self, stream_transport_t *transport)
+{
+    BIND_DATA (self, data);
+    memset (transport, 0, sizeof (stream_transport_t));
+    transport->rolling = data->rolling;
+    transport->frame = data->position;
+    if (data->transport.valid & JackPositionBBT)
+    {
+        transport->bbt_valid = 1;
+        // The bars and beats may refer to a frame before the cycle start
+        transport->bbt_frame = data->transport.frame;
+        if (data->transport.valid & JackBBTFrameOffset)
+            transport->bbt_frame -= data->transport.bbt_offset;
+        transport->bar = data->transport.bar;
+        transport->beat = data->transport.beat;
+        transport->tick = data->transport.tick;
+        transport->ticks_per_beat = data->transport.ticks_per_beat;
+        transport->beats_per_bar = data->transport.beats_per_bar;
+        transport->bpm = data->transport.beats_per_minute;
+    }
 }
 
 static void
@@ -277,18 +303,9 @@ process (jack_nframes_t nframes, void *_data)
 
     if (data->client)
     {
-        jack_position_t info;
-        
-        jack_transport_state_t state = jack_transport_query (data->client, &info);
-        if(jack_transport)
-        {
-            if(state == JackTransportRolling )
-            {
-                start_sequence();
-            }
-        }
-        
-        data->position = info.frame;
+        jack_transport_state_t state = jack_transport_query (data->client, &data->transport);
+        data->rolling = (state == JackTransportRolling);
+        data->position = data->transport.frame;
 
         stream_driver_port_t **ports = stream_driver_get_ports (self);
         int nports = stream_driver_get_ports_num (self);
@@ -302,7 +319,10 @@ process (jack_nframes_t nframes, void *_data)
                 for (j = 0; j < nports; j++)
                 {
                     jack_buffer = jack_port_get_buffer (PORTDATA (ports[j]), nframes);
-                    memcpy (jack_buffer + ofs, ports[j]->buffer, len * sizeof (float));
+                    if (ports[j]->silent)
+                        memset (jack_buffer + ofs, 0, len * sizeof (float));
+                    else
+                        memcpy (jack_buffer + ofs, ports[j]->buffer, len * sizeof (float));
                 }
                 data->position += len;
             }
@@ -410,13 +430,15 @@ stream_driver_jack_new (const char *client_name, int auto_start)
     self->data = malloc (sizeof (stream_driver_jack_data_t));
     BIND_DATA (self, data);
     data->position = 0;
+    data->rolling = 0;
+    memset (&data->transport, 0, sizeof (jack_position_t));
     data->client_name = strdup (client_name);
     data->auto_start = auto_start;
     data->auto_connect = 0;
 
     self->interface->port_add          = port_add;
     self->interface->port_rename       = port_rename;
-    self->interface->port_remove       = port_remove;
+    self->interface->port_release      = port_release;
     self->interface->port_touch        = port_touch;
 #ifdef JACK_GET_LATENCY
     self->interface->port_get_latency  = port_get_latency;
@@ -425,6 +447,7 @@ stream_driver_jack_new (const char *client_name, int auto_start)
     self->interface->get_sample_rate   = get_sample_rate;
     self->interface->get_position      = get_position;
     self->interface->is_started        = is_started;
+    self->interface->get_transport     = get_transport;
     self->interface->start             = start;
     self->interface->stop              = stop;
     self->interface->seek              = seek;
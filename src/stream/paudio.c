@@ -29,6 +29,7 @@
 #include "paudio.h"
 #include "driver.h"
 #include "stereo.h"
+#include "device.h"
 
 #define CLASSNAME "PortAudioStreamDriver"
 #define CAST(self) stream_driver_cast (self, CLASSNAME)
@@ -41,6 +42,9 @@
 
 #undef STAT_FORMATS
 
+#define STREAM_PORTAUDIO_HIGH_LATENCY 0
+#define STREAM_PORTAUDIO_LOW_LATENCY  -1
+
 typedef struct stream_driver_portaudio_data_t
 {
     PaStream  *pa_stream;
@@ -48,6 +52,11 @@ typedef struct stream_driver_portaudio_data_t
     int       output_latency;
     char      *device_name;
     int       current_device;
+    int       period_size;
+    int       periods;
+    int volatile            buffer_size;
+    unsigned long volatile  underflows;
+    unsigned long volatile  overflows;
 } stream_driver_portaudio_data_t;
 
 static int
@@ -80,16 +89,25 @@ process (const void *_input, void *_output, unsigned long nframes,
          void *_data)
 {
     stream_driver_t *self = (stream_driver_t *) _data;
-    //BIND_DATA (self, data);
+    BIND_DATA (self, data);
     float *output = (float *) _output;
     int ofs = 0;
 
-    //data->output_latency = (timeinfo->outputBufferDacTime - timeinfo->currentTime) * data->sample_rate;
+    if (statusFlags & paOutputUnderflow)
+        data->underflows++;
+    if (statusFlags & paOutputOverflow)
+        data->overflows++;
+
+    // Some host APIs don't provide timestamps, in which case they're all 0
+    if (timeinfo->outputBufferDacTime > timeinfo->currentTime)
+        data->output_latency = (timeinfo->outputBufferDacTime - timeinfo->currentTime) * data->sample_rate;
+
+    data->buffer_size = nframes;
 
     self->interface->sync (self);
 
     while (ofs < nframes)
-        ofs += self->interface->iterate (self, nframes - ofs, (void *) (output + ofs));
+        ofs += self->interface->iterate (self, nframes - ofs, (void *) (output + ofs * 2));
 
     return 0;
 }
@@ -190,6 +208,7 @@ find_output_device (char *generic_name)
 }
 
 // Function copied and adapted from Portaudio's pa_front.c (Pa_OpenDefaultStream())
+// suggestedOutputLatency is in seconds, or one of the STREAM_PORTAUDIO_*_LATENCY presets
 
 static
 PaError
@@ -200,6 +219,7 @@ open_pa_stream ( PaStream** stream,
                 PaSampleFormat sampleFormat,
                 double sampleRate,
                 unsigned long framesPerBuffer,
+                PaTime suggestedOutputLatency,
                 PaStreamCallback *streamCallback,
                 void *userData )
 {
@@ -234,12 +254,26 @@ open_pa_stream ( PaStream** stream,
 
         hostApiOutputParameters.channelCount = outputChannelCount;
         hostApiOutputParameters.sampleFormat = sampleFormat;
-        hostApiOutputParameters.suggestedLatency =
-                Pa_GetDeviceInfo ( hostApiOutputParameters.device )->defaultHighOutputLatency;
+        if (suggestedOutputLatency == STREAM_PORTAUDIO_LOW_LATENCY)
+        {
+            hostApiOutputParameters.suggestedLatency =
+                    Pa_GetDeviceInfo ( hostApiOutputParameters.device )->defaultLowOutputLatency;
+        }
+        else if (suggestedOutputLatency == STREAM_PORTAUDIO_HIGH_LATENCY)
+        {
+            hostApiOutputParameters.suggestedLatency =
+                    Pa_GetDeviceInfo ( hostApiOutputParameters.device )->defaultHighOutputLatency;
 #ifdef __WIN32__        
-        if (hostApiOutputParameters.suggestedLatency > 0.05)
-            hostApiOutputParameters.suggestedLatency = 0.05;
+            if (hostApiOutputParameters.suggestedLatency > 0.05)
+                hostApiOutputParameters.suggestedLatency = 0.05;
 #endif  
+        }
+        else
+        {
+            hostApiOutputParameters.suggestedLatency = suggestedOutputLatency;
+        }
+        DEBUG ("Suggested latency: %f (%lu frames per buffer)",
+               hostApiOutputParameters.suggestedLatency, framesPerBuffer);
         DEBUG ("Default latency (low/high): %f / %f",
                Pa_GetDeviceInfo ( hostApiOutputParameters.device )->defaultLowOutputLatency,
                Pa_GetDeviceInfo ( hostApiOutputParameters.device )->defaultHighOutputLatency);
@@ -309,11 +343,23 @@ activate (stream_driver_t *self)
         if (Pa_GetSampleSize (paFloat32) == sizeof (float))
         {
             PaDeviceIndex output = find_output_device (data->device_name);
+            unsigned long frames = paFramesPerBufferUnspecified;
+            PaTime latency = STREAM_PORTAUDIO_HIGH_LATENCY;
+            if (data->period_size > 0)
+            {
+                frames = data->period_size;
+                latency = (PaTime) (data->period_size * data->periods) / data->sample_rate;
+            }
+            else if (data->period_size == STREAM_DEVICE_LOW_LATENCY)
+            {
+                latency = STREAM_PORTAUDIO_LOW_LATENCY;
+            }
+
             if (output != paNoDevice)
             {
                 PaError err = open_pa_stream (&data->pa_stream, output,
                                               0, 2, paFloat32, data->sample_rate,
-                                              paFramesPerBufferUnspecified, process, (void *) self);
+                                              frames, latency, process, (void *) self);
                 if (!data->device_name)
                 {
                     if ((err != paNoError) && (output != Pa_GetDefaultOutputDevice ()))
@@ -321,7 +367,7 @@ activate (stream_driver_t *self)
                         output = Pa_GetDefaultOutputDevice ();
                         err = open_pa_stream (&data->pa_stream, output,
                                               0, 2, paFloat32, data->sample_rate,
-                                              paFramesPerBufferUnspecified, process, (void *) self);
+                                              frames, latency, process, (void *) self);
                     }
                 }
 
@@ -331,6 +377,9 @@ activate (stream_driver_t *self)
                     data->current_device = output;
                     data->sample_rate = info->sampleRate;
                     data->output_latency = info->outputLatency * data->sample_rate;
+                    data->buffer_size = frames == paFramesPerBufferUnspecified ? 0 : frames;
+                    data->underflows = 0;
+                    data->overflows = 0;
                     DEBUG ("Portaudio sample rate: %d (latency: %dms)", data->sample_rate, (int) (info->outputLatency * 1000.0));
                     err = Pa_StartStream (data->pa_stream);
                     if (err == paNoError)
@@ -401,21 +450,35 @@ deactivate (stream_driver_t *self)
     return 1;
 }
 
-#ifdef JACK_GET_LATENCY
 static int
 port_get_latency (stream_driver_t *self, stream_driver_port_t *port)
 {
     BIND_DATA (self, data);
-    if (port->flags & STREAM_OUTPUT)
+    if (!port || (port->flags & STREAM_OUTPUT))
         return data->output_latency;
     else
         return 0;
+}
 
+static int
+get_stats (stream_driver_t *self, stream_stats_t *stats)
+{
+    BIND_DATA (self, data);
+    memset (stats, 0, sizeof (stream_stats_t));
+    if (!data->pa_stream)
+        return 0;
+
+    stats->underruns   = data->underflows;
+    stats->overruns    = data->overflows;
+    stats->latency     = data->output_latency;
+    stats->period_size = data->buffer_size;
+    stats->periods     = data->buffer_size ? (data->output_latency + data->buffer_size - 1) / data->buffer_size : 0;
+    stats->cpu_load    = Pa_GetStreamCpuLoad (data->pa_stream);
+    return 1;
 }
-#endif // JACK_GET_LATENCY
 
 stream_driver_t *
-stream_driver_portaudio_new (char *device_name, int sample_rate)
+stream_driver_portaudio_new (char *device_name, int sample_rate, int period_size, int periods)
 {
     stream_driver_t *self = stream_driver_subclass (CLASSNAME, stream_driver_stereo_new ());
     self->data = malloc (sizeof (stream_driver_portaudio_data_t));
@@ -424,6 +487,11 @@ stream_driver_portaudio_new (char *device_name, int sample_rate)
     data->sample_rate = sample_rate > 0 ? sample_rate : 44100;
     data->output_latency = 0;
     data->current_device = paNoDevice;
+    data->period_size = period_size;
+    data->periods = periods > 1 ? periods : 2;
+    data->buffer_size = 0;
+    data->underflows = 0;
+    data->overflows = 0;
     if (device_name)
         data->device_name = strdup (device_name);
     else
@@ -433,9 +501,8 @@ stream_driver_portaudio_new (char *device_name, int sample_rate)
     self->interface->destroy           = destroy;
     self->interface->activate          = activate;
     self->interface->deactivate        = deactivate;
-#ifdef JACK_GET_LATENCY
     self->interface->port_get_latency  = port_get_latency;
-#endif
+    self->interface->get_stats         = get_stats;
 
     return self;
 }
@@ -25,7 +25,11 @@
 
 #include "stream.h"
 
-stream_driver_t * stream_driver_portaudio_new(char *device_name, int sample_rate);
+/* period_size and periods are the requested frames per buffer and number of
+ * buffers. A period_size of 0 uses the device's default high latency, and
+ * STREAM_DEVICE_LOW_LATENCY its default low latency. */
+stream_driver_t * stream_driver_portaudio_new(char *device_name, int sample_rate, int period_size,
+                                              int periods);
 char ** stream_driver_portaudio_list_devices();
 char * stream_driver_portaudio_get_current_device(stream_driver_t *self);
 
@@ -22,11 +22,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
 #include <string.h>
-#include <pulse/simple.h>
-#include <pulse/error.h>
-#include <dlfcn.h>
+#include <pulse/pulseaudio.h>
 #include "pulse.h"
 #include "driver.h"
 #include "stereo.h"
@@ -36,15 +33,27 @@
 #define BIND(self, parent, data) \
   stream_driver_t *_self = CAST(self); \
   stream_driver_t *parent = _self->parent; \
-  stream_driver_pulse_data_t *data = (stream_driver_pulse_data_t *) _self->data; 
+  stream_driver_pulse_data_t *data = (stream_driver_pulse_data_t *) _self->data;
 #define BIND_DATA(self, data) stream_driver_pulse_data_t *data = (stream_driver_pulse_data_t *) (CAST(self)->data)
-#define BIND_PARENT(self, parent) stream_driver_t *parent = CAST(self)->parent; 
+#define BIND_PARENT(self, parent) stream_driver_t *parent = CAST(self)->parent;
+
+#define STREAM_PULSE_DEFAULT_PERIOD_SIZE 512
+#define STREAM_PULSE_DEFAULT_PERIODS     4
+#define STREAM_PULSE_FRAME_SIZE          (sizeof (float) * 2)
 
 typedef struct stream_driver_pulse_data_t
 {
-    char *      app_name;
-    pa_simple * connection;
-    float *     buffer;
+    char *                  app_name;
+    pa_threaded_mainloop *  mainloop;
+    pa_context *            context;
+    pa_stream *             stream;
+    int                     stream_connected;
+    float *                 buffer;
+    int                     period_size;
+    int                     periods;
+    int volatile            latency;
+    unsigned long volatile  underflows;
+    unsigned long volatile  overflows;
 } stream_driver_pulse_data_t;
 
 static void
@@ -53,6 +62,7 @@ destroy (stream_driver_t *self)
     BIND (self, parent, data);
 
     free (data->app_name);
+    free (data->buffer);
     free (data);
 
     parent->interface->destroy (self);
@@ -64,96 +74,274 @@ destroy (stream_driver_t *self)
 }
 
 static void
-thread_process (stream_driver_t *self)
+context_state_callback (pa_context *context, void *arg)
+{
+    stream_driver_pulse_data_t *data = (stream_driver_pulse_data_t *) arg;
+    pa_threaded_mainloop_signal (data->mainloop, 0);
+}
+
+static void
+stream_state_callback (pa_stream *stream, void *arg)
 {
+    stream_driver_pulse_data_t *data = (stream_driver_pulse_data_t *) arg;
+    pa_threaded_mainloop_signal (data->mainloop, 0);
+}
+
+static void
+underflow_callback (pa_stream *stream, void *arg)
+{
+    stream_driver_pulse_data_t *data = (stream_driver_pulse_data_t *) arg;
+    data->underflows++;
+}
+
+static void
+overflow_callback (pa_stream *stream, void *arg)
+{
+    stream_driver_pulse_data_t *data = (stream_driver_pulse_data_t *) arg;
+    data->overflows++;
+}
+
+/**
+ * Called from the mainloop thread when the server requests more data. This
+ * is our process cycle: it renders exactly what is requested, by blocks of at
+ * most STREAM_BUFFER_SIZE frames.
+ */
+static void
+write_callback (pa_stream *stream, size_t nbytes, void *arg)
+{
+    stream_driver_t *self = (stream_driver_t *) arg;
     BIND_DATA (self, data);
+    int nframes = nbytes / STREAM_PULSE_FRAME_SIZE;
+    int ofs, len;
+    pa_usec_t usec;
+    int negative;
+
     self->interface->sync (self);
-    self->interface->iterate (self, 256, data->buffer);
-    int err;
-    //DEBUG("Pulse audio latency: %.3f ms", (double) pa_simple_get_latency (data->connection, NULL) / 1000);
-    //DEBUG("Pulse audio latency: %.3f ms", pa_simple_get_latency (data->connection, NULL) / 1000);
-    pa_simple_write (data->connection, data->buffer, sizeof (float) * 256 * 2, &err);
+
+    for (ofs = 0; ofs < nframes; ofs += len)
+    {
+        len = self->interface->iterate (self, nframes - ofs, data->buffer);
+        pa_stream_write (stream, data->buffer, len * STREAM_PULSE_FRAME_SIZE, NULL, 0,
+                         PA_SEEK_RELATIVE);
+    }
+
+    if (pa_stream_get_latency (stream, &usec, &negative) == 0)
+        data->latency = negative ? 0 : (double) usec
+            * self->interface->get_sample_rate (self) / 1000000.0;
 }
 
+/**
+ * Wait for the context to leave its transitional states. Must be called
+ * with the mainloop lock held. Returns 1 if the context is ready.
+ */
 static int
-activate (stream_driver_t *self)
+wait_context (stream_driver_pulse_data_t *data)
 {
-    BIND (self, parent, data);
+    pa_context_state_t state;
+    while ((state = pa_context_get_state (data->context)) != PA_CONTEXT_READY)
+    {
+        if (!PA_CONTEXT_IS_GOOD (state))
+            return 0;
+        pa_threaded_mainloop_wait (data->mainloop);
+    }
+    return 1;
+}
+
+/**
+ * Same as wait_context(), for the playback stream.
+ */
+static int
+wait_stream (stream_driver_pulse_data_t *data)
+{
+    pa_stream_state_t state;
+    while ((state = pa_stream_get_state (data->stream)) != PA_STREAM_READY)
+    {
+        if (!PA_STREAM_IS_GOOD (state))
+            return 0;
+        pa_threaded_mainloop_wait (data->mainloop);
+    }
+    return 1;
+}
+
+static void
+disconnect (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
+
+    if (data->mainloop)
+        pa_threaded_mainloop_stop (data->mainloop);
+
+    if (data->stream)
+    {
+        if (data->stream_connected)
+            pa_stream_disconnect (data->stream);
+        data->stream_connected = 0;
+        pa_stream_unref (data->stream);
+        data->stream = NULL;
+    }
+
+    if (data->context)
+    {
+        pa_context_disconnect (data->context);
+        pa_context_unref (data->context);
+        data->context = NULL;
+    }
 
+    if (data->mainloop)
+    {
+        pa_threaded_mainloop_free (data->mainloop);
+        data->mainloop = NULL;
+    }
+}
+
+static int
+connect_stream (stream_driver_t *self)
+{
+    BIND_DATA (self, data);
     pa_sample_spec spec;
-    spec.format = PA_SAMPLE_FLOAT32;
+    pa_buffer_attr attr;
+    const pa_buffer_attr *actual;
+
+    spec.format = PA_SAMPLE_FLOAT32NE;
     spec.channels = 2;
     spec.rate = self->interface->get_sample_rate (self);
 
+    data->stream = pa_stream_new (data->context, "Music", &spec, NULL);
+    if (!data->stream)
+        return 0;
+
+    pa_stream_set_state_callback (data->stream, stream_state_callback, data);
+    pa_stream_set_write_callback (data->stream, write_callback, self);
+    pa_stream_set_underflow_callback (data->stream, underflow_callback, data);
+    pa_stream_set_overflow_callback (data->stream, overflow_callback, data);
+
+    attr.maxlength = (uint32_t) -1;
+    attr.tlength   = data->period_size * data->periods * STREAM_PULSE_FRAME_SIZE;
+    attr.prebuf    = (uint32_t) -1;
+    attr.minreq    = data->period_size * STREAM_PULSE_FRAME_SIZE;
+    attr.fragsize  = (uint32_t) -1;
+
+    if (pa_stream_connect_playback (data->stream, NULL, &attr,
+                                    PA_STREAM_ADJUST_LATENCY | PA_STREAM_AUTO_TIMING_UPDATE
+                                    | PA_STREAM_INTERPOLATE_TIMING, NULL, NULL) < 0)
+        return 0;
+
+    data->stream_connected = 1;
+    if (!wait_stream (data))
+        return 0;
+
+    // The server may not grant the requested buffering
+    if ((actual = pa_stream_get_buffer_attr (data->stream)) && actual->minreq)
+    {
+        data->period_size = actual->minreq / STREAM_PULSE_FRAME_SIZE;
+        data->periods = actual->tlength / actual->minreq;
+    }
+
+    DEBUG ("PulseAudio stream ready: %d frames x %d periods", data->period_size, data->periods);
+    return 1;
+}
+
+static int
+activate (stream_driver_t *self)
+{
+    BIND (self, parent, data);
+    int success = 0;
+
+    data->latency = 0;
+    data->underflows = 0;
+    data->overflows = 0;
+
     DEBUG ("Connecting to PulseAudio");
-    int err;
-    data->connection = pa_simple_new (NULL,               // Use the default server.
-                                      data->app_name,     // Our application's name.
-                                      PA_STREAM_PLAYBACK,
-                                      NULL,               // Use the default device.
-                                      "Music",            // Description of our stream.
-                                      &spec,              // Our sample format.
-                                      NULL,               // Use default channel map
-                                      NULL,               // Use default buffering attributes.
-                                      &err                // Ignore error code.
-                                      );
-
-    if (data->connection)
+    data->mainloop = pa_threaded_mainloop_new ();
+    data->context = pa_context_new (pa_threaded_mainloop_get_api (data->mainloop), data->app_name);
+    pa_context_set_state_callback (data->context, context_state_callback, data);
+
+    if (pa_context_connect (data->context, NULL, 0, NULL) >= 0
+        && pa_threaded_mainloop_start (data->mainloop) >= 0)
     {
-        //DEBUG("Pulse audio latency: %.3f ms", (double) pa_simple_get_latency (data->connection, NULL) / 1000);
-        if (!parent->interface->activate (self))
+        pa_threaded_mainloop_lock (data->mainloop);
+        if (wait_context (data) && parent->interface->activate (self))
         {
-            pa_simple_free (data->connection);
-            data->connection = NULL;
+            if (connect_stream (self))
+                success = 1;
+            else
+                parent->interface->deactivate (self);
         }
+
+        if (!success)
+            DEBUG ("PulseAudio error: %s", pa_strerror (pa_context_errno (data->context)));
+
+        pa_threaded_mainloop_unlock (data->mainloop);
     }
-    else
-        DEBUG ("PulseAudio error: %s", pa_strerror (err));
 
+    if (!success)
+        disconnect (self);
 
-    return (data->connection != NULL);
+    return success;
 }
 
 static int
 deactivate (stream_driver_t *self)
 {
     BIND (self, parent, data);
-    int res = 1;
-    if (data->connection != NULL)
+    if (data->mainloop != NULL)
     {
+        // No more write callbacks after this, disconnect() won't do it again
+        pa_threaded_mainloop_lock (data->mainloop);
+        if (data->stream_connected)
+            pa_stream_disconnect (data->stream);
+        data->stream_connected = 0;
+        pa_threaded_mainloop_unlock (data->mainloop);
+
         parent->interface->deactivate (self);
-        pa_simple_free (data->connection);
+        disconnect (self);
     }
-    return res;
+    return 1;
 }
 
 static int
 port_get_latency (stream_driver_t *self, stream_driver_port_t *port)
 {
     BIND_DATA (self, data);
-    unsigned long latency = pa_simple_get_latency (data->connection, NULL);
-    if (latency >= 0)
-        return (float) self->interface->get_sample_rate (self) * (float) latency / 1000000.0f;
-    else
-        return 0;
-    return 0;
+    return data->latency ? data->latency : data->period_size * data->periods;
+}
+
+static int
+get_stats (stream_driver_t *self, stream_stats_t *stats)
+{
+    BIND_DATA (self, data);
+    memset (stats, 0, sizeof (stream_stats_t));
+    stats->underruns   = data->underflows;
+    stats->overruns    = data->overflows;
+    stats->latency     = port_get_latency (self, NULL);
+    stats->period_size = data->period_size;
+    stats->periods     = data->periods;
+    return 1;
 }
 
 stream_driver_t *
-stream_driver_pulse_new (char *app_name)
+stream_driver_pulse_new (const char *app_name, int period_size, int periods)
 {
     stream_driver_t *self = stream_driver_subclass (CLASSNAME, stream_driver_stereo_new ());
     self->data = malloc (sizeof (stream_driver_pulse_data_t));
     BIND_DATA (self, data);
-    data->connection = NULL;
-    data->app_name = strdup (app_name);
-    data->buffer = malloc (STREAM_BUFFER_SIZE * sizeof (float) * 2);
+    data->app_name    = strdup (app_name);
+    data->mainloop    = NULL;
+    data->context     = NULL;
+    data->stream      = NULL;
+    data->stream_connected = 0;
+    data->buffer      = malloc (STREAM_BUFFER_SIZE * STREAM_PULSE_FRAME_SIZE);
+    data->period_size = period_size > 0 ? period_size : STREAM_PULSE_DEFAULT_PERIOD_SIZE;
+    data->periods     = periods > 1 ? periods : STREAM_PULSE_DEFAULT_PERIODS;
+    data->latency     = 0;
+    data->underflows  = 0;
+    data->overflows   = 0;
 
     self->interface->destroy           = destroy;
     self->interface->activate          = activate;
     self->interface->deactivate        = deactivate;
-    self->interface->thread_process    = thread_process;
     self->interface->port_get_latency  = port_get_latency;
+    self->interface->get_stats         = get_stats;
 
     return self;
 }
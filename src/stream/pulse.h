@@ -25,6 +25,13 @@
 
 #include "stream.h"
 
-stream_driver_t * stream_driver_pulse_new();
+/**
+ * Create an asynchronous PulseAudio playback driver.
+ *
+ * The server is asked for a target latency of period_size x periods frames,
+ * and for a write request every period_size frames. 0 selects the default
+ * buffering (512 frames x 4 periods).
+ */
+stream_driver_t * stream_driver_pulse_new(const char *app_name, int period_size, int periods);
 
 #endif
@@ -123,6 +123,9 @@ iterate (stream_driver_t *self, int nframes, ...)
     for (j = 0; j < nports; j++)
     {
         stream_driver_port_t *port = ports[j];
+        if (port->silent)
+            continue;
+
         if (port->flags & STREAM_LEFT)
             for (k = 0; k < len; k++)
                 output[k * 2] += port->buffer[k];
@@ -24,15 +24,14 @@
 #include <stdio.h>
 #include <string.h>
 #include "core/event.h"
-#include "core/array.h"
+#include "core/vector.h"
 #include "driver.h"
 #include "null.h"
 
 struct stream_t
 {
     stream_driver_t * driver;
-    stream_port_t **  ports;
-    int               nports;
+    vector_t          ports;
     int               auto_connect;
 } ;
 
@@ -51,7 +50,7 @@ stream_port_add (stream_t *self, char *name, stream_port_flags_t flags)
     {
         port = malloc (sizeof (stream_port_t));
         port->driver_port = driver_port;
-        ARRAY_ADD (stream_port_t, self->ports, self->nports, port);
+        vector_add (&self->ports, port);
     }
     return port;
 }
@@ -72,7 +71,7 @@ void
 stream_port_remove (stream_t *self, stream_port_t *port)
 {
     self->driver->interface->port_remove (self->driver, port->driver_port);
-    ARRAY_REMOVE (stream_port_t, self->ports, self->nports, port);
+    vector_swap_remove (&self->ports, port);
     free (port);
 }
 
@@ -90,13 +89,56 @@ stream_port_touch (stream_t *self, stream_port_t *port)
     self->driver->interface->port_touch (self->driver, port->driver_port);
 }
 
-#ifdef JACK_GET_LATENCY
+/**
+ * Tell the driver whether a port buffer holds any audio for the current cycle.
+ *
+ * When a port is silent its buffer content is undefined and must not be read:
+ * this allows processes to skip zero-filling idle ports, and drivers to skip
+ * mixing or copying them. This is meant to be called from within the process
+ * callback, every cycle.
+ */
+void
+stream_port_set_silent (stream_t *self, stream_port_t *port, int silent)
+{
+    port->driver_port->silent = silent;
+}
+
 int
 stream_port_get_latency (stream_t *self, stream_port_t *port)
 {
     return self->driver->interface->port_get_latency (self->driver, port->driver_port);
 }
-#endif // JACK_GET_LATENCY
+
+/**
+ * Start a batch of port and process changes.
+ *
+ * Ports and processes added or removed until stream_transaction_commit() is 
+ * called are published to the audio thread at once. Committing doesn't wait
+ * for the audio thread, unless a process has been removed. Transactions can be
+ * nested.
+ */
+void
+stream_transaction_begin (stream_t *self)
+{
+    self->driver->interface->transaction_begin (self->driver);
+}
+
+void
+stream_transaction_commit (stream_t *self)
+{
+    self->driver->interface->transaction_commit (self->driver);
+}
+
+/**
+ * Release the ports and other resources which the audio thread has stopped
+ * using since they were removed. Meant to be called periodically from the main
+ * loop, so that nothing stays allocated until the next transaction.
+ */
+void
+stream_collect (stream_t *self)
+{
+    self->driver->interface->collect (self->driver);
+}
 
 int
 stream_get_buffer_size (stream_t *self)
@@ -140,12 +182,53 @@ stream_get_position (stream_t *self)
     return self->driver->interface->get_position (self->driver);
 }
 
+/**
+ * Return the number of process cycles run so far.
+ *
+ * Drivers may split a period into several cycles, each of which runs all
+ * processes once. This is meant to be called from within the process callback,
+ * for processes which depend on each other to tell whether some work was
+ * already done during the current cycle.
+ */
+unsigned long
+stream_get_cycle (stream_t *self)
+{
+    return self->driver->interface->get_cycle (self->driver);
+}
+
+/**
+ * Return the number of frames processed so far, whatever the transport state.
+ *
+ * Within the process callback, this is the time of the current cycle's first
+ * frame. Elsewhere, it is the time of the cycle being processed, or of the
+ * next one, so that frames scheduled from it are due within a cycle.
+ */
+unsigned long
+stream_get_frame_time (stream_t *self)
+{
+    return self->driver->interface->get_frame_time (self->driver);
+}
+
 int
 stream_is_started (stream_t *self)
 {
     return self->driver->interface->is_started (self->driver);
 }
 
+/**
+ * Retrieve the transport state for the current cycle.
+ *
+ * This is meant to be called from within the process callback: drivers take
+ * a snapshot once per period, so that this never blocks nor calls into the
+ * audio server. Drivers which don't know about bars and beats leave bbt_valid
+ * cleared.
+ */
+void
+stream_get_transport (stream_t *self, stream_transport_t *transport)
+{
+    self->driver->interface->get_transport (self->driver, transport);
+}
+
 void
 stream_start (stream_t *self)
 {
@@ -173,7 +256,7 @@ stream_destroy (stream_t *self)
         self->driver->interface->destroy (self->driver);
         self->driver = NULL;
     }
-    ARRAY_DESTROY (self->ports, self->nports);
+    vector_free_items (&self->ports);
     event_remove_source (self);
     free (self);
 }
@@ -182,13 +265,16 @@ static void
 copy_driver_resources (stream_t *self, stream_driver_t *src)
 {
     int i;
-    for (i = 0; i < self->nports; i++)
+    stream_transaction_begin (self);
+    for (i = 0; i < self->ports.num; i++)
     {
-        stream_driver_port_t *dport = self->ports[i]->driver_port;
-        self->ports[i]->driver_port = self->driver->interface->port_add (self->driver, dport->name, dport->flags, NULL);
+        stream_port_t *port = VECTOR_AT (stream_port_t, &self->ports, i);
+        stream_driver_port_t *dport = port->driver_port;
+        port->driver_port = self->driver->interface->port_add (self->driver, dport->name, dport->flags, NULL);
     }
 
     stream_driver_copy_processes (src, self->driver);
+    stream_transaction_commit (self);
 }
 
 static void
@@ -233,8 +319,7 @@ stream_new ()
 {
     stream_t *self = malloc (sizeof (stream_t));
     self->driver = NULL;
-    self->ports = NULL;
-    self->nports = 0;
+    vector_init (&self->ports);
     event_register (self, "connection-changed");
     event_register (self, "connection-lost");
     stream_set_driver (self, stream_driver_null_new ());
@@ -316,6 +401,16 @@ stream_disconnect (stream_t *self)
     stream_set_driver (self, stream_driver_null_new ());
 }
 
+/**
+ * Retrieve the current driver's statistics. Returns 0 if the driver doesn't
+ * provide any.
+ */
+int
+stream_get_stats (stream_t *self, stream_stats_t *stats)
+{
+    return self->driver->interface->get_stats (self->driver, stats);
+}
+
 void
 stream_auto_connect (stream_t *self, int active)
 {
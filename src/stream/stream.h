@@ -32,6 +32,31 @@ typedef enum {
 
 typedef int (* stream_process_t) (unsigned long nframes, void *arg);
 
+/* Driver statistics, as reported by stream_get_stats(). Fields which a
+   driver doesn't know about are set to 0. */
+typedef struct stream_stats_t {
+    unsigned long underruns;    // output underflows/xruns
+    unsigned long overruns;     // output overflows
+    int latency;                // current output latency, in frames
+    int period_size;            // frames processed per cycle
+    int periods;                // number of periods in the device buffer
+    double cpu_load;            // fraction of the cycle time spent processing
+} stream_stats_t;
+
+/* Transport state, as seen by the current cycle */
+typedef struct stream_transport_t {
+    int rolling;
+    unsigned long frame;        // position of the current cycle's first frame
+    int bbt_valid;              // whether the fields below are set
+    unsigned long bbt_frame;    // position the bar, beat and tick refer to
+    int bar;                    // starting at 1
+    int beat;                   // starting at 1
+    double tick;
+    double ticks_per_beat;
+    double beats_per_bar;
+    double bpm;
+} stream_transport_t;
+
 typedef struct stream_t stream_t;
 typedef struct stream_driver_t stream_driver_t;
 typedef struct stream_port_t stream_port_t;
@@ -43,8 +68,12 @@ void stream_port_rename(stream_t *, stream_port_t *, char *name);
 float * stream_port_get_buffer(stream_t *, stream_port_t *, int nframes);
 void stream_port_remove(stream_t *, stream_port_t *port);
 void stream_port_touch(stream_t *, stream_port_t *port);
+void stream_port_set_silent(stream_t *, stream_port_t *port, int silent);
 int stream_port_get_latency(stream_t *, stream_port_t *port);
 void stream_auto_connect(stream_t *, int active);
+void stream_transaction_begin(stream_t *);
+void stream_transaction_commit(stream_t *);
+void stream_collect(stream_t *);
 int stream_get_buffer_size(stream_t *);
 int stream_get_sample_rate(stream_t *);
 int stream_add_process(stream_t *, char * name, stream_process_t callback, void *data);
@@ -52,7 +81,10 @@ int stream_rename_process(stream_t *self, char *old_name, char *new_name);
 void stream_remove_process(stream_t *, char * name);
 void stream_process_exists(stream_t *, char * name);
 unsigned long stream_get_position(stream_t *);
+unsigned long stream_get_cycle(stream_t *);
+unsigned long stream_get_frame_time(stream_t *);
 int stream_is_started(stream_t *);
+void stream_get_transport(stream_t *, stream_transport_t *transport);
 void stream_start(stream_t *);
 void stream_stop(stream_t *);
 void stream_rewind(stream_t *);
@@ -62,5 +94,6 @@ int stream_is_connected(stream_t *);
 const char * stream_get_driver_classname(stream_t *);
 stream_driver_t * stream_get_driver(stream_t *);
 void stream_disconnect(stream_t *);
+int stream_get_stats(stream_t *, stream_stats_t *stats);
 
 #endif
@@ -8,6 +8,9 @@
 #include "null.h"
 #include "paudio.h"
 #include "pulse.h"
+#ifdef HAVE_ALSA
+#include "alsa.h"
+#endif
 
 #define PI 3.1416
 
@@ -124,7 +127,7 @@ main (int argc, char *argv[])
     stream_add_process (obj->stream, "synth", process, (void *) obj);
     stream_remove_process (obj->stream, "junk");
 
-    printf ("Commands: connect, start, stop, rewind, quit\n");
+    printf ("Commands: connect, start, stop, rewind, stats, quit\n");
     char s[64] = "";
     while (strcmp (s, "quit\n"))
     {
@@ -155,7 +158,7 @@ main (int argc, char *argv[])
         }
         else if (!strcmp (s, "loadpaudio\n"))
         {
-            if (stream_set_driver (obj->stream, stream_driver_portaudio_new ()))
+            if (stream_set_driver (obj->stream, stream_driver_portaudio_new (NULL, -1, 0, 0)))
                 printf ("success\n");
             else
                 printf ("failure\n");
@@ -163,17 +166,34 @@ main (int argc, char *argv[])
 #ifdef HAVE_PULSE
         else if (!strcmp (s, "loadpulse\n"))
         {
-            if (stream_set_driver (obj->stream, stream_driver_pulse_new ()))
+            if (stream_set_driver (obj->stream, stream_driver_pulse_new ("streamtest", 0, 0)))
                 printf ("success\n");
             else
                 printf ("failure\n");
         }
 #endif    
+#ifdef HAVE_ALSA
+        else if (!strcmp (s, "loadalsa\n"))
+        {
+            if (stream_set_driver (obj->stream, stream_driver_alsa_new (getenv ("ALSA_DEVICE"), 44100, 0, 0)))
+                printf ("success\n");
+            else
+                printf ("failure\n");
+        }
+#endif    
+        else if (!strcmp (s, "stats\n"))
+        {
+            stream_stats_t stats;
+            stream_get_stats (obj->stream, &stats);
+            printf ("underruns: %lu, overruns: %lu, latency: %d frames, buffering: %d x %d, cpu: %.1f%%\n",
+                    stats.underruns, stats.overruns, stats.latency, stats.period_size, stats.periods,
+                    stats.cpu_load * 100);
+        }
 
         stream_add_process (obj->stream, "junk", process, junk);
         stream_remove_process (obj->stream, "junk");
 
-        printf ("Commands: connect, start, stop, rewind, quit\n");
+        printf ("Commands: connect, start, stop, rewind, stats, quit\n");
     }
 
     stream_destroy (obj->stream);